@@ -19,15 +19,33 @@
 #ifndef SRC_AVLTREE_H_
 #define SRC_AVLTREE_H_
 
+#include <algorithm>
 #include <format>
+#include <functional>
+#include <optional>
 #include <stack>
 #include <queue>
 #include <stdexcept>
 #include <iterator>
 #include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <bit>
+#include <span>
+#include <utility>
+#include <vector>
+#include "AVLTreeCodec.h"
 #include "AVLTreeNode.h"
+#include "AVLTreeOperation.h"
+#include "ThreadPool.h"
 
 namespace _11c_dev_collections {
+
+template <class TKey, class TValue>
+class AVLTreeCheckpoint;
+
 /**
  * enum used to determine the order of Iteration traversal of an AVLTree.
  */
@@ -69,10 +87,24 @@ enum class AVLTreeTraversalMethod {
 template <class TKey, class TValue>
 class AVLTree {
  private:
+    // Pieces of a batch smaller than this are applied on one thread.
+    static constexpr std::ptrdiff_t kParallelBatchGrain = 2048;
+    // Subtrees smaller than this are traversed on one thread.
+    static constexpr int kParallelTraversalGrain = 4096;
+
+    static constexpr char kSnapshotMagic[8] = {'1', '1', 'c', 'A', 'V', 'L',
+        'T', '\0'};
+    // Version 1 stored keys with AVLTreeCodec, version 2 with
+    // AVLTreeKeyCodec, version 3 gave each raw byte codec its own id.
+    static constexpr std::uint32_t kSnapshotVersion = 3;
+
     AVLTreeNode<TKey, TValue> *root_;
     int count_;
     AVLTreeTraversalMethod traversal_method_;
 
+    // Writes and restores root_ and count_ for the checkpoint functions.
+    friend class AVLTreeCheckpoint<TKey, TValue>;
+
  public:
 	/**
 	 * Creates a new AVLTree that defaults to InOrder traversal.
@@ -95,19 +127,47 @@ class AVLTree {
         traversal_method_ = traversal_method;
     }
 
+    /**
+     * The tree owns its nodes, so it can be moved but not copied.
+     */
+    AVLTree(const AVLTree&) = delete;
+    AVLTree& operator=(const AVLTree&) = delete;
+
+    AVLTree(AVLTree &&other) noexcept {
+        root_ = other.root_;
+        count_ = other.count_;
+        traversal_method_ = other.traversal_method_;
+        other.root_ = nullptr;
+        other.count_ = 0;
+    }
+
+    AVLTree& operator=(AVLTree &&other) noexcept {
+        if (this != &other) {
+            Clear();
+            root_ = other.root_;
+            count_ = other.count_;
+            traversal_method_ = other.traversal_method_;
+            other.root_ = nullptr;
+            other.count_ = 0;
+        }
+        return *this;
+    }
+
+    ~AVLTree() { Clear(); }
+
 	/**
 	 * Returns the number of elements in the tree.
 	 * 
 	 * @return Number of elements in the tree.
 	 */
-    int GetCount() { return count_; }
+    int GetCount() const { return count_; }
 
 	/**
 	 * Returns the current traversal method used for iteration.
 	 * 
 	 * @return Current traversal method for iteration.
 	 */
-    AVLTreeTraversalMethod GetTraversalMethod() { return traversal_method_; }
+    AVLTreeTraversalMethod GetTraversalMethod() const { return traversal_method_; }
 
 	/**
 	 * Set the traversal method for iteration.
@@ -124,7 +184,7 @@ class AVLTree {
      * 
      * @return int height of the tree
      */
-    int GetTreeHieight() {
+    int GetTreeHieight() const {
         if (root_ != nullptr) return root_->GetHeight();
         return 0;
     }
@@ -134,7 +194,7 @@ class AVLTree {
      * 
      * @return int balance factor of the root node.
      */
-    int GetTreeBalanceFactor() {
+    int GetTreeBalanceFactor() const {
         if (root_ != nullptr) return root_->GetBalanceFactor();
         return 0;
     }
@@ -150,18 +210,8 @@ class AVLTree {
      * @throws range_error if no node exists at key
      */
     AVLTreeNode<TKey, TValue> GetNode(TKey key) {
-        AVLTreeNode<TKey, TValue> *current = root_;
-
-        while (current != nullptr) {
-            if (current->GetKey() == key) {
-                return *current;
-            }
-            if (current->GetKey() < key) {
-                current = current->GetRight();
-            } else  {
-                current = current->GetLeft();
-            }
-        }
+        AVLTreeNode<TKey, TValue> *node = FindNode(key);
+        if (node != nullptr) return *node;
 
         throw std::range_error
             (std::format("! Key {} not present in Tree !", key));
@@ -179,14 +229,154 @@ class AVLTree {
      */
     MapEntry<TKey, TValue> Get(TKey key) { return GetNode(key).GetMapEntry(); }
 
+    /**
+     * Looks up the value stored at key.  Unlike Get, a missing key is not an
+     * error, and the tree is not modified, so it is safe to call from
+     * several readers at once.
+     *
+     * @param Key Key to locate in the tree.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) const {
+        const AVLTreeNode<TKey, TValue> *node = FindNode(key);
+        if (node == nullptr) return std::nullopt;
+        return node->GetValue();
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     *
+     * @param Key Key to locate in the tree.
+     */
+    bool Contains(TKey key) const { return FindNode(key) != nullptr; }
+
+    /**
+     * Calls func for every node in the tree, in key order.  Does not use
+     * the Iterator, so the traversal method of the tree is ignored and the
+     * tree is not modified.
+     *
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) const { ForEachNode(root_, func); }
+
+    /**
+     * Calls func for every node in the tree using the threads of pool.
+     * The tree is cut into subtrees of about kParallelTraversalGrain nodes,
+     * using the subtree sizes kept in every node, and each subtree is
+     * walked in key order by one thread.  Calls on different subtrees run
+     * concurrently and in no particular order, so func must be safe to call
+     * from several threads at once.  The tree must not be modified until
+     * this returns.
+     *
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     * @param pool Threads to run on.  The calling thread takes part.
+     */
+    template <typename Func>
+    void ParallelForEach(Func func, ThreadPool &pool) const {
+        ParallelForEachNode(root_, func, &pool);
+    }
+
+    /**
+     * Folds every node of the tree into a single result using the threads
+     * of pool.
+     *
+     * The tree is cut into subtrees as for ParallelForEach.  Each subtree
+     * is folded in key order, starting from identity, and the partial
+     * results are combined in key order as well, so combine need only be
+     * associative, not commutative.  Where the tree is cut depends only on
+     * its shape, never on the number of threads or on timing, so the result
+     * is the same on every run, even for operations such as floating point
+     * addition that are only approximately associative.
+     *
+     * @param identity Result for an empty tree; combine(identity, x) must
+     *          equal x.
+     * @param map Callable taking a const AVLTreeNode<TKey, TValue>& and
+     *          returning a TResult.
+     * @param combine Callable taking two TResults, left part first, and
+     *          returning their combination.
+     * @param pool Threads to run on.  The calling thread takes part.
+     *
+     * @return combine of map over every node, in key order.
+     */
+    template <typename TResult, typename Map, typename Combine>
+    TResult ParallelReduce(TResult identity, Map map, Combine combine,
+            ThreadPool &pool) const {
+        return ParallelReduceNode(root_, identity, map, combine, &pool);
+    }
+
+    /**
+     * Calls func for every node with low <= key <= high, in key order.
+     * Subtrees outside of the range are never visited, so this costs
+     * O(log n + m) for m nodes in range.
+     *
+     * @param low Smallest key to visit.
+     * @param high Largest key to visit.
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     */
+    template <typename Func>
+    void Range(TKey low, TKey high, Func func) const {
+        std::stack<const AVLTreeNode<TKey, TValue>*> my_stack;
+        const AVLTreeNode<TKey, TValue> *current = root_;
+
+        while (current != nullptr || !my_stack.empty()) {
+            // Stack the left spine, skipping nodes below low (all of their
+            // left subtree is below low as well).
+            while (current != nullptr) {
+                if (current->GetKey() < low) {
+                    current = current->GetRight();
+                } else {
+                    my_stack.push(current);
+                    current = current->GetLeft();
+                }
+            }
+            if (my_stack.empty()) break;
+            current = my_stack.top(); my_stack.pop();
+            if (current->GetKey() > high) break;
+            func(*current);
+            current = current->GetRight();
+        }
+    }
+
+    /**
+     * Returns the key at position index in key order.  Uses the subtree
+     * sizes kept in every node, so this is O(log n).
+     *
+     * @param index Zero based position, 0 is the minimum key.
+     *
+     * @return Key at position index.
+     *
+     * @throws range_error if index is not in [0, GetCount())
+     */
+    TKey GetKeyAt(int index) const {
+        if (index < 0 || index >= count_)
+            throw std::range_error("! Index out of range !");
+
+        AVLTreeNode<TKey, TValue> *current = root_;
+        while (true) {
+            int left_size = (current->GetLeft() == nullptr)
+                ? 0 : current->GetLeft()->GetSize();
+            if (index == left_size) return current->GetKey();
+            if (index < left_size) {
+                current = current->GetLeft();
+            } else {
+                index -= left_size + 1;
+                current = current->GetRight();
+            }
+        }
+    }
+
     /**
      * Returns the key with the minimum value.
      *
      * @return Minimum valued key in the tree.
+     *
+     * @throws range_error if the tree is empty
      */
-    TKey GetMinKey() {
+    TKey GetMinKey() const {
         if (root_ == nullptr)
-            return nullptr;
+            throw std::range_error("! Tree is empty !");
 
         AVLTreeNode<TKey, TValue> *current = root_;
         while (current->GetLeft() != nullptr)
@@ -198,10 +388,12 @@ class AVLTree {
      * Returns the key with the maximum value.
      *
      * @return Maximum valued key in the tree.
+     *
+     * @throws range_error if the tree is empty
      */
-    TKey GetMaxKey() {
+    TKey GetMaxKey() const {
         if (root_ == nullptr)
-            return nullptr;
+            throw std::range_error("! Tree is empty !");
 
         AVLTreeNode<TKey, TValue> *current = root_;
         while (current->GetRight() != nullptr)
@@ -214,10 +406,200 @@ class AVLTree {
      * Clear the contents of the tree.
      */
     void Clear() {
+        DeleteNodes(root_);
         root_ = nullptr;
         count_ = 0;
     }
 
+    /**
+     * Writes a snapshot of the tree to out, streaming the entries in key
+     * order.
+     *
+     * The snapshot is a header (magic, format version, byte order, the
+     * codec id and item size of the key and value types, entry count),
+     * then every key and value, encoded by AVLTreeKeyCodec and AVLTreeCodec
+     * respectively, then a 64 bit FNV-1a checksum of everything before
+     * it.  Header integers are little endian.
+     *
+     * @param out Stream to write to, opened in binary mode.
+     *
+     * @throws runtime_error if writing to out fails
+     */
+    void Save(std::ostream &out) const {
+        SnapshotWriter writer(&out);
+        writer.Write(kSnapshotMagic, sizeof(kSnapshotMagic));
+        writer.WriteU32(kSnapshotVersion);
+        writer.WriteU32(std::endian::native == std::endian::little ? 0 : 1);
+        writer.WriteU32(AVLTreeKeyCodec<TKey>::kId);
+        writer.WriteU32(AVLTreeKeyCodec<TKey>::kSize);
+        writer.WriteU32(AVLTreeCodec<TValue>::kId);
+        writer.WriteU32(AVLTreeCodec<TValue>::kSize);
+        writer.WriteU64(static_cast<std::uint64_t>(count_));
+
+        std::optional<TKey> previous;
+        ForEach([&writer, &previous](const AVLTreeNode<TKey, TValue> &node) {
+            TKey key = node.GetKey();
+            AVLTreeKeyCodec<TKey>::Write(&writer,
+                previous.has_value() ? &*previous : nullptr, key);
+            AVLTreeCodec<TValue>::Write(&writer, node.GetValue());
+            previous = key;
+        });
+
+        writer.WriteU64(writer.GetChecksum());
+        if (!writer.Good())
+            throw std::runtime_error("! Failed to write snapshot !");
+    }
+
+    /**
+     * Reads a snapshot written by Save into a new tree.
+     *
+     * The entries arrive in key order and the header gives their count, so
+     * the tree is built perfectly balanced as the stream is read, in O(n)
+     * and without any rotations or buffering.
+     *
+     * @param in Stream to read from, opened in binary mode.
+     *
+     * @return The loaded tree.
+     *
+     * @throws runtime_error if the snapshot is truncated, corrupt, or was
+     *          written for different key or value codecs
+     */
+    static AVLTree Load(std::istream &in) {
+        SnapshotReader reader(&in);
+        char magic[sizeof(kSnapshotMagic)];
+        std::uint32_t version, byte_order, key_id, key_size, value_id,
+            value_size;
+        std::uint64_t count;
+        if (!reader.Read(magic, sizeof(magic))
+                || !std::equal(magic, magic + sizeof(magic), kSnapshotMagic)
+                || !reader.ReadU32(&version) || !reader.ReadU32(&byte_order)
+                || !reader.ReadU32(&key_id) || !reader.ReadU32(&key_size)
+                || !reader.ReadU32(&value_id) || !reader.ReadU32(&value_size)
+                || !reader.ReadU64(&count)) {
+            throw std::runtime_error("! Not an AVLTree snapshot !");
+        }
+        if (version < 1 || version > kSnapshotVersion)
+            throw std::runtime_error("! Unsupported snapshot version !");
+        bool key_codec = version != 1;
+        if (byte_order != (std::endian::native == std::endian::little ? 0 : 1)
+                || key_id != SnapshotCodecId(key_codec
+                    ? AVLTreeKeyCodec<TKey>::kId : AVLTreeCodec<TKey>::kId,
+                    version)
+                || key_size != (key_codec ? AVLTreeKeyCodec<TKey>::kSize
+                    : AVLTreeCodec<TKey>::kSize)
+                || value_id != SnapshotCodecId(AVLTreeCodec<TValue>::kId,
+                    version)
+                || value_size != AVLTreeCodec<TValue>::kSize) {
+            throw std::runtime_error
+                ("! Snapshot was written for different key or value types !");
+        }
+        if (count > static_cast<std::uint64_t>(std::numeric_limits<int>::max()))
+            throw std::runtime_error("! Snapshot entry count is too large !");
+
+        AVLTree tree;
+        std::optional<TKey> previous;
+        tree.root_ = LoadNodes(&reader, count, key_codec, &previous);
+        tree.count_ = static_cast<int>(count);
+
+        std::uint64_t expected = reader.GetChecksum();
+        std::uint64_t checksum;
+        if (!reader.ReadU64(&checksum) || checksum != expected)
+            throw std::runtime_error("! Snapshot checksum mismatch !");
+        return tree;
+    }
+
+    /**
+     * Returns a hash of every key/value pair in the tree.  Trees holding
+     * the same entries hash the same whatever their shape.
+     *
+     * The hash of a subtree is a polynomial over its entries in key order
+     * modulo 2^61 - 1, combined from its children's.  Entries are hashed
+     * with std::hash.  Each call costs O(n), unless AVLTreeHashPolicy has
+     * nodes cache their subtree's hash: every change clears the cache of
+     * the changed node and its ancestors, so then only the first call
+     * costs O(n) and later ones rehash just what changed since.
+     */
+    std::uint64_t GetHash() {
+        return SubtreeHash(root_).hash;
+    }
+
+    /**
+     * Returns true if other holds the same key/value pairs, by comparing
+     * counts and GetHash, so it costs O(1) on trees whose hashes are
+     * cached, and O(n) when the policy does not cache.  Different trees
+     * compare equal with probability about n / 2^61.
+     */
+    bool Equals(AVLTree &other) {
+        if (this == &other) return true;
+        return count_ == other.count_ && GetHash() == other.GetHash();
+    }
+
+    /**
+     * Calls func, in key order, for every key that is in only one of this
+     * tree and other, or in both with different values.
+     *
+     * When AVLTreeHashPolicy caches hashes, walks this tree from the
+     * root, comparing each subtree's cached hash with the hash of the same
+     * key range of other, which takes O(log n), and skips every range
+     * that matches.  That costs O(d log^2 n) for d differing keys, plus the
+     * hashing of whatever changed since the last comparison.  Otherwise
+     * merges the two trees in key order, in O(n + m).
+     *
+     * @param func Callable taking a const TKey&.
+     */
+    template <typename Func>
+    void Diff(AVLTree &other, Func func) {
+        if constexpr (AVLTreeHashPolicy<TKey, TValue>::kCache) {
+            DiffNodes(root_, other.root_, nullptr, nullptr, func);
+        } else {
+            DiffMerge(root_, other.root_, func);
+        }
+    }
+
+    /**
+     * Moves every entry with a key >= key out of this tree and into a new
+     * tree.  Uses the AVL split algorithm, so only O(log n) nodes are
+     * touched and nothing is allocated or copied.
+     *
+     * @param Key Smallest key to move into the returned tree.
+     *
+     * @return Tree holding every entry with a key >= key.
+     */
+    AVLTree Split(TKey key) {
+        AVLTreeNode<TKey, TValue> *left = nullptr;
+        AVLTreeNode<TKey, TValue> *found = nullptr;
+        AVLTreeNode<TKey, TValue> *right = nullptr;
+        SplitNodes(root_, key, &left, &found, &right);
+        if (found != nullptr) right = JoinNodes(nullptr, found, right);
+
+        AVLTree result(traversal_method_);
+        result.root_ = right;
+        result.count_ = (right == nullptr) ? 0 : right->GetSize();
+        root_ = left;
+        count_ -= result.count_;
+        return result;
+    }
+
+    /**
+     * Moves every entry of other onto the end of this tree, leaving other
+     * empty.  O(log n), nothing is allocated or copied.
+     *
+     * @param other Tree whose keys are all greater than the keys of this
+     *          tree.
+     *
+     * @throws range_error if the key ranges of the trees overlap
+     */
+    void Join(AVLTree &other) {
+        if (other.root_ == nullptr) return;
+        if (root_ != nullptr && !(GetMaxKey() < other.GetMinKey()))
+            throw std::range_error("! Joined tree keys overlap !");
+
+        root_ = ConcatNodes(root_, other.root_);
+        count_ += other.count_;
+        other.root_ = nullptr;
+        other.count_ = 0;
+    }
+
     /**
      * Add a key/value pair to the tree.
      *
@@ -230,8 +612,6 @@ class AVLTree {
     void Add(TKey Key, TValue Value) {
         std::stack<AVLTreeNode<TKey, TValue>*> my_stack =
             std::stack<AVLTreeNode<TKey, TValue>*>();
-        AVLTreeNode<TKey, TValue> *node =
-            new AVLTreeNode<TKey, TValue>(Key, Value);
 
         AVLTreeNode<TKey, TValue> *current = root_;
         AVLTreeNode<TKey, TValue> *parent = nullptr;
@@ -241,10 +621,10 @@ class AVLTree {
         while (current != nullptr) {
             my_stack.push(current);
 
-            if (node->GetKey() == current->GetKey()) {
+            if (Key == current->GetKey()) {
                 // Duplicate Value, throw exception
                 throw std::range_error("! Key already exists in Tree !");
-            } else if (node->GetKey() > current->GetKey()) {
+            } else if (Key > current->GetKey()) {
                     // node.key > current.key --> Go Right
                 parent = current;
                 current = current->GetRight();
@@ -254,6 +634,8 @@ class AVLTree {
             }
         }
 
+        AVLTreeNode<TKey, TValue> *node =
+            new AVLTreeNode<TKey, TValue>(Key, Value);
         count_++;
 
         if (parent == nullptr) {  // Empty Tree
@@ -284,12 +666,100 @@ class AVLTree {
         }
     }
 
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.
+     *
+     * @param Key
+     *            Key used for ordering the tree entries.
+     * @param Value
+     *            Value to be stored.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        // Walks down by hand so the path is marked dirty for Checkpoint,
+        // the way Add and Remove mark it by recalculating heights.
+        AVLTreeNode<TKey, TValue> *node = root_;
+        while (node != nullptr && node->GetKey() != key) {
+            node->MarkDirty();
+            node = key < node->GetKey() ? node->GetLeft() : node->GetRight();
+        }
+        if (node != nullptr)
+            node->SetValue(value);
+        else
+            Add(key, value);
+    }
+
+    /**
+     * Applies a batch of changes, sorted by key, in one pass over the tree.
+     *
+     * The batch is split around the root's key, each half is applied to
+     * the matching subtree recursively, and the results are joined back
+     * together (Blelloch, Ferizovic and Sun, "Just Join for Parallel
+     * Ordered Sets").  Operations that fall into an empty subtree are built
+     * into a balanced subtree directly.  For k operations this costs
+     * O(k log(n / k + 1)) instead of k separate O(log n) descents, and each
+     * node on a shared path is rebalanced once rather than once per
+     * operation.
+     *
+     * Operations on the same key are applied in the order they appear.  An
+     * operation that can not be applied (Add of a present key, Remove of a
+     * missing key) is skipped and left with applied == false, rather than
+     * throwing part way through the batch.
+     *
+     * @param ops Operations, sorted by key.  Each one's applied flag is set,
+     *          and an applied Remove receives the removed value.
+     *
+     * @throws invalid_argument if ops are not sorted by key
+     */
+    void ApplyBatch(std::span<AVLTreeOperation<TKey, TValue>> ops) {
+        for (std::size_t i = 1; i < ops.size(); i++) {
+            if (ops[i].key < ops[i - 1].key)
+                throw std::invalid_argument("! Batch is not sorted by key !");
+        }
+
+        int delta = 0;
+        root_ = ApplyBatchNodes(root_, ops.data(), ops.data() + ops.size(),
+            &delta);
+        count_ += delta;
+    }
+
+    /**
+     * Applies a batch of changes, sorted by key, using the threads of pool.
+     *
+     * Same as ApplyBatch(ops), except the two halves of the batch on either
+     * side of a node are applied in parallel, so the batch is spread over
+     * the pool by key range.  Pieces smaller than kParallelBatchGrain are
+     * applied sequentially.  With p threads the work is split p ways once
+     * the batch spans a few levels of the tree; the joins on the way back up
+     * cost O(log n) each.
+     *
+     * @param ops Operations, sorted by key.  Each one's applied flag is set,
+     *          and an applied Remove receives the removed value.
+     * @param pool Threads to run on.  The calling thread takes part.
+     *
+     * @throws invalid_argument if ops are not sorted by key
+     */
+    void ApplyBatch(std::span<AVLTreeOperation<TKey, TValue>> ops,
+            ThreadPool &pool) {
+        for (std::size_t i = 1; i < ops.size(); i++) {
+            if (ops[i].key < ops[i - 1].key)
+                throw std::invalid_argument("! Batch is not sorted by key !");
+        }
+
+        int delta = 0;
+        root_ = ApplyBatchNodes(root_, ops.data(), ops.data() + ops.size(),
+            &delta, &pool);
+        count_ += delta;
+    }
+
     /**
      * Remove an entry from the tree.
      *
      * @param Key
      *            Key of entry to remove.
      * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws range_error if no node exists at key
      */
     MapEntry<TKey, TValue> Remove(TKey key) {
         std::stack<AVLTreeNode<TKey, TValue>*> my_stack =
@@ -314,8 +784,9 @@ class AVLTree {
             }
         }
 
-        if (current == nullptr) {  // Key not found, throw exception??
-            return nullptr;
+        if (current == nullptr) {  // Key not found
+            throw std::range_error
+                (std::format("! Key {} not present in Tree !", key));
         } else {
             count_--;
             removed = current;
@@ -340,7 +811,7 @@ class AVLTree {
                     if (parent->GetKey() < current->GetKey()) {
                         parent->SetRight(current->GetLeft());
                     } else {
-                        parent->SetRight(current->GetLeft());
+                        parent->SetLeft(current->GetLeft());
                     }
                 }
 
@@ -414,7 +885,7 @@ class AVLTree {
                 }
             }
 
-            current = my_stack.pop();
+            current = my_stack.top(); my_stack.pop();
             while (current != nullptr) {
                 current->CalculateHeight();
                 if (current->GetBalanceFactor() > 1) {
@@ -491,6 +962,808 @@ class AVLTree {
         }
     }
 
+    /**
+     * Rebuilds the tree to its minimum possible height.
+     *
+     * Mixed insert/remove workloads can leave an AVL tree up to ~44% taller
+     * than a perfectly balanced tree.  Compact flattens the tree into a
+     * sorted, right leaning vine and then folds the vine back into a complete
+     * tree (Day-Stout-Warren).  Only rotations of the existing nodes are
+     * used, so this runs in O(n) time and allocates nothing.  Useful before
+     * a read-only phase, to shorten every lookup path.
+     */
+    void Compact() {
+        if (root_ == nullptr) return;
+
+        int size = TreeToVine();
+
+        // Fold the leaves of the bottom level first so every compression
+        // pass after that halves a vine of length 2^k - 1.
+        int leaves = size + 1 -
+            static_cast<int>(std::bit_floor(static_cast<unsigned>(size + 1)));
+        Compress(leaves);
+        size -= leaves;
+        while (size > 1) {
+            size /= 2;
+            Compress(size);
+        }
+
+        RecalculateHeights(root_);
+    }
+
+ private:
+    /**
+     * Locates the node indexed by key.
+     *
+     * @param Key Key to locate in the tree.
+     *
+     * @return pointer to the node at key, or nullptr if not present.
+     */
+    AVLTreeNode<TKey, TValue>* FindNode(TKey key) const {
+        AVLTreeNode<TKey, TValue> *current = root_;
+
+        while (current != nullptr) {
+            if (current->GetKey() == key) {
+                return current;
+            }
+            if (current->GetKey() < key) {
+                current = current->GetRight();
+            } else  {
+                current = current->GetLeft();
+            }
+        }
+        return nullptr;
+    }
+
+    static int Height(const AVLTreeNode<TKey, TValue> *node) {
+        return (node == nullptr) ? -1 : node->GetHeight();
+    }
+
+    /**
+     * Rotates the subtree rooted at node right.  A subtree with no left
+     * child can not rotate right and is returned as it is.
+     *
+     * @return New root of the subtree.
+     */
+    static AVLTreeNode<TKey, TValue>* RotateSubtreeRight(
+            AVLTreeNode<TKey, TValue> *node) {
+        AVLTreeNode<TKey, TValue> *left_node = node->GetLeft();
+        if (left_node == nullptr) return node;
+        node->SetLeft(left_node->GetRight());
+        left_node->SetRight(node);
+        node->CalculateHeight();
+        left_node->CalculateHeight();
+        return left_node;
+    }
+
+    /**
+     * Rotates the subtree rooted at node left.  A subtree with no right
+     * child can not rotate left and is returned as it is.
+     *
+     * @return New root of the subtree.
+     */
+    static AVLTreeNode<TKey, TValue>* RotateSubtreeLeft(
+            AVLTreeNode<TKey, TValue> *node) {
+        AVLTreeNode<TKey, TValue> *right_node = node->GetRight();
+        if (right_node == nullptr) return node;
+        node->SetRight(right_node->GetLeft());
+        right_node->SetLeft(node);
+        node->CalculateHeight();
+        right_node->CalculateHeight();
+        return right_node;
+    }
+
+    /**
+     * Joins two AVL subtrees and a middle node into one AVL subtree (see
+     * Blelloch, Ferizovic and Sun, "Just Join for Parallel Ordered Sets").
+     * Every key in left must be less than middle's key, and every key in
+     * right greater.  Costs O(|height(left) - height(right)|).
+     *
+     * @return Root of the joined subtree.
+     */
+    static AVLTreeNode<TKey, TValue>* JoinNodes(
+            AVLTreeNode<TKey, TValue> *left,
+            AVLTreeNode<TKey, TValue> *middle,
+            AVLTreeNode<TKey, TValue> *right) {
+        if (Height(left) > Height(right) + 1)
+            return JoinRight(left, middle, right);
+        if (Height(right) > Height(left) + 1)
+            return JoinLeft(left, middle, right);
+        middle->SetLeft(left);
+        middle->SetRight(right);
+        middle->CalculateHeight();
+        return middle;
+    }
+
+    /**
+     * JoinNodes when left is the taller tree: walk down the right spine of
+     * left to a subtree of right's height, join there, and rebalance on the
+     * way back up.
+     */
+    static AVLTreeNode<TKey, TValue>* JoinRight(
+            AVLTreeNode<TKey, TValue> *left,
+            AVLTreeNode<TKey, TValue> *middle,
+            AVLTreeNode<TKey, TValue> *right) {
+        // left is taller than right, so never empty; JoinNodes handles an
+        // empty left without coming back here.
+        if (left == nullptr) return JoinNodes(left, middle, right);
+        AVLTreeNode<TKey, TValue> *spine = left->GetRight();
+
+        if (Height(spine) <= Height(right) + 1) {
+            middle->SetLeft(spine);
+            middle->SetRight(right);
+            middle->CalculateHeight();
+            if (middle->GetHeight() <= Height(left->GetLeft()) + 1) {
+                left->SetRight(middle);
+                left->CalculateHeight();
+                return left;
+            }
+            left->SetRight(RotateSubtreeRight(middle));
+            left->CalculateHeight();
+            return RotateSubtreeLeft(left);
+        }
+
+        AVLTreeNode<TKey, TValue> *joined = JoinRight(spine, middle, right);
+        left->SetRight(joined);
+        left->CalculateHeight();
+        if (joined->GetHeight() <= Height(left->GetLeft()) + 1) return left;
+        return RotateSubtreeLeft(left);
+    }
+
+    /**
+     * Mirror image of JoinRight, for when right is the taller tree.
+     */
+    static AVLTreeNode<TKey, TValue>* JoinLeft(
+            AVLTreeNode<TKey, TValue> *left,
+            AVLTreeNode<TKey, TValue> *middle,
+            AVLTreeNode<TKey, TValue> *right) {
+        if (right == nullptr) return JoinNodes(left, middle, right);
+        AVLTreeNode<TKey, TValue> *spine = right->GetLeft();
+
+        if (Height(spine) <= Height(left) + 1) {
+            middle->SetLeft(left);
+            middle->SetRight(spine);
+            middle->CalculateHeight();
+            if (middle->GetHeight() <= Height(right->GetRight()) + 1) {
+                right->SetLeft(middle);
+                right->CalculateHeight();
+                return right;
+            }
+            right->SetLeft(RotateSubtreeLeft(middle));
+            right->CalculateHeight();
+            return RotateSubtreeRight(right);
+        }
+
+        AVLTreeNode<TKey, TValue> *joined = JoinLeft(left, middle, spine);
+        right->SetLeft(joined);
+        right->CalculateHeight();
+        if (joined->GetHeight() <= Height(right->GetRight()) + 1) return right;
+        return RotateSubtreeRight(right);
+    }
+
+    /**
+     * Splits the subtree rooted at node by key.  Costs O(log n).
+     *
+     * @param *left receives the subtree of keys < key.
+     * @param *found receives the detached node holding key, or nullptr.
+     * @param *right receives the subtree of keys > key.
+     */
+    static void SplitNodes(AVLTreeNode<TKey, TValue> *node, const TKey &key,
+            AVLTreeNode<TKey, TValue> **left,
+            AVLTreeNode<TKey, TValue> **found,
+            AVLTreeNode<TKey, TValue> **right) {
+        if (node == nullptr) {
+            *left = nullptr;
+            *found = nullptr;
+            *right = nullptr;
+        } else if (key == node->GetKey()) {
+            *left = node->GetLeft();
+            *right = node->GetRight();
+            node->SetLeft(nullptr);
+            node->SetRight(nullptr);
+            node->CalculateHeight();
+            *found = node;
+        } else if (key < node->GetKey()) {
+            AVLTreeNode<TKey, TValue> *split_right = nullptr;
+            SplitNodes(node->GetLeft(), key, left, found, &split_right);
+            *right = JoinNodes(split_right, node, node->GetRight());
+        } else {
+            AVLTreeNode<TKey, TValue> *split_left = nullptr;
+            SplitNodes(node->GetRight(), key, &split_left, found, right);
+            *left = JoinNodes(node->GetLeft(), node, split_left);
+        }
+    }
+
+    /**
+     * Detaches the node with the largest key from the subtree rooted at
+     * node.
+     *
+     * @param *rest receives the remaining subtree.
+     * @param *last receives the detached node.
+     */
+    static void SplitLastNode(AVLTreeNode<TKey, TValue> *node,
+            AVLTreeNode<TKey, TValue> **rest,
+            AVLTreeNode<TKey, TValue> **last) {
+        if (node->GetRight() == nullptr) {
+            *rest = node->GetLeft();
+            node->SetLeft(nullptr);
+            node->CalculateHeight();
+            *last = node;
+            return;
+        }
+        AVLTreeNode<TKey, TValue> *split_rest = nullptr;
+        SplitLastNode(node->GetRight(), &split_rest, last);
+        *rest = JoinNodes(node->GetLeft(), node, split_rest);
+    }
+
+    /**
+     * Joins two subtrees without a middle node.  Every key in left must be
+     * less than every key in right.
+     *
+     * @return Root of the joined subtree.
+     */
+    static AVLTreeNode<TKey, TValue>* ConcatNodes(
+            AVLTreeNode<TKey, TValue> *left,
+            AVLTreeNode<TKey, TValue> *right) {
+        if (left == nullptr) return right;
+        if (right == nullptr) return left;
+        AVLTreeNode<TKey, TValue> *rest = nullptr;
+        AVLTreeNode<TKey, TValue> *last = nullptr;
+        SplitLastNode(left, &rest, &last);
+        return JoinNodes(rest, last, right);
+    }
+
+    /**
+     * Deletes every node of the subtree rooted at node.
+     */
+    static void DeleteNodes(AVLTreeNode<TKey, TValue> *node) {
+        std::stack<AVLTreeNode<TKey, TValue>*> my_stack;
+        if (node != nullptr) my_stack.push(node);
+        while (!my_stack.empty()) {
+            AVLTreeNode<TKey, TValue> *current = my_stack.top();
+            my_stack.pop();
+            if (current->GetLeft() != nullptr)
+                my_stack.push(current->GetLeft());
+            if (current->GetRight() != nullptr)
+                my_stack.push(current->GetRight());
+            delete current;
+        }
+    }
+
+    /**
+     * Reads the next count entries of a snapshot into a perfectly balanced
+     * subtree: the left half, then the middle entry, then the right half.
+     * Frees whatever it built if it throws.
+     *
+     * @param key_codec true if keys were written by AVLTreeKeyCodec, false
+     *          for a version 1 snapshot that wrote them by AVLTreeCodec.
+     * @param *previous last key read, checked against each new key.
+     */
+    static AVLTreeNode<TKey, TValue>* LoadNodes(SnapshotReader *reader,
+            std::uint64_t count, bool key_codec,
+            std::optional<TKey> *previous) {
+        if (count == 0) return nullptr;
+        std::uint64_t left_count = count / 2;
+        AVLTreeNode<TKey, TValue> *left = LoadNodes(reader, left_count,
+            key_codec, previous);
+
+        AVLTreeNode<TKey, TValue> *node = nullptr;
+        try {
+            TKey key;
+            TValue value;
+            bool read = key_codec
+                ? AVLTreeKeyCodec<TKey>::Read(reader,
+                    previous->has_value() ? &**previous : nullptr, &key)
+                : AVLTreeCodec<TKey>::Read(reader, &key);
+            if (!read || !AVLTreeCodec<TValue>::Read(reader, &value))
+                throw std::runtime_error("! Snapshot is truncated !");
+            if (previous->has_value() && !(**previous < key))
+                throw std::runtime_error("! Snapshot keys are out of order !");
+            *previous = key;
+
+            node = new AVLTreeNode<TKey, TValue>(key, value);
+            node->SetLeft(left);
+            node->SetRight(LoadNodes(reader, count - 1 - left_count,
+                key_codec, previous));
+        } catch (...) {
+            DeleteNodes(node != nullptr ? node : left);
+            throw;
+        }
+        node->CalculateHeight();
+        return node;
+    }
+
+    /**
+     * Calls func for every node of the subtree rooted at node, in key
+     * order.
+     */
+    template <typename Func>
+    static void ForEachNode(const AVLTreeNode<TKey, TValue> *node,
+            Func &func) {
+        std::stack<const AVLTreeNode<TKey, TValue>*> my_stack;
+        const AVLTreeNode<TKey, TValue> *current = node;
+
+        while (current != nullptr || !my_stack.empty()) {
+            while (current != nullptr) {
+                my_stack.push(current);
+                current = current->GetLeft();
+            }
+            current = my_stack.top(); my_stack.pop();
+            func(*current);
+            current = current->GetRight();
+        }
+    }
+
+    template <typename Func>
+    static void ParallelForEachNode(const AVLTreeNode<TKey, TValue> *node,
+            Func &func, ThreadPool *pool) {
+        if (node == nullptr) return;
+        if (node->GetSize() < kParallelTraversalGrain) {
+            ForEachNode(node, func);
+            return;
+        }
+        pool->Invoke(
+            [&] {
+                ParallelForEachNode(node->GetLeft(), func, pool);
+                func(*node);
+            },
+            [&] { ParallelForEachNode(node->GetRight(), func, pool); });
+    }
+
+    template <typename TResult, typename Map, typename Combine>
+    static TResult ParallelReduceNode(const AVLTreeNode<TKey, TValue> *node,
+            const TResult &identity, Map &map, Combine &combine,
+            ThreadPool *pool) {
+        if (node == nullptr) return identity;
+        if (node->GetSize() < kParallelTraversalGrain) {
+            TResult result = identity;
+            auto fold = [&result, &map, &combine]
+                    (const AVLTreeNode<TKey, TValue> &n) {
+                result = combine(std::move(result), map(n));
+            };
+            ForEachNode(node, fold);
+            return result;
+        }
+
+        TResult left = identity;
+        TResult right = identity;
+        pool->Invoke(
+            [&] {
+                left = ParallelReduceNode(node->GetLeft(), identity, map,
+                    combine, pool);
+            },
+            [&] {
+                right = ParallelReduceNode(node->GetRight(), identity, map,
+                    combine, pool);
+            });
+        return combine(combine(std::move(left), map(*node)),
+            std::move(right));
+    }
+
+    /**
+     * Hash, modulo kHashPrime, of a run of entries, its length, and
+     * kHashBase to the power of its length, so runs concatenate in O(1).
+     */
+    struct HashRun {
+        std::uint64_t hash;
+        std::uint64_t power;
+        int count;
+    };
+
+    static constexpr std::uint64_t kHashPrime = (std::uint64_t{1} << 61) - 1;
+    static constexpr std::uint64_t kHashBase = 0x1f3d5b79a2c4e687ULL
+        % kHashPrime;
+
+    static std::uint64_t MultiplyHash(std::uint64_t a, std::uint64_t b) {
+        unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        std::uint64_t low = static_cast<std::uint64_t>(product) & kHashPrime;
+        std::uint64_t high = static_cast<std::uint64_t>(product >> 61);
+        std::uint64_t sum = low + high;
+        return sum >= kHashPrime ? sum - kHashPrime : sum;
+    }
+
+    /**
+     * Hash of the run a followed by the run b.
+     */
+    static HashRun ConcatHash(HashRun a, HashRun b) {
+        std::uint64_t hash = MultiplyHash(a.hash, b.power) + b.hash;
+        if (hash >= kHashPrime) hash -= kHashPrime;
+        return HashRun{hash, MultiplyHash(a.power, b.power),
+            a.count + b.count};
+    }
+
+    static HashRun EntryHash(const AVLTreeNode<TKey, TValue> *node) {
+        std::uint64_t hash = Mix(Mix(std::hash<TKey>{}(node->GetKey()))
+            ^ std::hash<TValue>{}(node->GetValue()));
+        return HashRun{hash % kHashPrime, kHashBase, 1};
+    }
+
+    /**
+     * splitmix64 finalizer, so that std::hash's identity hash of integers
+     * still spreads entries over the whole range.
+     */
+    static std::uint64_t Mix(std::uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    /**
+     * Hash of the subtree at node, from its cache when it has one.  The
+     * cache holds the hash plus one, so that zero can mean kNoHash.
+     */
+    static HashRun SubtreeHash(AVLTreeNode<TKey, TValue> *node) {
+        if (node == nullptr) return HashRun{0, 1, 0};
+        if (node->GetHash() != AVLTreeNode<TKey, TValue>::kNoHash)
+            return HashRun{node->GetHash() - 1, node->GetHashPower(),
+                node->GetSize()};
+        HashRun run = ConcatHash(ConcatHash(SubtreeHash(node->GetLeft()),
+            EntryHash(node)), SubtreeHash(node->GetRight()));
+        node->SetHash(run.hash + 1, run.power);
+        return run;
+    }
+
+    /**
+     * Hash of the entries of the subtree at node with low < key < high.  A
+     * null bound is open.  Descends one path per bound, taking the hash of
+     * every subtree wholly in range from SubtreeHash, so with cached hashes
+     * it costs O(log n).
+     */
+    static HashRun RangeHash(AVLTreeNode<TKey, TValue> *node,
+            const TKey *low, const TKey *high) {
+        if (low == nullptr && high == nullptr) return SubtreeHash(node);
+        while (node != nullptr) {
+            if (low != nullptr && !(*low < node->GetKey())) {
+                node = node->GetRight();
+            } else if (high != nullptr && !(node->GetKey() < *high)) {
+                node = node->GetLeft();
+            } else {
+                break;
+            }
+        }
+        if (node == nullptr) return HashRun{0, 1, 0};
+        // node is the highest node in range; its left subtree is bounded
+        // only by low, its right only by high.
+        return ConcatHash(ConcatHash(RangeHash(node->GetLeft(), low, nullptr),
+            EntryHash(node)), RangeHash(node->GetRight(), nullptr, high));
+    }
+
+    template <typename Func>
+    static void DiffNodes(AVLTreeNode<TKey, TValue> *node,
+            AVLTreeNode<TKey, TValue> *other, const TKey *low,
+            const TKey *high, Func &func) {
+        HashRun theirs = RangeHash(other, low, high);
+        HashRun mine = SubtreeHash(node);
+        if (mine.hash == theirs.hash && mine.count == theirs.count) return;
+
+        if (node == nullptr) {
+            // Everything other has in the range is missing here.
+            ForEachBetween(other, low, high, func);
+            return;
+        }
+        TKey key = node->GetKey();
+        DiffNodes(node->GetLeft(), other, low, &key, func);
+        const AVLTreeNode<TKey, TValue> *match = other;
+        while (match != nullptr && match->GetKey() != key)
+            match = key < match->GetKey() ? match->GetLeft()
+                : match->GetRight();
+        if (match == nullptr || !(match->GetValue() == node->GetValue()))
+            func(key);
+        DiffNodes(node->GetRight(), other, &key, high, func);
+    }
+
+    /**
+     * Diff without cached hashes: walks both trees in key order at once.
+     */
+    template <typename Func>
+    static void DiffMerge(const AVLTreeNode<TKey, TValue> *node,
+            const AVLTreeNode<TKey, TValue> *other, Func &func) {
+        std::vector<const AVLTreeNode<TKey, TValue>*> mine;
+        std::vector<const AVLTreeNode<TKey, TValue>*> theirs;
+        auto push_left = [](std::vector<const AVLTreeNode<TKey, TValue>*>
+                *my_stack, const AVLTreeNode<TKey, TValue> *n) {
+            for (; n != nullptr; n = n->GetLeft()) my_stack->push_back(n);
+        };
+        auto pop = [&push_left](std::vector<const AVLTreeNode<TKey, TValue>*>
+                *my_stack) {
+            const AVLTreeNode<TKey, TValue> *n = my_stack->back();
+            my_stack->pop_back();
+            push_left(my_stack, n->GetRight());
+        };
+        push_left(&mine, node);
+        push_left(&theirs, other);
+        while (!mine.empty() || !theirs.empty()) {
+            const AVLTreeNode<TKey, TValue> *a = mine.empty() ? nullptr
+                : mine.back();
+            const AVLTreeNode<TKey, TValue> *b = theirs.empty() ? nullptr
+                : theirs.back();
+            if (b == nullptr || (a != nullptr && a->GetKey() < b->GetKey())) {
+                func(a->GetKey());
+                pop(&mine);
+            } else if (a == nullptr || b->GetKey() < a->GetKey()) {
+                func(b->GetKey());
+                pop(&theirs);
+            } else {
+                if (!(a->GetValue() == b->GetValue())) func(a->GetKey());
+                pop(&mine);
+                pop(&theirs);
+            }
+        }
+    }
+
+    /**
+     * Calls func with every key of the subtree at node with low < key <
+     * high, in key order.
+     */
+    template <typename Func>
+    static void ForEachBetween(const AVLTreeNode<TKey, TValue> *node,
+            const TKey *low, const TKey *high, Func &func) {
+        if (node == nullptr) return;
+        bool above_low = low == nullptr || *low < node->GetKey();
+        bool below_high = high == nullptr || node->GetKey() < *high;
+        if (above_low) ForEachBetween(node->GetLeft(), low, high, func);
+        if (above_low && below_high) func(node->GetKey());
+        if (below_high) ForEachBetween(node->GetRight(), low, high, func);
+    }
+
+    /**
+     * Finds the operations on key within the sorted operations
+     * [first, last), by binary search, as [*equal_first, *equal_last).
+     */
+    static void EqualOperations(AVLTreeOperation<TKey, TValue> *first,
+            AVLTreeOperation<TKey, TValue> *last, const TKey &key,
+            AVLTreeOperation<TKey, TValue> **equal_first,
+            AVLTreeOperation<TKey, TValue> **equal_last) {
+        *equal_first = std::lower_bound(first, last, key,
+            [](const AVLTreeOperation<TKey, TValue> &op, const TKey &k) {
+                return op.key < k;
+            });
+        *equal_last = std::upper_bound(*equal_first, last, key,
+            [](const TKey &k, const AVLTreeOperation<TKey, TValue> &op) {
+                return k < op.key;
+            });
+    }
+
+    /**
+     * Applies the sorted operations [first, last) to the subtree rooted at
+     * node.
+     *
+     * @param *delta accumulates the change in entry count.
+     *
+     * @return New root of the subtree.
+     */
+    static AVLTreeNode<TKey, TValue>* ApplyBatchNodes(
+            AVLTreeNode<TKey, TValue> *node,
+            AVLTreeOperation<TKey, TValue> *first,
+            AVLTreeOperation<TKey, TValue> *last, int *delta) {
+        if (first == last) return node;
+        if (node == nullptr) return BuildBatchNodes(first, last, delta);
+
+        // Keys in [first, equal_first) are below the node's key, keys in
+        // [equal_first, equal_last) equal it, the rest are above it.
+        AVLTreeOperation<TKey, TValue> *equal_first;
+        AVLTreeOperation<TKey, TValue> *equal_last;
+        EqualOperations(first, last, node->GetKey(), &equal_first,
+            &equal_last);
+
+        AVLTreeNode<TKey, TValue> *left =
+            ApplyBatchNodes(node->GetLeft(), first, equal_first, delta);
+        AVLTreeNode<TKey, TValue> *right =
+            ApplyBatchNodes(node->GetRight(), equal_last, last, delta);
+
+        bool present = true;
+        TValue value = node->GetValue();
+        ApplyKeyOperations(&present, &value, equal_first, equal_last);
+        if (!present) {
+            delete node;
+            (*delta)--;
+            return ConcatNodes(left, right);
+        }
+        if (equal_first != equal_last) node->SetValue(value);
+        return JoinNodes(left, node, right);
+    }
+
+    /**
+     * Parallel ApplyBatchNodes.  Splits the operations around node's key
+     * with a binary search, or around the middle key when the subtree is
+     * empty, and applies the two sides through pool.
+     */
+    static AVLTreeNode<TKey, TValue>* ApplyBatchNodes(
+            AVLTreeNode<TKey, TValue> *node,
+            AVLTreeOperation<TKey, TValue> *first,
+            AVLTreeOperation<TKey, TValue> *last, int *delta,
+            ThreadPool *pool) {
+        if (last - first < kParallelBatchGrain)
+            return ApplyBatchNodes(node, first, last, delta);
+
+        TKey key = node != nullptr ? node->GetKey()
+            : first[(last - first) / 2].key;
+        AVLTreeOperation<TKey, TValue> *equal_first;
+        AVLTreeOperation<TKey, TValue> *equal_last;
+        EqualOperations(first, last, key, &equal_first, &equal_last);
+
+        AVLTreeNode<TKey, TValue> *left = nullptr;
+        AVLTreeNode<TKey, TValue> *right = nullptr;
+        int left_delta = 0;
+        int right_delta = 0;
+        pool->Invoke(
+            [&] {
+                left = ApplyBatchNodes(node != nullptr ? node->GetLeft()
+                    : nullptr, first, equal_first, &left_delta, pool);
+            },
+            [&] {
+                right = ApplyBatchNodes(node != nullptr ? node->GetRight()
+                    : nullptr, equal_last, last, &right_delta, pool);
+            });
+        *delta += left_delta + right_delta;
+
+        bool present = node != nullptr;
+        TValue value = present ? node->GetValue() : TValue();
+        ApplyKeyOperations(&present, &value, equal_first, equal_last);
+        if (!present) {
+            if (node != nullptr) {
+                delete node;
+                (*delta)--;
+            }
+            return ConcatNodes(left, right);
+        }
+        if (node == nullptr) {
+            node = new AVLTreeNode<TKey, TValue>(key, value);
+            (*delta)++;
+        } else if (equal_first != equal_last) {
+            node->SetValue(value);
+        }
+        return JoinNodes(left, node, right);
+    }
+
+    /**
+     * Applies the sorted operations [first, last) to an empty subtree,
+     * building the surviving keys into a balanced subtree.
+     */
+    static AVLTreeNode<TKey, TValue>* BuildBatchNodes(
+            AVLTreeOperation<TKey, TValue> *first,
+            AVLTreeOperation<TKey, TValue> *last, int *delta) {
+        std::vector<AVLTreeNode<TKey, TValue>*> nodes;
+        while (first != last) {
+            AVLTreeOperation<TKey, TValue> *group_last = first + 1;
+            while (group_last != last && group_last->key == first->key)
+                group_last++;
+
+            bool present = false;
+            TValue value = TValue();
+            ApplyKeyOperations(&present, &value, first, group_last);
+            if (present)
+                nodes.push_back(new AVLTreeNode<TKey, TValue>(first->key,
+                    value));
+            first = group_last;
+        }
+        *delta += static_cast<int>(nodes.size());
+        return BuildNodes(nodes, 0, static_cast<int>(nodes.size()));
+    }
+
+    /**
+     * Links nodes[low, high), sorted by key, into a perfectly balanced
+     * subtree.
+     *
+     * @return Root of the subtree.
+     */
+    static AVLTreeNode<TKey, TValue>* BuildNodes(
+            const std::vector<AVLTreeNode<TKey, TValue>*> &nodes, int low,
+            int high) {
+        if (low >= high) return nullptr;
+        int middle = low + (high - low) / 2;
+        AVLTreeNode<TKey, TValue> *node = nodes[middle];
+        node->SetLeft(BuildNodes(nodes, low, middle));
+        node->SetRight(BuildNodes(nodes, middle + 1, high));
+        node->CalculateHeight();
+        return node;
+    }
+
+    /**
+     * Applies operations [first, last), all on the same key, in order.
+     *
+     * @param *present whether the key is present, updated.
+     * @param *value value of the key if present, updated.
+     */
+    static void ApplyKeyOperations(bool *present, TValue *value,
+            AVLTreeOperation<TKey, TValue> *first,
+            AVLTreeOperation<TKey, TValue> *last) {
+        for (; first != last; first++) {
+            switch (first->type) {
+            case AVLTreeOperationType::Add:
+                first->applied = !*present;
+                if (first->applied) {
+                    *present = true;
+                    *value = first->value;
+                }
+                break;
+            case AVLTreeOperationType::InsertOrAssign:
+                first->applied = true;
+                *present = true;
+                *value = first->value;
+                break;
+            case AVLTreeOperationType::Remove:
+                first->applied = *present;
+                if (first->applied) {
+                    *present = false;
+                    first->value = *value;
+                }
+                break;
+            }
+        }
+    }
+
+    /**
+     * Day-Stout-Warren phase 1.  Rotates right until no node has a left
+     * child, leaving the nodes as a sorted vine hanging to the right.
+     *
+     * @return Number of nodes in the vine.
+     */
+    int TreeToVine() {
+        int size = 0;
+        AVLTreeNode<TKey, TValue> *tail = nullptr;  // nullptr --> root_
+        AVLTreeNode<TKey, TValue> *rest = root_;
+
+        while (rest != nullptr) {
+            if (rest->GetLeft() == nullptr) {
+                tail = rest;
+                rest = rest->GetRight();
+                size++;
+            } else {
+                AVLTreeNode<TKey, TValue> *left = rest->GetLeft();
+                rest->SetLeft(left->GetRight());
+                left->SetRight(rest);
+                rest = left;
+                if (tail == nullptr)
+                    root_ = left;
+                else
+                    tail->SetRight(left);
+            }
+        }
+        return size;
+    }
+
+    /**
+     * Day-Stout-Warren phase 2.  Performs count left rotations down the
+     * right spine, rotating every other vine node down into a left child.
+     *
+     * @param count Number of rotations to perform.
+     */
+    void Compress(int count) {
+        AVLTreeNode<TKey, TValue> *scanner = nullptr;  // nullptr --> root_
+
+        for (int i = 0; i < count; i++) {
+            AVLTreeNode<TKey, TValue> *child =
+                (scanner == nullptr) ? root_ : scanner->GetRight();
+            AVLTreeNode<TKey, TValue> *grandchild = child->GetRight();
+
+            if (scanner == nullptr)
+                root_ = grandchild;
+            else
+                scanner->SetRight(grandchild);
+            child->SetRight(grandchild->GetLeft());
+            grandchild->SetLeft(child);
+            scanner = grandchild;
+        }
+    }
+
+    /**
+     * Recalculates the height of every node below node, bottom up.  Only
+     * called on a freshly compacted tree, so the recursion depth is
+     * log2(n).
+     *
+     * @param *node pointer to the subtree root to recalculate.
+     */
+    void RecalculateHeights(AVLTreeNode<TKey, TValue> *node) {
+        if (node == nullptr) return;
+        RecalculateHeights(node->GetLeft());
+        RecalculateHeights(node->GetRight());
+        node->CalculateHeight();
+    }
+
+ public:
 
     // ITERATOR
 
@@ -0,0 +1,519 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_AVLTREECHECKPOINT_H_
+#define SRC_AVLTREECHECKPOINT_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include "AVLTree.h"
+#include "AVLTreeCodec.h"
+#include "AVLTreeNode.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Append only file of incremental AVLTree checkpoints, written by
+ * Checkpoint(tree, file) and read by RestoreCheckpoint(file).  Nodes only
+ * record their offsets in the file when AVLTreeCheckpointPolicy enables it
+ * for TKey and TValue.
+ *
+ * The file is a sequence of blocks, one per checkpoint.  A block is an 8
+ * byte length, the records of every node that was dirty at the checkpoint,
+ * children before parents, and a trailer.  A node record is the key and
+ * value as encoded by their AVLTreeCodec and the file offsets of the left
+ * and right child records, kNone for no child; a clean child is referenced
+ * where an earlier block wrote it.  The trailer is a magic number, the
+ * offset of the root record, the entry count, and a 64 bit FNV-1a checksum
+ * of the block.  Integers are little endian.
+ *
+ * A checkpoint therefore costs O(d log n) for d changed entries, and the
+ * file grows by as much.  Records replaced by later blocks become garbage;
+ * CompactCheckpoint(tree, file) writes just the live records to a new file
+ * and renames it over the old one.
+ *
+ * A crash can leave a torn block at the end of the file.  Opening the file
+ * finds the last block whose checksum matches and truncates anything after
+ * it.
+ *
+ * Node offsets are stored in the nodes, so a tree must always be
+ * checkpointed to the same file, and its nodes must not be moved to
+ * another tree with Split or Join while both are checkpointed.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting.  Must have
+ *            an AVLTreeCodec.
+ * @param <TValue>
+ *            Generic type representing the data being stored.  Must have an
+ *            AVLTreeCodec.
+ */
+template <class TKey, class TValue>
+class AVLTreeCheckpoint {
+    static_assert(AVLTreeCheckpointPolicy<TKey, TValue>::kTrack,
+        "AVLTreeCheckpointPolicy must enable kTrack to checkpoint a tree");
+
+ private:
+    static constexpr std::uint64_t kNone = ~std::uint64_t{0};
+    static constexpr char kTrailerMagic[8] = {'1', '1', 'c', 'A', 'V', 'L',
+        'C', '\0'};
+    static constexpr std::uint64_t kTrailerSize = 32;
+    // Bytes buffered before they are written out mid checkpoint.
+    static constexpr std::size_t kWriteBuffer = 1 << 20;
+
+    std::string path_;
+    int fd_;
+    std::uint64_t end_;     // size of the committed part of the file
+    std::uint64_t root_;    // offset of the last committed root record
+    std::uint64_t count_;   // entry count of the last commit
+
+    // Checkpoint in progress.
+    std::string buffer_;        // bytes not yet written
+    std::uint64_t written_;     // offset buffer_ starts at
+    bool rewriting_;            // writing a compacted copy to path_.tmp
+    int rewrite_fd_;
+
+ public:
+    /**
+     * Opens or creates the checkpoint file at path, dropping any torn
+     * block at its end.
+     *
+     * @throws system_error if the file can not be opened or truncated
+     */
+    explicit AVLTreeCheckpoint(std::string path) : path_(std::move(path)),
+        end_(0), root_(kNone), count_(0), written_(0), rewriting_(false),
+        rewrite_fd_(-1) {
+        fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+        try {
+            FindLastBlock();
+            if (ftruncate(fd_, static_cast<off_t>(end_)) != 0)
+                throw std::system_error(errno, std::generic_category(), path_);
+        } catch (...) {
+            close(fd_);
+            throw;
+        }
+    }
+
+    AVLTreeCheckpoint(const AVLTreeCheckpoint&) = delete;
+    AVLTreeCheckpoint& operator=(const AVLTreeCheckpoint&) = delete;
+
+    ~AVLTreeCheckpoint() {
+        Abort();
+        close(fd_);
+    }
+
+    /**
+     * Appends the entries of tree changed since the last checkpoint to
+     * file, as one new block, and makes it durable.
+     *
+     * Every change marks the changed node and its ancestors dirty, and the
+     * checkpoint only descends into dirty nodes: a clean subtree is
+     * referenced where an earlier checkpoint wrote it.  The cost is
+     * O(d log n) for d changed entries, however large the tree.
+     *
+     * @param file Checkpoint file tree was restored from or has always
+     *          been checkpointed to.
+     *
+     * @throws system_error if the checkpoint can not be written
+     */
+    friend void Checkpoint(AVLTree<TKey, TValue> *tree,
+            AVLTreeCheckpoint *file) {
+        WriteTree(tree, file, false);
+    }
+
+    /**
+     * Writes every entry of tree to a fresh copy of file and renames it
+     * over the old one, dropping the records that later checkpoints
+     * replaced.  Costs as much as a full snapshot; run it when
+     * file->GetFileSize() has grown to a few times the size of the live
+     * tree.
+     *
+     * @throws system_error if the checkpoint can not be written
+     */
+    friend void CompactCheckpoint(AVLTree<TKey, TValue> *tree,
+            AVLTreeCheckpoint *file) {
+        WriteTree(tree, file, true);
+    }
+
+    /**
+     * Reads the last checkpoint in file into a new tree.  Its nodes start
+     * clean, so the next Checkpoint to file is incremental.
+     *
+     * @throws runtime_error if the checkpoint is corrupt or holds more than
+     *          INT_MAX entries
+     */
+    friend AVLTree<TKey, TValue> RestoreCheckpoint(
+            const AVLTreeCheckpoint &file) {
+        return ReadTree(file);
+    }
+
+    /**
+     * Returns the size of the file in bytes, live and garbage records
+     * together.
+     */
+    std::uint64_t GetFileSize() const { return end_; }
+
+    /**
+     * Returns the entry count of the last checkpoint.
+     */
+    std::uint64_t GetCount() const { return count_; }
+
+    /**
+     * Starts a checkpoint: a new block at the end of the file, or, if
+     * rewrite, the first block of a fresh file that replaces this one when
+     * the checkpoint commits.
+     */
+    void Begin(bool rewrite) {
+        Abort();
+        if (rewrite) {
+            std::string temp_path = path_ + ".tmp";
+            rewrite_fd_ = open(temp_path.c_str(),
+                O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (rewrite_fd_ < 0)
+                throw std::system_error(errno, std::generic_category(),
+                    temp_path);
+            rewriting_ = true;
+            written_ = 0;
+        } else {
+            written_ = end_;
+        }
+        buffer_.assign(8, '\0');  // block length, filled in by Commit
+    }
+
+    /**
+     * Appends the record of node, whose children must already be clean,
+     * and marks node clean.
+     */
+    void Append(AVLTreeNode<TKey, TValue> *node) {
+        std::uint64_t offset = written_ + buffer_.size();
+        std::ostringstream out;
+        SnapshotWriter writer(&out);
+        AVLTreeCodec<TKey>::Write(&writer, node->GetKey());
+        AVLTreeCodec<TValue>::Write(&writer, node->GetValue());
+        writer.WriteU64(Offset(node->GetLeft()));
+        writer.WriteU64(Offset(node->GetRight()));
+        buffer_ += out.str();
+        node->SetCheckpointOffset(offset);
+
+        if (buffer_.size() >= kWriteBuffer) Flush();
+    }
+
+    /**
+     * Ends the checkpoint with root as the root record and makes it
+     * durable.
+     *
+     * @throws system_error if the block can not be written or synced
+     */
+    void Commit(const AVLTreeNode<TKey, TValue> *root, std::uint64_t count) {
+        int fd = rewriting_ ? rewrite_fd_ : fd_;
+        std::uint64_t block_start = rewriting_ ? 0 : end_;
+        std::uint64_t root_offset = Offset(root);
+
+        std::ostringstream out;
+        SnapshotWriter writer(&out);
+        writer.Write(kTrailerMagic, sizeof(kTrailerMagic));
+        writer.WriteU64(root_offset);
+        writer.WriteU64(count);
+        buffer_ += out.str();
+        Flush();
+
+        // The block length and checksum cover everything written since
+        // Begin, so read the block back rather than keep it all in memory.
+        std::uint64_t length = written_ - block_start;
+        std::string length_bytes = EncodeU64(length - 8);
+        PWrite(fd, length_bytes, block_start);
+        std::uint64_t checksum = HashRange(fd, block_start, length);
+        PWrite(fd, EncodeU64(checksum), written_);
+        if (fdatasync(fd) != 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+
+        if (rewriting_) {
+            std::string temp_path = path_ + ".tmp";
+            if (std::rename(temp_path.c_str(), path_.c_str()) != 0)
+                throw std::system_error(errno, std::generic_category(),
+                    temp_path);
+            SyncDirectory();
+            close(fd_);
+            fd_ = rewrite_fd_;
+            rewrite_fd_ = -1;
+            rewriting_ = false;
+        }
+        end_ = written_ + 8;
+        root_ = root_offset;
+        count_ = count;
+        buffer_.clear();
+    }
+
+    /**
+     * Abandons a checkpoint in progress, leaving the file as of the last
+     * commit.
+     */
+    void Abort() {
+        buffer_.clear();
+        if (rewriting_) {
+            close(rewrite_fd_);
+            std::remove((path_ + ".tmp").c_str());
+            rewrite_fd_ = -1;
+            rewriting_ = false;
+        } else if (written_ > end_) {
+            if (ftruncate(fd_, static_cast<off_t>(end_)) != 0) {}
+        }
+        written_ = end_;
+    }
+
+    /**
+     * Reads the tree of the last checkpoint, with every node clean.
+     *
+     * @param *count receives the entry count.
+     *
+     * @return Root of the tree, nullptr if it is empty.
+     *
+     * @throws runtime_error if a record can not be read
+     */
+    AVLTreeNode<TKey, TValue>* Read(std::uint64_t *count) const {
+        *count = count_;
+        std::ifstream in(path_, std::ios::binary);
+        return ReadNodes(&in, root_);
+    }
+
+ private:
+    /**
+     * Writes the dirty nodes of tree to a new block of file, or, if
+     * rewrite, every node to a fresh file.  If anything fails, the nodes
+     * may hold offsets into the abandoned block, so every node is marked
+     * dirty again and the next checkpoint writes the whole tree.
+     */
+    static void WriteTree(AVLTree<TKey, TValue> *tree,
+            AVLTreeCheckpoint *file, bool rewrite) {
+        if (rewrite) MarkDirtyNodes(tree->root_);
+        file->Begin(rewrite);
+        try {
+            AppendNodes(tree->root_, file);
+            file->Commit(tree->root_,
+                static_cast<std::uint64_t>(tree->count_));
+        } catch (...) {
+            file->Abort();
+            MarkDirtyNodes(tree->root_);
+            throw;
+        }
+    }
+
+    static AVLTree<TKey, TValue> ReadTree(const AVLTreeCheckpoint &file) {
+        if (file.GetCount()
+                > static_cast<std::uint64_t>(std::numeric_limits<int>::max()))
+            throw std::runtime_error("! Checkpoint entry count is too large !");
+        std::uint64_t count;
+        AVLTree<TKey, TValue> tree;
+        tree.root_ = file.Read(&count);
+        tree.count_ = static_cast<int>(count);
+        return tree;
+    }
+
+    /**
+     * Appends the dirty nodes of the subtree rooted at node, children
+     * first.
+     */
+    static void AppendNodes(AVLTreeNode<TKey, TValue> *node,
+            AVLTreeCheckpoint *file) {
+        if (node == nullptr || !node->IsDirty()) return;
+        AppendNodes(node->GetLeft(), file);
+        AppendNodes(node->GetRight(), file);
+        file->Append(node);
+    }
+
+    static void MarkDirtyNodes(AVLTreeNode<TKey, TValue> *node) {
+        if (node == nullptr) return;
+        MarkDirtyNodes(node->GetLeft());
+        MarkDirtyNodes(node->GetRight());
+        node->MarkDirty();
+    }
+
+    static std::uint64_t Offset(const AVLTreeNode<TKey, TValue> *node) {
+        return node == nullptr ? kNone : node->GetCheckpointOffset();
+    }
+
+    static std::string EncodeU64(std::uint64_t value) {
+        std::ostringstream out;
+        SnapshotWriter writer(&out);
+        writer.WriteU64(value);
+        return out.str();
+    }
+
+    static std::uint64_t DecodeU64(const unsigned char *bytes) {
+        std::uint64_t value = 0;
+        for (int i = 0; i < 8; i++)
+            value |= static_cast<std::uint64_t>(bytes[i]) << (8 * i);
+        return value;
+    }
+
+    void PWrite(int fd, const std::string &bytes, std::uint64_t offset) {
+        std::size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t result = pwrite(fd, bytes.data() + done,
+                bytes.size() - done, static_cast<off_t>(offset + done));
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                throw std::system_error(errno, std::generic_category(), path_);
+            }
+            done += static_cast<std::size_t>(result);
+        }
+    }
+
+    /**
+     * Writes the buffered bytes of the checkpoint in progress.
+     */
+    void Flush() {
+        PWrite(rewriting_ ? rewrite_fd_ : fd_, buffer_, written_);
+        written_ += buffer_.size();
+        buffer_.clear();
+    }
+
+    /**
+     * FNV-1a hash of length bytes of fd starting at offset, computed by
+     * feeding them through a SnapshotWriter.
+     *
+     * @throws system_error if the file is shorter
+     */
+    std::uint64_t HashRange(int fd, std::uint64_t offset,
+            std::uint64_t length) const {
+        std::ostringstream sink;
+        SnapshotWriter hasher(&sink);
+        std::string chunk(kWriteBuffer, '\0');
+        while (length > 0) {
+            std::size_t size = static_cast<std::size_t>(
+                std::min<std::uint64_t>(length, chunk.size()));
+            ssize_t result = pread(fd, chunk.data(), size,
+                static_cast<off_t>(offset));
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0)
+                throw std::system_error(result < 0 ? errno : EIO,
+                    std::generic_category(), path_);
+            sink.seekp(0);
+            hasher.Write(chunk.data(), static_cast<std::size_t>(result));
+            offset += static_cast<std::uint64_t>(result);
+            length -= static_cast<std::uint64_t>(result);
+        }
+        return hasher.GetChecksum();
+    }
+
+    /**
+     * Walks the block lengths from the start of the file and commits to
+     * the last block that is complete and whose checksum matches.
+     */
+    void FindLastBlock() {
+        struct stat st;
+        if (fstat(fd_, &st) != 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+        std::uint64_t size = static_cast<std::uint64_t>(st.st_size);
+
+        std::uint64_t start = 0;
+        while (start + 8 + kTrailerSize <= size) {
+            unsigned char length_bytes[8];
+            if (pread(fd_, length_bytes, 8, static_cast<off_t>(start)) != 8)
+                break;
+            std::uint64_t length = DecodeU64(length_bytes);
+            if (length < kTrailerSize - 8
+                    || length > size - start - 8 - 8) break;
+
+            unsigned char trailer[kTrailerSize];
+            std::uint64_t trailer_start = start + 8 + length - 24;
+            if (pread(fd_, trailer, kTrailerSize,
+                    static_cast<off_t>(trailer_start)) != kTrailerSize)
+                break;
+            if (!std::equal(trailer, trailer + 8,
+                    reinterpret_cast<const unsigned char*>(kTrailerMagic))
+                    || HashRange(fd_, start, 8 + length)
+                        != DecodeU64(trailer + 24)) {
+                break;
+            }
+
+            root_ = DecodeU64(trailer + 8);
+            count_ = DecodeU64(trailer + 16);
+            start += 8 + length + 8;
+            end_ = start;
+        }
+        written_ = end_;
+    }
+
+    /**
+     * Reads the subtree whose root record is at offset.
+     */
+    AVLTreeNode<TKey, TValue>* ReadNodes(std::ifstream *in,
+            std::uint64_t offset) const {
+        if (offset == kNone) return nullptr;
+        in->seekg(static_cast<std::streamoff>(offset));
+        SnapshotReader reader(in);
+        TKey key;
+        TValue value;
+        std::uint64_t left, right;
+        if (!AVLTreeCodec<TKey>::Read(&reader, &key)
+                || !AVLTreeCodec<TValue>::Read(&reader, &value)
+                || !reader.ReadU64(&left) || !reader.ReadU64(&right)
+                || (left != kNone && left >= offset)
+                || (right != kNone && right >= offset)) {
+            throw std::runtime_error("! Corrupt checkpoint record !");
+        }
+
+        AVLTreeNode<TKey, TValue> *node =
+            new AVLTreeNode<TKey, TValue>(key, value);
+        try {
+            node->SetLeft(ReadNodes(in, left));
+            node->SetRight(ReadNodes(in, right));
+        } catch (...) {
+            DeleteNodes(node);
+            throw;
+        }
+        node->CalculateHeight();
+        node->SetCheckpointOffset(offset);
+        return node;
+    }
+
+    static void DeleteNodes(AVLTreeNode<TKey, TValue> *node) {
+        if (node == nullptr) return;
+        DeleteNodes(node->GetLeft());
+        DeleteNodes(node->GetRight());
+        delete node;
+    }
+
+    void SyncDirectory() {
+        std::string::size_type slash = path_.rfind('/');
+        std::string directory = slash == std::string::npos ? std::string(".")
+            : path_.substr(0, slash + 1);
+        int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        if (fsync(fd) != 0) {}
+        close(fd);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_AVLTREECHECKPOINT_H_
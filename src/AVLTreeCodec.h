@@ -0,0 +1,331 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_AVLTREECODEC_H_
+#define SRC_AVLTREECODEC_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <type_traits>
+
+namespace _11c_dev_collections {
+
+/**
+ * Byte sink used by AVLTree::Save.  Keeps a running FNV-1a hash of every
+ * byte written, for the snapshot's checksum.
+ */
+class SnapshotWriter {
+ public:
+    explicit SnapshotWriter(std::ostream *out) : out_(out),
+        checksum_(kFnvOffset) {}
+
+    void Write(const void *data, std::size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char*>(data);
+        for (std::size_t i = 0; i < size; i++)
+            checksum_ = (checksum_ ^ bytes[i]) * kFnvPrime;
+        out_->write(static_cast<const char*>(data),
+            static_cast<std::streamsize>(size));
+    }
+
+    /**
+     * Writes value as 8 little endian bytes.
+     */
+    void WriteU64(std::uint64_t value) {
+        unsigned char bytes[8];
+        for (int i = 0; i < 8; i++) bytes[i] = (value >> (8 * i)) & 0xff;
+        Write(bytes, sizeof(bytes));
+    }
+
+    /**
+     * Writes value as 4 little endian bytes.
+     */
+    void WriteU32(std::uint32_t value) {
+        unsigned char bytes[4];
+        for (int i = 0; i < 4; i++) bytes[i] = (value >> (8 * i)) & 0xff;
+        Write(bytes, sizeof(bytes));
+    }
+
+    /**
+     * Writes value as an LEB128 varint: 7 bits per byte, low bits first,
+     * high bit set on every byte but the last.  1 to 10 bytes.
+     */
+    void WriteVarint(std::uint64_t value) {
+        unsigned char bytes[10];
+        std::size_t size = 0;
+        while (value >= 0x80) {
+            bytes[size++] = static_cast<unsigned char>(value | 0x80);
+            value >>= 7;
+        }
+        bytes[size++] = static_cast<unsigned char>(value);
+        Write(bytes, size);
+    }
+
+    std::uint64_t GetChecksum() const { return checksum_; }
+
+    bool Good() const { return out_->good(); }
+
+ private:
+    static constexpr std::uint64_t kFnvOffset = 14695981039346656037ULL;
+    static constexpr std::uint64_t kFnvPrime = 1099511628211ULL;
+
+    std::ostream *out_;
+    std::uint64_t checksum_;
+};
+
+/**
+ * Byte source used by AVLTree::Load.  Hashes every byte read the same way
+ * SnapshotWriter does.
+ */
+class SnapshotReader {
+ public:
+    explicit SnapshotReader(std::istream *in) : in_(in),
+        checksum_(kFnvOffset) {}
+
+    /**
+     * Reads exactly size bytes.
+     *
+     * @return false if the stream ended first.
+     */
+    bool Read(void *data, std::size_t size) {
+        in_->read(static_cast<char*>(data), static_cast<std::streamsize>(size));
+        if (static_cast<std::size_t>(in_->gcount()) != size) return false;
+        const unsigned char *bytes = static_cast<const unsigned char*>(data);
+        for (std::size_t i = 0; i < size; i++)
+            checksum_ = (checksum_ ^ bytes[i]) * kFnvPrime;
+        return true;
+    }
+
+    bool ReadU64(std::uint64_t *value) {
+        unsigned char bytes[8];
+        if (!Read(bytes, sizeof(bytes))) return false;
+        *value = 0;
+        for (int i = 0; i < 8; i++)
+            *value |= static_cast<std::uint64_t>(bytes[i]) << (8 * i);
+        return true;
+    }
+
+    bool ReadU32(std::uint32_t *value) {
+        unsigned char bytes[4];
+        if (!Read(bytes, sizeof(bytes))) return false;
+        *value = 0;
+        for (int i = 0; i < 4; i++)
+            *value |= static_cast<std::uint32_t>(bytes[i]) << (8 * i);
+        return true;
+    }
+
+    /**
+     * Reads a varint written by SnapshotWriter::WriteVarint.
+     *
+     * @return false if the stream ended first, or the varint does not fit
+     *          in 64 bits.
+     */
+    bool ReadVarint(std::uint64_t *value) {
+        *value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char byte;
+            if (!Read(&byte, 1)) return false;
+            if (shift == 63 && byte > 1) return false;
+            *value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) return true;
+        }
+        return false;
+    }
+
+    std::uint64_t GetChecksum() const { return checksum_; }
+
+ private:
+    static constexpr std::uint64_t kFnvOffset = 14695981039346656037ULL;
+    static constexpr std::uint64_t kFnvPrime = 1099511628211ULL;
+
+    std::istream *in_;
+    std::uint64_t checksum_;
+};
+
+/**
+ * Encodes values, and by default keys (see AVLTreeKeyCodec), for
+ * AVLTree::Save and decodes them for AVLTree::Load.  Specialize it to
+ * store other types.  A codec has:
+ *
+ *   static constexpr std::uint32_t kId;    // recorded in the header
+ *   static constexpr std::uint32_t kSize;  // bytes per item, 0 if variable
+ *   static void Write(SnapshotWriter *writer, const T &item);
+ *   static bool Read(SnapshotReader *reader, T *item);  // false on EOF
+ *
+ * Load refuses a snapshot whose codec ids or sizes differ from its own.
+ */
+template <typename T, typename Enable = void>
+struct AVLTreeCodec;
+
+/**
+ * Returns the id that a codec whose id is now id was recorded under in a
+ * snapshot of format version.  Raw byte codecs, whose ids have a nonzero
+ * top byte, all shared id 1 before version 3.
+ */
+constexpr std::uint32_t SnapshotCodecId(std::uint32_t id,
+        std::uint32_t version) {
+    return version < 3 && id >> 24 != 0 ? 1 : id;
+}
+
+/**
+ * Trivially copyable types are stored as their raw bytes, in host byte
+ * order.  The snapshot header records the byte order.
+ */
+template <typename T>
+struct AVLTreeCodec<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> {
+    // Top byte 1 for signed and 2 for unsigned integers, 3 for floating
+    // point and 4 for anything else, low bytes the size, so a snapshot of
+    // int64_t values is not loaded as double values.
+    static constexpr std::uint32_t kId = (std::is_integral_v<T>
+            ? (std::is_signed_v<T> ? 1u : 2u)
+            : std::is_floating_point_v<T> ? 3u : 4u) << 24
+        | (sizeof(T) & 0xffffff);
+    static constexpr std::uint32_t kSize = sizeof(T);
+
+    static void Write(SnapshotWriter *writer, const T &item) {
+        writer->Write(&item, sizeof(T));
+    }
+
+    static bool Read(SnapshotReader *reader, T *item) {
+        return reader->Read(item, sizeof(T));
+    }
+};
+
+/**
+ * Strings are stored as a 4 byte little endian length and their bytes.
+ * The length is not trusted: bytes are read in chunks of at most kChunk,
+ * so a corrupt length fails at the end of the stream instead of first
+ * allocating up to 4 GiB.
+ */
+template <>
+struct AVLTreeCodec<std::string> {
+    static constexpr std::uint32_t kId = 2;
+    static constexpr std::uint32_t kSize = 0;
+    static constexpr std::uint32_t kChunk = 64 * 1024;
+
+    static void Write(SnapshotWriter *writer, const std::string &item) {
+        writer->WriteU32(static_cast<std::uint32_t>(item.size()));
+        writer->Write(item.data(), item.size());
+    }
+
+    static bool Read(SnapshotReader *reader, std::string *item) {
+        std::uint32_t size;
+        if (!reader->ReadU32(&size)) return false;
+        item->clear();
+        while (item->size() < size) {
+            std::size_t done = item->size();
+            std::size_t chunk = std::min<std::size_t>(size - done, kChunk);
+            item->resize(done + chunk);
+            if (!reader->Read(item->data() + done, chunk)) return false;
+        }
+        return true;
+    }
+};
+
+/**
+ * Encodes the keys of a snapshot.  AVLTree::Save writes keys in strictly
+ * increasing order, so a key codec may store each key relative to the one
+ * before it.  Specialize it to compress other key types.  A key codec has:
+ *
+ *   static constexpr std::uint32_t kId;    // recorded in the header
+ *   static constexpr std::uint32_t kSize;  // bytes per key, 0 if variable
+ *   // previous is nullptr for the first key.
+ *   static void Write(SnapshotWriter *writer, const T *previous,
+ *       const T &key);
+ *   static bool Read(SnapshotReader *reader, const T *previous, T *key);
+ *
+ * By default every key is stored whole by its AVLTreeCodec.
+ */
+template <typename T, typename Enable = void>
+struct AVLTreeKeyCodec {
+    static constexpr std::uint32_t kId = AVLTreeCodec<T>::kId;
+    static constexpr std::uint32_t kSize = AVLTreeCodec<T>::kSize;
+
+    static void Write(SnapshotWriter *writer, const T*, const T &key) {
+        AVLTreeCodec<T>::Write(writer, key);
+    }
+
+    static bool Read(SnapshotReader *reader, const T*, T *key) {
+        return AVLTreeCodec<T>::Read(reader, key);
+    }
+};
+
+/**
+ * Integral keys are stored as varints: the first key zigzag encoded, so
+ * small negative keys stay short, and every later key as its difference
+ * from the one before.  Dense keys take one byte each instead of
+ * sizeof(T).
+ */
+template <typename T>
+struct AVLTreeKeyCodec<T, std::enable_if_t<std::is_integral_v<T>
+        && !std::is_same_v<T, bool>>> {
+    // 0x3nn for signed and 0x4nn for unsigned keys nn bytes wide, so a
+    // snapshot of int keys is not loaded as long keys.
+    static constexpr std::uint32_t kId = (std::is_signed_v<T> ? 0x300 : 0x400)
+        | sizeof(T);
+    static constexpr std::uint32_t kSize = 0;
+
+    static void Write(SnapshotWriter *writer, const T *previous,
+            const T &key) {
+        if (previous != nullptr) {
+            writer->WriteVarint(static_cast<std::uint64_t>(
+                static_cast<Unsigned>(static_cast<Unsigned>(key)
+                    - static_cast<Unsigned>(*previous))));
+        } else if constexpr (std::is_signed_v<T>) {
+            std::int64_t value = key;
+            writer->WriteVarint((static_cast<std::uint64_t>(value) << 1)
+                ^ static_cast<std::uint64_t>(value >> 63));
+        } else {
+            writer->WriteVarint(key);
+        }
+    }
+
+    static bool Read(SnapshotReader *reader, const T *previous, T *key) {
+        std::uint64_t encoded;
+        if (!reader->ReadVarint(&encoded)) return false;
+        if (previous != nullptr) {
+            if (encoded > std::numeric_limits<Unsigned>::max()) return false;
+            *key = static_cast<T>(static_cast<Unsigned>(
+                static_cast<Unsigned>(*previous)
+                    + static_cast<Unsigned>(encoded)));
+            return true;
+        }
+        if constexpr (std::is_signed_v<T>) {
+            std::int64_t value = static_cast<std::int64_t>(encoded >> 1)
+                ^ -static_cast<std::int64_t>(encoded & 1);
+            if (value < std::numeric_limits<T>::min()
+                    || value > std::numeric_limits<T>::max())
+                return false;
+            *key = static_cast<T>(value);
+        } else {
+            if (encoded > std::numeric_limits<T>::max()) return false;
+            *key = static_cast<T>(encoded);
+        }
+        return true;
+    }
+
+ private:
+    using Unsigned = std::make_unsigned_t<T>;
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_AVLTREECODEC_H_
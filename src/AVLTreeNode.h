@@ -18,11 +18,90 @@
 #ifndef SRC_AVLTREENODE_H_
 #define SRC_AVLTREENODE_H_
 
+#include <cstdint>
 #include "MapEntry.h"
 
 
 namespace _11c_dev_collections {
 
+/**
+ * Chooses whether AVLTreeNode<TKey, TValue> caches the hash of its subtree
+ * for AVLTree::GetHash, Equals and Diff.  Off by default, so nodes carry no
+ * hash and every GetHash costs O(n).  Specialize it for trees that are
+ * hashed or compared over and over:
+ *
+ *   template <>
+ *   struct AVLTreeHashPolicy<int, std::string> {
+ *       static constexpr bool kCache = true;
+ *   };
+ */
+template <typename TKey, typename TValue>
+struct AVLTreeHashPolicy {
+    static constexpr bool kCache = false;
+};
+
+/**
+ * Storage for a node's cached subtree hash, 0 if none, and the power of
+ * the hash base it was computed with.  Empty when the policy does not
+ * cache.
+ */
+template <bool kCache>
+struct AVLTreeNodeHash {
+    std::uint64_t hash = 0;
+    std::uint64_t power = 0;
+
+    std::uint64_t Get() const { return hash; }
+    std::uint64_t GetPower() const { return power; }
+    void Set(std::uint64_t value, std::uint64_t value_power) {
+        hash = value;
+        power = value_power;
+    }
+    void Clear() { hash = 0; }
+};
+
+template <>
+struct AVLTreeNodeHash<false> {
+    std::uint64_t Get() const { return 0; }
+    std::uint64_t GetPower() const { return 0; }
+    void Set(std::uint64_t, std::uint64_t) {}
+    void Clear() {}
+};
+
+/**
+ * Chooses whether AVLTreeNode<TKey, TValue> records where it was last
+ * written to an AVLTreeCheckpoint file.  Off by default, so nodes carry no
+ * offset; AVLTreeCheckpoint only accepts trees whose policy enables it:
+ *
+ *   template <>
+ *   struct AVLTreeCheckpointPolicy<int, std::string> {
+ *       static constexpr bool kTrack = true;
+ *   };
+ */
+template <typename TKey, typename TValue>
+struct AVLTreeCheckpointPolicy {
+    static constexpr bool kTrack = false;
+};
+
+/**
+ * Storage for a node's checkpoint offset, ~0 if dirty.  Empty, and always
+ * dirty, when the policy does not track checkpoints.
+ */
+template <bool kTrack>
+struct AVLTreeNodeCheckpoint {
+    std::uint64_t offset = ~std::uint64_t{0};
+
+    std::uint64_t Get() const { return offset; }
+    void Set(std::uint64_t value) { offset = value; }
+    void Clear() { offset = ~std::uint64_t{0}; }
+};
+
+template <>
+struct AVLTreeNodeCheckpoint<false> {
+    std::uint64_t Get() const { return ~std::uint64_t{0}; }
+    void Set(std::uint64_t) {}
+    void Clear() {}
+};
+
 /**
  * Node used in an AVLTree.
  *
@@ -37,8 +116,22 @@ class AVLTreeNode{
     AVLTreeNode<TKey, TValue> *left_;
     AVLTreeNode<TKey, TValue> *right_;
     int height_;
+    int size_;
+    // Offset of the node's record in an AVLTreeCheckpoint file, or kDirty
+    // if the node has changed since it was last written.  Takes no space
+    // unless AVLTreeCheckpointPolicy enables it.
+    [[no_unique_address]] AVLTreeNodeCheckpoint<AVLTreeCheckpointPolicy<
+        TKey, TValue>::kTrack> checkpoint_;
+    // Cached AVLTree::GetHash of the subtree rooted at the node, or kNoHash
+    // if the subtree has changed since it was last hashed.  Takes no space
+    // unless AVLTreeHashPolicy enables it.
+    [[no_unique_address]] AVLTreeNodeHash<AVLTreeHashPolicy<TKey,
+        TValue>::kCache> hash_;
 
  public:
+    static constexpr std::uint64_t kDirty = ~std::uint64_t{0};
+    static constexpr std::uint64_t kNoHash = 0;
+
 	/**
 	 * Creates a leaf node with no left or right children.
 	 * 
@@ -50,6 +143,8 @@ class AVLTreeNode{
         value_ = value;
         left_ = nullptr;
         right_ = nullptr;
+        checkpoint_.Clear();
+        hash_.Clear();
         CalculateHeight();
     }
 
@@ -58,61 +153,128 @@ class AVLTreeNode{
 	 * 
 	 * @return Value (TValue).
 	 */
-    TValue GetValue() { return value_; }
+    TValue GetValue() const { return value_; }
 
     /**
 	 * Set the value of the TreeNode.
 	 * 
 	 * @param value Set the nodes value.
 	 */
-    void SetValue(TValue value) { value_ = value; }
+    void SetValue(TValue value) {
+        value_ = value;
+        checkpoint_.Clear();
+        hash_.Clear();
+    }
 
 	/**
 	 * Get the key of the TreeNode.
 	 * 
 	 * @return Key.
 	 */    
-    TKey GetKey() { return key_; }
+    TKey GetKey() const { return key_; }
 
     /**
 	 * Get the Left child TreeNode.  The Left child is the "smaller" key.
 	 * 
 	 * @return Left child node.
 	 */
-    AVLTreeNode<TKey, TValue>* GetLeft() { return left_; }
+    AVLTreeNode<TKey, TValue>* GetLeft() const { return left_; }
 
 	/**
 	 * Get the Right child TreeNode.  The Right child is the "larger" key.
 	 * 
 	 * @return Right child node.
 	 */      
-    AVLTreeNode<TKey, TValue>* GetRight() { return right_; }
+    AVLTreeNode<TKey, TValue>* GetRight() const { return right_; }
 
 	/**
 	 * Set the Left child TreeNode.  The Left child is the "smaller" key.
 	 * 
 	 * @param node	Set the left child node.
 	 */    
-    void SetLeft(AVLTreeNode<TKey, TValue> *node) { left_ = node; }
+    void SetLeft(AVLTreeNode<TKey, TValue> *node) {
+        left_ = node;
+        checkpoint_.Clear();
+        hash_.Clear();
+    }
 
   	/**
 	 * Set the Right child TreeNode.  The Right child is the "larger" key.
 
 	 * @param node	Set the right child node.
 	 */
-    void SetRight(AVLTreeNode<TKey, TValue> *node) { right_ = node; }
+    void SetRight(AVLTreeNode<TKey, TValue> *node) {
+        right_ = node;
+        checkpoint_.Clear();
+        hash_.Clear();
+    }
 
 	/**
 	 * @return Height of the node.
 	 */
-    int GetHeight() { return height_; }
+    int GetHeight() const { return height_; }
+
+	/**
+	 * @return Number of nodes in the subtree rooted at this node.
+	 */
+    int GetSize() const { return size_; }
+
+	/**
+	 * @return True if the node has changed since it was last written to a
+	 *         checkpoint.  Every change to a node marks it dirty, and the
+	 *         tree recalculates, and so marks, every ancestor of a change.
+	 */
+    bool IsDirty() const { return checkpoint_.Get() == kDirty; }
+
+	/**
+	 * Marks the node as changed since its last checkpoint.
+	 */
+    void MarkDirty() {
+        checkpoint_.Clear();
+        hash_.Clear();
+    }
+
+	/**
+	 * @return Offset of the node's record in its checkpoint file.  Only
+	 *         meaningful if the node is not dirty.
+	 */
+    std::uint64_t GetCheckpointOffset() const { return checkpoint_.Get(); }
+
+	/**
+	 * Records that the node was written to its checkpoint file at offset,
+	 * clearing its dirty mark.
+	 */
+    void SetCheckpointOffset(std::uint64_t offset) { checkpoint_.Set(offset); }
+
+	/**
+	 * @return Cached hash of the subtree rooted at this node, or kNoHash if
+	 *         it has not been hashed since it last changed, or the policy
+	 *         does not cache.  Cleared along with the dirty mark, so every
+	 *         ancestor of a change loses it.
+	 */
+    std::uint64_t GetHash() const { return hash_.Get(); }
+
+	/**
+	 * @return Power of the hash base cached along with GetHash, one factor
+	 *         per entry of the subtree.  Only meaningful if GetHash is not
+	 *         kNoHash.
+	 */
+    std::uint64_t GetHashPower() const { return hash_.GetPower(); }
+
+	/**
+	 * Caches the hash of the subtree rooted at this node, and the power of
+	 * the hash base for its size, if the policy caches.
+	 */
+    void SetHash(std::uint64_t hash, std::uint64_t power) {
+        hash_.Set(hash, power);
+    }
 
 	/**
 	 * Get the balance factor of the current node.  Compares height if right and left child nodes.  Used to determine how balanced this node is.
 	 * 
 	 * @return	Balance factor of the node.  
 	 */    
-    int GetBalanceFactor() {
+    int GetBalanceFactor() const {
         int r, l;
         r = (right_ == nullptr) ? -1 : right_->GetHeight();
         l = (left_ == nullptr) ? -1 : left_->GetHeight();
@@ -124,18 +286,24 @@ class AVLTreeNode{
 	 * 
 	 * @return	MapEntry representing the Key and Value of the node.
 	 */
-    MapEntry<TKey, TValue> GetMapEntry() {
+    MapEntry<TKey, TValue> GetMapEntry() const {
         return MapEntry<TKey, TValue>(key_, value_);
     }
 
 	/**
-	 * Recalcualtes the height of the node.
+	 * Recalcualtes the height of the node, and the size of its subtree,
+	 * and marks it dirty, clearing its hash.  Must be called whenever a
+	 * child changes.
 	 */
     void CalculateHeight() {
         int r, l;
         r = (right_ == nullptr) ? -1 : right_->GetHeight();
         l = (left_ == nullptr) ? -1 : left_->GetHeight();
         height_ = (r > l) ? r + 1 : l + 1;
+        checkpoint_.Clear();
+        hash_.Clear();
+        size_ = 1 + ((right_ == nullptr) ? 0 : right_->GetSize())
+            + ((left_ == nullptr) ? 0 : left_->GetSize());
     }
 };
 }  // namespace _11c_dev_collections
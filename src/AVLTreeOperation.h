@@ -0,0 +1,65 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_AVLTREEOPERATION_H_
+#define SRC_AVLTREEOPERATION_H_
+
+namespace _11c_dev_collections {
+
+/**
+ * Kind of change an AVLTreeOperation makes.  Each matches the AVLTree
+ * method of the same name.
+ */
+enum class AVLTreeOperationType {
+    Add,
+    InsertOrAssign,
+    Remove
+};
+
+/**
+ * A single change to an AVLTree, used to hand batches of changes to
+ * AVLTree::ApplyBatch and the trees built on it.
+ */
+template <typename TKey, typename TValue>
+struct AVLTreeOperation {
+    AVLTreeOperationType type;
+    TKey key;
+    /**
+     * Value to store.  For a Remove that was applied, receives the value
+     * that was removed.
+     */
+    TValue value;
+    /**
+     * Set when the batch is applied.  False for an Add of a key that was
+     * already present, or a Remove of a key that was not.
+     */
+    bool applied;
+
+    AVLTreeOperation() : type(AVLTreeOperationType::Add), key(), value(),
+        applied(false) {}
+
+    AVLTreeOperation(AVLTreeOperationType t, TKey k, TValue v = TValue()) {
+        type = t;
+        key = k;
+        value = v;
+        applied = false;
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_AVLTREEOPERATION_H_
@@ -0,0 +1,488 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_BUFFERPOOL_H_
+#define SRC_BUFFERPOOL_H_
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "IoUring.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Counters kept by a BufferPool.  hits / (hits + misses) is the hit rate;
+ * writes counts dirty pages written back, on eviction or by Flush.
+ */
+struct BufferPoolStats {
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t evictions;
+    std::uint64_t writes;
+};
+
+/**
+ * Fixed number of page sized frames caching the pages of one file.
+ *
+ * A page must be pinned while it is in use and is never evicted while
+ * pinned.  When a page is needed and not resident, a CLOCK sweep picks the
+ * frame to reuse: the hand passes over pinned frames, clears the reference
+ * bit of frames used since it last came by, and stops at the first
+ * unpinned frame whose bit is already clear.  A dirty victim is written
+ * back before it is reused.  Pages past the end of the file read as zeros.
+ *
+ * After EnableAsyncReads, PinAsync starts a miss with io_uring instead of
+ * blocking on it and Reap reports the frames whose reads have finished.
+ * A frame being read stays pinned by every caller waiting on it; a plain
+ * Pin of such a page waits for its read.
+ *
+ * Not thread safe.
+ */
+class BufferPool {
+ private:
+    static constexpr std::uint64_t kNoPage = ~std::uint64_t{0};
+
+    struct Frame {
+        std::uint64_t page = kNoPage;
+        int pins = 0;
+        bool referenced = false;
+        bool dirty = false;
+        bool loading = false;  // async read in flight
+    };
+
+    int fd_;
+    std::size_t page_size_;
+    std::vector<Frame> frames_;
+    unsigned char *memory_;
+    std::unordered_map<std::uint64_t, std::size_t> page_table_;
+    std::size_t hand_;
+    std::size_t unpinned_;  // frames with no pins
+    BufferPoolStats stats_;
+
+    std::unique_ptr<IoUring> ring_;
+    // Async reads reaped while a plain Pin waited, not yet reported.
+    std::vector<std::pair<std::size_t, int>> finished_;
+
+ public:
+    /**
+     * Creates a pool of frame_count frames over fd, which the caller keeps
+     * open for the life of the pool.  Frames are aligned to page_size.
+     *
+     * @throws invalid_argument if frame_count is 0 or page_size is not a
+     *          power of two
+     */
+    BufferPool(int fd, std::size_t page_size, std::size_t frame_count)
+        : fd_(fd), page_size_(page_size), frames_(frame_count), hand_(0),
+          unpinned_(frame_count), stats_{} {
+        if (frame_count == 0 || page_size == 0
+                || (page_size & (page_size - 1)) != 0)
+            throw std::invalid_argument("! Invalid buffer pool geometry !");
+        memory_ = static_cast<unsigned char*>(::operator new(
+            page_size * frame_count, std::align_val_t(page_size)));
+        page_table_.reserve(frame_count);
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /**
+     * Waits for reads in flight and frees the frames without writing
+     * anything back; call Flush first.
+     */
+    ~BufferPool() {
+        while (ring_ != nullptr && ring_->GetInFlight() > 0) {
+            std::uint64_t frame;
+            int result;
+            if (!ring_->Reap(&frame, &result) && ring_->Submit(true) != 0)
+                break;
+        }
+        ::operator delete(memory_, std::align_val_t(page_size_));
+    }
+
+    /**
+     * Sets up an io_uring with room for depth reads for PinAsync.
+     *
+     * @return false if io_uring is unavailable, in which case PinAsync
+     *          reads synchronously.
+     */
+    bool EnableAsyncReads(unsigned int depth) {
+        ring_ = std::make_unique<IoUring>(depth);
+        if (!ring_->IsAvailable()) ring_.reset();
+        return ring_ != nullptr;
+    }
+
+    std::size_t GetPageSize() const { return page_size_; }
+
+    std::size_t GetFrameCount() const { return frames_.size(); }
+
+    /**
+     * Makes page resident and pins it.
+     *
+     * @return Frame holding the page, for GetData, MarkDirty and Unpin.
+     *
+     * @throws runtime_error if every frame is pinned
+     * @throws system_error if a page can not be read or written back
+     */
+    std::size_t Pin(std::uint64_t page) {
+        auto found = page_table_.find(page);
+        if (found != page_table_.end()) {
+            stats_.hits++;
+            AddPin(found->second);
+            if (frames_[found->second].loading) WaitFor(found->second);
+            return found->second;
+        }
+
+        stats_.misses++;
+        std::size_t index = Claim(page);
+        int error = ReadPage(index);
+        if (error != 0) {
+            Release(index);
+            throw std::system_error(error, std::generic_category(),
+                "! Failed to read page !");
+        }
+        return index;
+    }
+
+    /**
+     * Pins page, starting an async read if it is not resident.
+     *
+     * @param *ready set if the page can be used now.  Otherwise the frame
+     *          is reported by Reap once its read finishes, and stays pinned
+     *          for the caller meanwhile.
+     *
+     * @throws runtime_error if every frame is pinned
+     * @throws system_error if the page can not be read synchronously, or a
+     *          victim can not be written back
+     */
+    std::size_t PinAsync(std::uint64_t page, bool *ready) {
+        auto found = page_table_.find(page);
+        if (found != page_table_.end()) {
+            stats_.hits++;
+            AddPin(found->second);
+            *ready = !frames_[found->second].loading;
+            return found->second;
+        }
+        if (ring_ == nullptr) {
+            *ready = true;
+            return Pin(page);
+        }
+
+        stats_.misses++;
+        std::size_t index = Claim(page);
+        if (!ring_->QueueRead(fd_, GetData(index),
+                static_cast<unsigned int>(page_size_), page * page_size_,
+                index)) {
+            // Ring full: read it the slow way.
+            int error = ReadPage(index);
+            if (error != 0) {
+                Release(index);
+                throw std::system_error(error, std::generic_category(),
+                    "! Failed to read page !");
+            }
+            *ready = true;
+            return index;
+        }
+        frames_[index].loading = true;
+        *ready = false;
+        return index;
+    }
+
+    /**
+     * Returns true if pinning page would not run out of frames: the page
+     * is resident or some frame is unpinned.
+     */
+    bool CanPin(std::uint64_t page) const {
+        return unpinned_ > 0 || page_table_.count(page) != 0;
+    }
+
+    /**
+     * Submits queued async reads and collects the ones that have finished.
+     *
+     * @param *frames receives (frame, error) for each finished read: error
+     *          0 if the page is now resident, else the errno of the failed
+     *          read, after which the frame no longer holds the page.
+     * @param wait block until at least one read finishes, if any are in
+     *          flight.
+     *
+     * @throws system_error if the reads can not be submitted
+     */
+    void Reap(std::vector<std::pair<std::size_t, int>> *frames, bool wait) {
+        frames->insert(frames->end(), finished_.begin(), finished_.end());
+        finished_.clear();
+        if (ring_ == nullptr) return;
+        int error = ring_->Submit(wait && frames->empty()
+            && ring_->GetInFlight() > 0);
+        if (error != 0)
+            throw std::system_error(error, std::generic_category(),
+                "! Failed to submit page reads !");
+        std::uint64_t index;
+        int result;
+        while (ring_->Reap(&index, &result))
+            frames->emplace_back(index, Complete(index, result));
+    }
+
+    /**
+     * Returns true if async reads have been started and not yet reported
+     * by Reap.
+     */
+    bool HasPendingReads() const {
+        return !finished_.empty()
+            || (ring_ != nullptr && ring_->GetInFlight() > 0);
+    }
+
+    /**
+     * Pins page without reading it, zero filled, for a page being created.
+     */
+    std::size_t PinNew(std::uint64_t page) {
+        auto found = page_table_.find(page);
+        std::size_t index;
+        if (found != page_table_.end()) {
+            index = found->second;
+            AddPin(index);
+        } else {
+            index = Claim(page);
+        }
+        std::memset(GetData(index), 0, page_size_);
+        frames_[index].dirty = true;
+        return index;
+    }
+
+    /**
+     * Releases one pin on frame.
+     */
+    void Unpin(std::size_t frame) {
+        if (--frames_[frame].pins == 0) unpinned_++;
+    }
+
+    /**
+     * Marks the page in frame as changed, to be written back before it is
+     * evicted.
+     */
+    void MarkDirty(std::size_t frame) { frames_[frame].dirty = true; }
+
+    unsigned char* GetData(std::size_t frame) const {
+        return memory_ + frame * page_size_;
+    }
+
+    /**
+     * Writes every dirty page back to the file.  Does not sync it.
+     *
+     * @throws system_error if a page can not be written
+     */
+    void Flush() {
+        for (std::size_t i = 0; i < frames_.size(); i++) {
+            if (frames_[i].dirty) WriteBack(i);
+        }
+    }
+
+    BufferPoolStats GetStats() const { return stats_; }
+
+    /**
+     * Sets every counter back to zero.
+     */
+    void ResetStats() { stats_ = BufferPoolStats{}; }
+
+ private:
+    /**
+     * Finds a frame for page by CLOCK, writes back its old page if dirty,
+     * and hands it over pinned once.  Its contents are undefined.
+     */
+    std::size_t Claim(std::uint64_t page) {
+        std::size_t index = Victim();
+        Frame &frame = frames_[index];
+        if (frame.page != kNoPage) {
+            if (frame.dirty) WriteBack(index);
+            page_table_.erase(frame.page);
+            stats_.evictions++;
+        }
+        frame.page = page;
+        frame.pins = 1;
+        unpinned_--;
+        frame.referenced = true;
+        frame.dirty = false;
+        page_table_.emplace(page, index);
+        return index;
+    }
+
+    /**
+     * Undoes a Claim whose read failed.
+     */
+    void Release(std::size_t index) {
+        page_table_.erase(frames_[index].page);
+        if (frames_[index].pins > 0) unpinned_++;
+        frames_[index] = Frame();
+    }
+
+    /**
+     * Adds a pin to frame index, which holds a page.
+     */
+    void AddPin(std::size_t index) {
+        Frame &frame = frames_[index];
+        if (frame.pins++ == 0) unpinned_--;
+        frame.referenced = true;
+    }
+
+    /**
+     * Reads the page of frame index with pread.
+     *
+     * @return 0, or the errno of the failure.
+     */
+    int ReadPage(std::size_t index) {
+        unsigned char *data = GetData(index);
+        std::uint64_t page = frames_[index].page;
+        std::size_t done = 0;
+        while (done < page_size_) {
+            ssize_t result = pread(fd_, data + done, page_size_ - done,
+                static_cast<off_t>(page * page_size_ + done));
+            if (result < 0 && errno == EINTR) continue;
+            if (result < 0) return errno;
+            if (result == 0) {
+                std::memset(data + done, 0, page_size_ - done);
+                break;
+            }
+            done += static_cast<std::size_t>(result);
+        }
+        return 0;
+    }
+
+    /**
+     * Finishes the async read of frame index, which read result bytes or
+     * failed with -result.  A short read, at the end of the file or
+     * otherwise, and a failed one are redone with pread.  If that fails
+     * too, the frame drops the page but stays pinned by its waiters.
+     *
+     * @return 0, or the errno of the failure.
+     */
+    int Complete(std::size_t index, int result) {
+        Frame &frame = frames_[index];
+        frame.loading = false;
+        if (result == static_cast<int>(page_size_)) return 0;
+        int error = ReadPage(index);
+        if (error != 0) {
+            page_table_.erase(frame.page);
+            frame.page = kNoPage;
+        }
+        return error;
+    }
+
+    /**
+     * Reaps async reads until frame index has been read, keeping the
+     * others for the next Reap.
+     *
+     * @throws system_error if the read failed
+     */
+    void WaitFor(std::size_t index) {
+        while (frames_[index].loading) {
+            int error = ring_->Submit(true);
+            if (error != 0)
+                throw std::system_error(error, std::generic_category(),
+                    "! Failed to wait for page !");
+            std::uint64_t done;
+            int result;
+            while (ring_->Reap(&done, &result))
+                finished_.emplace_back(done, Complete(done, result));
+        }
+        for (const std::pair<std::size_t, int> &entry : finished_) {
+            if (entry.first == index && entry.second != 0) {
+                Unpin(index);
+                throw std::system_error(entry.second, std::generic_category(),
+                    "! Failed to read page !");
+            }
+        }
+    }
+
+    std::size_t Victim() {
+        if (unpinned_ == 0)
+            throw std::runtime_error("! Every buffer pool frame is pinned !");
+        // Two full turns: the first may only clear reference bits.
+        for (std::size_t step = 0; step < 2 * frames_.size(); step++) {
+            std::size_t index = hand_;
+            hand_ = (hand_ + 1) % frames_.size();
+            Frame &frame = frames_[index];
+            if (frame.pins > 0) continue;
+            if (frame.referenced) {
+                frame.referenced = false;
+                continue;
+            }
+            return index;
+        }
+        throw std::runtime_error("! Every buffer pool frame is pinned !");
+    }
+
+    void WriteBack(std::size_t index) {
+        Frame &frame = frames_[index];
+        const unsigned char *data = GetData(index);
+        std::size_t done = 0;
+        while (done < page_size_) {
+            ssize_t result = pwrite(fd_, data + done, page_size_ - done,
+                static_cast<off_t>(frame.page * page_size_ + done));
+            if (result < 0 && errno == EINTR) continue;
+            if (result < 0)
+                throw std::system_error(errno, std::generic_category(),
+                    "! Failed to write page !");
+            done += static_cast<std::size_t>(result);
+        }
+        frame.dirty = false;
+        stats_.writes++;
+    }
+};
+
+/**
+ * Pin on one buffer pool page, released when the guard goes out of scope.
+ */
+class PageGuard {
+ public:
+    PageGuard(BufferPool *pool, std::uint64_t page)
+        : pool_(pool), frame_(pool->Pin(page)) {}
+
+    PageGuard(BufferPool *pool, std::uint64_t page, bool create)
+        : pool_(pool),
+          frame_(create ? pool->PinNew(page) : pool->Pin(page)) {}
+
+    PageGuard(const PageGuard&) = delete;
+    PageGuard& operator=(const PageGuard&) = delete;
+
+    PageGuard(PageGuard &&other) noexcept
+        : pool_(std::exchange(other.pool_, nullptr)), frame_(other.frame_) {}
+
+    ~PageGuard() {
+        if (pool_ != nullptr) pool_->Unpin(frame_);
+    }
+
+    unsigned char* GetData() const { return pool_->GetData(frame_); }
+
+    void MarkDirty() { pool_->MarkDirty(frame_); }
+
+ private:
+    BufferPool *pool_;
+    std::size_t frame_;
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_BUFFERPOOL_H_
@@ -0,0 +1,405 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_BUFFEREDAVLTREE_H_
+#define SRC_BUFFEREDAVLTREE_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+#include "AVLTree.h"
+#include "AVLTreeOperation.h"
+#include "ThreadRegistry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Thread safe AVLTree that absorbs writes in small per-thread buffers and
+ * merges them into the main tree in sorted batches, in the manner of the
+ * memtable of a log structured merge tree.
+ *
+ * A write takes only its own buffer lock, which no other writer ever
+ * touches, and costs a descent of a tree of at most GetBufferLimit()
+ * entries.  Once a buffer reaches the limit every buffer is merged into
+ * the main tree with one AVLTree::ApplyBatch, so the main tree's lock is
+ * taken exclusively and its upper levels rebalanced once per batch rather
+ * than once per write.  Reads take the tree lock shared, which only a
+ * flush excludes.
+ *
+ * Every buffered write is stamped with the flush generation and a
+ * sequence number, read under the buffer lock.  The sequence is the
+ * monotonic clock, and a write does not return until the clock has moved
+ * past its stamp, so a write that starts after another returns gets a
+ * higher stamp whichever buffer it lands in, with no counter shared
+ * between writers.  A flush moves only the writes of earlier generations
+ * into the main tree; writes that land while it runs wait for the next
+ * one, so a buffered write is always newer than the main tree.
+ *
+ * A removal is buffered as a tombstone.  Lookups check the buffers for
+ * the key, newest stamp wins, and only fall back to the main tree when no
+ * buffer has it.  Each buffer keeps a bitmap of the hashes of its keys,
+ * read without its lock, so a lookup only locks the buffers that may hold
+ * its key.  Range scans merge the buffers with the main tree.  Since
+ * writes are blind, there is no Add, and Erase does not report whether the
+ * key was present.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >, and have a std::hash specialization.
+ * @param <TValue>
+ *            Generic type representing the data being stored.
+ */
+template <class TKey, class TValue>
+class BufferedAVLTree {
+ private:
+    static constexpr int kFilterShift = 13;
+    static constexpr std::size_t kFilterBits = std::size_t{1} << kFilterShift;
+
+    /**
+     * A buffered write.  erased marks a tombstone.  Writes are ordered by
+     * generation, then sequence.
+     */
+    struct Delta {
+        std::uint64_t generation = 0;
+        std::uint64_t sequence = 0;
+        bool erased = false;
+        TValue value = TValue();
+
+        bool NewerThan(const Delta &other) const {
+            if (generation != other.generation)
+                return generation > other.generation;
+            return sequence > other.sequence;
+        }
+    };
+
+    struct Buffer {
+        std::mutex mutex;
+        AVLTree<TKey, Delta> deltas;
+        // Bit FilterBit(key) is set for every key in deltas, and possibly
+        // for keys no longer there.  Set under mutex, read without it.
+        std::array<std::atomic<std::uint64_t>, kFilterBits / 64> filter{};
+
+        void SetBit(std::size_t bit) {
+            filter[bit / 64].fetch_or(std::uint64_t{1} << bit % 64);
+        }
+
+        bool HasBit(std::size_t bit) const {
+            return (filter[bit / 64].load() >> bit % 64 & 1) != 0;
+        }
+    };
+
+    AVLTree<TKey, TValue> tree_;
+    // Held shared by readers, so buffered writes can not move into tree_
+    // under them, and exclusively by Flush.  Always taken before any
+    // buffer's mutex.  Writers do not take it.
+    mutable std::shared_mutex mutex_;
+    mutable ThreadRegistry<Buffer> buffers_;
+    // Generation of writes the next Flush leaves in the buffers.
+    std::atomic<std::uint64_t> generation_;
+    int buffer_limit_;
+
+ public:
+    /**
+     * Creates a new, empty, BufferedAVLTree.
+     *
+     * @param buffer_limit Number of keys a thread's buffer may hold before
+     *          the buffers are flushed into the main tree.
+     */
+    explicit BufferedAVLTree(int buffer_limit = 1024) {
+        generation_ = 0;
+        buffer_limit_ = std::max(buffer_limit, 1);
+    }
+
+    BufferedAVLTree(const BufferedAVLTree&) = delete;
+    BufferedAVLTree& operator=(const BufferedAVLTree&) = delete;
+
+    /**
+     * Returns the number of keys a buffer may hold before a flush.
+     */
+    int GetBufferLimit() const { return buffer_limit_; }
+
+    /**
+     * Returns the number of writes waiting in buffers.
+     */
+    int GetBufferedCount() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        int count = 0;
+        buffers_.ForEach([&count](Buffer &buffer) {
+            std::lock_guard<std::mutex> buffer_lock(buffer.mutex);
+            count += buffer.deltas.GetCount();
+        });
+        return count;
+    }
+
+    /**
+     * Returns the number of elements in the tree.  Costs a lookup in the
+     * main tree for every buffered key, so Flush first when calling this
+     * in a loop.
+     */
+    int GetCount() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        int count = tree_.GetCount();
+        for (const std::pair<TKey, Delta> &delta : CollectDeltas()) {
+            bool was_present = tree_.Contains(delta.first);
+            bool is_present = !delta.second.erased;
+            count += static_cast<int>(is_present)
+                - static_cast<int>(was_present);
+        }
+        return count;
+    }
+
+    /**
+     * Looks up the value stored at key, checking the buffers first.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        std::size_t bit = FilterBit(key);
+        std::optional<Delta> newest;
+        buffers_.ForEach([&key, bit, &newest](Buffer &buffer) {
+            if (!buffer.HasBit(bit)) return;
+            std::lock_guard<std::mutex> buffer_lock(buffer.mutex);
+            std::optional<Delta> delta = buffer.deltas.Find(key);
+            if (delta.has_value()
+                    && (!newest.has_value() || delta->NewerThan(*newest))) {
+                newest = delta;
+            }
+        });
+
+        if (!newest.has_value()) return tree_.Find(key);
+        if (newest->erased) return std::nullopt;
+        return newest->value;
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) const { return Find(key).has_value(); }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.  Lands in the calling thread's buffer.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        Write(key, Delta{0, 0, false, value});
+    }
+
+    /**
+     * Removes key from the tree, if it is present.  Lands in the calling
+     * thread's buffer as a tombstone.
+     */
+    void Erase(TKey key) {
+        Write(key, Delta{0, 0, true, TValue()});
+    }
+
+    /**
+     * Copies every entry with low <= key <= high out of the tree, in key
+     * order, merging buffered writes over the main tree.
+     *
+     * @param low Smallest key to return.
+     * @param high Largest key to return.
+     *
+     * @return Entries in range, ordered by key.
+     */
+    std::vector<MapEntry<TKey, TValue>> Range(TKey low, TKey high) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+
+        std::vector<std::pair<TKey, Delta>> deltas = CollectDeltas(low, high);
+        std::vector<MapEntry<TKey, TValue>> result;
+        std::size_t next = 0;
+
+        // Emits the buffered writes with keys below key, or every one left
+        // when key is null.
+        auto emit_deltas_before = [&deltas, &next, &result](const TKey *key) {
+            while (next < deltas.size()
+                    && (key == nullptr || deltas[next].first < *key)) {
+                if (!deltas[next].second.erased) {
+                    result.push_back(MapEntry<TKey, TValue>(deltas[next].first,
+                        deltas[next].second.value));
+                }
+                next++;
+            }
+        };
+
+        tree_.Range(low, high,
+            [&](const AVLTreeNode<TKey, TValue> &node) {
+                TKey key = node.GetKey();
+                emit_deltas_before(&key);
+                if (next < deltas.size() && deltas[next].first == key) {
+                    // Shadowed by a buffered write.
+                    if (!deltas[next].second.erased) {
+                        result.push_back(MapEntry<TKey, TValue>(key,
+                            deltas[next].second.value));
+                    }
+                    next++;
+                } else {
+                    result.push_back(node.GetMapEntry());
+                }
+            });
+        emit_deltas_before(nullptr);
+        return result;
+    }
+
+    /**
+     * Merges every buffer into the main tree.  Called automatically when a
+     * buffer reaches the limit; call it directly before a long read-only
+     * phase.  Writes made while it runs stay buffered.
+     */
+    void Flush() {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        // Every write that reads the old generation is stored before its
+        // buffer is drained below, since both happen under the buffer lock.
+        std::uint64_t generation = generation_.fetch_add(1);
+
+        std::vector<std::pair<TKey, Delta>> drained;
+        buffers_.ForEach([&drained, generation](Buffer &buffer) {
+            std::lock_guard<std::mutex> buffer_lock(buffer.mutex);
+            std::vector<std::pair<TKey, Delta>> kept;
+            buffer.deltas.ForEach(
+                [&drained, &kept, generation](
+                        const AVLTreeNode<TKey, Delta> &n) {
+                    if (n.GetValue().generation <= generation) {
+                        drained.emplace_back(n.GetKey(), n.GetValue());
+                    } else {
+                        kept.emplace_back(n.GetKey(), n.GetValue());
+                    }
+                });
+            buffer.deltas.Clear();
+            for (std::atomic<std::uint64_t> &word : buffer.filter) word = 0;
+            for (const std::pair<TKey, Delta> &delta : kept) {
+                buffer.deltas.Add(delta.first, delta.second);
+                buffer.SetBit(FilterBit(delta.first));
+            }
+        });
+        if (drained.empty()) return;
+
+        // Writes to one key from several buffers collapse to the newest.
+        std::vector<std::pair<TKey, Delta>> newest =
+            Newest(std::move(drained));
+        std::vector<AVLTreeOperation<TKey, TValue>> batch;
+        batch.reserve(newest.size());
+        for (const std::pair<TKey, Delta> &delta : newest) {
+            batch.emplace_back(delta.second.erased
+                    ? AVLTreeOperationType::Remove
+                    : AVLTreeOperationType::InsertOrAssign,
+                delta.first, delta.second.value);
+        }
+        tree_.ApplyBatch(batch);
+    }
+
+ private:
+    /**
+     * Stamps delta and stores it in the calling thread's buffer, flushing
+     * if the buffer is full.
+     */
+    void Write(const TKey &key, Delta delta) {
+        Buffer *buffer = buffers_.Local();
+        bool full;
+        {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            delta.generation = generation_.load();
+            delta.sequence = Now();
+            buffer->deltas.InsertOrAssign(key, delta);
+            buffer->SetBit(FilterBit(key));
+            full = buffer->deltas.GetCount() >= buffer_limit_;
+        }
+        // Any write that starts after this one returns reads a later time.
+        while (Now() <= delta.sequence) {}
+        if (full) Flush();
+    }
+
+    static std::uint64_t Now() {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<
+            std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+                .time_since_epoch()).count());
+    }
+
+    static std::size_t FilterBit(const TKey &key) {
+        // Fibonacci hashing spreads the sequential hashes of integers.
+        std::uint64_t hash = static_cast<std::uint64_t>(
+            std::hash<TKey>{}(key));
+        return static_cast<std::size_t>(hash * 0x9e3779b97f4a7c15ULL
+            >> (64 - kFilterShift));
+    }
+
+    /**
+     * Returns the newest buffered write for every buffered key, in key
+     * order.  Called with mutex_ held.
+     */
+    std::vector<std::pair<TKey, Delta>> CollectDeltas() const {
+        std::vector<std::pair<TKey, Delta>> deltas;
+        buffers_.ForEach([&deltas](Buffer &buffer) {
+            std::lock_guard<std::mutex> buffer_lock(buffer.mutex);
+            buffer.deltas.ForEach([&deltas](const AVLTreeNode<TKey, Delta> &n) {
+                deltas.emplace_back(n.GetKey(), n.GetValue());
+            });
+        });
+        return Newest(std::move(deltas));
+    }
+
+    /**
+     * Returns the newest buffered write for every buffered key with
+     * low <= key <= high, in key order.  Called with mutex_ held.
+     */
+    std::vector<std::pair<TKey, Delta>> CollectDeltas(const TKey &low,
+            const TKey &high) const {
+        std::vector<std::pair<TKey, Delta>> deltas;
+        buffers_.ForEach([&deltas, &low, &high](Buffer &buffer) {
+            std::lock_guard<std::mutex> buffer_lock(buffer.mutex);
+            buffer.deltas.Range(low, high,
+                [&deltas](const AVLTreeNode<TKey, Delta> &n) {
+                    deltas.emplace_back(n.GetKey(), n.GetValue());
+                });
+        });
+        return Newest(std::move(deltas));
+    }
+
+    /**
+     * Sorts deltas by key and keeps only the newest write to each key.
+     */
+    static std::vector<std::pair<TKey, Delta>> Newest(
+            std::vector<std::pair<TKey, Delta>> deltas) {
+        std::sort(deltas.begin(), deltas.end(),
+            [](const std::pair<TKey, Delta> &a,
+                    const std::pair<TKey, Delta> &b) {
+                if (a.first < b.first) return true;
+                if (b.first < a.first) return false;
+                return a.second.NewerThan(b.second);
+            });
+
+        std::vector<std::pair<TKey, Delta>> newest;
+        for (std::pair<TKey, Delta> &delta : deltas) {
+            if (newest.empty() || newest.back().first < delta.first)
+                newest.push_back(std::move(delta));
+        }
+        return newest;
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_BUFFEREDAVLTREE_H_
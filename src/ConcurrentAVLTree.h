@@ -0,0 +1,272 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_CONCURRENTAVLTREE_H_
+#define SRC_CONCURRENTAVLTREE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <vector>
+#include "AVLTree.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Snapshot of the lock counters of a ConcurrentAVLTree.  A contention is
+ * counted every time a thread could not take the lock immediately and had to
+ * block.  A high contention / acquisition ratio is the signal to move to one
+ * of the finer grained trees.
+ */
+struct ConcurrentAVLTreeStats {
+    std::uint64_t shared_acquisitions;
+    std::uint64_t shared_contentions;
+    std::uint64_t exclusive_acquisitions;
+    std::uint64_t exclusive_contentions;
+};
+
+/**
+ * Coarse grained thread safe wrapper around an AVLTree.
+ *
+ * Readers share a std::shared_mutex, writers take it exclusively.  Only read
+ * paths that leave the tree untouched are exposed (Find, Range, ForEach), so
+ * any number of readers may run together.  The Iterator is not exposed,
+ * since begin() and SetTraversalMethod mutate shared state.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >.
+ * @param <TValue>
+ *            Generic type representing the data being stored.
+ */
+template <class TKey, class TValue>
+class ConcurrentAVLTree {
+ private:
+    AVLTree<TKey, TValue> tree_;
+    mutable std::shared_mutex mutex_;
+
+    mutable std::atomic<std::uint64_t> shared_acquisitions_;
+    mutable std::atomic<std::uint64_t> shared_contentions_;
+    mutable std::atomic<std::uint64_t> exclusive_acquisitions_;
+    mutable std::atomic<std::uint64_t> exclusive_contentions_;
+
+ public:
+    /**
+     * Creates a new, empty, ConcurrentAVLTree.
+     */
+    ConcurrentAVLTree() {
+        shared_acquisitions_ = 0;
+        shared_contentions_ = 0;
+        exclusive_acquisitions_ = 0;
+        exclusive_contentions_ = 0;
+    }
+
+    ConcurrentAVLTree(const ConcurrentAVLTree&) = delete;
+    ConcurrentAVLTree& operator=(const ConcurrentAVLTree&) = delete;
+
+    /**
+     * Returns the number of elements in the tree.
+     *
+     * @return Number of elements in the tree.
+     */
+    int GetCount() const {
+        std::shared_lock<std::shared_mutex> lock = LockShared();
+        return tree_.GetCount();
+    }
+
+    /**
+     * Looks up the value stored at key, under a shared lock.
+     *
+     * @param Key Key to locate in the tree.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) const {
+        std::shared_lock<std::shared_mutex> lock = LockShared();
+        return tree_.Find(key);
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     *
+     * @param Key Key to locate in the tree.
+     */
+    bool Contains(TKey key) const {
+        std::shared_lock<std::shared_mutex> lock = LockShared();
+        return tree_.Contains(key);
+    }
+
+    /**
+     * Copies every entry with low <= key <= high out of the tree, in key
+     * order.  The shared lock is only held while copying.
+     *
+     * @param low Smallest key to return.
+     * @param high Largest key to return.
+     *
+     * @return Entries in range, ordered by key.
+     */
+    std::vector<MapEntry<TKey, TValue>> Range(TKey low, TKey high) const {
+        std::vector<MapEntry<TKey, TValue>> result;
+        std::shared_lock<std::shared_mutex> lock = LockShared();
+        tree_.Range(low, high, [&result](const AVLTreeNode<TKey, TValue> &n) {
+            result.push_back(n.GetMapEntry());
+        });
+        return result;
+    }
+
+    /**
+     * Calls func for every node in key order, under a shared lock.  func
+     * must not call back into this tree.
+     *
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) const {
+        std::shared_lock<std::shared_mutex> lock = LockShared();
+        tree_.ForEach(func);
+    }
+
+    /**
+     * Add a key/value pair to the tree.
+     *
+     * @throws std::range_error if key is already present.
+     */
+    void Add(TKey key, TValue value) {
+        std::unique_lock<std::shared_mutex> lock = LockExclusive();
+        tree_.Add(key, value);
+    }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        std::unique_lock<std::shared_mutex> lock = LockExclusive();
+        tree_.InsertOrAssign(key, value);
+    }
+
+    /**
+     * Remove an entry from the tree.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        std::unique_lock<std::shared_mutex> lock = LockExclusive();
+        return tree_.Remove(key);
+    }
+
+    /**
+     * Adds or replaces every entry under a single exclusive lock
+     * acquisition.
+     *
+     * @param entries Key/value pairs to store.
+     */
+    void InsertOrAssignAll(const std::vector<MapEntry<TKey, TValue>> &entries) {
+        std::unique_lock<std::shared_mutex> lock = LockExclusive();
+        for (const MapEntry<TKey, TValue> &entry : entries)
+            tree_.InsertOrAssign(entry.key, entry.value);
+    }
+
+    /**
+     * Removes every key present in keys under a single exclusive lock
+     * acquisition.  Keys that are not in the tree are skipped.
+     *
+     * @param keys Keys to remove.
+     *
+     * @return Number of entries removed.
+     */
+    int RemoveAll(const std::vector<TKey> &keys) {
+        int removed = 0;
+        std::unique_lock<std::shared_mutex> lock = LockExclusive();
+        for (const TKey &key : keys) {
+            if (tree_.Contains(key)) {
+                tree_.Remove(key);
+                removed++;
+            }
+        }
+        return removed;
+    }
+
+    /**
+     * Runs func with exclusive access to the underlying AVLTree.  Used for
+     * larger batches, or operations not wrapped here (Compact, ...).
+     *
+     * @param func Callable taking an AVLTree<TKey, TValue>&.
+     */
+    template <typename Func>
+    void Update(Func func) {
+        std::unique_lock<std::shared_mutex> lock = LockExclusive();
+        func(tree_);
+    }
+
+    /**
+     * Returns the lock counters collected so far.
+     */
+    ConcurrentAVLTreeStats GetStats() const {
+        return ConcurrentAVLTreeStats {
+            shared_acquisitions_.load(std::memory_order_relaxed),
+            shared_contentions_.load(std::memory_order_relaxed),
+            exclusive_acquisitions_.load(std::memory_order_relaxed),
+            exclusive_contentions_.load(std::memory_order_relaxed)
+        };
+    }
+
+    /**
+     * Resets the lock counters to zero.
+     */
+    void ResetStats() {
+        shared_acquisitions_.store(0, std::memory_order_relaxed);
+        shared_contentions_.store(0, std::memory_order_relaxed);
+        exclusive_acquisitions_.store(0, std::memory_order_relaxed);
+        exclusive_contentions_.store(0, std::memory_order_relaxed);
+    }
+
+ private:
+    /**
+     * Takes the shared lock, counting a contention if it was not
+     * immediately available.
+     */
+    std::shared_lock<std::shared_mutex> LockShared() const {
+        if (!mutex_.try_lock_shared()) {
+            shared_contentions_.fetch_add(1, std::memory_order_relaxed);
+            mutex_.lock_shared();
+        }
+        shared_acquisitions_.fetch_add(1, std::memory_order_relaxed);
+        return std::shared_lock<std::shared_mutex>(mutex_, std::adopt_lock);
+    }
+
+    /**
+     * Takes the exclusive lock, counting a contention if it was not
+     * immediately available.
+     */
+    std::unique_lock<std::shared_mutex> LockExclusive() const {
+        if (!mutex_.try_lock()) {
+            exclusive_contentions_.fetch_add(1, std::memory_order_relaxed);
+            mutex_.lock();
+        }
+        exclusive_acquisitions_.fetch_add(1, std::memory_order_relaxed);
+        return std::unique_lock<std::shared_mutex>(mutex_, std::adopt_lock);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_CONCURRENTAVLTREE_H_
@@ -0,0 +1,298 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_COPYONWRITEAVL_H_
+#define SRC_COPYONWRITEAVL_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "MapEntry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Node of an AVL tree kept in a flat array, for trees that live in mapped
+ * files or shared memory.  Children are indexes into the array rather than
+ * pointers, so the array means the same thing wherever it is mapped.
+ */
+template <class TKey, class TValue>
+struct OffsetAVLNode {
+    static constexpr std::uint64_t kNone = ~std::uint64_t{0};
+
+    TKey key;
+    TValue value;
+    std::uint64_t left;   // kNone if absent
+    std::uint64_t right;  // kNone if absent
+    std::int32_t height;
+};
+
+/**
+ * Copy on write AVL algorithms over OffsetAVLNodes.
+ *
+ * Insert and Erase never change a node reachable from the root they are
+ * given.  Every node they would change is first copied, unless the heap
+ * says it was allocated by the current change, and the copies form a new
+ * root; the old root stays a complete, unchanged tree.  That lets a caller
+ * publish the new root with one write, to a file header or an atomic, and
+ * have readers of the old root, or a crash part way through, see either
+ * the old tree or the new one.
+ *
+ * Heap is the node storage, and must provide:
+ *   Node* At(std::uint64_t id);         the node with index id
+ *   std::uint64_t Allocate();           a fresh node; may move every node
+ *   bool IsFresh(std::uint64_t id);     true if allocated by this change
+ *   void Retire(std::uint64_t id);      id is no longer in the new tree
+ *
+ * Because Allocate may move the nodes, no Node* is held across a call to
+ * it.  Insert and Erase expect the caller to have checked for the key.
+ */
+template <class TKey, class TValue, class Heap>
+class CopyOnWriteAVL {
+ public:
+    using Node = OffsetAVLNode<TKey, TValue>;
+    static constexpr std::uint64_t kNone = Node::kNone;
+
+ private:
+    Heap *heap_;
+
+ public:
+    explicit CopyOnWriteAVL(Heap *heap) : heap_(heap) {}
+
+    /**
+     * Returns the node holding key in the tree at root, or nullptr.
+     */
+    const Node* Find(std::uint64_t root, const TKey &key) const {
+        std::uint64_t id = root;
+        while (id != kNone) {
+            const Node *node = heap_->At(id);
+            if (key == node->key) return node;
+            id = key < node->key ? node->left : node->right;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Calls func for every entry of the tree at root, in key order.
+     *
+     * @param func Callable taking a const MapEntry<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(std::uint64_t root, Func &&func) const {
+        std::vector<std::uint64_t> my_stack;
+        std::uint64_t id = root;
+        while (id != kNone || !my_stack.empty()) {
+            while (id != kNone) {
+                my_stack.push_back(id);
+                id = heap_->At(id)->left;
+            }
+            const Node *node = heap_->At(my_stack.back());
+            my_stack.pop_back();
+            const MapEntry<TKey, TValue> entry(node->key, node->value);
+            func(entry);
+            id = node->right;
+        }
+    }
+
+    /**
+     * Stores value at key in the tree at root, adding key if it is absent.
+     *
+     * @return Root of the new tree.
+     */
+    std::uint64_t Insert(std::uint64_t root, const TKey &key,
+            const TValue &value) {
+        bool added = false;
+        return Insert(root, key, value, &added);
+    }
+
+    /**
+     * Removes key, which must be present, from the tree at root.
+     *
+     * @return Root of the new tree.
+     */
+    std::uint64_t Erase(std::uint64_t root, const TKey &key) {
+        return EraseNode(root, key);
+    }
+
+ private:
+    int Height(std::uint64_t id) const {
+        return id == kNone ? -1 : heap_->At(id)->height;
+    }
+
+    void UpdateHeight(std::uint64_t id) {
+        Node *node = heap_->At(id);
+        int height = 1 + std::max(Height(node->left), Height(node->right));
+        heap_->At(id)->height = height;
+    }
+
+    /**
+     * Returns a node of this change with id's contents: id itself if it is
+     * already one, else a copy, retiring id.
+     */
+    std::uint64_t Own(std::uint64_t id) {
+        if (heap_->IsFresh(id)) return id;
+        std::uint64_t copy = heap_->Allocate();
+        std::memcpy(static_cast<void*>(heap_->At(copy)), heap_->At(id),
+            sizeof(Node));
+        heap_->Retire(id);
+        return copy;
+    }
+
+    // id and its left child are owned.
+    std::uint64_t RotateRight(std::uint64_t id) {
+        std::uint64_t left = heap_->At(id)->left;
+        heap_->At(id)->left = heap_->At(left)->right;
+        UpdateHeight(id);
+        heap_->At(left)->right = id;
+        UpdateHeight(left);
+        return left;
+    }
+
+    // id and its right child are owned.
+    std::uint64_t RotateLeft(std::uint64_t id) {
+        std::uint64_t right = heap_->At(id)->right;
+        heap_->At(id)->right = heap_->At(right)->left;
+        UpdateHeight(id);
+        heap_->At(right)->left = id;
+        UpdateHeight(right);
+        return right;
+    }
+
+    /**
+     * Recalculates the height of owned node id, whose children are
+     * balanced, and rotates it if it is not.
+     *
+     * @return Id of the node now at the root of the subtree.
+     */
+    std::uint64_t Rebalance(std::uint64_t id) {
+        int left = Height(heap_->At(id)->left);
+        int right = Height(heap_->At(id)->right);
+        if (left > right + 1) {
+            std::uint64_t child = Own(heap_->At(id)->left);
+            heap_->At(id)->left = child;
+            if (Height(heap_->At(child)->left)
+                    < Height(heap_->At(child)->right)) {
+                std::uint64_t grandchild = Own(heap_->At(child)->right);
+                heap_->At(child)->right = grandchild;
+                heap_->At(id)->left = RotateLeft(child);
+            }
+            return RotateRight(id);
+        }
+        if (right > left + 1) {
+            std::uint64_t child = Own(heap_->At(id)->right);
+            heap_->At(id)->right = child;
+            if (Height(heap_->At(child)->right)
+                    < Height(heap_->At(child)->left)) {
+                std::uint64_t grandchild = Own(heap_->At(child)->left);
+                heap_->At(child)->left = grandchild;
+                heap_->At(id)->right = RotateRight(child);
+            }
+            return RotateLeft(id);
+        }
+        UpdateHeight(id);
+        return id;
+    }
+
+    std::uint64_t Insert(std::uint64_t id, const TKey &key,
+            const TValue &value, bool *added) {
+        if (id == kNone) {
+            *added = true;
+            std::uint64_t leaf = heap_->Allocate();
+            Node *node = heap_->At(leaf);
+            node->key = key;
+            node->value = value;
+            node->left = kNone;
+            node->right = kNone;
+            node->height = 0;
+            return leaf;
+        }
+
+        const Node *node = heap_->At(id);
+        if (key == node->key) {
+            std::uint64_t copy = Own(id);
+            heap_->At(copy)->value = value;
+            return copy;
+        }
+        bool go_left = key < node->key;
+        std::uint64_t child = Insert(go_left ? node->left : node->right, key,
+            value, added);
+        std::uint64_t copy = Own(id);
+        if (go_left) {
+            heap_->At(copy)->left = child;
+        } else {
+            heap_->At(copy)->right = child;
+        }
+        return *added ? Rebalance(copy) : copy;
+    }
+
+    std::uint64_t EraseNode(std::uint64_t id, const TKey &key) {
+        const Node *node = heap_->At(id);
+        if (key < node->key || node->key < key) {
+            bool go_left = key < node->key;
+            std::uint64_t child = EraseNode(go_left ? node->left : node->right,
+                key);
+            std::uint64_t copy = Own(id);
+            if (go_left) {
+                heap_->At(copy)->left = child;
+            } else {
+                heap_->At(copy)->right = child;
+            }
+            return Rebalance(copy);
+        }
+
+        if (node->left == kNone || node->right == kNone) {
+            std::uint64_t child = node->left != kNone ? node->left
+                : node->right;
+            heap_->Retire(id);
+            return child;
+        }
+        // Two children: the successor's entry takes this node's place.
+        TKey successor_key;
+        TValue successor_value;
+        std::uint64_t right = EraseMin(node->right, &successor_key,
+            &successor_value);
+        std::uint64_t copy = Own(id);
+        Node *owned = heap_->At(copy);
+        owned->key = successor_key;
+        owned->value = successor_value;
+        owned->right = right;
+        return Rebalance(copy);
+    }
+
+    /**
+     * Removes the smallest entry of the subtree at id, copying it out.
+     */
+    std::uint64_t EraseMin(std::uint64_t id, TKey *key, TValue *value) {
+        const Node *node = heap_->At(id);
+        if (node->left == kNone) {
+            *key = node->key;
+            *value = node->value;
+            std::uint64_t right = node->right;
+            heap_->Retire(id);
+            return right;
+        }
+        std::uint64_t left = EraseMin(node->left, key, value);
+        std::uint64_t copy = Own(id);
+        heap_->At(copy)->left = left;
+        return Rebalance(copy);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_COPYONWRITEAVL_H_
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_DURABLEAVLTREE_H_
+#define SRC_DURABLEAVLTREE_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include "AVLTree.h"
+#include "AVLTreeOperation.h"
+#include "MapEntry.h"
+#include "WriteAheadLog.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * AVL tree that survives crashes: the latest snapshot written by
+ * AVLTree::Save plus a WriteAheadLog of every change made since.
+ *
+ * Each change is appended to the log and then applied to the in memory
+ * tree under one exclusive lock, so the log order is the order the changes
+ * were made in, and then waits outside the lock for the log's group commit.
+ * A change the log refuses, because an earlier flush failed, never reaches
+ * the tree.  A change returns only once it is on disk, but it is visible
+ * to lookups from other threads slightly before that.
+ *
+ * Checkpoint writes a new snapshot, fsyncs it, renames it over the old one,
+ * and then empties the log.  On open, the snapshot is loaded and the log
+ * replayed on top of it.  A crash between the rename and the truncate
+ * leaves a log whose changes are already in the snapshot, so replay is
+ * idempotent: an Add is replayed as an InsertOrAssign and a Remove of a
+ * missing key is ignored.  Replaying a prefix of changes over a state that
+ * already includes them ends with the same last write to every key.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >, and have an AVLTreeCodec.
+ * @param <TValue>
+ *            Generic type representing the data being stored.  Must have an
+ *            AVLTreeCodec.
+ */
+template <class TKey, class TValue>
+class DurableAVLTree {
+ private:
+    std::string snapshot_path_;
+    std::mutex checkpoint_mutex_;
+    mutable std::shared_mutex mutex_;
+    AVLTree<TKey, TValue> tree_;
+    WriteAheadLog<TKey, TValue> log_;
+
+ public:
+    /**
+     * Opens the tree stored at snapshot_path and log_path, creating it if
+     * neither exists.
+     *
+     * @throws runtime_error if the snapshot is corrupt
+     * @throws system_error if a file can not be opened
+     */
+    DurableAVLTree(std::string snapshot_path, std::string log_path)
+        : snapshot_path_(std::move(snapshot_path)),
+          tree_(LoadSnapshot(snapshot_path_, log_path)),
+          log_(std::move(log_path)) {}
+
+    DurableAVLTree(const DurableAVLTree&) = delete;
+    DurableAVLTree& operator=(const DurableAVLTree&) = delete;
+
+    /**
+     * Returns the number of elements in the tree.
+     */
+    int GetCount() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return tree_.GetCount();
+    }
+
+    /**
+     * Looks up the value stored at key.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return tree_.Find(key);
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return tree_.Contains(key);
+    }
+
+    /**
+     * Add a key/value pair to the tree, returning once it is durable.
+     *
+     * @throws std::range_error if key is already present.
+     * @throws system_error if the log can not be written
+     */
+    void Add(TKey key, TValue value) {
+        std::uint64_t lsn;
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            if (tree_.Contains(key))
+                throw std::range_error("! Key already exists in Tree !");
+            lsn = log_.Append({AVLTreeOperationType::Add, key, value});
+            tree_.Add(key, value);
+        }
+        log_.Sync(lsn);
+    }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present, returning once the change is durable.
+     *
+     * @throws system_error if the log can not be written
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        std::uint64_t lsn;
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            lsn = log_.Append({AVLTreeOperationType::InsertOrAssign, key,
+                value});
+            tree_.InsertOrAssign(key, value);
+        }
+        log_.Sync(lsn);
+    }
+
+    /**
+     * Remove an entry from the tree, returning once the removal is durable.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     * @throws system_error if the log can not be written
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        std::uint64_t lsn;
+        std::optional<MapEntry<TKey, TValue>> removed;
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            if (!tree_.Contains(key))
+                throw std::range_error
+                    (std::format("! Key {} not present in Tree !", key));
+            lsn = log_.Append({AVLTreeOperationType::Remove, key});
+            removed.emplace(tree_.Remove(key));
+        }
+        log_.Sync(lsn);
+        return *removed;
+    }
+
+    /**
+     * Writes a new snapshot and empties the log.  Changes wait while the
+     * snapshot is written; lookups do not.  After a failed log flush this
+     * is how the tree becomes writable again, since the snapshot covers
+     * every change the log was refusing.
+     *
+     * @throws runtime_error if the snapshot can not be written
+     * @throws system_error if the snapshot can not be synced or renamed
+     */
+    void Checkpoint() {
+        std::lock_guard<std::mutex> checkpoint_lock(checkpoint_mutex_);
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        std::string temp_path = snapshot_path_ + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            tree_.Save(out);
+            out.close();
+            if (!out)
+                throw std::runtime_error("! Failed to write snapshot !");
+        }
+        SyncPath(temp_path);
+        if (std::rename(temp_path.c_str(), snapshot_path_.c_str()) != 0)
+            throw std::system_error(errno, std::generic_category(), temp_path);
+        std::string::size_type slash = snapshot_path_.rfind('/');
+        SyncPath(slash == std::string::npos ? std::string(".")
+            : snapshot_path_.substr(0, slash + 1));
+        log_.Truncate();
+    }
+
+ private:
+    /**
+     * Loads the snapshot at snapshot_path, if there is one, and replays the
+     * log at log_path on top of it.
+     */
+    static AVLTree<TKey, TValue> LoadSnapshot(const std::string &snapshot_path,
+            const std::string &log_path) {
+        AVLTree<TKey, TValue> tree;
+        std::ifstream in(snapshot_path, std::ios::binary);
+        if (in) tree = AVLTree<TKey, TValue>::Load(in);
+
+        WriteAheadLog<TKey, TValue>::Replay(log_path,
+            [&tree](const AVLTreeOperation<TKey, TValue> &op) {
+                if (op.type != AVLTreeOperationType::Remove)
+                    tree.InsertOrAssign(op.key, op.value);
+                else if (tree.Contains(op.key))
+                    tree.Remove(op.key);
+            });
+        return tree;
+    }
+
+    /**
+     * fsyncs the file or directory at path.
+     */
+    static void SyncPath(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+        int result = fsync(fd);
+        int error = errno;
+        close(fd);
+        if (result != 0)
+            throw std::system_error(error, std::generic_category(), path);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_DURABLEAVLTREE_H_
@@ -0,0 +1,287 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_EPOCHRECLAMATION_H_
+#define SRC_EPOCHRECLAMATION_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "ThreadRegistry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Epoch based memory reclamation (Fraser, "Practical lock-freedom").
+ *
+ * Readers Pin the manager for as long as they hold pointers into a shared
+ * structure.  Pinning only publishes the current global epoch in the
+ * thread's record, so the read path never blocks and never frees memory.
+ *
+ * Writers Retire objects they have unlinked instead of freeing them.  Each
+ * retired object is tagged with the global epoch and parked on the retiring
+ * thread's limbo list.  The global epoch only advances once every pinned
+ * thread has observed it, so an object retired in epoch e can no longer be
+ * reached by anyone once the global epoch reaches e + 2.  Retire
+ * periodically tries to advance the epoch and frees what has become safe.
+ *
+ * Objects are released through a deleter and context pointer, so a node
+ * pool can take retired nodes back instead of deleting them.
+ *
+ * When a thread exits, whatever it retired that is not yet free moves to
+ * a shared orphan list, which the next thread to collect frees as it
+ * becomes safe, and its record is reused by a later thread.  A manager
+ * must not be destroyed while threads that used it are exiting.
+ */
+class EpochManager {
+ public:
+    /**
+     * Function that releases a retired object.
+     *
+     * @param context Context pointer given to Retire.
+     * @param object Object being released.
+     */
+    using Deleter = void (*)(void *context, void *object);
+
+ private:
+    static constexpr std::uint64_t kPinned = 1;
+    static constexpr std::size_t kCollectInterval = 64;
+
+    struct Retired {
+        void *object;
+        Deleter deleter;
+        void *context;
+        std::uint64_t epoch;
+    };
+
+    /**
+     * Per thread state.  state is (epoch << 1) | kPinned while pinned, 0
+     * otherwise.  Everything else is only touched by the owning thread.
+     */
+    struct Record {
+        std::atomic<std::uint64_t> state{0};
+        int pin_depth = 0;
+        std::size_t retires_since_collect = 0;
+        std::vector<Retired> limbo;
+    };
+
+    std::atomic<std::uint64_t> global_epoch_;
+    // Limbo lists of exited threads.
+    std::mutex orphans_mutex_;
+    std::vector<Retired> orphans_;
+    std::atomic<bool> has_orphans_;
+    ThreadRegistry<Record> records_;
+
+ public:
+    /**
+     * RAII pin on an EpochManager.  Objects reachable when the guard was
+     * created are not freed until it is destroyed.
+     */
+    class Guard {
+     public:
+        explicit Guard(EpochManager *manager) : manager_(manager) {
+            manager_->Enter();
+        }
+        Guard(Guard &&other) : manager_(other.manager_) {
+            other.manager_ = nullptr;
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        Guard& operator=(Guard&&) = delete;
+        ~Guard() {
+            if (manager_ != nullptr) manager_->Exit();
+        }
+
+     private:
+        EpochManager *manager_;
+    };
+
+    EpochManager() : global_epoch_(0), has_orphans_(false),
+        records_(&EpochManager::Orphan, this) {}
+
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    /**
+     * Frees everything still retired.  No thread may be pinned.
+     */
+    ~EpochManager() {
+        records_.ForEach([](Record &record) {
+            for (Retired &retired : record.limbo)
+                retired.deleter(retired.context, retired.object);
+            record.limbo.clear();
+        });
+        for (Retired &retired : orphans_)
+            retired.deleter(retired.context, retired.object);
+    }
+
+    /**
+     * Pins the calling thread.  Pins nest.
+     *
+     * @return Guard that unpins when destroyed.
+     */
+    Guard Pin() { return Guard(this); }
+
+    /**
+     * Retires object, to be deleted with delete once no pinned thread can
+     * still reach it.  The caller must have already unlinked it.
+     */
+    template <typename T>
+    void Retire(T *object) {
+        Retire(object, [](void *, void *o) { delete static_cast<T*>(o); },
+            nullptr);
+    }
+
+    /**
+     * Retires object, to be released with deleter(context, object) once no
+     * pinned thread can still reach it.
+     */
+    void Retire(void *object, Deleter deleter, void *context) {
+        Record *record = records_.Local();
+        record->limbo.push_back(Retired{object, deleter, context,
+            global_epoch_.load(std::memory_order_acquire)});
+        if (++record->retires_since_collect >= kCollectInterval) {
+            record->retires_since_collect = 0;
+            TryAdvance();
+            Collect(record);
+        }
+    }
+
+    /**
+     * Tries to advance the epoch and frees whatever the calling thread has
+     * retired that is now safe.  Normally called from Retire.
+     */
+    void Collect() {
+        TryAdvance();
+        Collect(records_.Local());
+    }
+
+    /**
+     * Returns the number of objects the calling thread has retired that
+     * have not been freed yet.
+     */
+    std::size_t GetPendingCount() { return records_.Local()->limbo.size(); }
+
+    /**
+     * Returns the number of objects retired by exited threads that have
+     * not been freed yet.
+     */
+    std::size_t GetOrphanCount() {
+        std::lock_guard<std::mutex> lock(orphans_mutex_);
+        return orphans_.size();
+    }
+
+    /**
+     * Returns the current global epoch.
+     */
+    std::uint64_t GetEpoch() const {
+        return global_epoch_.load(std::memory_order_relaxed);
+    }
+
+ private:
+    void Enter() {
+        Record *record = records_.Local();
+        if (record->pin_depth++ > 0) return;
+        std::uint64_t epoch = global_epoch_.load(std::memory_order_relaxed);
+        record->state.store((epoch << 1) | kPinned, std::memory_order_relaxed);
+        // The pin must be visible before any shared pointer is read.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void Exit() {
+        Record *record = records_.Local();
+        if (--record->pin_depth > 0) return;
+        record->state.store(0, std::memory_order_release);
+    }
+
+    /**
+     * Advances the global epoch if every pinned thread has observed it.
+     */
+    void TryAdvance() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+        bool behind = false;
+        records_.ForEach([epoch, &behind](Record &record) {
+            std::uint64_t state = record.state.load(std::memory_order_acquire);
+            if ((state & kPinned) != 0 && (state >> 1) != epoch)
+                behind = true;
+        });
+        if (!behind) {
+            global_epoch_.compare_exchange_strong(epoch, epoch + 1,
+                std::memory_order_acq_rel);
+        }
+    }
+
+    /**
+     * Frees the prefix of record's limbo list that is at least two epochs
+     * old.  The list is in retire order, so epochs never decrease along it.
+     */
+    void Collect(Record *record) {
+        std::uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+        std::size_t freed = 0;
+        while (freed < record->limbo.size()
+                && record->limbo[freed].epoch + 2 <= epoch) {
+            Retired &retired = record->limbo[freed];
+            retired.deleter(retired.context, retired.object);
+            freed++;
+        }
+        record->limbo.erase(record->limbo.begin(),
+            record->limbo.begin() + freed);
+        if (has_orphans_.load(std::memory_order_relaxed)) CollectOrphans();
+    }
+
+    /**
+     * Frees the orphans that are at least two epochs old, unless another
+     * thread is already at it.
+     */
+    void CollectOrphans() {
+        std::unique_lock<std::mutex> lock(orphans_mutex_, std::try_to_lock);
+        if (!lock.owns_lock()) return;
+        std::uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+        std::size_t kept = 0;
+        for (Retired &retired : orphans_) {
+            if (retired.epoch + 2 <= epoch) {
+                retired.deleter(retired.context, retired.object);
+            } else {
+                orphans_[kept++] = retired;
+            }
+        }
+        orphans_.resize(kept);
+        has_orphans_.store(kept > 0, std::memory_order_relaxed);
+    }
+
+    /**
+     * Exit hook of records_: moves an exiting thread's limbo list to the
+     * orphans, leaving the record clean for its next owner.
+     */
+    static void Orphan(void *context, Record *record) {
+        EpochManager *manager = static_cast<EpochManager*>(context);
+        record->retires_since_collect = 0;
+        if (record->limbo.empty()) return;
+        std::lock_guard<std::mutex> lock(manager->orphans_mutex_);
+        manager->orphans_.insert(manager->orphans_.end(),
+            record->limbo.begin(), record->limbo.end());
+        record->limbo.clear();
+        manager->has_orphans_.store(true, std::memory_order_relaxed);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_EPOCHRECLAMATION_H_
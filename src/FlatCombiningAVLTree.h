@@ -0,0 +1,313 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_FLATCOMBININGAVLTREE_H_
+#define SRC_FLATCOMBININGAVLTREE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <format>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "AVLTree.h"
+#include "AVLTreeOperation.h"
+#include "ThreadRegistry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Snapshot of the counters of a FlatCombiningAVLTree.  operations /
+ * combines is the average batch size; the closer it is to the number of
+ * writing threads, the more the combining is paying off.
+ */
+struct FlatCombiningAVLTreeStats {
+    std::uint64_t combines;
+    std::uint64_t operations;
+};
+
+/**
+ * Thread safe AVLTree whose writers hand their changes to a single combiner
+ * instead of fighting over a lock (Hendler, Incze, Shavit and Tzafrir, "Flat
+ * Combining and the Synchronization-Parallelism Tradeoff").
+ *
+ * Each writer publishes its operation in its own slot, then tries to become
+ * the combiner.  The combiner collects every pending slot, sorts the batch
+ * by key and applies it with AVLTree::ApplyBatch, so overlapping paths are
+ * walked and rebalanced once, all from one core's cache.  Writers that lose
+ * the race spin on their own slot until it is marked done.  Between spins
+ * they only read a combiner flag, and only try to claim it, with growing
+ * backoff, once it reads as free, so waiting never bounces the lock's cache
+ * line between cores.
+ *
+ * Readers take the combiner lock shared, so lookups run in parallel with
+ * each other but not with a batch.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >.
+ * @param <TValue>
+ *            Generic type representing the data being stored.
+ */
+template <class TKey, class TValue>
+class FlatCombiningAVLTree {
+ private:
+    static constexpr int kEmpty = 0;
+    static constexpr int kPending = 1;
+    static constexpr int kDone = 2;
+    // Longest run of spins on a slot between attempts to become combiner.
+    static constexpr int kMaxBackoff = 1024;
+
+    /**
+     * A thread's published operation.  op is written by the owner before
+     * state becomes kPending, and op and error by the combiner before state
+     * becomes kDone.  error is set if the batch holding op threw.
+     */
+    struct alignas(64) Slot {
+        std::atomic<int> state{kEmpty};
+        AVLTreeOperation<TKey, TValue> op;
+        std::exception_ptr error;
+    };
+
+    AVLTree<TKey, TValue> tree_;
+    mutable std::shared_mutex mutex_;
+    // Set while some writer is combining, on its own cache line so waiters
+    // can read it without touching mutex_.
+    alignas(64) std::atomic<bool> combining_{false};
+    ThreadRegistry<Slot> slots_;
+
+    std::atomic<std::uint64_t> combines_;
+    std::atomic<std::uint64_t> operations_;
+
+ public:
+    /**
+     * Creates a new, empty, FlatCombiningAVLTree.
+     */
+    FlatCombiningAVLTree() {
+        combines_ = 0;
+        operations_ = 0;
+    }
+
+    FlatCombiningAVLTree(const FlatCombiningAVLTree&) = delete;
+    FlatCombiningAVLTree& operator=(const FlatCombiningAVLTree&) = delete;
+
+    /**
+     * Returns the number of elements in the tree.
+     */
+    int GetCount() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return tree_.GetCount();
+    }
+
+    /**
+     * Looks up the value stored at key.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return tree_.Find(key);
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return tree_.Contains(key);
+    }
+
+    /**
+     * Calls func for every node in key order, between batches.  func must
+     * not call back into this tree.
+     *
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        tree_.ForEach(func);
+    }
+
+    /**
+     * Add a key/value pair to the tree.
+     *
+     * @throws std::range_error if key is already present.
+     */
+    void Add(TKey key, TValue value) {
+        AVLTreeOperation<TKey, TValue> op =
+            Apply({AVLTreeOperationType::Add, key, value});
+        if (!op.applied)
+            throw std::range_error("! Key already exists in Tree !");
+    }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        Apply({AVLTreeOperationType::InsertOrAssign, key, value});
+    }
+
+    /**
+     * Remove an entry from the tree.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        AVLTreeOperation<TKey, TValue> op =
+            Apply({AVLTreeOperationType::Remove, key});
+        if (!op.applied)
+            throw std::range_error
+                (std::format("! Key {} not present in Tree !", key));
+        return MapEntry<TKey, TValue>(op.key, op.value);
+    }
+
+    /**
+     * Returns the combining counters.
+     */
+    FlatCombiningAVLTreeStats GetStats() const {
+        return FlatCombiningAVLTreeStats{
+            combines_.load(std::memory_order_relaxed),
+            operations_.load(std::memory_order_relaxed)};
+    }
+
+    /**
+     * Sets every counter back to zero.
+     */
+    void ResetStats() {
+        combines_ = 0;
+        operations_ = 0;
+    }
+
+ private:
+    /**
+     * Publishes op in the calling thread's slot and waits until some
+     * combiner, possibly this thread, has applied it.
+     *
+     * @return op with applied, and for Remove value, filled in.
+     *
+     * @throws whatever the tree threw while applying the batch holding op.
+     */
+    AVLTreeOperation<TKey, TValue> Apply(AVLTreeOperation<TKey, TValue> op) {
+        Slot *slot = slots_.Local();
+        slot->op = op;
+        slot->state.store(kPending, std::memory_order_release);
+
+        int backoff = 1;
+        while (slot->state.load(std::memory_order_acquire) != kDone) {
+            if (TryCombine()) {
+                backoff = 1;
+                continue;
+            }
+            for (int i = 0; i < backoff; i++) {
+                if (slot->state.load(std::memory_order_acquire) == kDone)
+                    break;
+            }
+            if (backoff < kMaxBackoff) {
+                backoff *= 2;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+
+        slot->state.store(kEmpty, std::memory_order_relaxed);
+        if (slot->error) {
+            std::exception_ptr error = slot->error;
+            slot->error = nullptr;
+            std::rethrow_exception(error);
+        }
+        return slot->op;
+    }
+
+    /**
+     * Becomes the combiner and runs one Combine, if no one else is
+     * combining.  The flag is read before it is claimed, so a writer only
+     * writes to it when it is likely to win.
+     *
+     * @return true if this thread combined.
+     */
+    bool TryCombine() {
+        if (combining_.load(std::memory_order_relaxed)) return false;
+        bool expected = false;
+        if (!combining_.compare_exchange_strong(expected, true,
+                std::memory_order_acquire, std::memory_order_relaxed))
+            return false;
+        try {
+            // Waits out any readers holding mutex_ shared.
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            Combine();
+        } catch (...) {
+            combining_.store(false, std::memory_order_release);
+            throw;
+        }
+        combining_.store(false, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Applies every pending slot as one batch.  Called with mutex_ held
+     * exclusively.  If the batch throws, every slot in it is marked done
+     * with the exception, for its owner to rethrow, rather than being left
+     * pending with no combiner to finish it.
+     */
+    void Combine() {
+        std::vector<Slot*> pending;
+        try {
+            slots_.ForEach([&pending](Slot &slot) {
+                if (slot.state.load(std::memory_order_acquire) == kPending)
+                    pending.push_back(&slot);
+            });
+            if (pending.empty()) return;
+
+            // Operations from different threads on one key are concurrent,
+            // so any order among them is a valid one.
+            std::sort(pending.begin(), pending.end(),
+                [](const Slot *a, const Slot *b) {
+                    return a->op.key < b->op.key;
+                });
+
+            std::vector<AVLTreeOperation<TKey, TValue>> batch;
+            batch.reserve(pending.size());
+            for (Slot *slot : pending) batch.push_back(slot->op);
+
+            tree_.ApplyBatch(batch);
+
+            for (std::size_t i = 0; i < pending.size(); i++)
+                pending[i]->op = batch[i];
+        } catch (...) {
+            for (Slot *slot : pending) slot->error = std::current_exception();
+        }
+
+        for (Slot *slot : pending)
+            slot->state.store(kDone, std::memory_order_release);
+
+        combines_.fetch_add(1, std::memory_order_relaxed);
+        operations_.fetch_add(pending.size(), std::memory_order_relaxed);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_FLATCOMBININGAVLTREE_H_
@@ -0,0 +1,236 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_IOURING_H_
+#define SRC_IOURING_H_
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace _11c_dev_collections {
+
+/**
+ * Minimal io_uring submission and completion queue pair for file reads,
+ * driven by the raw io_uring_setup and io_uring_enter system calls so that
+ * no liburing is needed.
+ *
+ * Reads are queued with QueueRead, handed to the kernel in one system call
+ * by Submit, and their results collected with Reap.  If the kernel does not
+ * support io_uring, or a seccomp policy forbids it, IsAvailable returns
+ * false and the caller should fall back to pread.
+ *
+ * Not thread safe.
+ */
+class IoUring {
+ private:
+    int fd_;
+    unsigned int sq_entries_;
+    unsigned int cq_entries_;
+    unsigned int queued_;     // SQEs queued but not yet submitted
+    unsigned int in_flight_;  // submitted or queued, not yet reaped
+
+    void *sq_ring_;
+    std::size_t sq_ring_size_;
+    void *cq_ring_;
+    std::size_t cq_ring_size_;
+    io_uring_sqe *sqes_;
+    std::size_t sqes_size_;
+
+    unsigned int *sq_head_;
+    unsigned int *sq_tail_;
+    unsigned int sq_mask_;
+    unsigned int *sq_array_;
+    unsigned int *cq_head_;
+    unsigned int *cq_tail_;
+    unsigned int cq_mask_;
+    io_uring_cqe *cqes_;
+
+ public:
+    /**
+     * Sets up a ring with room for entries submissions.  Check IsAvailable
+     * before use.
+     */
+    explicit IoUring(unsigned int entries) : fd_(-1), sq_entries_(0),
+        cq_entries_(0), queued_(0), in_flight_(0), sq_ring_(MAP_FAILED),
+        sq_ring_size_(0), cq_ring_(MAP_FAILED), cq_ring_size_(0),
+        sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)), sqes_size_(0) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) return;
+        if (!Map(params)) {
+            Unmap();
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        if (fd_ < 0) return;
+        Unmap();
+        close(fd_);
+    }
+
+    bool IsAvailable() const { return fd_ >= 0; }
+
+    /**
+     * Returns the number of reads queued or submitted and not yet reaped.
+     */
+    unsigned int GetInFlight() const { return in_flight_; }
+
+    /**
+     * Queues a read of size bytes at offset of fd into buffer, tagged with
+     * user_data.  Not started until Submit.
+     *
+     * @return false if the ring is full; reap some completions first.
+     */
+    bool QueueRead(int fd, void *buffer, unsigned int size,
+            std::uint64_t offset, std::uint64_t user_data) {
+        // Never have more outstanding than the completion queue can hold.
+        if (in_flight_ >= cq_entries_) return false;
+        unsigned int tail = *sq_tail_;
+        unsigned int head = std::atomic_ref<unsigned int>(*sq_head_)
+            .load(std::memory_order_acquire);
+        if (tail - head >= sq_entries_) return false;
+
+        unsigned int index = tail & sq_mask_;
+        io_uring_sqe *sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(buffer);
+        sqe->len = size;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array_[index] = index;
+        std::atomic_ref<unsigned int>(*sq_tail_).store(tail + 1,
+            std::memory_order_release);
+        queued_++;
+        in_flight_++;
+        return true;
+    }
+
+    /**
+     * Hands every queued read to the kernel and, if wait, blocks until at
+     * least one completion is available.
+     *
+     * @return 0, or the errno of io_uring_enter.
+     */
+    int Submit(bool wait) {
+        while (queued_ > 0 || wait) {
+            unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+            long result = syscall(__NR_io_uring_enter, fd_, queued_,
+                wait ? 1 : 0, flags, nullptr, 0);
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                return errno;
+            }
+            queued_ -= std::min(queued_, static_cast<unsigned int>(result));
+            if (wait || result == 0) return 0;
+        }
+        return 0;
+    }
+
+    /**
+     * Takes one completion off the completion queue.
+     *
+     * @param *user_data receives the tag passed to QueueRead.
+     * @param *result receives the byte count read, or -errno.
+     *
+     * @return false if no completion is available.
+     */
+    bool Reap(std::uint64_t *user_data, int *result) {
+        unsigned int head = *cq_head_;
+        unsigned int tail = std::atomic_ref<unsigned int>(*cq_tail_)
+            .load(std::memory_order_acquire);
+        if (head == tail) return false;
+        const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+        *user_data = cqe.user_data;
+        *result = cqe.res;
+        std::atomic_ref<unsigned int>(*cq_head_).store(head + 1,
+            std::memory_order_release);
+        in_flight_--;
+        return true;
+    }
+
+ private:
+    template <typename T>
+    static T* At(void *ring, std::uint32_t offset) {
+        return reinterpret_cast<T*>(static_cast<unsigned char*>(ring)
+            + offset);
+    }
+
+    bool Map(const io_uring_params &params) {
+        sq_entries_ = params.sq_entries;
+        cq_entries_ = params.cq_entries;
+        sq_ring_size_ = params.sq_off.array
+            + params.sq_entries * sizeof(unsigned int);
+        cq_ring_size_ = params.cq_off.cqes
+            + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single)
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_,
+                cq_ring_size_);
+
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) return false;
+        if (!single) {
+            cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED) return false;
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size_,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+            IORING_OFF_SQES));
+        if (sqes_ == MAP_FAILED) return false;
+
+        void *cq_ring = single ? sq_ring_ : cq_ring_;
+        sq_head_ = At<unsigned int>(sq_ring_, params.sq_off.head);
+        sq_tail_ = At<unsigned int>(sq_ring_, params.sq_off.tail);
+        sq_mask_ = *At<unsigned int>(sq_ring_, params.sq_off.ring_mask);
+        sq_array_ = At<unsigned int>(sq_ring_, params.sq_off.array);
+        cq_head_ = At<unsigned int>(cq_ring, params.cq_off.head);
+        cq_tail_ = At<unsigned int>(cq_ring, params.cq_off.tail);
+        cq_mask_ = *At<unsigned int>(cq_ring, params.cq_off.ring_mask);
+        cqes_ = At<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+        return true;
+    }
+
+    void Unmap() {
+        if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+        if (cq_ring_ != MAP_FAILED) munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_IOURING_H_
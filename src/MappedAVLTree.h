@@ -0,0 +1,553 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_MAPPEDAVLTREE_H_
+#define SRC_MAPPEDAVLTREE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "AVLTree.h"
+#include "MapEntry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Read only AVL tree served straight from a memory mapped file.
+ *
+ * The file is the tree: a one page header followed by an array of fixed
+ * size nodes, each holding its key, its value, and its children as indexes
+ * into the node array rather than pointers, so the file means the same
+ * thing wherever it is mapped.  Open maps the file and checks the header,
+ * which is O(1) whatever the size of the file; lookups then fault in only
+ * the pages on their path.
+ *
+ * Write lays the nodes out in breadth first (Eytzinger) order, so the top
+ * levels of the tree, which every lookup visits, share the first few pages
+ * and stay resident.  The node array starts on a page boundary.
+ *
+ * Add, InsertOrAssign and Remove go to an in memory overlay that shadows
+ * the mapping, with removals kept as tombstones, so the file is never
+ * written to.  Save writes the merged view out as a new file.
+ *
+ * Keys and values are stored as raw bytes, so both must be trivially
+ * copyable, and files are only readable on machines with the same byte
+ * order and type sizes, which Open checks.  Child indexes are checked as
+ * they are followed, and a lookup or walk that meets one outside the file,
+ * or a cycle, throws runtime_error.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >, and be trivially copyable.
+ * @param <TValue>
+ *            Generic type representing the data being stored.  Must be
+ *            trivially copyable.
+ */
+template <class TKey, class TValue>
+class MappedAVLTree {
+    static_assert(std::is_trivially_copyable_v<TKey>,
+        "MappedAVLTree keys must be trivially copyable");
+    static_assert(std::is_trivially_copyable_v<TValue>,
+        "MappedAVLTree values must be trivially copyable");
+
+ private:
+    static constexpr std::uint64_t kNone = ~std::uint64_t{0};
+    static constexpr std::size_t kHeaderSize = 4096;
+    static constexpr char kMagic[8] = {'1', '1', 'c', 'A', 'V', 'L', 'M',
+        '\0'};
+    static constexpr std::uint32_t kVersion = 1;
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;  // 0 little endian, 1 big endian
+        std::uint32_t key_size;
+        std::uint32_t value_size;
+        std::uint32_t node_size;
+        std::uint32_t reserved;
+        std::uint64_t count;
+        std::uint64_t root;  // index of the root node, kNone if empty
+    };
+
+    /**
+     * Node as stored in the file.  Children are indexes into the node
+     * array, kNone if absent.
+     */
+    struct Node {
+        TKey key;
+        TValue value;
+        std::uint64_t left;
+        std::uint64_t right;
+    };
+
+    const unsigned char *mapping_;
+    std::size_t mapping_size_;
+    const Node *nodes_;
+    std::uint64_t root_;
+    int base_count_;
+
+    // Overlay of updates made since Open; nullopt is a tombstone.
+    AVLTree<TKey, std::optional<TValue>> overlay_;
+    int count_;
+
+ public:
+    /**
+     * Maps the file at path.  Costs the same whatever the size of the file.
+     *
+     * @throws system_error if the file can not be opened or mapped
+     * @throws runtime_error if the file is not a MappedAVLTree file for
+     *          these key and value types
+     */
+    static MappedAVLTree Open(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+
+        struct stat status;
+        if (fstat(fd, &status) != 0) {
+            int error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+        std::size_t size = static_cast<std::size_t>(status.st_size);
+        if (size < kHeaderSize) {
+            close(fd);
+            throw std::runtime_error("! Not a MappedAVLTree file !");
+        }
+
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        int error = errno;
+        close(fd);
+        if (mapping == MAP_FAILED)
+            throw std::system_error(error, std::generic_category(), path);
+
+        MappedAVLTree tree(static_cast<const unsigned char*>(mapping), size);
+        tree.Validate();
+        // Lookups jump around the file; read ahead would only waste memory.
+        madvise(mapping, size, MADV_RANDOM);
+        return tree;
+    }
+
+    /**
+     * Writes tree to a new file at path in the MappedAVLTree format,
+     * replacing any file already there only once the new one is on disk.
+     *
+     * @throws system_error if the file can not be written
+     */
+    static void Write(const std::string &path,
+            const AVLTree<TKey, TValue> &tree) {
+        WriteFile(path, tree.GetCount(), [&tree](auto emit) {
+            tree.ForEach([&emit](const AVLTreeNode<TKey, TValue> &node) {
+                emit(node.GetKey(), node.GetValue());
+            });
+        });
+    }
+
+    MappedAVLTree(MappedAVLTree &&other) noexcept
+        : mapping_(std::exchange(other.mapping_, nullptr)),
+          mapping_size_(std::exchange(other.mapping_size_, 0)),
+          nodes_(other.nodes_), root_(other.root_),
+          base_count_(other.base_count_),
+          overlay_(std::move(other.overlay_)), count_(other.count_) {}
+
+    MappedAVLTree(const MappedAVLTree&) = delete;
+    MappedAVLTree& operator=(const MappedAVLTree&) = delete;
+    MappedAVLTree& operator=(MappedAVLTree&&) = delete;
+
+    ~MappedAVLTree() {
+        if (mapping_ != nullptr)
+            munmap(const_cast<unsigned char*>(mapping_), mapping_size_);
+    }
+
+    /**
+     * Returns the number of elements in the tree, overlay included.
+     */
+    int GetCount() const { return count_; }
+
+    /**
+     * Returns the number of entries in the overlay, tombstones included.
+     */
+    int GetOverlayCount() const { return overlay_.GetCount(); }
+
+    /**
+     * Looks up the value stored at key, in the overlay and then in the
+     * mapping.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) const {
+        std::optional<std::optional<TValue>> shadow = overlay_.Find(key);
+        if (shadow.has_value()) return *shadow;
+
+        std::uint64_t index = root_;
+        std::uint64_t steps = 0;
+        while (index != kNone) {
+            CountStep(&steps);
+            const Node &node = At(index);
+            if (key == node.key) return node.value;
+            index = key < node.key ? node.left : node.right;
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) const { return Find(key).has_value(); }
+
+    /**
+     * Calls func for every entry, in key order.
+     *
+     * @param func Callable taking a const MapEntry<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) const {
+        std::vector<std::pair<TKey, std::optional<TValue>>> shadows;
+        overlay_.ForEach(
+            [&shadows](const AVLTreeNode<TKey, std::optional<TValue>> &n) {
+                shadows.emplace_back(n.GetKey(), n.GetValue());
+            });
+        Merge(nullptr, nullptr, shadows, func);
+    }
+
+    /**
+     * Copies every entry with low <= key <= high out of the tree, in key
+     * order.
+     *
+     * @param low Smallest key to return.
+     * @param high Largest key to return.
+     *
+     * @return Entries in range, ordered by key.
+     */
+    std::vector<MapEntry<TKey, TValue>> Range(TKey low, TKey high) const {
+        std::vector<std::pair<TKey, std::optional<TValue>>> shadows;
+        overlay_.Range(low, high,
+            [&shadows](const AVLTreeNode<TKey, std::optional<TValue>> &n) {
+                shadows.emplace_back(n.GetKey(), n.GetValue());
+            });
+
+        std::vector<MapEntry<TKey, TValue>> result;
+        Merge(&low, &high, shadows,
+            [&result](const MapEntry<TKey, TValue> &entry) {
+                result.push_back(entry);
+            });
+        return result;
+    }
+
+    /**
+     * Add a key/value pair to the overlay.
+     *
+     * @throws std::range_error if key is already present.
+     */
+    void Add(TKey key, TValue value) {
+        if (Contains(key))
+            throw std::range_error("! Key already exists in Tree !");
+        overlay_.InsertOrAssign(key, value);
+        count_++;
+    }
+
+    /**
+     * Add a key/value pair to the overlay, or replace the value if key is
+     * already present.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        if (!Contains(key)) count_++;
+        overlay_.InsertOrAssign(key, value);
+    }
+
+    /**
+     * Remove an entry, by shadowing it with a tombstone in the overlay.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        std::optional<TValue> value = Find(key);
+        if (!value.has_value()) {
+            throw std::range_error
+                (std::format("! Key {} not present in Tree !", key));
+        }
+        overlay_.InsertOrAssign(key, std::nullopt);
+        count_--;
+        return MapEntry<TKey, TValue>(key, *value);
+    }
+
+    /**
+     * Writes the tree, overlay included, to a new file at path.  path may
+     * be the file this tree was opened from: the new file replaces it by
+     * rename, so this tree keeps reading the old one.
+     *
+     * @throws system_error if the file can not be written
+     */
+    void Save(const std::string &path) const {
+        WriteFile(path, count_, [this](auto emit) {
+            ForEach([&emit](const MapEntry<TKey, TValue> &entry) {
+                emit(entry.key, entry.value);
+            });
+        });
+    }
+
+ private:
+    MappedAVLTree(const unsigned char *mapping, std::size_t size)
+        : mapping_(mapping), mapping_size_(size),
+          nodes_(reinterpret_cast<const Node*>(mapping + kHeaderSize)),
+          root_(kNone), base_count_(0), count_(0) {}
+
+    static std::uint32_t ByteOrder() {
+        return std::endian::native == std::endian::little ? 0 : 1;
+    }
+
+    /**
+     * Checks the header against these types and the file size.
+     */
+    void Validate() {
+        Header header;
+        std::memcpy(&header, mapping_, sizeof(header));
+        if (!std::equal(header.magic, header.magic + sizeof(kMagic), kMagic)
+                || header.version != kVersion)
+            throw std::runtime_error("! Not a MappedAVLTree file !");
+        if (header.byte_order != ByteOrder()
+                || header.key_size != sizeof(TKey)
+                || header.value_size != sizeof(TValue)
+                || header.node_size != sizeof(Node)) {
+            throw std::runtime_error
+                ("! File was written for different key or value types !");
+        }
+        if (header.count > static_cast<std::uint64_t>(INT32_MAX)
+                || header.count > (mapping_size_ - kHeaderSize) / sizeof(Node)
+                || (header.count == 0) != (header.root == kNone)
+                || (header.root != kNone && header.root >= header.count))
+            throw std::runtime_error("! MappedAVLTree file is truncated !");
+
+        root_ = header.root;
+        base_count_ = static_cast<int>(header.count);
+        count_ = base_count_;
+    }
+
+    /**
+     * Returns the node at index, which was read from the file.
+     *
+     * @throws runtime_error if index is outside the node array
+     */
+    const Node& At(std::uint64_t index) const {
+        if (index >= static_cast<std::uint64_t>(base_count_))
+            throw std::runtime_error("! MappedAVLTree file is corrupt !");
+        return nodes_[index];
+    }
+
+    /**
+     * Counts one more node visited by a walk that visits each node at most
+     * once in a well formed file, so a cycle of child indexes ends in an
+     * error instead of a walk that never ends.
+     *
+     * @throws runtime_error if more nodes were visited than the file holds
+     */
+    void CountStep(std::uint64_t *steps) const {
+        if (++*steps > static_cast<std::uint64_t>(base_count_))
+            throw std::runtime_error("! MappedAVLTree file is corrupt !");
+    }
+
+    /**
+     * Calls func for every entry of the mapping with low <= key <= high,
+     * merged with shadows, the overlay entries in that range in key order.
+     * A null bound is open.
+     */
+    template <typename Func>
+    void Merge(const TKey *low, const TKey *high,
+            const std::vector<std::pair<TKey, std::optional<TValue>>> &shadows,
+            Func &&func) const {
+        auto call = [&func](const TKey &key, const TValue &value) {
+            const MapEntry<TKey, TValue> entry(key, value);
+            func(entry);
+        };
+        std::size_t next = 0;
+        auto emit_shadows_before = [&](const TKey *key) {
+            while (next < shadows.size()
+                    && (key == nullptr || shadows[next].first < *key)) {
+                if (shadows[next].second.has_value()) {
+                    call(shadows[next].first, *shadows[next].second);
+                }
+                next++;
+            }
+        };
+
+        std::vector<std::uint64_t> my_stack;
+        std::uint64_t index = root_;
+        std::uint64_t steps = 0;
+        while (index != kNone || !my_stack.empty()) {
+            while (index != kNone) {
+                CountStep(&steps);
+                const Node &node = At(index);
+                if (low != nullptr && node.key < *low) {
+                    index = node.right;
+                } else {
+                    my_stack.push_back(index);
+                    index = node.left;
+                }
+            }
+            if (my_stack.empty()) break;
+            index = my_stack.back(); my_stack.pop_back();
+            const Node &node = nodes_[index];
+            if (high != nullptr && *high < node.key) break;
+
+            emit_shadows_before(&node.key);
+            if (next < shadows.size() && shadows[next].first == node.key) {
+                if (shadows[next].second.has_value()) {
+                    call(node.key, *shadows[next].second);
+                }
+                next++;
+            } else {
+                call(node.key, node.value);
+            }
+            index = node.right;
+        }
+        emit_shadows_before(nullptr);
+    }
+
+    /**
+     * Writes count entries, produced in key order by each(emit), to a new
+     * file at path.  The file is sized up front and filled through a
+     * writable mapping: the i-th entry in key order goes to the node that
+     * an in order walk of the implicit complete tree over [0, count) visits
+     * i-th, which gives the breadth first layout in one streaming pass.
+     */
+    template <typename Each>
+    static void WriteFile(const std::string &path, int count, Each each) {
+        // Built beside path and renamed over it, so a process with the old
+        // file mapped keeps reading the old file, and a crash part way
+        // through leaves the old file whole.
+        std::string temp_path = path + ".tmp";
+        int fd = open(temp_path.c_str(),
+            O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), temp_path);
+
+        std::uint64_t n = static_cast<std::uint64_t>(count);
+        std::size_t size = kHeaderSize + n * sizeof(Node);
+        void *mapping = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+        }
+        if (mapping == MAP_FAILED) {
+            int error = errno;
+            close(fd);
+            unlink(temp_path.c_str());
+            throw std::system_error(error, std::generic_category(), temp_path);
+        }
+
+        try {
+            FillFile(static_cast<unsigned char*>(mapping), n, each);
+            if (msync(mapping, size, MS_SYNC) != 0 || fsync(fd) != 0)
+                throw std::system_error(errno, std::generic_category(),
+                    temp_path);
+        } catch (...) {
+            munmap(mapping, size);
+            close(fd);
+            unlink(temp_path.c_str());
+            throw;
+        }
+        munmap(mapping, size);
+        close(fd);
+
+        if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+            int error = errno;
+            unlink(temp_path.c_str());
+            throw std::system_error(error, std::generic_category(), temp_path);
+        }
+        std::string::size_type slash = path.rfind('/');
+        SyncPath(slash == std::string::npos ? std::string(".")
+            : path.substr(0, slash + 1));
+    }
+
+    /**
+     * Writes the header and the n entries produced by each(emit) into the
+     * mapping at bytes.
+     */
+    template <typename Each>
+    static void FillFile(unsigned char *bytes, std::uint64_t n, Each &each) {
+        Node *nodes = reinterpret_cast<Node*>(bytes + kHeaderSize);
+
+        // In order walk of the implicit tree where node i has children
+        // 2i + 1 and 2i + 2.
+        std::vector<std::uint64_t> my_stack;
+        std::uint64_t next = 0;
+        each([&](const TKey &key, const TValue &value) {
+            while (next < n) {
+                my_stack.push_back(next);
+                next = 2 * next + 1;
+            }
+            std::uint64_t index = my_stack.back(); my_stack.pop_back();
+            next = 2 * index + 2;
+
+            Node node;
+            node.key = key;
+            node.value = value;
+            node.left = 2 * index + 1 < n ? 2 * index + 1 : kNone;
+            node.right = 2 * index + 2 < n ? 2 * index + 2 : kNone;
+            std::memcpy(&nodes[index], &node, sizeof(Node));
+        });
+
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.byte_order = ByteOrder();
+        header.key_size = sizeof(TKey);
+        header.value_size = sizeof(TValue);
+        header.node_size = sizeof(Node);
+        header.count = n;
+        header.root = n > 0 ? 0 : kNone;
+        std::memcpy(bytes, &header, sizeof(header));
+    }
+
+    /**
+     * fsyncs the file or directory at path.
+     */
+    static void SyncPath(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+        int result = fsync(fd);
+        int error = errno;
+        close(fd);
+        if (result != 0)
+            throw std::system_error(error, std::generic_category(), path);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_MAPPEDAVLTREE_H_
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_NODEARENA_H_
+#define SRC_NODEARENA_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include "EpochReclamation.h"
+#include "ThreadRegistry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Allocator for the fixed size objects of a concurrent tree, with a cache
+ * per thread so that allocating and freeing never touch shared state in the
+ * common case.
+ *
+ * Each thread carves objects out of chunks it owns and keeps the objects it
+ * frees on a private free list.  Every object remembers the cache it was
+ * carved from.  An object freed by another thread, which is the normal case
+ * for nodes retired through an EpochManager by whichever thread removed
+ * them, is pushed onto its owner's remote free list with one compare and
+ * swap; the owner takes the whole remote list back in one exchange once its
+ * private list runs dry.  New chunks, whose size doubles up to kMaxChunk,
+ * are the only calls to the global allocator.
+ *
+ * When a thread exits, its private free list moves onto its remote list
+ * and the cache is orphaned: a thread whose own lists run dry adopts an
+ * orphan's remote list before carving a new chunk, and the next thread to
+ * start takes the cache over whole.  Objects later freed into an orphan
+ * go to its remote list as before.
+ *
+ * Memory is returned to the system only when the arena is destroyed.
+ * Every object must have been freed, or be freed by an EpochManager that is
+ * destroyed first, before the arena is destroyed, and the arena must not
+ * be destroyed while threads that used it are exiting.
+ *
+ * @param <T> Type of object allocated.
+ */
+template <class T>
+class NodeArena {
+ private:
+    static constexpr std::size_t kMinChunk = 64;
+    static constexpr std::size_t kMaxChunk = 4096;
+
+    struct Cache;
+
+    struct Slot {
+        Cache *owner;
+        Slot *next;
+        alignas(T) unsigned char object[sizeof(T)];
+    };
+
+    struct Cache {
+        Slot *free = nullptr;  // only touched by the owning thread
+        std::atomic<Slot*> remote{nullptr};  // pushed to by other threads
+        std::vector<std::unique_ptr<Slot[]>> chunks;
+        std::size_t next_chunk = kMinChunk;
+        bool orphaned = false;  // on orphans_; guarded by orphans_mutex_
+    };
+
+    // Caches of exited threads, possibly since taken over by new threads.
+    std::mutex orphans_mutex_;
+    std::vector<Cache*> orphans_;
+    std::atomic<bool> has_orphans_;
+    ThreadRegistry<Cache> caches_;
+
+ public:
+    NodeArena() : has_orphans_(false), caches_(&NodeArena::Orphan, this) {}
+
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    /**
+     * Constructs a T from args in memory from the calling thread's cache.
+     */
+    template <typename... Args>
+    T* New(Args&&... args) {
+        Cache *cache = caches_.Local();
+        if (cache->free == nullptr) Refill(cache);
+
+        Slot *slot = cache->free;
+        cache->free = slot->next;
+        try {
+            return new (slot->object) T(std::forward<Args>(args)...);
+        } catch (...) {
+            slot->next = cache->free;
+            cache->free = slot;
+            throw;
+        }
+    }
+
+    /**
+     * Destroys object and returns its memory to the cache it came from.
+     * object must have come from New on this arena.
+     */
+    void Delete(T *object) {
+        if (object == nullptr) return;
+        object->~T();
+
+        Slot *slot = reinterpret_cast<Slot*>(
+            reinterpret_cast<unsigned char*>(object) - offsetof(Slot, object));
+        Cache *owner = slot->owner;
+        if (owner == caches_.Local()) {
+            slot->next = owner->free;
+            owner->free = slot;
+            return;
+        }
+
+        slot->next = owner->remote.load(std::memory_order_relaxed);
+        while (!owner->remote.compare_exchange_weak(slot->next, slot,
+                std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    /**
+     * Retires object to epochs, to be returned to this arena once no pinned
+     * thread can still reach it.
+     */
+    void Retire(EpochManager *epochs, T *object) {
+        epochs->Retire(object, &Reclaim, this);
+    }
+
+ private:
+    /**
+     * EpochManager::Deleter that hands a retired object back to its arena.
+     */
+    static void Reclaim(void *context, void *object) {
+        static_cast<NodeArena*>(context)->Delete(static_cast<T*>(object));
+    }
+
+    /**
+     * Refills cache's free list, from its remote list if anything has been
+     * freed there, else from an orphan's, else from a new chunk.
+     */
+    void Refill(Cache *cache) {
+        cache->free = cache->remote.exchange(nullptr,
+            std::memory_order_acquire);
+        if (cache->free != nullptr) return;
+        if (has_orphans_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(orphans_mutex_);
+            for (Cache *orphan : orphans_) {
+                cache->free = orphan->remote.exchange(nullptr,
+                    std::memory_order_acquire);
+                if (cache->free != nullptr) return;
+            }
+        }
+
+        std::size_t size = cache->next_chunk;
+        cache->next_chunk = std::min(size * 2, kMaxChunk);
+        std::unique_ptr<Slot[]> chunk(new Slot[size]);
+        for (std::size_t i = 0; i < size; i++) {
+            chunk[i].owner = cache;
+            chunk[i].next = i + 1 < size ? &chunk[i + 1] : nullptr;
+        }
+        cache->free = &chunk[0];
+        cache->chunks.push_back(std::move(chunk));
+    }
+
+    /**
+     * Exit hook of caches_: moves an exiting thread's free list onto its
+     * remote list, where other threads can adopt it, and lists the cache
+     * as an orphan.
+     */
+    static void Orphan(void *context, Cache *cache) {
+        NodeArena *arena = static_cast<NodeArena*>(context);
+        if (cache->free != nullptr) {
+            Slot *tail = cache->free;
+            while (tail->next != nullptr) tail = tail->next;
+            tail->next = cache->remote.load(std::memory_order_relaxed);
+            while (!cache->remote.compare_exchange_weak(tail->next,
+                    cache->free, std::memory_order_release,
+                    std::memory_order_relaxed)) {}
+            cache->free = nullptr;
+        }
+        std::lock_guard<std::mutex> lock(arena->orphans_mutex_);
+        if (!cache->orphaned) {
+            cache->orphaned = true;
+            arena->orphans_.push_back(cache);
+        }
+        arena->has_orphans_.store(true, std::memory_order_relaxed);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_NODEARENA_H_
@@ -0,0 +1,896 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_OPTIMISTICAVLTREE_H_
+#define SRC_OPTIMISTICAVLTREE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <format>
+#include <mutex>
+#include <optional>
+#include <stack>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "EpochReclamation.h"
+#include "MapEntry.h"
+#include "NodeArena.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Concurrent AVL Balanced Binary Search Tree with optimistic readers.
+ *
+ * Follows Bronson, Casper, Chafi and Olukotun, "A Practical Concurrent
+ * Binary Search Tree" (PPoPP 2010).  Every node carries a version number and
+ * a lock.  Readers never lock: they read a node's version, follow a child
+ * link, and validate that the version is unchanged, retrying from the
+ * parent otherwise (optimistic hand-over-hand validation).  Writers lock
+ * only the nodes they change, parent before child.  A rotation marks the
+ * node that moves down as shrinking while it relinks, which is the only
+ * change that can invalidate a reader's path.
+ *
+ * Balance is relaxed: removing a node with two children only clears its
+ * value, leaving a routing node that is unlinked later once it has at most
+ * one child.  Heights are repaired bottom up after each change, so the
+ * tree is an AVL tree again whenever it is quiescent.
+ *
+ * Nodes and values come from per-thread NodeArenas.  Those that are
+ * unlinked or replaced are retired to an EpochManager, and handed back to
+ * their arena once no reader can still be looking at them.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >.
+ * @param <TValue>
+ *            Generic type representing the data being stored.
+ */
+template <class TKey, class TValue>
+class OptimisticAVLTree {
+ private:
+    /**
+     * Immutable holder for a value, so a value can be swapped atomically.
+     */
+    struct ValueBox {
+        TValue value;
+    };
+
+    /**
+     * Node of an OptimisticAVLTree.  Height is 1 for a leaf and 0 for an
+     * absent child.  A nullptr value marks a routing node.
+     */
+    struct Node {
+        TKey key;
+        std::atomic<int> height;
+        std::atomic<ValueBox*> value;
+        std::atomic<Node*> parent;
+        std::atomic<std::uint64_t> version;
+        std::atomic<Node*> left;
+        std::atomic<Node*> right;
+        std::mutex lock;
+
+        Node(TKey k, ValueBox *v, Node *p) : key(k), height(1), value(v),
+            parent(p), version(0), left(nullptr), right(nullptr) {}
+    };
+
+    // Version layout: bit 0 unlinked, bit 1 shrinking, remaining bits count
+    // completed shrinks.
+    static constexpr std::uint64_t kUnlinked = 1;
+    static constexpr std::uint64_t kShrinking = 2;
+    static constexpr std::uint64_t kShrinkCountIncrement = 4;
+    static constexpr int kSpinCount = 100;
+
+    // Results of NodeCondition.  Non negative values are a new height.
+    static constexpr int kUnlinkRequired = -1;
+    static constexpr int kRebalanceRequired = -2;
+    static constexpr int kNothingRequired = -3;
+
+    /**
+     * Which updates should happen, given the current value of a key.
+     */
+    enum class UpdateMode { Add, Assign, Remove };
+
+    /**
+     * Result of an attempted read or update.  retry means a concurrent
+     * rotation invalidated the path and the caller must start over from
+     * the parent.
+     */
+    struct Attempt {
+        bool retry;
+        ValueBox *value;
+    };
+
+    Node root_holder_;
+    std::atomic<int> count_;
+
+    // Declared before epochs_, which hands retired objects back to them
+    // when it is destroyed.
+    NodeArena<Node> nodes_;
+    NodeArena<ValueBox> values_;
+    mutable EpochManager epochs_;
+
+ public:
+    /**
+     * Creates a new, empty, OptimisticAVLTree.
+     */
+    OptimisticAVLTree() : root_holder_(TKey(), nullptr, nullptr), count_(0) {}
+
+    OptimisticAVLTree(const OptimisticAVLTree&) = delete;
+    OptimisticAVLTree& operator=(const OptimisticAVLTree&) = delete;
+
+    ~OptimisticAVLTree() {
+        std::stack<Node*> my_stack;
+        if (root_holder_.right != nullptr) my_stack.push(root_holder_.right);
+        while (!my_stack.empty()) {
+            Node *node = my_stack.top(); my_stack.pop();
+            if (node->left != nullptr) my_stack.push(node->left);
+            if (node->right != nullptr) my_stack.push(node->right);
+            values_.Delete(node->value.load());
+            nodes_.Delete(node);
+        }
+    }
+
+    /**
+     * Returns the number of elements in the tree.
+     *
+     * @return Number of elements in the tree.
+     */
+    int GetCount() const { return count_.load(std::memory_order_relaxed); }
+
+    /**
+     * Returns the current height of the tree, counting a single node as 0
+     * like AVLTree does.  Routing nodes are included.
+     *
+     * @return int height of the tree
+     */
+    int GetTreeHieight() const {
+        Node *root = root_holder_.right;
+        return root == nullptr ? 0 : root->height - 1;
+    }
+
+    /**
+     * Looks up the value stored at key.  Takes no locks.
+     *
+     * @param Key Key to locate in the tree.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) const {
+        EpochManager::Guard guard = epochs_.Pin();
+        while (true) {
+            Node *right = root_holder_.right;
+            if (right == nullptr) return std::nullopt;
+
+            int right_cmp = Compare(key, right->key);
+            if (right_cmp == 0) return Unbox(right->value);
+
+            std::uint64_t version = right->version;
+            if (IsShrinkingOrUnlinked(version)) {
+                WaitUntilShrinkCompleted(right, version);
+            } else if (right == root_holder_.right) {
+                Attempt attempt = AttemptFind(key, right, right_cmp, version);
+                if (!attempt.retry) return Unbox(attempt.value);
+            }
+        }
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     *
+     * @param Key Key to locate in the tree.
+     */
+    bool Contains(TKey key) const { return Find(key).has_value(); }
+
+    /**
+     * Add a key/value pair to the tree.
+     *
+     * @throws std::range_error if key is already present.
+     */
+    void Add(TKey key, TValue value) {
+        EpochManager::Guard guard = epochs_.Pin();
+        ValueBox *box = values_.New(ValueBox{value});
+        if (Update(key, UpdateMode::Add, box) != nullptr) {
+            values_.Delete(box);
+            throw std::range_error("! Key already exists in Tree !");
+        }
+    }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        EpochManager::Guard guard = epochs_.Pin();
+        ValueBox *previous = Update(key, UpdateMode::Assign,
+            values_.New(ValueBox{value}));
+        if (previous != nullptr) Retire(previous);
+    }
+
+    /**
+     * Remove an entry from the tree.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        EpochManager::Guard guard = epochs_.Pin();
+        ValueBox *previous = Update(key, UpdateMode::Remove, nullptr);
+        if (previous == nullptr) {
+            throw std::range_error
+                (std::format("! Key {} not present in Tree !", key));
+        }
+        MapEntry<TKey, TValue> map_entry(key, previous->value);
+        Retire(previous);
+        return map_entry;
+    }
+
+ private:
+    static int Compare(const TKey &a, const TKey &b) {
+        if (a < b) return -1;
+        if (a > b) return 1;
+        return 0;
+    }
+
+    static std::optional<TValue> Unbox(const ValueBox *box) {
+        if (box == nullptr) return std::nullopt;
+        return box->value;
+    }
+
+    static int Height(const Node *node) {
+        return node == nullptr ? 0 : node->height.load();
+    }
+
+    static Node* Child(const Node *node, int dir) {
+        return dir < 0 ? node->left.load() : node->right.load();
+    }
+
+    static void SetChild(Node *node, int dir, Node *child) {
+        if (dir < 0)
+            node->left = child;
+        else
+            node->right = child;
+    }
+
+    static bool IsShrinkingOrUnlinked(std::uint64_t version) {
+        return (version & (kShrinking | kUnlinked)) != 0;
+    }
+
+    static bool IsUnlinked(std::uint64_t version) {
+        return (version & kUnlinked) != 0;
+    }
+
+    static std::uint64_t BeginShrink(std::uint64_t version) {
+        return version | kShrinking;
+    }
+
+    static std::uint64_t EndShrink(std::uint64_t version) {
+        return (version & ~(kShrinking | kUnlinked)) + kShrinkCountIncrement;
+    }
+
+    /**
+     * Waits for a rotation in progress at node to finish.  Spins briefly,
+     * then blocks on the node's lock, which the rotating thread holds.
+     */
+    static void WaitUntilShrinkCompleted(Node *node, std::uint64_t version) {
+        if ((version & kShrinking) == 0) return;
+        for (int i = 0; i < kSpinCount; i++) {
+            if (node->version != version) return;
+        }
+        std::lock_guard<std::mutex> guard(node->lock);
+    }
+
+    /**
+     * Optimistic descent below node.  version is the version of node
+     * observed when the caller followed the link to node.
+     */
+    Attempt AttemptFind(const TKey &key, Node *node, int dir,
+            std::uint64_t version) const {
+        while (true) {
+            Node *child = Child(node, dir);
+
+            if (child == nullptr) {
+                if (node->version != version) return Attempt{true, nullptr};
+                return Attempt{false, nullptr};
+            }
+
+            int child_cmp = Compare(key, child->key);
+            if (child_cmp == 0) return Attempt{false, child->value};
+
+            std::uint64_t child_version = child->version;
+            if (IsShrinkingOrUnlinked(child_version)) {
+                WaitUntilShrinkCompleted(child, child_version);
+                if (node->version != version) return Attempt{true, nullptr};
+                // else RETRY from node
+            } else if (child != Child(node, dir)) {
+                if (node->version != version) return Attempt{true, nullptr};
+                // else RETRY from node
+            } else {
+                if (node->version != version) return Attempt{true, nullptr};
+                // The link node --> child was valid while child_version was
+                // current, so the descent no longer depends on node.
+                Attempt attempt = AttemptFind(key, child, child_cmp,
+                    child_version);
+                if (!attempt.retry) return attempt;
+                // else RETRY from node
+            }
+        }
+    }
+
+    /**
+     * Applies an update to key.
+     *
+     * @return Previous value, or nullptr if key was not present.
+     */
+    ValueBox* Update(const TKey &key, UpdateMode mode, ValueBox *value) {
+        while (true) {
+            Node *right = root_holder_.right;
+            if (right == nullptr) {
+                if (mode == UpdateMode::Remove) return nullptr;
+                if (AttemptInsertIntoEmpty(key, value)) {
+                    count_++;
+                    return nullptr;
+                }
+                // else RETRY
+            } else {
+                std::uint64_t version = right->version;
+                if (IsShrinkingOrUnlinked(version)) {
+                    WaitUntilShrinkCompleted(right, version);
+                } else if (right == root_holder_.right) {
+                    Attempt attempt = AttemptUpdate(key, mode, value,
+                        &root_holder_, right, version);
+                    if (!attempt.retry) return attempt.value;
+                    // else RETRY
+                }
+            }
+        }
+    }
+
+    bool AttemptInsertIntoEmpty(const TKey &key, ValueBox *value) {
+        std::lock_guard<std::mutex> guard(root_holder_.lock);
+        if (root_holder_.right != nullptr) return false;
+        root_holder_.right = nodes_.New(key, value, &root_holder_);
+        root_holder_.height = 2;
+        return true;
+    }
+
+    /**
+     * Optimistic descent for an update, locking only once the node to
+     * change is found.
+     */
+    Attempt AttemptUpdate(const TKey &key, UpdateMode mode, ValueBox *value,
+            Node *parent, Node *node, std::uint64_t version) {
+        int cmp = Compare(key, node->key);
+        if (cmp == 0) return AttemptNodeUpdate(mode, value, parent, node);
+
+        while (true) {
+            Node *child = Child(node, cmp);
+
+            if (node->version != version) return Attempt{true, nullptr};
+
+            if (child == nullptr) {
+                if (mode == UpdateMode::Remove) return Attempt{false, nullptr};
+
+                Node *damaged = nullptr;
+                {
+                    std::lock_guard<std::mutex> guard(node->lock);
+                    // Holding the lock, no further rotations can move node.
+                    if (node->version != version)
+                        return Attempt{true, nullptr};
+                    if (Child(node, cmp) != nullptr) continue;  // lost a race
+
+                    SetChild(node, cmp, nodes_.New(key, value, node));
+                    count_++;
+                    damaged = FixHeight(node);
+                }
+                FixHeightAndRebalance(damaged);
+                return Attempt{false, nullptr};
+            }
+
+            std::uint64_t child_version = child->version;
+            if (IsShrinkingOrUnlinked(child_version)) {
+                WaitUntilShrinkCompleted(child, child_version);
+                // RETRY
+            } else if (child != Child(node, cmp)) {
+                // RETRY
+            } else {
+                if (node->version != version) return Attempt{true, nullptr};
+                Attempt attempt = AttemptUpdate(key, mode, value, node, child,
+                    child_version);
+                if (!attempt.retry) return attempt;
+                // else RETRY
+            }
+        }
+    }
+
+    /**
+     * Updates the value of node, which holds the key being updated.
+     * parent is only needed to unlink node.
+     */
+    Attempt AttemptNodeUpdate(UpdateMode mode, ValueBox *value, Node *parent,
+            Node *node) {
+        if (mode == UpdateMode::Remove) {
+            if (node->value == nullptr) return Attempt{false, nullptr};
+
+            if (node->left == nullptr || node->right == nullptr) {
+                // Removal can unlink node, which requires the parent lock.
+                ValueBox *previous = nullptr;
+                Node *damaged = nullptr;
+                {
+                    std::lock_guard<std::mutex> parent_guard(parent->lock);
+                    if (IsUnlinked(parent->version) || node->parent != parent)
+                        return Attempt{true, nullptr};
+                    {
+                        std::lock_guard<std::mutex> guard(node->lock);
+                        previous = node->value;
+                        if (previous == nullptr)
+                            return Attempt{false, nullptr};
+                        if (!AttemptUnlink(parent, node))
+                            return Attempt{true, nullptr};
+                    }
+                    count_--;
+                    damaged = FixHeight(parent);
+                }
+                FixHeightAndRebalance(damaged);
+                return Attempt{false, previous};
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(node->lock);
+        if (IsUnlinked(node->version)) return Attempt{true, nullptr};
+
+        ValueBox *previous = node->value;
+        switch (mode) {
+        case UpdateMode::Add:
+            if (previous != nullptr) return Attempt{false, previous};
+            node->value = value;
+            count_++;
+            break;
+        case UpdateMode::Assign:
+            node->value = value;
+            if (previous == nullptr) count_++;
+            break;
+        case UpdateMode::Remove:
+            if (previous == nullptr) return Attempt{false, nullptr};
+            // Children may have been unlinked since the check above.
+            if (node->left == nullptr || node->right == nullptr)
+                return Attempt{true, nullptr};
+            node->value = nullptr;  // node becomes a routing node
+            count_--;
+            break;
+        }
+        return Attempt{false, previous};
+    }
+
+    /**
+     * Splices node out of the tree.  parent and node must be locked.  Does
+     * not adjust count_ or any heights.
+     *
+     * @return false if node is no longer a child of parent or has grown a
+     *          second child.
+     */
+    bool AttemptUnlink(Node *parent, Node *node) {
+        Node *parent_left = parent->left;
+        Node *parent_right = parent->right;
+        if (parent_left != node && parent_right != node) return false;
+
+        Node *left = node->left;
+        Node *right = node->right;
+        if (left != nullptr && right != nullptr) return false;
+
+        Node *splice = (left != nullptr) ? left : right;
+        if (parent_left == node)
+            parent->left = splice;
+        else
+            parent->right = splice;
+        if (splice != nullptr) splice->parent = parent;
+
+        node->version = kUnlinked;
+        node->value = nullptr;
+        Retire(node);
+        return true;
+    }
+
+    /**
+     * Determines what repair node needs.  The reads are not atomic, but any
+     * thread that changes a node promises to repair it, so a
+     * kNothingRequired answer is always safe.
+     */
+    int NodeCondition(Node *node) {
+        Node *left = node->left;
+        Node *right = node->right;
+
+        if ((left == nullptr || right == nullptr) && node->value == nullptr)
+            return kUnlinkRequired;
+
+        int height = node->height;
+        int left_height = Height(left);
+        int right_height = Height(right);
+        int new_height = 1 + std::max(left_height, right_height);
+        int balance = left_height - right_height;
+
+        if (balance < -1 || balance > 1) return kRebalanceRequired;
+        return height != new_height ? new_height : kNothingRequired;
+    }
+
+    /**
+     * Walks up from node repairing heights, unlinking routing nodes and
+     * rotating, until no repair is needed.
+     *
+     * A rotation can leave damage at more than one level but hands back only
+     * the deepest damaged node.  The rotated node and its parent are kept on
+     * pending and checked again once the repairs below them are finished.
+     */
+    void FixHeightAndRebalance(Node *node) {
+        std::vector<Node*> pending;
+
+        while (true) {
+            while (node != nullptr && node->parent != nullptr) {
+                int condition = NodeCondition(node);
+                if (condition == kNothingRequired || IsUnlinked(node->version))
+                    break;
+
+                if (condition != kUnlinkRequired
+                        && condition != kRebalanceRequired) {
+                    std::lock_guard<std::mutex> guard(node->lock);
+                    node = FixHeight(node);
+                } else {
+                    Node *parent = node->parent;
+                    std::lock_guard<std::mutex> parent_guard(parent->lock);
+                    if (!IsUnlinked(parent->version)
+                            && node->parent == parent) {
+                        std::lock_guard<std::mutex> guard(node->lock);
+                        pending.push_back(parent);
+                        pending.push_back(node);
+                        node = Rebalance(parent, node);
+                    }
+                    // else RETRY
+                }
+            }
+
+            if (pending.empty()) return;
+            node = pending.back(); pending.pop_back();
+        }
+    }
+
+    /**
+     * Repairs the height of a locked node.
+     *
+     * @return The next node this thread is responsible for repairing, or
+     *          nullptr if none.
+     */
+    Node* FixHeight(Node *node) {
+        int condition = NodeCondition(node);
+        switch (condition) {
+        case kRebalanceRequired:
+        case kUnlinkRequired:
+            return node;
+        case kNothingRequired:
+            return nullptr;
+        default:
+            node->height = condition;
+            return node->parent;
+        }
+    }
+
+    /**
+     * Repairs node.  parent and node must be locked.
+     *
+     * @return The next damaged node, or nullptr if none.
+     */
+    Node* Rebalance(Node *parent, Node *node) {
+        Node *left = node->left;
+        Node *right = node->right;
+
+        if ((left == nullptr || right == nullptr) && node->value == nullptr) {
+            if (AttemptUnlink(parent, node)) return FixHeight(parent);
+            return node;
+        }
+
+        int height = node->height;
+        int left_height = Height(left);
+        int right_height = Height(right);
+        int new_height = 1 + std::max(left_height, right_height);
+        int balance = left_height - right_height;
+
+        if (balance > 1) return RebalanceToRight(parent, node, left,
+            right_height);
+        if (balance < -1) return RebalanceToLeft(parent, node, right,
+            left_height);
+        if (new_height != height) {
+            node->height = new_height;
+            return FixHeight(parent);
+        }
+        return nullptr;
+    }
+
+    /**
+     * node's left subtree is too tall; rotate right, first rotating the
+     * left child left if its right subtree is the taller one.
+     */
+    Node* RebalanceToRight(Node *parent, Node *node, Node *left,
+            int right_height) {
+        std::unique_lock<std::mutex> left_guard(left->lock);
+        int left_height = left->height;
+        if (left_height - right_height <= 1) return node;  // retry
+
+        Node *left_right = left->right;
+        int left_left_height = Height(left->left);
+        int left_right_height = Height(left_right);
+        if (left_left_height >= left_right_height) {
+            return RotateRight(parent, node, left, right_height,
+                left_left_height, left_right, left_right_height);
+        }
+
+        {
+            std::lock_guard<std::mutex> left_right_guard(left_right->lock);
+            // The snapshot of left_right_height may be stale.
+            left_right_height = left_right->height;
+            if (left_left_height >= left_right_height) {
+                return RotateRight(parent, node, left, right_height,
+                    left_left_height, left_right, left_right_height);
+            }
+            int left_right_left_height = Height(left_right->left);
+            int balance = left_left_height - left_right_left_height;
+            if (balance >= -1 && balance <= 1) {
+                return RotateRightOverLeft(parent, node, left, right_height,
+                    left_left_height, left_right, left_right_left_height);
+            }
+        }
+        // A double rotation would leave left damaged.  Fix left first,
+        // node is rebalanced again afterwards if needed.
+        return RebalanceToLeft(node, left, left_right, left_left_height);
+    }
+
+    /**
+     * Mirror image of RebalanceToRight.
+     */
+    Node* RebalanceToLeft(Node *parent, Node *node, Node *right,
+            int left_height) {
+        std::unique_lock<std::mutex> right_guard(right->lock);
+        int right_height = right->height;
+        if (left_height - right_height >= -1) return node;  // retry
+
+        Node *right_left = right->left;
+        int right_left_height = Height(right_left);
+        int right_right_height = Height(right->right);
+        if (right_right_height >= right_left_height) {
+            return RotateLeft(parent, node, left_height, right,
+                right_left, right_left_height, right_right_height);
+        }
+
+        {
+            std::lock_guard<std::mutex> right_left_guard(right_left->lock);
+            right_left_height = right_left->height;
+            if (right_right_height >= right_left_height) {
+                return RotateLeft(parent, node, left_height, right,
+                    right_left, right_left_height, right_right_height);
+            }
+            int right_left_right_height = Height(right_left->right);
+            int balance = right_right_height - right_left_right_height;
+            if (balance >= -1 && balance <= 1) {
+                return RotateLeftOverRight(parent, node, left_height, right,
+                    right_left, right_right_height, right_left_right_height);
+            }
+        }
+        return RebalanceToRight(node, right, right_left, right_right_height);
+    }
+
+    static void ReplaceChild(Node *parent, Node *old_child, Node *new_child) {
+        if (parent->left == old_child)
+            parent->left = new_child;
+        else
+            parent->right = new_child;
+        new_child->parent = parent;
+    }
+
+    /**
+     * Single right rotation at node.  parent, node and left are locked.
+     * node moves down and its key range shrinks, so it is marked shrinking
+     * for the duration.
+     */
+    Node* RotateRight(Node *parent, Node *node, Node *left, int right_height,
+            int left_left_height, Node *left_right, int left_right_height) {
+        std::uint64_t version = node->version;
+        node->version = BeginShrink(version);
+
+        node->left = left_right;
+        if (left_right != nullptr) left_right->parent = node;
+        left->right = node;
+        node->parent = left;
+        ReplaceChild(parent, node, left);
+
+        int node_height = 1 + std::max(left_right_height, right_height);
+        node->height = node_height;
+        left->height = 1 + std::max(left_left_height, node_height);
+
+        node->version = EndShrink(version);
+
+        int node_balance = left_right_height - right_height;
+        if (node_balance < -1 || node_balance > 1) return node;
+        if ((left_right == nullptr || right_height == 0)
+                && node->value == nullptr) return node;
+
+        int left_balance = left_left_height - node_height;
+        if (left_balance < -1 || left_balance > 1) return left;
+        if (left_left_height == 0 && left->value == nullptr) return left;
+
+        return FixHeight(parent);
+    }
+
+    /**
+     * Mirror image of RotateRight.
+     */
+    Node* RotateLeft(Node *parent, Node *node, int left_height, Node *right,
+            Node *right_left, int right_left_height, int right_right_height) {
+        std::uint64_t version = node->version;
+        node->version = BeginShrink(version);
+
+        node->right = right_left;
+        if (right_left != nullptr) right_left->parent = node;
+        right->left = node;
+        node->parent = right;
+        ReplaceChild(parent, node, right);
+
+        int node_height = 1 + std::max(left_height, right_left_height);
+        node->height = node_height;
+        right->height = 1 + std::max(node_height, right_right_height);
+
+        node->version = EndShrink(version);
+
+        int node_balance = left_height - right_left_height;
+        if (node_balance < -1 || node_balance > 1) return node;
+        if ((right_left == nullptr || left_height == 0)
+                && node->value == nullptr) return node;
+
+        int right_balance = node_height - right_right_height;
+        if (right_balance < -1 || right_balance > 1) return right;
+        if (right_right_height == 0 && right->value == nullptr) return right;
+
+        return FixHeight(parent);
+    }
+
+    /**
+     * Double rotation: left rotation at left, then right rotation at node.
+     * parent, node, left and left_right are locked.  Both node and left
+     * shrink.
+     */
+    Node* RotateRightOverLeft(Node *parent, Node *node, Node *left,
+            int right_height, int left_left_height, Node *left_right,
+            int left_right_left_height) {
+        std::uint64_t node_version = node->version;
+        std::uint64_t left_version = left->version;
+
+        Node *left_right_left = left_right->left;
+        Node *left_right_right = left_right->right;
+        int left_right_right_height = Height(left_right_right);
+
+        node->version = BeginShrink(node_version);
+        left->version = BeginShrink(left_version);
+
+        node->left = left_right_right;
+        if (left_right_right != nullptr) left_right_right->parent = node;
+        left->right = left_right_left;
+        if (left_right_left != nullptr) left_right_left->parent = left;
+        left_right->left = left;
+        left->parent = left_right;
+        left_right->right = node;
+        node->parent = left_right;
+        ReplaceChild(parent, node, left_right);
+
+        int node_height = 1 + std::max(left_right_right_height, right_height);
+        node->height = node_height;
+        int left_height = 1 + std::max(left_left_height,
+            left_right_left_height);
+        left->height = left_height;
+        left_right->height = 1 + std::max(left_height, node_height);
+
+        node->version = EndShrink(node_version);
+        left->version = EndShrink(left_version);
+
+        // left may be left as a routing node with a single child.  Every
+        // lock needed to splice it out is already held.
+        if ((left->left == nullptr || left->right == nullptr)
+                && left->value == nullptr) {
+            AttemptUnlink(left_right, left);
+            left_height = Height(left_right->left);
+            left_right->height = 1 + std::max(left_height, node_height);
+        }
+
+        int node_balance = left_right_right_height - right_height;
+        if (node_balance < -1 || node_balance > 1) return node;
+        if ((left_right_right == nullptr || right_height == 0)
+                && node->value == nullptr) return node;
+
+        int left_right_balance = left_height - node_height;
+        if (left_right_balance < -1 || left_right_balance > 1)
+            return left_right;
+
+        return FixHeight(parent);
+    }
+
+    /**
+     * Mirror image of RotateRightOverLeft.
+     */
+    Node* RotateLeftOverRight(Node *parent, Node *node, int left_height,
+            Node *right, Node *right_left, int right_right_height,
+            int right_left_right_height) {
+        std::uint64_t node_version = node->version;
+        std::uint64_t right_version = right->version;
+
+        Node *right_left_left = right_left->left;
+        Node *right_left_right = right_left->right;
+        int right_left_left_height = Height(right_left_left);
+
+        node->version = BeginShrink(node_version);
+        right->version = BeginShrink(right_version);
+
+        node->right = right_left_left;
+        if (right_left_left != nullptr) right_left_left->parent = node;
+        right->left = right_left_right;
+        if (right_left_right != nullptr) right_left_right->parent = right;
+        right_left->right = right;
+        right->parent = right_left;
+        right_left->left = node;
+        node->parent = right_left;
+        ReplaceChild(parent, node, right_left);
+
+        int node_height = 1 + std::max(left_height, right_left_left_height);
+        node->height = node_height;
+        int right_height = 1 + std::max(right_left_right_height,
+            right_right_height);
+        right->height = right_height;
+        right_left->height = 1 + std::max(node_height, right_height);
+
+        node->version = EndShrink(node_version);
+        right->version = EndShrink(right_version);
+
+        // right may be left as a routing node with a single child.  Every
+        // lock needed to splice it out is already held.
+        if ((right->left == nullptr || right->right == nullptr)
+                && right->value == nullptr) {
+            AttemptUnlink(right_left, right);
+            right_height = Height(right_left->right);
+            right_left->height = 1 + std::max(node_height, right_height);
+        }
+
+        int node_balance = left_height - right_left_left_height;
+        if (node_balance < -1 || node_balance > 1) return node;
+        if ((right_left_left == nullptr || left_height == 0)
+                && node->value == nullptr) return node;
+
+        int right_left_balance = node_height - right_height;
+        if (right_left_balance < -1 || right_left_balance > 1)
+            return right_left;
+
+        return FixHeight(parent);
+    }
+
+    /**
+     * Unlinked nodes are still locked by the caller, but the caller is
+     * pinned, so they cannot be freed before they are unlocked.
+     */
+    void Retire(Node *node) { nodes_.Retire(&epochs_, node); }
+
+    void Retire(ValueBox *box) { values_.Retire(&epochs_, box); }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_OPTIMISTICAVLTREE_H_
@@ -0,0 +1,743 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_PAGEDAVLTREE_H_
+#define SRC_PAGEDAVLTREE_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <format>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "BufferPool.h"
+#include "MapEntry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * AVL tree stored in fixed size pages of a file, for trees larger than
+ * memory.  Only the pages held by a BufferPool of a chosen number of
+ * frames are resident; the rest are read on demand.
+ *
+ * Page 0 holds the file header.  Every other page holds a small page
+ * header and an array of node slots.  Nodes link to their children by node
+ * id, page * kSlotsPerPage + slot, instead of by pointer.  A new node is
+ * placed in its parent's page when that page has a free slot, so subtrees
+ * tend to share pages and a descent touches fewer pages than nodes; when
+ * it does not, the node goes to the page currently being filled, or a new
+ * page at the end of the file.  Rotations only relink nodes and never move
+ * them between pages, and a freed slot is reused by the next node placed
+ * in its page.
+ *
+ * Operations pin the page of each node on their path for as long as they
+ * use it, which is at most the height of the tree plus a few pages, so the
+ * pool needs at least kMinFrames frames.
+ *
+ * Changes are made to the pages in the pool.  Flush, also run by the
+ * destructor, writes the dirty pages and the header back and syncs the
+ * file.  A crash between flushes can leave the file inconsistent; pair the
+ * tree with a WriteAheadLog if that matters.
+ *
+ * FindAsync starts a lookup without waiting for the disk: when the descent
+ * reaches a page that is not resident it queues an io_uring read and parks
+ * the lookup on the page's frame, and Poll or Wait resumes every lookup
+ * parked on a frame once its read completes.  With many lookups in flight
+ * the reads overlap, and lookups that need the same page share one read.
+ * Each parked lookup pins a frame, so a lookup that needs a page when every
+ * frame is pinned is queued instead, and retried once a read finishes and
+ * frees a frame; any number of lookups may be started.
+ * Without io_uring (see EnableAsyncReads) the reads are synchronous and
+ * FindAsync finishes before it returns.
+ *
+ * Keys and values are stored as raw bytes, so both must be trivially
+ * copyable, and files are only readable on machines with the same byte
+ * order and type sizes, which the constructor checks.  Not thread safe.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >, and be trivially copyable.
+ * @param <TValue>
+ *            Generic type representing the data being stored.  Must be
+ *            trivially copyable.
+ */
+template <class TKey, class TValue>
+class PagedAVLTree {
+    static_assert(std::is_trivially_copyable_v<TKey>,
+        "PagedAVLTree keys must be trivially copyable");
+    static_assert(std::is_trivially_copyable_v<TValue>,
+        "PagedAVLTree values must be trivially copyable");
+
+ public:
+    static constexpr std::size_t kPageSize = 4096;
+    // Enough pins for a descent of the tallest possible tree.
+    static constexpr std::size_t kMinFrames = 128;
+
+ private:
+    static constexpr std::uint64_t kNone = ~std::uint64_t{0};
+    static constexpr char kMagic[8] = {'1', '1', 'c', 'A', 'V', 'L', 'P',
+        '\0'};
+    static constexpr std::uint32_t kVersion = 1;
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;  // 0 little endian, 1 big endian
+        std::uint32_t key_size;
+        std::uint32_t value_size;
+        std::uint32_t page_size;
+        std::uint32_t node_size;
+        std::uint64_t count;
+        std::uint64_t root;        // node id, kNone if empty
+        std::uint64_t page_count;  // pages in the file, header included
+        std::uint64_t fill_page;   // page new nodes go to, 0 if none
+    };
+
+    /**
+     * Start of every node page.  A zeroed page is a valid empty page.
+     */
+    struct PageHeader {
+        std::uint32_t used;       // slots ever handed out
+        std::uint32_t free_head;  // 1 + first free slot, 0 if none
+    };
+
+    /**
+     * Node as stored in a page.  A free slot keeps 1 + the next free slot
+     * in left.
+     */
+    struct Node {
+        TKey key;
+        TValue value;
+        std::uint64_t left;
+        std::uint64_t right;
+        std::int32_t height;
+    };
+
+    static constexpr std::size_t kNodeOffset =
+        (sizeof(PageHeader) + alignof(Node) - 1) / alignof(Node)
+            * alignof(Node);
+
+ public:
+    static constexpr std::size_t kSlotsPerPage =
+        (kPageSize - kNodeOffset) / sizeof(Node);
+    static_assert(kSlotsPerPage >= 2, "PagedAVLTree nodes are too large");
+
+ private:
+    /**
+     * A node and the pin that keeps its page resident.
+     */
+    struct NodeRef {
+        PageGuard guard;
+        Node *node;
+    };
+
+    /**
+     * Lookup started by FindAsync, at node id.
+     */
+    struct Lookup {
+        TKey key;
+        std::uint64_t id;
+        std::function<void(std::optional<TValue>)> callback;
+    };
+
+    int fd_;
+    std::string path_;
+    BufferPool pool_;
+    std::uint64_t root_;
+    int count_;
+    std::uint64_t page_count_;
+    std::uint64_t fill_page_;
+
+    // Lookups waiting for a page read, by the frame it is read into.  Each
+    // holds a pin on its frame.
+    std::unordered_map<std::size_t, std::vector<Lookup>> waiting_;
+    // Lookups that found every frame pinned, waiting for a frame.
+    std::deque<Lookup> blocked_;
+    std::size_t pending_;
+
+ public:
+    /**
+     * Opens the tree stored at path, creating an empty one if the file does
+     * not exist, with a buffer pool of frame_count pages.
+     *
+     * @throws invalid_argument if frame_count is less than kMinFrames
+     * @throws system_error if the file can not be opened or read
+     * @throws runtime_error if the file is not a PagedAVLTree file for
+     *          these key and value types
+     */
+    PagedAVLTree(std::string path, std::size_t frame_count)
+        : fd_(OpenFile(path, frame_count)), path_(std::move(path)),
+          pool_(fd_, kPageSize, frame_count), root_(kNone), count_(0),
+          page_count_(1), fill_page_(0), pending_(0) {
+        try {
+            ReadHeader();
+        } catch (...) {
+            close(fd_);
+            throw;
+        }
+    }
+
+    PagedAVLTree(const PagedAVLTree&) = delete;
+    PagedAVLTree& operator=(const PagedAVLTree&) = delete;
+
+    /**
+     * Flushes the tree and closes the file.  Errors are swallowed; call
+     * Flush first to see them.
+     */
+    ~PagedAVLTree() {
+        try {
+            Flush();
+        } catch (...) {}
+        close(fd_);
+    }
+
+    /**
+     * Returns the number of elements in the tree.
+     */
+    int GetCount() const { return count_; }
+
+    /**
+     * Returns the number of pages in the file, header page included.
+     */
+    std::uint64_t GetPageCount() const { return page_count_; }
+
+    /**
+     * Returns the buffer pool's hit, miss, eviction and write counters.
+     */
+    BufferPoolStats GetStats() const { return pool_.GetStats(); }
+
+    /**
+     * Sets every buffer pool counter back to zero.
+     */
+    void ResetStats() { pool_.ResetStats(); }
+
+    /**
+     * Looks up the value stored at key.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) {
+        std::uint64_t id = root_;
+        while (id != kNone) {
+            NodeRef ref = Get(id);
+            if (key == ref.node->key) return ref.node->value;
+            id = key < ref.node->key ? ref.node->left : ref.node->right;
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) { return Find(key).has_value(); }
+
+    /**
+     * Calls func for every entry, in key order.  func must not change the
+     * tree.
+     *
+     * @param func Callable taking a const MapEntry<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) { ForEachNode(root_, func); }
+
+    /**
+     * Has FindAsync read pages with io_uring, with up to depth reads in
+     * flight.
+     *
+     * @return false if io_uring is unavailable, in which case FindAsync
+     *          reads synchronously.
+     */
+    bool EnableAsyncReads(unsigned int depth) {
+        return pool_.EnableAsyncReads(depth);
+    }
+
+    /**
+     * Starts looking up key.  callback is called with the value at key, or
+     * std::nullopt, from within FindAsync if every page on the path is
+     * resident, else from a later Poll or Wait.  The tree must not be
+     * changed until the lookup has finished.
+     *
+     * @param callback Callable taking a std::optional<TValue>.
+     */
+    template <typename Callback>
+    void FindAsync(TKey key, Callback callback) {
+        Resume(Lookup{key, root_, std::move(callback)});
+    }
+
+    /**
+     * Submits queued page reads and continues the lookups whose pages have
+     * arrived, without blocking.
+     *
+     * @return Number of lookups still waiting for a page.
+     *
+     * @throws system_error if a page can not be read; the lookups waiting
+     *          for it are dropped
+     */
+    std::size_t Poll() {
+        Continue(false);
+        return pending_;
+    }
+
+    /**
+     * Runs until every lookup started by FindAsync has finished.
+     *
+     * @throws system_error if a page can not be read; the lookups waiting
+     *          for it are dropped
+     */
+    void Wait() {
+        while (pending_ > 0) Continue(true);
+    }
+
+    /**
+     * Returns the number of lookups waiting for a page.
+     */
+    std::size_t GetPendingCount() const { return pending_; }
+
+    /**
+     * Add a key/value pair to the tree.
+     *
+     * @throws std::range_error if key is already present.
+     * @throws logic_error if async lookups are pending.
+     */
+    void Add(TKey key, TValue value) {
+        CheckNoLookups();
+        bool added = false;
+        root_ = Insert(root_, 0, key, value, false, &added);
+        count_++;
+    }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.
+     *
+     * @throws logic_error if async lookups are pending.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        CheckNoLookups();
+        bool added = false;
+        root_ = Insert(root_, 0, key, value, true, &added);
+        if (added) count_++;
+    }
+
+    /**
+     * Remove an entry from the tree.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     * @throws logic_error if async lookups are pending.
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        CheckNoLookups();
+        TValue removed;
+        root_ = Erase(root_, key, &removed);
+        count_--;
+        return MapEntry<TKey, TValue>(key, removed);
+    }
+
+    /**
+     * Writes every dirty page and the header to the file and syncs it.
+     *
+     * @throws system_error if the file can not be written
+     */
+    void Flush() {
+        pool_.Flush();
+        Header header = MakeHeader();
+        header.count = static_cast<std::uint64_t>(count_);
+        header.root = root_;
+        header.page_count = page_count_;
+        header.fill_page = fill_page_;
+        if (pwrite(fd_, &header, sizeof(header), 0)
+                != static_cast<ssize_t>(sizeof(header))
+                || fdatasync(fd_) != 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+    }
+
+ private:
+    static int OpenFile(const std::string &path, std::size_t frame_count) {
+        if (frame_count < kMinFrames)
+            throw std::invalid_argument("! Buffer pool is too small !");
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+        return fd;
+    }
+
+    static Header MakeHeader() {
+        Header header{};
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.byte_order = std::endian::native == std::endian::little ? 0 : 1;
+        header.key_size = sizeof(TKey);
+        header.value_size = sizeof(TValue);
+        header.page_size = kPageSize;
+        header.node_size = sizeof(Node);
+        return header;
+    }
+
+    /**
+     * Reads and checks the header of an existing file, or writes one to an
+     * empty file.
+     */
+    void ReadHeader() {
+        struct stat status;
+        if (fstat(fd_, &status) != 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+        if (status.st_size == 0) {
+            Flush();
+            return;
+        }
+
+        Header header;
+        Header expected = MakeHeader();
+        if (pread(fd_, &header, sizeof(header), 0)
+                != static_cast<ssize_t>(sizeof(header))
+                || !std::equal(header.magic, header.magic + sizeof(kMagic),
+                    kMagic)
+                || header.version != kVersion) {
+            throw std::runtime_error("! Not a PagedAVLTree file !");
+        }
+        if (header.byte_order != expected.byte_order
+                || header.key_size != expected.key_size
+                || header.value_size != expected.value_size
+                || header.page_size != expected.page_size
+                || header.node_size != expected.node_size) {
+            throw std::runtime_error
+                ("! PagedAVLTree file was written for different types !");
+        }
+        root_ = header.root;
+        count_ = static_cast<int>(header.count);
+        page_count_ = header.page_count;
+        fill_page_ = header.fill_page;
+    }
+
+    NodeRef Get(std::uint64_t id) {
+        PageGuard guard(&pool_, id / kSlotsPerPage);
+        Node *node = SlotAt(guard, id % kSlotsPerPage);
+        return NodeRef{std::move(guard), node};
+    }
+
+    static PageHeader* PageHeaderOf(const PageGuard &guard) {
+        return reinterpret_cast<PageHeader*>(guard.GetData());
+    }
+
+    static Node* SlotAt(unsigned char *data, std::uint64_t slot) {
+        return reinterpret_cast<Node*>(data + kNodeOffset) + slot;
+    }
+
+    static Node* SlotAt(const PageGuard &guard, std::uint64_t slot) {
+        return SlotAt(guard.GetData(), slot);
+    }
+
+    void CheckNoLookups() const {
+        if (pending_ > 0)
+            throw std::logic_error("! Tree changed with lookups pending !");
+    }
+
+    /**
+     * Continues lookup's descent until it finishes or reaches a page that
+     * is being read.
+     */
+    void Resume(Lookup lookup) {
+        while (lookup.id != kNone) {
+            std::uint64_t page = lookup.id / kSlotsPerPage;
+            if (!pool_.CanPin(page)) {
+                blocked_.push_back(std::move(lookup));
+                pending_++;
+                return;
+            }
+            bool ready;
+            std::size_t frame = pool_.PinAsync(page, &ready);
+            if (!ready) {
+                waiting_[frame].push_back(std::move(lookup));
+                pending_++;
+                return;
+            }
+            if (Step(&lookup, frame)) return;
+        }
+        lookup.callback(std::nullopt);
+    }
+
+    /**
+     * Visits lookup's node, in the page pinned in frame, and releases the
+     * pin.
+     *
+     * @return true if the key was found and the callback called.
+     */
+    bool Step(Lookup *lookup, std::size_t frame) {
+        const Node *node = SlotAt(pool_.GetData(frame),
+            lookup->id % kSlotsPerPage);
+        if (lookup->key == node->key) {
+            TValue value = node->value;
+            pool_.Unpin(frame);
+            lookup->callback(value);
+            return true;
+        }
+        lookup->id = lookup->key < node->key ? node->left : node->right;
+        pool_.Unpin(frame);
+        return false;
+    }
+
+    /**
+     * Resumes the lookups parked on every frame whose read has finished,
+     * then retries the lookups waiting for a frame.
+     */
+    void Continue(bool wait) {
+        std::vector<std::pair<std::size_t, int>> finished;
+        pool_.Reap(&finished, wait);
+        int error = 0;
+        for (const std::pair<std::size_t, int> &read : finished) {
+            auto found = waiting_.find(read.first);
+            if (found == waiting_.end()) continue;
+            std::vector<Lookup> lookups = std::move(found->second);
+            waiting_.erase(found);
+            pending_ -= lookups.size();
+            for (Lookup &lookup : lookups) {
+                if (read.second != 0) {
+                    pool_.Unpin(read.first);
+                    error = read.second;
+                } else if (!Step(&lookup, read.first)) {
+                    Resume(std::move(lookup));
+                }
+            }
+        }
+        // Lookups pin frames only while parked, so once no reads are in
+        // flight every frame is free and none of these can block again.
+        std::deque<Lookup> blocked = std::move(blocked_);
+        blocked_.clear();
+        pending_ -= blocked.size();
+        for (Lookup &lookup : blocked) Resume(std::move(lookup));
+        if (error != 0)
+            throw std::system_error(error, std::generic_category(), path_);
+    }
+
+    int Height(std::uint64_t id) {
+        return id == kNone ? -1 : Get(id).node->height;
+    }
+
+    /**
+     * Takes a free slot in page and stores a leaf there.
+     *
+     * @return Id of the new node, or kNone if page is full.
+     */
+    static std::uint64_t Place(PageGuard *guard, std::uint64_t page,
+            const TKey &key, const TValue &value) {
+        PageHeader *header = PageHeaderOf(*guard);
+        std::uint64_t slot;
+        if (header->free_head != 0) {
+            slot = header->free_head - 1;
+            header->free_head =
+                static_cast<std::uint32_t>(SlotAt(*guard, slot)->left);
+        } else if (header->used < kSlotsPerPage) {
+            slot = header->used++;
+        } else {
+            return kNone;
+        }
+        Node *node = SlotAt(*guard, slot);
+        node->key = key;
+        node->value = value;
+        node->left = kNone;
+        node->right = kNone;
+        node->height = 0;
+        guard->MarkDirty();
+        return page * kSlotsPerPage + slot;
+    }
+
+    /**
+     * Allocates a leaf, in near_page if it has room.
+     */
+    std::uint64_t NewNode(std::uint64_t near_page, const TKey &key,
+            const TValue &value) {
+        for (std::uint64_t page : {near_page, fill_page_}) {
+            if (page == 0) continue;
+            PageGuard guard(&pool_, page);
+            std::uint64_t id = Place(&guard, page, key, value);
+            if (id != kNone) return id;
+        }
+        fill_page_ = page_count_++;
+        PageGuard guard(&pool_, fill_page_, true);
+        return Place(&guard, fill_page_, key, value);
+    }
+
+    /**
+     * Returns the slot of ref's node to its page's free list.
+     */
+    static void FreeNode(NodeRef *ref, std::uint64_t id) {
+        PageHeader *header = PageHeaderOf(ref->guard);
+        ref->node->left = header->free_head;
+        header->free_head = static_cast<std::uint32_t>(id % kSlotsPerPage + 1);
+        ref->guard.MarkDirty();
+    }
+
+    void UpdateHeight(NodeRef *ref) {
+        ref->node->height = 1 + std::max(Height(ref->node->left),
+            Height(ref->node->right));
+        ref->guard.MarkDirty();
+    }
+
+    std::uint64_t RotateRight(std::uint64_t id) {
+        NodeRef node = Get(id);
+        std::uint64_t left_id = node.node->left;
+        NodeRef left = Get(left_id);
+        node.node->left = left.node->right;
+        UpdateHeight(&node);
+        left.node->right = id;
+        UpdateHeight(&left);
+        return left_id;
+    }
+
+    std::uint64_t RotateLeft(std::uint64_t id) {
+        NodeRef node = Get(id);
+        std::uint64_t right_id = node.node->right;
+        NodeRef right = Get(right_id);
+        node.node->right = right.node->left;
+        UpdateHeight(&node);
+        right.node->left = id;
+        UpdateHeight(&right);
+        return right_id;
+    }
+
+    /**
+     * Recalculates the height of the node at id, whose children are
+     * balanced, and rotates it if it is not.
+     *
+     * @return Id of the node now at the root of the subtree.
+     */
+    std::uint64_t Rebalance(std::uint64_t id) {
+        NodeRef ref = Get(id);
+        int left = Height(ref.node->left);
+        int right = Height(ref.node->right);
+        if (left > right + 1) {
+            NodeRef child = Get(ref.node->left);
+            if (Height(child.node->left) < Height(child.node->right)) {
+                ref.node->left = RotateLeft(ref.node->left);
+                ref.guard.MarkDirty();
+            }
+            return RotateRight(id);
+        }
+        if (right > left + 1) {
+            NodeRef child = Get(ref.node->right);
+            if (Height(child.node->right) < Height(child.node->left)) {
+                ref.node->right = RotateRight(ref.node->right);
+                ref.guard.MarkDirty();
+            }
+            return RotateLeft(id);
+        }
+        UpdateHeight(&ref);
+        return id;
+    }
+
+    std::uint64_t Insert(std::uint64_t id, std::uint64_t near_page,
+            const TKey &key, const TValue &value, bool assign, bool *added) {
+        if (id == kNone) {
+            *added = true;
+            return NewNode(near_page, key, value);
+        }
+
+        NodeRef ref = Get(id);
+        if (key == ref.node->key) {
+            if (!assign)
+                throw std::range_error("! Key already exists in Tree !");
+            ref.node->value = value;
+            ref.guard.MarkDirty();
+            return id;
+        }
+        std::uint64_t page = id / kSlotsPerPage;
+        if (key < ref.node->key) {
+            ref.node->left = Insert(ref.node->left, page, key, value, assign,
+                added);
+        } else {
+            ref.node->right = Insert(ref.node->right, page, key, value,
+                assign, added);
+        }
+        ref.guard.MarkDirty();
+        return *added ? Rebalance(id) : id;
+    }
+
+    std::uint64_t Erase(std::uint64_t id, const TKey &key, TValue *removed) {
+        if (id == kNone) {
+            throw std::range_error
+                (std::format("! Key {} not present in Tree !", key));
+        }
+
+        NodeRef ref = Get(id);
+        if (key < ref.node->key) {
+            ref.node->left = Erase(ref.node->left, key, removed);
+        } else if (ref.node->key < key) {
+            ref.node->right = Erase(ref.node->right, key, removed);
+        } else {
+            *removed = ref.node->value;
+            if (ref.node->left == kNone || ref.node->right == kNone) {
+                std::uint64_t child = ref.node->left != kNone
+                    ? ref.node->left : ref.node->right;
+                FreeNode(&ref, id);
+                return child;
+            }
+            // Two children: the successor's entry takes this node's place.
+            ref.node->right = EraseMin(ref.node->right, &ref.node->key,
+                &ref.node->value);
+        }
+        ref.guard.MarkDirty();
+        return Rebalance(id);
+    }
+
+    /**
+     * Removes the smallest entry of the subtree at id, copying it out.
+     */
+    std::uint64_t EraseMin(std::uint64_t id, TKey *key, TValue *value) {
+        NodeRef ref = Get(id);
+        if (ref.node->left == kNone) {
+            *key = ref.node->key;
+            *value = ref.node->value;
+            std::uint64_t right = ref.node->right;
+            FreeNode(&ref, id);
+            return right;
+        }
+        ref.node->left = EraseMin(ref.node->left, key, value);
+        ref.guard.MarkDirty();
+        return Rebalance(id);
+    }
+
+    template <typename Func>
+    void ForEachNode(std::uint64_t id, Func &func) {
+        if (id == kNone) return;
+        NodeRef ref = Get(id);
+        ForEachNode(ref.node->left, func);
+        const MapEntry<TKey, TValue> entry(ref.node->key, ref.node->value);
+        func(entry);
+        ForEachNode(ref.node->right, func);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_PAGEDAVLTREE_H_
@@ -0,0 +1,526 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_PERSISTENTAVLTREE_H_
+#define SRC_PERSISTENTAVLTREE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "AVLTreeCodec.h"
+#include "CopyOnWriteAVL.h"
+#include "MapEntry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * AVL tree whose nodes live in a memory mapped file, so that reopening the
+ * file gives back the tree, ready for reads and writes, without reading or
+ * rebuilding it.
+ *
+ * The file is a one page header followed by an array of OffsetAVLNodes.
+ * The header holds two root slots, each with a sequence number, the root,
+ * the count, the array's high water mark and a checksum; the valid slot
+ * with the higher sequence number is current.
+ *
+ * Changes are copy on write (see CopyOnWriteAVL): a change copies the
+ * nodes on its path into free slots, leaving the current tree untouched,
+ * then publishes the new root by writing the other slot.  With sync on,
+ * the new nodes are msync'ed before the slot is written and the slot
+ * before the change returns, so after a crash, even of the machine, the
+ * file holds the tree as of the last change that returned.  With sync
+ * off, changes are atomic against a crash of the process, since the page
+ * cache outlives it, and Flush makes them durable.
+ *
+ * Nodes a change replaced are reused once it is published.  The list of
+ * free nodes is kept in memory and written to the file, threaded through
+ * the free nodes, by Flush and on close; opening a file that was not
+ * closed cleanly finds the free nodes by walking the tree instead, which
+ * is O(n).  Otherwise opening costs the same whatever the size of the
+ * file, and lookups fault in only the pages on their path.
+ *
+ * Keys and values are stored as raw bytes, so both must be trivially
+ * copyable, and files are only readable on machines with the same byte
+ * order and type sizes, which opening checks.  Not thread safe.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >, and be trivially copyable.
+ * @param <TValue>
+ *            Generic type representing the data being stored.  Must be
+ *            trivially copyable.
+ */
+template <class TKey, class TValue>
+class PersistentAVLTree {
+    static_assert(std::is_trivially_copyable_v<TKey>,
+        "PersistentAVLTree keys must be trivially copyable");
+    static_assert(std::is_trivially_copyable_v<TValue>,
+        "PersistentAVLTree values must be trivially copyable");
+
+ private:
+    using Node = OffsetAVLNode<TKey, TValue>;
+    using Algorithms = CopyOnWriteAVL<TKey, TValue, PersistentAVLTree>;
+    friend Algorithms;
+
+    static constexpr std::uint64_t kNone = Node::kNone;
+    static constexpr std::size_t kHeaderSize = 4096;
+    static constexpr std::size_t kSlotOffset[2] = {512, 1024};
+    static constexpr std::size_t kMinFileSize = 1 << 16;
+    static constexpr char kMagic[8] = {'1', '1', 'c', 'A', 'V', 'L', 'H',
+        '\0'};
+    static constexpr std::uint32_t kVersion = 1;
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;  // 0 little endian, 1 big endian
+        std::uint32_t key_size;
+        std::uint32_t value_size;
+        std::uint32_t node_size;
+        std::uint32_t reserved;
+    };
+
+    /**
+     * One of the header's two root slots.
+     */
+    struct Slot {
+        std::uint64_t sequence;
+        std::uint64_t root;
+        std::uint64_t count;
+        std::uint64_t end;        // nodes in use or free, from the start
+        std::uint64_t free_head;  // kNone unless closed cleanly
+        std::uint64_t clean;
+        std::uint64_t checksum;   // FNV-1a of the fields above
+    };
+
+    std::string path_;
+    int fd_;
+    bool sync_;
+    unsigned char *mapping_;
+    std::size_t mapping_size_;
+
+    std::uint64_t sequence_;
+    std::uint64_t root_;
+    int count_;
+    std::uint64_t end_;
+    bool clean_;  // the current slot says closed cleanly
+
+    std::vector<std::uint64_t> free_;
+    // Nodes allocated and retired by the change in progress.
+    std::unordered_set<std::uint64_t> fresh_;
+    std::vector<std::uint64_t> retired_;
+
+ public:
+    /**
+     * Opens the tree stored at path, creating an empty one if the file does
+     * not exist.
+     *
+     * @param sync Whether every change is synced to disk before it returns.
+     *
+     * @throws system_error if the file can not be opened or mapped
+     * @throws runtime_error if the file is not a PersistentAVLTree file for
+     *          these key and value types
+     */
+    explicit PersistentAVLTree(std::string path, bool sync = true)
+        : path_(std::move(path)), fd_(-1), sync_(sync), mapping_(nullptr),
+          mapping_size_(0), sequence_(0), root_(kNone), count_(0), end_(0),
+          clean_(false) {
+        fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+        try {
+            OpenFile();
+        } catch (...) {
+            if (mapping_ != nullptr) munmap(mapping_, mapping_size_);
+            close(fd_);
+            throw;
+        }
+    }
+
+    PersistentAVLTree(const PersistentAVLTree&) = delete;
+    PersistentAVLTree& operator=(const PersistentAVLTree&) = delete;
+
+    /**
+     * Flushes the tree and closes the file.  Errors are swallowed; call
+     * Flush first to see them.
+     */
+    ~PersistentAVLTree() {
+        try {
+            Flush();
+        } catch (...) {}
+        munmap(mapping_, mapping_size_);
+        close(fd_);
+    }
+
+    /**
+     * Returns the number of elements in the tree.
+     */
+    int GetCount() const { return count_; }
+
+    /**
+     * Returns the size of the file in bytes.
+     */
+    std::size_t GetFileSize() const { return mapping_size_; }
+
+    /**
+     * Looks up the value stored at key.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) {
+        const Node *node = Algorithms(this).Find(root_, key);
+        if (node == nullptr) return std::nullopt;
+        return node->value;
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) { return Find(key).has_value(); }
+
+    /**
+     * Calls func for every entry, in key order.  func must not change the
+     * tree.
+     *
+     * @param func Callable taking a const MapEntry<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) { Algorithms(this).ForEach(root_, func); }
+
+    /**
+     * Add a key/value pair to the tree.
+     *
+     * @throws std::range_error if key is already present.
+     * @throws system_error if the file can not be grown or synced
+     */
+    void Add(TKey key, TValue value) {
+        if (Contains(key))
+            throw std::range_error("! Key already exists in Tree !");
+        Change([&] { return Algorithms(this).Insert(root_, key, value); }, 1);
+    }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.
+     *
+     * @throws system_error if the file can not be grown or synced
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        int added = Contains(key) ? 0 : 1;
+        Change([&] { return Algorithms(this).Insert(root_, key, value); },
+            added);
+    }
+
+    /**
+     * Remove an entry from the tree.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     * @throws system_error if the file can not be grown or synced
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        std::optional<TValue> value = Find(key);
+        if (!value.has_value()) {
+            throw std::range_error
+                (std::format("! Key {} not present in Tree !", key));
+        }
+        Change([&] { return Algorithms(this).Erase(root_, key); }, -1);
+        return MapEntry<TKey, TValue>(key, *value);
+    }
+
+    /**
+     * Writes the free list to the file and syncs it, leaving the file as a
+     * clean close would.
+     *
+     * @throws system_error if the sync fails
+     */
+    void Flush() {
+        if (clean_) return;
+        std::uint64_t head = kNone;
+        for (std::uint64_t id : free_) {
+            At(id)->left = head;
+            head = id;
+        }
+        Sync(0, mapping_size_);
+        Publish(root_, head, true);
+        Sync(0, kHeaderSize);
+    }
+
+ private:
+    // Heap interface for CopyOnWriteAVL.
+
+    Node* At(std::uint64_t id) {
+        return reinterpret_cast<Node*>(mapping_ + kHeaderSize) + id;
+    }
+
+    std::uint64_t Allocate() {
+        std::uint64_t id;
+        if (!free_.empty()) {
+            id = free_.back();
+            free_.pop_back();
+        } else {
+            if (kHeaderSize + (end_ + 1) * sizeof(Node) > mapping_size_)
+                Grow();
+            id = end_++;
+        }
+        fresh_.insert(id);
+        return id;
+    }
+
+    bool IsFresh(std::uint64_t id) const { return fresh_.count(id) != 0; }
+
+    void Retire(std::uint64_t id) { retired_.push_back(id); }
+
+    static std::uint32_t ByteOrder() {
+        return std::endian::native == std::endian::little ? 0 : 1;
+    }
+
+    static std::uint64_t Checksum(const Slot &slot) {
+        std::ostringstream ignored;
+        SnapshotWriter writer(&ignored);
+        writer.Write(&slot, offsetof(Slot, checksum));
+        return writer.GetChecksum();
+    }
+
+    /**
+     * Runs change, which builds a new tree and returns its root, and then
+     * publishes it, or on failure frees the nodes it allocated.  If change
+     * or syncing its nodes throws, the old tree stays current; if only the
+     * final header sync throws, the new tree is current but may not be
+     * durable.  Either way fresh_ and retired_ are left empty.
+     */
+    template <typename Func>
+    void Change(Func change, int delta) {
+        // Once a change reuses a free node the free list in the file is
+        // stale, so first mark the file as not closed cleanly.
+        if (clean_) {
+            Publish(root_, kNone, false);
+            if (sync_) Sync(0, kHeaderSize);
+        }
+
+        std::uint64_t root;
+        try {
+            root = change();
+            if (sync_) SyncFresh();
+        } catch (...) {
+            free_.insert(free_.end(), fresh_.begin(), fresh_.end());
+            fresh_.clear();
+            retired_.clear();
+            throw;
+        }
+
+        count_ += delta;
+        Publish(root, kNone, false);
+        // The new tree is current from here on, so what it replaced is
+        // free even if the header can not be synced.
+        free_.insert(free_.end(), retired_.begin(), retired_.end());
+        fresh_.clear();
+        retired_.clear();
+        if (sync_) Sync(0, kHeaderSize);
+    }
+
+    /**
+     * Syncs the pages holding the nodes of the change in progress, merging
+     * neighboring nodes into runs.
+     */
+    void SyncFresh() {
+        std::vector<std::uint64_t> ids(fresh_.begin(), fresh_.end());
+        std::sort(ids.begin(), ids.end());
+        std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t start = 0;
+        std::size_t stop = 0;
+        for (std::uint64_t id : ids) {
+            std::size_t offset = kHeaderSize + id * sizeof(Node);
+            std::size_t first = offset / page * page;
+            if (first > stop) {
+                if (stop > start) Sync(start, stop - start);
+                start = first;
+            }
+            stop = std::max(stop, offset + sizeof(Node));
+        }
+        if (stop > start) Sync(start, stop - start);
+    }
+
+    /**
+     * Writes the slot after the current one and makes it current.
+     */
+    void Publish(std::uint64_t root, std::uint64_t free_head, bool clean) {
+        Slot slot{};
+        slot.sequence = sequence_ + 1;
+        slot.root = root;
+        slot.count = static_cast<std::uint64_t>(count_);
+        slot.end = end_;
+        slot.free_head = free_head;
+        slot.clean = clean ? 1 : 0;
+        slot.checksum = Checksum(slot);
+        std::memcpy(mapping_ + kSlotOffset[slot.sequence % 2], &slot,
+            sizeof(slot));
+        sequence_ = slot.sequence;
+        root_ = root;
+        clean_ = clean;
+    }
+
+    void Sync(std::size_t offset, std::size_t size) {
+        if (msync(mapping_ + offset, size, MS_SYNC) != 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+    }
+
+    /**
+     * Doubles the file and its mapping.  Moves every node.
+     */
+    void Grow() {
+        std::size_t size = mapping_size_ * 2;
+        if (ftruncate(fd_, static_cast<off_t>(size)) != 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+        void *mapping = mremap(mapping_, mapping_size_, size, MREMAP_MAYMOVE);
+        if (mapping == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), path_);
+        mapping_ = static_cast<unsigned char*>(mapping);
+        mapping_size_ = size;
+    }
+
+    void Map(std::size_t size) {
+        void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd_, 0);
+        if (mapping == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), path_);
+        mapping_ = static_cast<unsigned char*>(mapping);
+        mapping_size_ = size;
+    }
+
+    /**
+     * Maps the file and reads its header, or writes one to an empty file.
+     */
+    void OpenFile() {
+        struct stat status;
+        if (fstat(fd_, &status) != 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+        std::size_t size = static_cast<std::size_t>(status.st_size);
+
+        if (size == 0) {
+            if (ftruncate(fd_, kMinFileSize) != 0)
+                throw std::system_error(errno, std::generic_category(), path_);
+            Map(kMinFileSize);
+            Header header{};
+            std::memcpy(header.magic, kMagic, sizeof(kMagic));
+            header.version = kVersion;
+            header.byte_order = ByteOrder();
+            header.key_size = sizeof(TKey);
+            header.value_size = sizeof(TValue);
+            header.node_size = sizeof(Node);
+            std::memcpy(mapping_, &header, sizeof(header));
+            Publish(kNone, kNone, true);
+            Sync(0, kHeaderSize);
+            return;
+        }
+
+        if (size < kHeaderSize)
+            throw std::runtime_error("! Not a PersistentAVLTree file !");
+        Map(size);
+        Header header;
+        std::memcpy(&header, mapping_, sizeof(header));
+        if (!std::equal(header.magic, header.magic + sizeof(kMagic), kMagic)
+                || header.version != kVersion)
+            throw std::runtime_error("! Not a PersistentAVLTree file !");
+        if (header.byte_order != ByteOrder()
+                || header.key_size != sizeof(TKey)
+                || header.value_size != sizeof(TValue)
+                || header.node_size != sizeof(Node)) {
+            throw std::runtime_error
+                ("! File was written for different key or value types !");
+        }
+
+        std::optional<Slot> current;
+        for (std::size_t offset : kSlotOffset) {
+            Slot slot;
+            std::memcpy(&slot, mapping_ + offset, sizeof(slot));
+            if (slot.checksum == Checksum(slot)
+                    && (!current || slot.sequence > current->sequence))
+                current = slot;
+        }
+        std::uint64_t capacity = (size - kHeaderSize) / sizeof(Node);
+        if (!current || current->end > capacity
+                || current->count > static_cast<std::uint64_t>(INT32_MAX)
+                || (current->root != kNone && current->root >= current->end))
+            throw std::runtime_error("! PersistentAVLTree file is corrupt !");
+
+        sequence_ = current->sequence;
+        root_ = current->root;
+        count_ = static_cast<int>(current->count);
+        end_ = current->end;
+        clean_ = current->clean != 0;
+        if (clean_) {
+            for (std::uint64_t id = current->free_head; id != kNone;
+                    id = At(id)->left) {
+                if (id >= end_ || free_.size() >= end_) {
+                    throw std::runtime_error
+                        ("! PersistentAVLTree file is corrupt !");
+                }
+                free_.push_back(id);
+            }
+        } else {
+            FindFreeNodes();
+        }
+    }
+
+    /**
+     * Rebuilds the free list after an unclean close: every node below the
+     * high water mark that the tree does not reach.
+     */
+    void FindFreeNodes() {
+        std::vector<bool> used(end_, false);
+        std::vector<std::uint64_t> my_stack;
+        if (root_ != kNone) my_stack.push_back(root_);
+        while (!my_stack.empty()) {
+            std::uint64_t id = my_stack.back();
+            my_stack.pop_back();
+            if (id >= end_ || used[id])
+                throw std::runtime_error
+                    ("! PersistentAVLTree file is corrupt !");
+            used[id] = true;
+            const Node *node = At(id);
+            if (node->left != kNone) my_stack.push_back(node->left);
+            if (node->right != kNone) my_stack.push_back(node->right);
+        }
+        for (std::uint64_t id = end_; id-- > 0;) {
+            if (!used[id]) free_.push_back(id);
+        }
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_PERSISTENTAVLTREE_H_
@@ -0,0 +1,575 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_RCUAVLTREE_H_
+#define SRC_RCUAVLTREE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <format>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <stack>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+#include "AVLTree.h"
+#include "AVLTreeNode.h"
+#include "EpochReclamation.h"
+#include "NodeArena.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Single writer / multiple reader AVL tree with RCU style root publishing.
+ *
+ * Published nodes are never modified.  The writer path copies every node it
+ * would change, builds the new version next to the old one, and publishes
+ * it with a release store of root_.  Readers pin an EpochManager and take
+ * an acquire load of root_, then walk a version that can not change under
+ * them: they never block, never retry, and never see a rotation half done.
+ * Nodes come from a NodeArena.  Nodes replaced by a publish are retired to
+ * the EpochManager and handed back to the arena once no reader can still be
+ * walking them.
+ *
+ * Writers are serialized by a mutex.  Update applies a whole batch of
+ * changes to one private version and publishes it once, so nodes copied
+ * earlier in the batch are reused rather than copied again.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >.
+ * @param <TValue>
+ *            Generic type representing the data being stored.
+ */
+template <class TKey, class TValue>
+class RcuAVLTree {
+ private:
+    std::atomic<AVLTreeNode<TKey, TValue>*> root_;
+    std::atomic<int> count_;
+    // Declared before epochs_, which hands retired nodes back to it when it
+    // is destroyed.
+    NodeArena<AVLTreeNode<TKey, TValue>> nodes_;
+    mutable EpochManager epochs_;
+
+    // Writer state, only touched while holding writer_lock_.
+    std::mutex writer_lock_;
+    AVLTreeNode<TKey, TValue> *working_root_;
+    int working_count_;
+    std::unordered_set<AVLTreeNode<TKey, TValue>*> fresh_;  // unpublished
+    std::vector<AVLTreeNode<TKey, TValue>*> replaced_;  // published, replaced
+
+ public:
+    /**
+     * Private version of the tree handed to an Update batch.  Changes made
+     * through a Writer become visible to readers together, when the batch
+     * is published.
+     */
+    class Writer {
+     public:
+        /**
+         * Add a key/value pair to the tree.
+         *
+         * @throws std::range_error if key is already present.
+         */
+        void Add(TKey key, TValue value) {
+            if (tree_->FindNode(tree_->working_root_, key) != nullptr)
+                throw std::range_error("! Key already exists in Tree !");
+            tree_->working_root_ = tree_->Insert(tree_->working_root_, key,
+                value);
+            tree_->working_count_++;
+        }
+
+        /**
+         * Add a key/value pair to the tree, or replace the value if key is
+         * already present.
+         */
+        void InsertOrAssign(TKey key, TValue value) {
+            if (tree_->FindNode(tree_->working_root_, key) == nullptr)
+                tree_->working_count_++;
+            tree_->working_root_ = tree_->Insert(tree_->working_root_, key,
+                value);
+        }
+
+        /**
+         * Remove an entry from the tree.
+         *
+         * @return MapEntry representing the key/value pair that was removed.
+         *
+         * @throws std::range_error if key is not present.
+         */
+        MapEntry<TKey, TValue> Remove(TKey key) {
+            const AVLTreeNode<TKey, TValue> *node =
+                tree_->FindNode(tree_->working_root_, key);
+            if (node == nullptr) {
+                throw std::range_error
+                    (std::format("! Key {} not present in Tree !", key));
+            }
+            MapEntry<TKey, TValue> map_entry = node->GetMapEntry();
+            tree_->working_root_ = tree_->Delete(tree_->working_root_, key);
+            tree_->working_count_--;
+            return map_entry;
+        }
+
+        /**
+         * Looks up key in the private version, including this batch's
+         * changes.
+         */
+        std::optional<TValue> Find(TKey key) const {
+            const AVLTreeNode<TKey, TValue> *node =
+                tree_->FindNode(tree_->working_root_, key);
+            if (node == nullptr) return std::nullopt;
+            return node->GetValue();
+        }
+
+     private:
+        friend class RcuAVLTree;
+        explicit Writer(RcuAVLTree *tree) : tree_(tree) {}
+        RcuAVLTree *tree_;
+    };
+
+    /**
+     * Read only view of one published version of the tree, for scans that
+     * must see a consistent state no matter how long they take.
+     *
+     * A Snapshot pins the tree's EpochManager for its whole life, so none
+     * of the nodes of its version are freed, and published nodes are never
+     * modified, so nothing a writer does can move them under an Iterator.
+     * Writers are never blocked by a Snapshot, but nothing they retire can
+     * be freed while any Snapshot is alive, so memory grows with the
+     * updates made during a long scan.
+     *
+     * The pin belongs to the thread that took the Snapshot, so a Snapshot
+     * must be used and destroyed on that thread.
+     */
+    class Snapshot {
+     public:
+        /**
+         * Read only iterator over a Snapshot, in the Snapshot's traversal
+         * order.
+         */
+        class Iterator {
+         public:
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+            using value_type = AVLTreeNode<TKey, TValue>;
+            using pointer = const AVLTreeNode<TKey, TValue>*;
+            using reference = const AVLTreeNode<TKey, TValue>&;
+
+            reference operator*() const { return *it_; }
+            pointer operator->() const { return &*it_; }
+            Iterator& operator++() { ++it_; return *this; }
+
+            friend bool operator== (const Iterator &a, const Iterator &b) {
+                return a.it_ == b.it_;
+            }
+            friend bool operator!= (const Iterator &a, const Iterator &b) {
+                return a.it_ != b.it_;
+            }
+
+         private:
+            friend class Snapshot;
+            explicit Iterator(typename AVLTree<TKey, TValue>::Iterator it)
+                : it_(it) {}
+            typename AVLTree<TKey, TValue>::Iterator it_;
+        };
+
+        Snapshot(Snapshot&&) = default;
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+
+        /**
+         * Returns the number of elements in this version.
+         */
+        int GetCount() const {
+            return root_ == nullptr ? 0 : root_->GetSize();
+        }
+
+        /**
+         * Looks up the value stored at key in this version.
+         *
+         * @return Value at key, or std::nullopt if key is not in this
+         *          version.
+         */
+        std::optional<TValue> Find(TKey key) const {
+            const AVLTreeNode<TKey, TValue> *node = FindNode(root_, key);
+            if (node == nullptr) return std::nullopt;
+            return node->GetValue();
+        }
+
+        Iterator begin() const {
+            return Iterator(typename AVLTree<TKey, TValue>::Iterator(root_,
+                traversal_method_));
+        }
+
+        Iterator end() const {
+            return Iterator(typename AVLTree<TKey, TValue>::Iterator(nullptr,
+                traversal_method_));
+        }
+
+     private:
+        friend class RcuAVLTree;
+
+        Snapshot(EpochManager *epochs,
+                const std::atomic<AVLTreeNode<TKey, TValue>*> &root,
+                AVLTreeTraversalMethod traversal_method)
+            : guard_(epochs), root_(root.load(std::memory_order_acquire)),
+              traversal_method_(traversal_method) {}
+
+        // Declared first, so the pin is taken before root_ is loaded.
+        EpochManager::Guard guard_;
+        // Never written through: published nodes are immutable, and the
+        // AVLTree Iterator only reads through its pointers.
+        AVLTreeNode<TKey, TValue> *root_;
+        AVLTreeTraversalMethod traversal_method_;
+    };
+
+    /**
+     * Creates a new, empty, RcuAVLTree.
+     */
+    RcuAVLTree() : root_(nullptr), count_(0), working_root_(nullptr),
+        working_count_(0) {}
+
+    RcuAVLTree(const RcuAVLTree&) = delete;
+    RcuAVLTree& operator=(const RcuAVLTree&) = delete;
+
+    ~RcuAVLTree() {
+        std::stack<AVLTreeNode<TKey, TValue>*> my_stack;
+        if (root_ != nullptr) my_stack.push(root_);
+        while (!my_stack.empty()) {
+            AVLTreeNode<TKey, TValue> *node = my_stack.top(); my_stack.pop();
+            if (node->GetLeft() != nullptr) my_stack.push(node->GetLeft());
+            if (node->GetRight() != nullptr) my_stack.push(node->GetRight());
+            nodes_.Delete(node);
+        }
+    }
+
+    /**
+     * Returns the number of elements in the published version.
+     */
+    int GetCount() const { return count_.load(std::memory_order_acquire); }
+
+    /**
+     * Returns the height of the published version.
+     */
+    int GetTreeHieight() const {
+        EpochManager::Guard guard = epochs_.Pin();
+        const AVLTreeNode<TKey, TValue> *root =
+            root_.load(std::memory_order_acquire);
+        return root == nullptr ? 0 : root->GetHeight();
+    }
+
+    /**
+     * Looks up the value stored at key in the published version.  Never
+     * blocks.
+     *
+     * @param Key Key to locate in the tree.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) const {
+        EpochManager::Guard guard = epochs_.Pin();
+        const AVLTreeNode<TKey, TValue> *node =
+            FindNode(root_.load(std::memory_order_acquire), key);
+        if (node == nullptr) return std::nullopt;
+        return node->GetValue();
+    }
+
+    /**
+     * Returns true if key is present in the published version.
+     */
+    bool Contains(TKey key) const { return Find(key).has_value(); }
+
+    /**
+     * Takes a Snapshot of the current published version.
+     *
+     * @param traversal_method Order the Snapshot's Iterator visits nodes.
+     */
+    Snapshot GetSnapshot(AVLTreeTraversalMethod traversal_method =
+            AVLTreeTraversalMethod::InOrder) const {
+        return Snapshot(&epochs_, root_, traversal_method);
+    }
+
+    /**
+     * Calls func for every node of one published version, in key order.
+     * Writers are not blocked, and changes published during the walk are
+     * not seen.
+     *
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) const {
+        EpochManager::Guard guard = epochs_.Pin();
+        std::stack<const AVLTreeNode<TKey, TValue>*> my_stack;
+        const AVLTreeNode<TKey, TValue> *current =
+            root_.load(std::memory_order_acquire);
+
+        while (current != nullptr || !my_stack.empty()) {
+            while (current != nullptr) {
+                my_stack.push(current);
+                current = current->GetLeft();
+            }
+            current = my_stack.top(); my_stack.pop();
+            func(*current);
+            current = current->GetRight();
+        }
+    }
+
+    /**
+     * Calls func for every node with low <= key <= high of one published
+     * version, in key order.
+     *
+     * @param low Smallest key to visit.
+     * @param high Largest key to visit.
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     */
+    template <typename Func>
+    void Range(TKey low, TKey high, Func func) const {
+        EpochManager::Guard guard = epochs_.Pin();
+        std::stack<const AVLTreeNode<TKey, TValue>*> my_stack;
+        const AVLTreeNode<TKey, TValue> *current =
+            root_.load(std::memory_order_acquire);
+
+        while (current != nullptr || !my_stack.empty()) {
+            while (current != nullptr) {
+                if (current->GetKey() < low) {
+                    current = current->GetRight();
+                } else {
+                    my_stack.push(current);
+                    current = current->GetLeft();
+                }
+            }
+            if (my_stack.empty()) break;
+            current = my_stack.top(); my_stack.pop();
+            if (current->GetKey() > high) break;
+            func(*current);
+            current = current->GetRight();
+        }
+    }
+
+    /**
+     * Applies a batch of changes and publishes them as one new version.  If
+     * func throws, nothing from the batch is published.
+     *
+     * @param func Callable taking a RcuAVLTree<TKey, TValue>::Writer&.
+     */
+    template <typename Func>
+    void Update(Func func) {
+        std::lock_guard<std::mutex> lock(writer_lock_);
+        Writer writer(this);
+        try {
+            func(writer);
+        } catch (...) {
+            Abort();
+            throw;
+        }
+        Publish();
+    }
+
+    /**
+     * Add a key/value pair to the tree and publish.
+     *
+     * @throws std::range_error if key is already present.
+     */
+    void Add(TKey key, TValue value) {
+        Update([&key, &value](Writer &writer) { writer.Add(key, value); });
+    }
+
+    /**
+     * Add or replace a key/value pair and publish.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        Update([&key, &value](Writer &writer) {
+            writer.InsertOrAssign(key, value);
+        });
+    }
+
+    /**
+     * Remove an entry from the tree and publish.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        std::optional<MapEntry<TKey, TValue>> map_entry;
+        Update([&key, &map_entry](Writer &writer) {
+            map_entry.emplace(writer.Remove(key));
+        });
+        return *map_entry;
+    }
+
+ private:
+    static AVLTreeNode<TKey, TValue>* FindNode(
+            AVLTreeNode<TKey, TValue> *current, const TKey &key) {
+        while (current != nullptr) {
+            if (current->GetKey() == key) return current;
+            if (current->GetKey() < key)
+                current = current->GetRight();
+            else
+                current = current->GetLeft();
+        }
+        return nullptr;
+    }
+
+    /**
+     * Publishes the working version with a release store, then retires the
+     * nodes it replaced.
+     */
+    void Publish() {
+        root_.store(working_root_, std::memory_order_release);
+        count_.store(working_count_, std::memory_order_release);
+        fresh_.clear();
+        for (AVLTreeNode<TKey, TValue> *node : replaced_)
+            nodes_.Retire(&epochs_, node);
+        replaced_.clear();
+    }
+
+    /**
+     * Throws away the working version.
+     */
+    void Abort() {
+        for (AVLTreeNode<TKey, TValue> *node : fresh_) nodes_.Delete(node);
+        fresh_.clear();
+        replaced_.clear();
+        working_root_ = root_.load(std::memory_order_relaxed);
+        working_count_ = count_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns a copy of node that is safe to modify.  Nodes already copied
+     * in this batch are returned as is.
+     */
+    AVLTreeNode<TKey, TValue>* Copy(AVLTreeNode<TKey, TValue> *node) {
+        if (fresh_.contains(node)) return node;
+        AVLTreeNode<TKey, TValue> *copy = nodes_.New(*node);
+        fresh_.insert(copy);
+        replaced_.push_back(node);
+        return copy;
+    }
+
+    /**
+     * Drops a node from the working version.
+     */
+    void Discard(AVLTreeNode<TKey, TValue> *node) {
+        if (fresh_.erase(node) > 0) {
+            nodes_.Delete(node);
+        } else {
+            replaced_.push_back(node);
+        }
+    }
+
+    AVLTreeNode<TKey, TValue>* Insert(AVLTreeNode<TKey, TValue> *node,
+            const TKey &key, const TValue &value) {
+        if (node == nullptr) {
+            AVLTreeNode<TKey, TValue> *leaf = nodes_.New(key, value);
+            fresh_.insert(leaf);
+            return leaf;
+        }
+
+        AVLTreeNode<TKey, TValue> *copy = Copy(node);
+        if (key == copy->GetKey()) {
+            copy->SetValue(value);
+            return copy;
+        }
+        if (key < copy->GetKey())
+            copy->SetLeft(Insert(copy->GetLeft(), key, value));
+        else
+            copy->SetRight(Insert(copy->GetRight(), key, value));
+        return Balance(copy);
+    }
+
+    AVLTreeNode<TKey, TValue>* Delete(AVLTreeNode<TKey, TValue> *node,
+            const TKey &key) {
+        if (key < node->GetKey()) {
+            AVLTreeNode<TKey, TValue> *copy = Copy(node);
+            copy->SetLeft(Delete(copy->GetLeft(), key));
+            return Balance(copy);
+        }
+        if (key > node->GetKey()) {
+            AVLTreeNode<TKey, TValue> *copy = Copy(node);
+            copy->SetRight(Delete(copy->GetRight(), key));
+            return Balance(copy);
+        }
+
+        AVLTreeNode<TKey, TValue> *left = node->GetLeft();
+        AVLTreeNode<TKey, TValue> *right = node->GetRight();
+        Discard(node);
+        if (left == nullptr) return right;
+        if (right == nullptr) return left;
+
+        // Replace node with the smallest node of its right subtree.
+        AVLTreeNode<TKey, TValue> *successor = nullptr;
+        right = DeleteMin(right, &successor);
+        AVLTreeNode<TKey, TValue> *copy = Copy(successor);
+        copy->SetLeft(left);
+        copy->SetRight(right);
+        return Balance(copy);
+    }
+
+    AVLTreeNode<TKey, TValue>* DeleteMin(AVLTreeNode<TKey, TValue> *node,
+            AVLTreeNode<TKey, TValue> **min) {
+        if (node->GetLeft() == nullptr) {
+            *min = node;
+            return node->GetRight();
+        }
+        AVLTreeNode<TKey, TValue> *copy = Copy(node);
+        copy->SetLeft(DeleteMin(copy->GetLeft(), min));
+        return Balance(copy);
+    }
+
+    /**
+     * Restores the AVL property at a freshly copied node.
+     */
+    AVLTreeNode<TKey, TValue>* Balance(AVLTreeNode<TKey, TValue> *node) {
+        node->CalculateHeight();
+        if (node->GetBalanceFactor() > 1) {
+            if (node->GetLeft()->GetBalanceFactor() < 0)
+                node->SetLeft(RotateLeft(Copy(node->GetLeft())));
+            return RotateRight(node);
+        }
+        if (node->GetBalanceFactor() < -1) {
+            if (node->GetRight()->GetBalanceFactor() > 0)
+                node->SetRight(RotateRight(Copy(node->GetRight())));
+            return RotateLeft(node);
+        }
+        return node;
+    }
+
+    AVLTreeNode<TKey, TValue>* RotateRight(AVLTreeNode<TKey, TValue> *node) {
+        AVLTreeNode<TKey, TValue> *left_node = Copy(node->GetLeft());
+        node->SetLeft(left_node->GetRight());
+        left_node->SetRight(node);
+        node->CalculateHeight();
+        left_node->CalculateHeight();
+        return left_node;
+    }
+
+    AVLTreeNode<TKey, TValue>* RotateLeft(AVLTreeNode<TKey, TValue> *node) {
+        AVLTreeNode<TKey, TValue> *right_node = Copy(node->GetRight());
+        node->SetRight(right_node->GetLeft());
+        right_node->SetLeft(node);
+        node->CalculateHeight();
+        right_node->CalculateHeight();
+        return right_node;
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_RCUAVLTREE_H_
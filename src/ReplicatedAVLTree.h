@@ -0,0 +1,339 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_REPLICATEDAVLTREE_H_
+#define SRC_REPLICATEDAVLTREE_H_
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "AVLTree.h"
+#include "AVLTreeOperation.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * AVL tree replicated once per NUMA node, so lookups never leave the
+ * calling thread's node (Calciu et al., "Black-box Concurrent Data
+ * Structures for NUMA Architectures").
+ *
+ * Every change is appended to one shared operation log, which fixes the
+ * order of all changes.  Each replica is an ordinary AVLTree that replays
+ * the log at its own pace.  A writer appends its operation and then brings
+ * its local replica up to date, which also yields the operation's result.
+ * A reader notes the end of the log, brings its local replica up to that
+ * point if it is behind, and then looks up under the replica's shared lock.
+ * Catching up stable sorts the pending part of the log by key and replays
+ * it with AVLTree::ApplyBatch; operations on different keys commute, and
+ * the sort keeps operations on the same key in log order.
+ *
+ * Replica nodes are allocated by the threads that replay the log into that
+ * replica, which are nearly always threads running on the replica's node,
+ * so the kernel's first touch policy places them in local memory.  When
+ * the log grows past kLogLimit, the writer that noticed brings every
+ * replica up to date so the log can be trimmed; nodes it allocates for
+ * remote replicas then live on its own node until they are replaced.
+ *
+ * The node count is read from /sys/devices/system/node, and the calling
+ * thread's node from getcpu(2).  Runs correctly, with one replica, on a
+ * machine without NUMA; use numactl --cpunodebind to pin test threads.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >.
+ * @param <TValue>
+ *            Generic type representing the data being stored.
+ */
+template <class TKey, class TValue>
+class ReplicatedAVLTree {
+ private:
+    // Log length at which writers start bringing lagging replicas up to date.
+    static constexpr std::size_t kLogLimit = 4096;
+
+    struct Replica {
+        // Shared for lookups, exclusive while replaying the log.
+        std::shared_mutex mutex;
+        AVLTree<TKey, TValue> tree;
+        // Log index replayed up to.  Written with mutex held exclusively.
+        std::atomic<std::uint64_t> applied{0};
+    };
+
+    std::vector<std::unique_ptr<Replica>> replicas_;
+
+    std::mutex log_mutex_;
+    std::deque<AVLTreeOperation<TKey, TValue>> log_;
+    std::uint64_t log_head_;  // log index of log_.front()
+    std::atomic<std::uint64_t> log_tail_;  // log index one past log_.back()
+
+ public:
+    /**
+     * Creates a new, empty, ReplicatedAVLTree with one replica per NUMA
+     * node.
+     */
+    ReplicatedAVLTree() : ReplicatedAVLTree(GetNumaNodeCount()) {}
+
+    /**
+     * Creates a new, empty, ReplicatedAVLTree with replica_count replicas.
+     * NUMA node n uses replica n % replica_count.
+     *
+     * @throws invalid_argument if replica_count is less than 1
+     */
+    explicit ReplicatedAVLTree(int replica_count) {
+        if (replica_count < 1)
+            throw std::invalid_argument("! Replica count must be positive !");
+        for (int i = 0; i < replica_count; i++)
+            replicas_.push_back(std::make_unique<Replica>());
+        log_head_ = 0;
+        log_tail_ = 0;
+    }
+
+    ReplicatedAVLTree(const ReplicatedAVLTree&) = delete;
+    ReplicatedAVLTree& operator=(const ReplicatedAVLTree&) = delete;
+
+    /**
+     * Returns the number of replicas.
+     */
+    int GetReplicaCount() const { return static_cast<int>(replicas_.size()); }
+
+    /**
+     * Returns the number of NUMA nodes on this machine, 1 if unknown.
+     */
+    static int GetNumaNodeCount() {
+        std::ifstream possible("/sys/devices/system/node/possible");
+        std::string nodes;
+        if (!(possible >> nodes) || nodes.empty()) return 1;
+        // A list such as "0" or "0-3" or "0,2-3"; the last number is the
+        // highest node id.
+        std::size_t last = nodes.find_last_of("-,");
+        std::string highest = last == std::string::npos ? nodes
+            : nodes.substr(last + 1);
+        try {
+            return std::stoi(highest) + 1;
+        } catch (const std::exception&) {
+            return 1;
+        }
+    }
+
+    /**
+     * Returns the NUMA node the calling thread is running on, 0 if unknown.
+     */
+    static int GetCurrentNumaNode() {
+        unsigned int cpu = 0;
+        unsigned int node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return 0;
+        return static_cast<int>(node);
+    }
+
+    /**
+     * Returns the number of elements in the tree.
+     */
+    int GetCount() {
+        Replica &replica = Local();
+        std::shared_lock<std::shared_mutex> lock = ReadLock(&replica);
+        return replica.tree.GetCount();
+    }
+
+    /**
+     * Looks up the value stored at key, in the calling thread's local
+     * replica.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) {
+        Replica &replica = Local();
+        std::shared_lock<std::shared_mutex> lock = ReadLock(&replica);
+        return replica.tree.Find(key);
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) { return Find(key).has_value(); }
+
+    /**
+     * Calls func for every node of the local replica, in key order.  func
+     * must not call back into this tree.
+     *
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) {
+        Replica &replica = Local();
+        std::shared_lock<std::shared_mutex> lock = ReadLock(&replica);
+        replica.tree.ForEach(func);
+    }
+
+    /**
+     * Add a key/value pair to the tree.
+     *
+     * @throws std::range_error if key is already present.
+     */
+    void Add(TKey key, TValue value) {
+        if (!Execute({AVLTreeOperationType::Add, key, value}).applied)
+            throw std::range_error("! Key already exists in Tree !");
+    }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        Execute({AVLTreeOperationType::InsertOrAssign, key, value});
+    }
+
+    /**
+     * Remove an entry from the tree.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        AVLTreeOperation<TKey, TValue> op =
+            Execute({AVLTreeOperationType::Remove, key});
+        if (!op.applied)
+            throw std::range_error
+                (std::format("! Key {} not present in Tree !", key));
+        return MapEntry<TKey, TValue>(op.key, op.value);
+    }
+
+ private:
+    Replica& Local() {
+        return *replicas_[GetCurrentNumaNode() % replicas_.size()];
+    }
+
+    /**
+     * Shared lock on replica, taken once replica has replayed every change
+     * logged before the call.
+     */
+    std::shared_lock<std::shared_mutex> ReadLock(Replica *replica) {
+        std::uint64_t tail = log_tail_.load(std::memory_order_acquire);
+        if (replica->applied.load(std::memory_order_acquire) < tail) {
+            std::unique_lock<std::shared_mutex> lock(replica->mutex);
+            CatchUp(replica, tail, tail, nullptr);
+        }
+        return std::shared_lock<std::shared_mutex>(replica->mutex);
+    }
+
+    /**
+     * Logs op, replays it on the local replica, and returns it with its
+     * result filled in.
+     */
+    AVLTreeOperation<TKey, TValue> Execute(AVLTreeOperation<TKey, TValue> op) {
+        Replica &replica = Local();
+        bool log_full;
+        {
+            std::unique_lock<std::shared_mutex> lock(replica.mutex);
+            std::uint64_t index;
+            {
+                std::lock_guard<std::mutex> log_lock(log_mutex_);
+                index = log_head_ + log_.size();
+                log_.push_back(op);
+                log_tail_.store(index + 1, std::memory_order_release);
+                log_full = log_.size() > kLogLimit;
+            }
+            CatchUp(&replica, index + 1, index, &op);
+        }
+
+        if (log_full) {
+            // Only one replica lock is ever held at a time.
+            std::uint64_t tail = log_tail_.load(std::memory_order_acquire);
+            for (std::unique_ptr<Replica> &other : replicas_) {
+                std::unique_lock<std::shared_mutex> lock(other->mutex);
+                CatchUp(other.get(), tail, tail, nullptr);
+            }
+        }
+        return op;
+    }
+
+    /**
+     * Replays the log on replica up to index target, then trims whatever
+     * every replica has replayed.  Called with replica->mutex held
+     * exclusively.
+     *
+     * @param watch Log index whose result is copied to *result.
+     */
+    void CatchUp(Replica *replica, std::uint64_t target, std::uint64_t watch,
+            AVLTreeOperation<TKey, TValue> *result) {
+        std::uint64_t from = replica->applied.load(std::memory_order_relaxed);
+        if (from >= target) return;
+
+        std::vector<AVLTreeOperation<TKey, TValue>> pending;
+        {
+            std::lock_guard<std::mutex> log_lock(log_mutex_);
+            pending.assign(log_.begin() + (from - log_head_),
+                log_.begin() + (target - log_head_));
+        }
+
+        std::vector<std::size_t> order(pending.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+            [&pending](std::size_t a, std::size_t b) {
+                return pending[a].key < pending[b].key;
+            });
+        std::vector<AVLTreeOperation<TKey, TValue>> batch;
+        batch.reserve(order.size());
+        for (std::size_t i : order) batch.push_back(pending[i]);
+
+        replica->tree.ApplyBatch(batch);
+        replica->applied.store(target, std::memory_order_release);
+
+        if (result != nullptr && watch >= from && watch < target) {
+            for (std::size_t i = 0; i < order.size(); i++) {
+                if (order[i] == watch - from) *result = batch[i];
+            }
+        }
+
+        Trim();
+    }
+
+    /**
+     * Drops the log entries every replica has replayed.
+     */
+    void Trim() {
+        std::uint64_t oldest = log_tail_.load(std::memory_order_acquire);
+        for (std::unique_ptr<Replica> &replica : replicas_) {
+            oldest = std::min(oldest,
+                replica->applied.load(std::memory_order_acquire));
+        }
+
+        std::lock_guard<std::mutex> log_lock(log_mutex_);
+        while (log_head_ < oldest) {
+            log_.pop_front();
+            log_head_++;
+        }
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_REPLICATEDAVLTREE_H_
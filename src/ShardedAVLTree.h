@@ -0,0 +1,325 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_SHARDEDAVLTREE_H_
+#define SRC_SHARDEDAVLTREE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "AVLTree.h"
+#include "EpochReclamation.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * AVL tree partitioned by key range into shards that are locked
+ * independently, so writers working on disjoint key ranges never contend.
+ *
+ * Shard i holds the keys in [split_points[i - 1], split_points[i]).  The
+ * split points live in an immutable layout published through an atomic
+ * pointer, so routing a key to its shard takes no lock at all; only the
+ * shard's own std::shared_mutex is taken.  Each shard also records its own
+ * bounds, which are checked once the shard is locked, so an operation that
+ * raced with Rebalance simply routes again.
+ *
+ * Rebalance moves the boundary between neighboring shards whose sizes have
+ * drifted apart, using AVLTree::Split and AVLTree::Join, so moving m
+ * entries costs O(log n) rather than O(m log n).
+ *
+ * Iteration (ForEach, Range) walks the shards in key order, holding one
+ * shard's shared lock at a time.  Because the shards hold disjoint,
+ * ordered key ranges, merging them is a concatenation.  The walk also holds
+ * the rebalance lock shared, so no boundary moves under it and every key
+ * is seen once, in order; the result is still not a snapshot across
+ * shards.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >.
+ * @param <TValue>
+ *            Generic type representing the data being stored.
+ */
+template <class TKey, class TValue>
+class ShardedAVLTree {
+ private:
+    struct Shard {
+        AVLTree<TKey, TValue> tree;
+        std::optional<TKey> low;   // inclusive, nullopt is unbounded
+        std::optional<TKey> high;  // exclusive, nullopt is unbounded
+        mutable std::shared_mutex mutex;
+
+        bool Holds(const TKey &key) const {
+            return (!low.has_value() || !(key < *low))
+                && (!high.has_value() || key < *high);
+        }
+    };
+
+    struct Layout {
+        std::vector<TKey> split_points;
+
+        std::size_t Route(const TKey &key) const {
+            return std::upper_bound(split_points.begin(), split_points.end(),
+                key) - split_points.begin();
+        }
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<Layout*> layout_;
+    mutable EpochManager epochs_;
+    // Held exclusively by Rebalance and shared by iteration.
+    mutable std::shared_mutex rebalance_lock_;
+
+ public:
+    /**
+     * Creates a ShardedAVLTree with split_points.size() + 1 shards.
+     *
+     * @param split_points Strictly increasing keys at which a new shard
+     *          starts.
+     *
+     * @throws invalid_argument if split_points are not strictly increasing
+     */
+    explicit ShardedAVLTree(std::vector<TKey> split_points) {
+        for (std::size_t i = 1; i < split_points.size(); i++) {
+            if (!(split_points[i - 1] < split_points[i]))
+                throw std::invalid_argument
+                    ("! Split points must be strictly increasing !");
+        }
+
+        for (std::size_t i = 0; i <= split_points.size(); i++) {
+            std::unique_ptr<Shard> shard = std::make_unique<Shard>();
+            if (i > 0) shard->low = split_points[i - 1];
+            if (i < split_points.size()) shard->high = split_points[i];
+            shards_.push_back(std::move(shard));
+        }
+        layout_ = new Layout{std::move(split_points)};
+    }
+
+    ShardedAVLTree(const ShardedAVLTree&) = delete;
+    ShardedAVLTree& operator=(const ShardedAVLTree&) = delete;
+
+    ~ShardedAVLTree() { delete layout_.load(); }
+
+    /**
+     * Returns the number of shards.
+     */
+    int GetShardCount() const { return static_cast<int>(shards_.size()); }
+
+    /**
+     * Returns the number of entries in every shard.  Not a snapshot, each
+     * shard is counted under its own lock.
+     */
+    std::vector<int> GetShardCounts() const {
+        std::vector<int> counts;
+        for (const std::unique_ptr<Shard> &shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            counts.push_back(shard->tree.GetCount());
+        }
+        return counts;
+    }
+
+    /**
+     * Returns the number of elements in the tree.
+     */
+    int GetCount() const {
+        int count = 0;
+        for (int shard_count : GetShardCounts()) count += shard_count;
+        return count;
+    }
+
+    /**
+     * Looks up the value stored at key.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) const {
+        std::optional<TValue> result;
+        WithShard<std::shared_lock<std::shared_mutex>>(key,
+            [&result, &key](Shard &shard) { result = shard.tree.Find(key); });
+        return result;
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) const { return Find(key).has_value(); }
+
+    /**
+     * Add a key/value pair to the tree.
+     *
+     * @throws std::range_error if key is already present.
+     */
+    void Add(TKey key, TValue value) {
+        WithShard<std::unique_lock<std::shared_mutex>>(key,
+            [&key, &value](Shard &shard) { shard.tree.Add(key, value); });
+    }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        WithShard<std::unique_lock<std::shared_mutex>>(key,
+            [&key, &value](Shard &shard) {
+                shard.tree.InsertOrAssign(key, value);
+            });
+    }
+
+    /**
+     * Remove an entry from the tree.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        std::optional<MapEntry<TKey, TValue>> map_entry;
+        WithShard<std::unique_lock<std::shared_mutex>>(key,
+            [&key, &map_entry](Shard &shard) {
+                map_entry.emplace(shard.tree.Remove(key));
+            });
+        return *map_entry;
+    }
+
+    /**
+     * Calls func for every node in key order, shard by shard.  func must
+     * not call back into this tree.
+     *
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) const {
+        std::shared_lock<std::shared_mutex> rebalance_guard(rebalance_lock_);
+        for (const std::unique_ptr<Shard> &shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            shard->tree.ForEach(func);
+        }
+    }
+
+    /**
+     * Calls func for every node with low <= key <= high, in key order.
+     * Shards whose bounds do not overlap the range are skipped.
+     *
+     * @param low Smallest key to visit.
+     * @param high Largest key to visit.
+     * @param func Callable taking a const AVLTreeNode<TKey, TValue>&.
+     */
+    template <typename Func>
+    void Range(TKey low, TKey high, Func func) const {
+        std::shared_lock<std::shared_mutex> rebalance_guard(rebalance_lock_);
+        for (const std::unique_ptr<Shard> &shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            if ((!shard->high.has_value() || low < *shard->high)
+                    && (!shard->low.has_value() || !(high < *shard->low))) {
+                shard->tree.Range(low, high, func);
+            }
+        }
+    }
+
+    /**
+     * Evens out neighboring shards.  Whenever one shard of a neighboring
+     * pair holds more than twice as many entries as the other, the boundary
+     * between them is moved so both hold half of the pair's entries.  Only
+     * the two shards involved are locked while a boundary moves, but
+     * Rebalance waits for ForEach and Range calls in progress to finish.
+     *
+     * @return Number of boundaries moved.
+     */
+    int Rebalance() {
+        std::unique_lock<std::shared_mutex> rebalance_guard(rebalance_lock_);
+        int moved = 0;
+        for (std::size_t i = 0; i + 1 < shards_.size(); i++) {
+            if (RebalancePair(i)) moved++;
+        }
+        return moved;
+    }
+
+ private:
+    /**
+     * Routes key to its shard, locks the shard with TLock, and calls func.
+     * Routes again if a Rebalance moved key out of the shard in between.
+     */
+    template <typename TLock, typename Func>
+    void WithShard(const TKey &key, Func func) const {
+        while (true) {
+            std::size_t index;
+            {
+                EpochManager::Guard guard = epochs_.Pin();
+                index = layout_.load(std::memory_order_acquire)->Route(key);
+            }
+            Shard &shard = *shards_[index];
+            TLock lock(shard.mutex);
+            if (shard.Holds(key)) {
+                func(shard);
+                return;
+            }
+        }
+    }
+
+    /**
+     * Moves the boundary between shards i and i + 1 if they are out of
+     * balance.
+     */
+    bool RebalancePair(std::size_t i) {
+        Shard &left = *shards_[i];
+        Shard &right = *shards_[i + 1];
+        std::unique_lock<std::shared_mutex> left_lock(left.mutex);
+        std::unique_lock<std::shared_mutex> right_lock(right.mutex);
+
+        int left_count = left.tree.GetCount();
+        int right_count = right.tree.GetCount();
+        int target = (left_count + right_count) / 2;
+        TKey boundary;
+
+        if (left_count > 2 * right_count + 1) {
+            // Move the top of left into right.
+            boundary = left.tree.GetKeyAt(target);
+            AVLTree<TKey, TValue> moved = left.tree.Split(boundary);
+            moved.Join(right.tree);
+            right.tree = std::move(moved);
+        } else if (right_count > 2 * left_count + 1) {
+            // Move the bottom of right into left.
+            boundary = right.tree.GetKeyAt(target - left_count);
+            AVLTree<TKey, TValue> rest = right.tree.Split(boundary);
+            left.tree.Join(right.tree);
+            right.tree = std::move(rest);
+        } else {
+            return false;
+        }
+
+        left.high = boundary;
+        right.low = boundary;
+
+        Layout *old_layout = layout_.load(std::memory_order_relaxed);
+        Layout *new_layout = new Layout(*old_layout);
+        new_layout->split_points[i] = boundary;
+        layout_.store(new_layout, std::memory_order_release);
+        epochs_.Retire(old_layout);
+        return true;
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_SHARDEDAVLTREE_H_
@@ -0,0 +1,736 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_SHAREDAVLTREE_H_
+#define SRC_SHAREDAVLTREE_H_
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "CopyOnWriteAVL.h"
+#include "MapEntry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Layout of a SharedAVLTree segment, shared by the writer and readers.
+ *
+ * A segment is a control block, an array of reader slots, and, from the
+ * next page boundary, an array of OffsetAVLNodes.
+ */
+struct SharedAVLTreeLayout {
+    static constexpr char kMagic[8] = {'1', '1', 'c', 'A', 'V', 'L', 'S',
+        '\0'};
+    static constexpr std::uint32_t kVersion = 1;
+    static constexpr std::uint64_t kNone = ~std::uint64_t{0};
+
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+        "SharedAVLTree needs lock free 64 bit atomics");
+
+    struct Control {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;  // 0 little endian, 1 big endian
+        std::uint32_t key_size;
+        std::uint32_t value_size;
+        std::uint32_t node_size;
+        std::uint32_t reader_slots;
+        std::uint64_t capacity;      // nodes
+        std::uint64_t nodes_offset;  // bytes from the start of the segment
+        std::atomic<std::uint32_t> ready;  // set once the rest is written
+
+        alignas(64) std::atomic<std::uint64_t> root;
+        std::atomic<std::uint64_t> count;
+        alignas(64) std::atomic<std::uint64_t> epoch;
+    };
+
+    /**
+     * Claimed by one reader.  epoch is the global epoch the reader saw when
+     * it started its current operation, or 0 between operations.
+     */
+    struct alignas(64) ReaderSlot {
+        std::atomic<std::int64_t> pid;  // 0 if free
+        std::atomic<std::uint64_t> epoch;
+    };
+
+    static constexpr std::size_t kSlotsOffset =
+        (sizeof(Control) + alignof(ReaderSlot) - 1) / alignof(ReaderSlot)
+        * alignof(ReaderSlot);
+
+    static std::uint32_t ByteOrder() {
+        return std::endian::native == std::endian::little ? 0 : 1;
+    }
+
+    static std::size_t NodesOffset(std::size_t reader_slots) {
+        std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t size = kSlotsOffset + reader_slots * sizeof(ReaderSlot);
+        return (size + page - 1) / page * page;
+    }
+
+    static ReaderSlot* Slots(unsigned char *segment) {
+        return reinterpret_cast<ReaderSlot*>(segment + kSlotsOffset);
+    }
+};
+
+/**
+ * AVL tree built by one process in a POSIX shared memory segment and read,
+ * in place, by any number of others through SharedAVLTreeReader, so that
+ * a host keeps one copy of the tree rather than one per process.
+ *
+ * Nodes are OffsetAVLNodes, linked by index, so the segment means the same
+ * thing wherever each process maps it.  The writer allocates nodes from a
+ * fixed capacity set when the segment is created.
+ *
+ * Updates work like RcuAVLTree's.  The writer copies every node it would
+ * change (see CopyOnWriteAVL), builds the new version next to the old one,
+ * and publishes it with an atomic store of the root in the segment, so
+ * readers never block and never see a change half done.  Update publishes
+ * a whole batch of changes at once.
+ *
+ * Nodes replaced by a publish are reclaimed by epochs kept in the segment.
+ * Each publish advances the global epoch.  Readers copy the global epoch
+ * into their reader slot for the length of each operation, and a node
+ * retired in epoch e is reused only once every busy reader has an epoch
+ * after e.  The slot of a reader process that died mid operation is freed
+ * when the writer finds the process gone.
+ *
+ * The writer creates the segment and unlinks its name when destroyed;
+ * readers already attached keep their mappings.  Writers are serialized
+ * by a mutex.  Keys and values are stored as raw bytes, so both must be
+ * trivially copyable.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >, and be trivially copyable.
+ * @param <TValue>
+ *            Generic type representing the data being stored.  Must be
+ *            trivially copyable.
+ */
+template <class TKey, class TValue>
+class SharedAVLTree {
+    static_assert(std::is_trivially_copyable_v<TKey>,
+        "SharedAVLTree keys must be trivially copyable");
+    static_assert(std::is_trivially_copyable_v<TValue>,
+        "SharedAVLTree values must be trivially copyable");
+
+ private:
+    using Layout = SharedAVLTreeLayout;
+    using Node = OffsetAVLNode<TKey, TValue>;
+    using Algorithms = CopyOnWriteAVL<TKey, TValue, SharedAVLTree>;
+    friend Algorithms;
+
+    static constexpr std::uint64_t kNone = Node::kNone;
+
+    std::string name_;
+    unsigned char *segment_;
+    std::size_t segment_size_;
+    Layout::Control *control_;
+    Node *nodes_;
+    std::uint64_t capacity_;
+    std::uint32_t reader_slots_;
+
+    // Writer state, only touched while holding writer_lock_.
+    std::mutex writer_lock_;
+    std::uint64_t working_root_;
+    int working_count_;
+    std::uint64_t end_;  // nodes below end_ have been handed out
+    std::vector<std::uint64_t> free_;
+    std::unordered_set<std::uint64_t> fresh_;  // unpublished
+    std::vector<std::uint64_t> replaced_;  // published, replaced
+    // Replaced nodes waiting for readers, by the epoch they were retired in.
+    std::vector<std::pair<std::uint64_t, std::vector<std::uint64_t>>> limbo_;
+
+ public:
+    /**
+     * Private version of the tree handed to an Update batch.  Changes made
+     * through a Writer become visible to readers together, when the batch
+     * is published.
+     */
+    class Writer {
+     public:
+        /**
+         * Add a key/value pair to the tree.
+         *
+         * @throws std::range_error if key is already present.
+         * @throws runtime_error if the segment is full
+         */
+        void Add(TKey key, TValue value) {
+            if (tree_->FindNode(key) != nullptr)
+                throw std::range_error("! Key already exists in Tree !");
+            tree_->working_root_ = Algorithms(tree_).Insert(
+                tree_->working_root_, key, value);
+            tree_->working_count_++;
+        }
+
+        /**
+         * Add a key/value pair to the tree, or replace the value if key is
+         * already present.
+         *
+         * @throws runtime_error if the segment is full
+         */
+        void InsertOrAssign(TKey key, TValue value) {
+            if (tree_->FindNode(key) == nullptr) tree_->working_count_++;
+            tree_->working_root_ = Algorithms(tree_).Insert(
+                tree_->working_root_, key, value);
+        }
+
+        /**
+         * Remove an entry from the tree.
+         *
+         * @return MapEntry representing the key/value pair that was removed.
+         *
+         * @throws std::range_error if key is not present.
+         * @throws runtime_error if the segment is full
+         */
+        MapEntry<TKey, TValue> Remove(TKey key) {
+            const Node *node = tree_->FindNode(key);
+            if (node == nullptr) {
+                throw std::range_error
+                    (std::format("! Key {} not present in Tree !", key));
+            }
+            MapEntry<TKey, TValue> map_entry(node->key, node->value);
+            tree_->working_root_ = Algorithms(tree_).Erase(
+                tree_->working_root_, key);
+            tree_->working_count_--;
+            return map_entry;
+        }
+
+        /**
+         * Looks up key in the private version, including this batch's
+         * changes.
+         */
+        std::optional<TValue> Find(TKey key) const {
+            const Node *node = tree_->FindNode(key);
+            if (node == nullptr) return std::nullopt;
+            return node->value;
+        }
+
+     private:
+        friend class SharedAVLTree;
+        explicit Writer(SharedAVLTree *tree) : tree_(tree) {}
+        SharedAVLTree *tree_;
+    };
+
+    /**
+     * Creates the shared memory segment name, which must not exist, with
+     * room for capacity nodes and reader_slots attached readers.
+     *
+     * @param name POSIX shared memory object name, such as "/my-tree".
+     *
+     * @throws system_error if the segment can not be created or mapped
+     */
+    SharedAVLTree(std::string name, std::size_t capacity,
+            std::uint32_t reader_slots = 64)
+        : name_(std::move(name)), segment_(nullptr), segment_size_(0),
+          control_(nullptr), nodes_(nullptr), capacity_(capacity),
+          reader_slots_(reader_slots), working_root_(kNone),
+          working_count_(0), end_(0) {
+        std::size_t nodes_offset = Layout::NodesOffset(reader_slots);
+        segment_size_ = nodes_offset + capacity * sizeof(Node);
+
+        int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), name_);
+        void *segment = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(segment_size_)) == 0) {
+            segment = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+        }
+        int error = errno;
+        close(fd);
+        if (segment == MAP_FAILED) {
+            shm_unlink(name_.c_str());
+            throw std::system_error(error, std::generic_category(), name_);
+        }
+        segment_ = static_cast<unsigned char*>(segment);
+        nodes_ = reinterpret_cast<Node*>(segment_ + nodes_offset);
+
+        control_ = new (segment_) Layout::Control;
+        std::memcpy(control_->magic, Layout::kMagic, sizeof(Layout::kMagic));
+        control_->version = Layout::kVersion;
+        control_->byte_order = Layout::ByteOrder();
+        control_->key_size = sizeof(TKey);
+        control_->value_size = sizeof(TValue);
+        control_->node_size = sizeof(Node);
+        control_->reader_slots = reader_slots;
+        control_->capacity = capacity;
+        control_->nodes_offset = nodes_offset;
+        control_->root.store(kNone, std::memory_order_relaxed);
+        control_->count.store(0, std::memory_order_relaxed);
+        control_->epoch.store(1, std::memory_order_relaxed);
+        Layout::ReaderSlot *slots = Layout::Slots(segment_);
+        for (std::uint32_t i = 0; i < reader_slots; i++) {
+            Layout::ReaderSlot *slot = new (&slots[i]) Layout::ReaderSlot;
+            slot->pid.store(0, std::memory_order_relaxed);
+            slot->epoch.store(0, std::memory_order_relaxed);
+        }
+        control_->ready.store(1, std::memory_order_release);
+    }
+
+    SharedAVLTree(const SharedAVLTree&) = delete;
+    SharedAVLTree& operator=(const SharedAVLTree&) = delete;
+
+    /**
+     * Unmaps the segment and unlinks its name.
+     */
+    ~SharedAVLTree() {
+        munmap(segment_, segment_size_);
+        shm_unlink(name_.c_str());
+    }
+
+    /**
+     * Returns the number of elements in the published version.
+     */
+    int GetCount() const {
+        return static_cast<int>(control_->count.load(
+            std::memory_order_acquire));
+    }
+
+    /**
+     * Returns the number of nodes in use or waiting to be reclaimed.
+     */
+    std::uint64_t GetNodesUsed() {
+        std::lock_guard<std::mutex> lock(writer_lock_);
+        return end_ - free_.size();
+    }
+
+    /**
+     * Looks up the value stored at key in the published version.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) {
+        std::lock_guard<std::mutex> lock(writer_lock_);
+        const Node *node = FindNode(key);
+        if (node == nullptr) return std::nullopt;
+        return node->value;
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) { return Find(key).has_value(); }
+
+    /**
+     * Calls func for every entry of the published version, in key order.
+     * func must not change the tree.
+     *
+     * @param func Callable taking a const MapEntry<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) {
+        std::lock_guard<std::mutex> lock(writer_lock_);
+        Algorithms(this).ForEach(working_root_, func);
+    }
+
+    /**
+     * Applies a batch of changes and publishes them as one new version.  If
+     * func throws, nothing from the batch is published.
+     *
+     * @param func Callable taking a SharedAVLTree<TKey, TValue>::Writer&.
+     */
+    template <typename Func>
+    void Update(Func func) {
+        std::lock_guard<std::mutex> lock(writer_lock_);
+        Writer writer(this);
+        try {
+            func(writer);
+        } catch (...) {
+            Abort();
+            throw;
+        }
+        Publish();
+    }
+
+    /**
+     * Add a key/value pair to the tree and publish.
+     *
+     * @throws std::range_error if key is already present.
+     * @throws runtime_error if the segment is full
+     */
+    void Add(TKey key, TValue value) {
+        Update([&key, &value](Writer &writer) { writer.Add(key, value); });
+    }
+
+    /**
+     * Add or replace a key/value pair and publish.
+     *
+     * @throws runtime_error if the segment is full
+     */
+    void InsertOrAssign(TKey key, TValue value) {
+        Update([&key, &value](Writer &writer) {
+            writer.InsertOrAssign(key, value);
+        });
+    }
+
+    /**
+     * Remove an entry from the tree and publish.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     * @throws runtime_error if the segment is full
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        std::optional<MapEntry<TKey, TValue>> map_entry;
+        Update([&key, &map_entry](Writer &writer) {
+            map_entry.emplace(writer.Remove(key));
+        });
+        return *map_entry;
+    }
+
+ private:
+    // Heap interface for CopyOnWriteAVL.
+
+    Node* At(std::uint64_t id) { return &nodes_[id]; }
+
+    std::uint64_t Allocate() {
+        if (free_.empty() && end_ == capacity_) Reclaim();
+        std::uint64_t id;
+        if (!free_.empty()) {
+            id = free_.back();
+            free_.pop_back();
+        } else if (end_ < capacity_) {
+            id = end_++;
+        } else {
+            throw std::runtime_error("! Shared memory segment is full !");
+        }
+        fresh_.insert(id);
+        return id;
+    }
+
+    bool IsFresh(std::uint64_t id) const { return fresh_.contains(id); }
+
+    void Retire(std::uint64_t id) {
+        if (fresh_.erase(id) > 0) {
+            free_.push_back(id);
+        } else {
+            replaced_.push_back(id);
+        }
+    }
+
+    const Node* FindNode(const TKey &key) {
+        return Algorithms(this).Find(working_root_, key);
+    }
+
+    /**
+     * Publishes the working version, then advances the epoch and parks the
+     * nodes it replaced until no reader can still be walking them.
+     */
+    void Publish() {
+        control_->root.store(working_root_, std::memory_order_seq_cst);
+        control_->count.store(static_cast<std::uint64_t>(working_count_),
+            std::memory_order_release);
+        fresh_.clear();
+        std::uint64_t epoch = control_->epoch.fetch_add(1,
+            std::memory_order_seq_cst);
+        if (!replaced_.empty()) {
+            limbo_.emplace_back(epoch, std::move(replaced_));
+            replaced_.clear();
+        }
+        Reclaim();
+    }
+
+    /**
+     * Throws away the working version.
+     */
+    void Abort() {
+        free_.insert(free_.end(), fresh_.begin(), fresh_.end());
+        fresh_.clear();
+        replaced_.clear();
+        working_root_ = control_->root.load(std::memory_order_relaxed);
+        working_count_ = static_cast<int>(control_->count.load(
+            std::memory_order_relaxed));
+    }
+
+    /**
+     * Frees the limbo batches retired before the oldest epoch any reader
+     * is still in.
+     */
+    void Reclaim() {
+        if (limbo_.empty()) return;
+        std::uint64_t oldest = control_->epoch.load(std::memory_order_seq_cst);
+        Layout::ReaderSlot *slots = Layout::Slots(segment_);
+        for (std::uint32_t i = 0; i < reader_slots_; i++) {
+            std::int64_t pid = slots[i].pid.load(std::memory_order_seq_cst);
+            std::uint64_t epoch =
+                slots[i].epoch.load(std::memory_order_seq_cst);
+            if (pid == 0 || epoch == 0) continue;
+            if (kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH) {
+                // The reader died mid operation; free its slot.
+                if (slots[i].pid.compare_exchange_strong(pid, 0))
+                    slots[i].epoch.store(0, std::memory_order_seq_cst);
+                continue;
+            }
+            oldest = std::min(oldest, epoch);
+        }
+
+        std::size_t freed = 0;
+        while (freed < limbo_.size() && limbo_[freed].first < oldest) {
+            free_.insert(free_.end(), limbo_[freed].second.begin(),
+                limbo_[freed].second.end());
+            freed++;
+        }
+        limbo_.erase(limbo_.begin(), limbo_.begin() + freed);
+    }
+};
+
+/**
+ * Read only view of a SharedAVLTree from another process, or the same one.
+ *
+ * The node array is mapped read only.  Only the control block and reader
+ * slots are mapped writable, for the reader to claim a slot and record
+ * its epoch in.  Every operation reads the version published when it
+ * started.  One reader must not be used by two threads at once; give each
+ * thread its own.
+ *
+ * @param <TKey>
+ *            Key type the SharedAVLTree was created with.
+ * @param <TValue>
+ *            Value type the SharedAVLTree was created with.
+ */
+template <class TKey, class TValue>
+class SharedAVLTreeReader {
+ private:
+    using Layout = SharedAVLTreeLayout;
+    using Node = OffsetAVLNode<TKey, TValue>;
+    using Algorithms = CopyOnWriteAVL<TKey, TValue, SharedAVLTreeReader>;
+    friend Algorithms;
+
+    unsigned char *control_mapping_;
+    std::size_t control_size_;
+    const unsigned char *nodes_mapping_;
+    std::size_t nodes_size_;
+    Layout::Control *control_;
+    Layout::ReaderSlot *slot_;
+    const Node *nodes_;
+
+    /**
+     * Holds the reader's slot at the current epoch for one operation.
+     */
+    class Guard {
+     public:
+        explicit Guard(Layout::ReaderSlot *slot, Layout::Control *control)
+            : slot_(slot) {
+            slot_->epoch.store(control->epoch.load(std::memory_order_seq_cst),
+                std::memory_order_seq_cst);
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        ~Guard() { slot_->epoch.store(0, std::memory_order_release); }
+
+     private:
+        Layout::ReaderSlot *slot_;
+    };
+
+ public:
+    /**
+     * Attaches to the SharedAVLTree segment name and claims a reader slot.
+     *
+     * @throws system_error if the segment can not be opened or mapped
+     * @throws runtime_error if it is not a SharedAVLTree segment for these
+     *          key and value types, or every reader slot is taken
+     */
+    explicit SharedAVLTreeReader(const std::string &name)
+        : control_mapping_(nullptr), control_size_(0), nodes_mapping_(nullptr),
+          nodes_size_(0), control_(nullptr), slot_(nullptr), nodes_(nullptr) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), name);
+        try {
+            Map(fd, name);
+            Validate();
+            ClaimSlot();
+        } catch (...) {
+            close(fd);
+            Unmap();
+            throw;
+        }
+        close(fd);
+    }
+
+    SharedAVLTreeReader(const SharedAVLTreeReader&) = delete;
+    SharedAVLTreeReader& operator=(const SharedAVLTreeReader&) = delete;
+
+    /**
+     * Frees the reader slot and unmaps the segment.
+     */
+    ~SharedAVLTreeReader() {
+        slot_->epoch.store(0, std::memory_order_release);
+        slot_->pid.store(0, std::memory_order_release);
+        Unmap();
+    }
+
+    /**
+     * Returns the number of elements in the published version.
+     */
+    int GetCount() const {
+        return static_cast<int>(control_->count.load(
+            std::memory_order_acquire));
+    }
+
+    /**
+     * Looks up the value stored at key.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     */
+    std::optional<TValue> Find(TKey key) {
+        Guard guard(slot_, control_);
+        const Node *node = Algorithms(this).Find(LoadRoot(), key);
+        if (node == nullptr) return std::nullopt;
+        return node->value;
+    }
+
+    /**
+     * Returns true if key is present in the tree.
+     */
+    bool Contains(TKey key) { return Find(key).has_value(); }
+
+    /**
+     * Calls func for every entry of one published version, in key order.
+     * Nodes replaced while func runs are not reused until it returns.
+     *
+     * @param func Callable taking a const MapEntry<TKey, TValue>&.
+     */
+    template <typename Func>
+    void ForEach(Func func) {
+        Guard guard(slot_, control_);
+        Algorithms(this).ForEach(LoadRoot(), func);
+    }
+
+ private:
+    const Node* At(std::uint64_t id) const { return &nodes_[id]; }
+
+    std::uint64_t LoadRoot() const {
+        return control_->root.load(std::memory_order_seq_cst);
+    }
+
+    void Map(int fd, const std::string &name) {
+        struct stat status;
+        if (fstat(fd, &status) != 0)
+            throw std::system_error(errno, std::generic_category(), name);
+        std::size_t size = static_cast<std::size_t>(status.st_size);
+        if (size < sizeof(Layout::Control))
+            throw std::runtime_error("! Not a SharedAVLTree segment !");
+
+        // The control block says where the nodes start.
+        void *control = mmap(nullptr, sizeof(Layout::Control), PROT_READ,
+            MAP_SHARED, fd, 0);
+        if (control == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), name);
+        std::uint64_t nodes_offset =
+            static_cast<Layout::Control*>(control)->nodes_offset;
+        munmap(control, sizeof(Layout::Control));
+        if (nodes_offset == 0 || nodes_offset > size)
+            throw std::runtime_error("! Not a SharedAVLTree segment !");
+
+        control = mmap(nullptr, nodes_offset, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+        if (control == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), name);
+        control_mapping_ = static_cast<unsigned char*>(control);
+        control_size_ = nodes_offset;
+        control_ = reinterpret_cast<Layout::Control*>(control_mapping_);
+
+        nodes_size_ = size - nodes_offset;
+        if (nodes_size_ > 0) {
+            void *nodes = mmap(nullptr, nodes_size_, PROT_READ, MAP_SHARED,
+                fd, static_cast<off_t>(nodes_offset));
+            if (nodes == MAP_FAILED)
+                throw std::system_error(errno, std::generic_category(), name);
+            nodes_mapping_ = static_cast<const unsigned char*>(nodes);
+            nodes_ = reinterpret_cast<const Node*>(nodes_mapping_);
+        }
+    }
+
+    void Unmap() {
+        if (nodes_mapping_ != nullptr)
+            munmap(const_cast<unsigned char*>(nodes_mapping_), nodes_size_);
+        if (control_mapping_ != nullptr)
+            munmap(control_mapping_, control_size_);
+    }
+
+    /**
+     * Checks the control block against these types and the segment size.
+     */
+    void Validate() {
+        if (control_->ready.load(std::memory_order_acquire) != 1
+                || !std::equal(control_->magic,
+                    control_->magic + sizeof(Layout::kMagic), Layout::kMagic)
+                || control_->version != Layout::kVersion)
+            throw std::runtime_error("! Not a SharedAVLTree segment !");
+        if (control_->byte_order != Layout::ByteOrder()
+                || control_->key_size != sizeof(TKey)
+                || control_->value_size != sizeof(TValue)
+                || control_->node_size != sizeof(Node)) {
+            throw std::runtime_error
+                ("! Segment was created for different key or value types !");
+        }
+        if (Layout::NodesOffset(control_->reader_slots) != control_size_
+                || control_->capacity * sizeof(Node) > nodes_size_)
+            throw std::runtime_error("! SharedAVLTree segment is truncated !");
+    }
+
+    void ClaimSlot() {
+        Layout::ReaderSlot *slots = Layout::Slots(control_mapping_);
+        std::int64_t pid = getpid();
+        for (std::uint32_t i = 0; i < control_->reader_slots; i++) {
+            std::int64_t expected = 0;
+            if (slots[i].pid.compare_exchange_strong(expected, pid)) {
+                slot_ = &slots[i];
+                return;
+            }
+        }
+        // Take over the slot of a reader that exited without detaching.
+        for (std::uint32_t i = 0; i < control_->reader_slots; i++) {
+            std::int64_t owner = slots[i].pid.load(std::memory_order_seq_cst);
+            if (owner != 0 && kill(static_cast<pid_t>(owner), 0) != 0
+                    && errno == ESRCH
+                    && slots[i].pid.compare_exchange_strong(owner, pid)) {
+                slots[i].epoch.store(0, std::memory_order_seq_cst);
+                slot_ = &slots[i];
+                return;
+            }
+        }
+        throw std::runtime_error("! Every reader slot is taken !");
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_SHAREDAVLTREE_H_
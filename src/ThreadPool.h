@@ -0,0 +1,244 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_THREADPOOL_H_
+#define SRC_THREADPOOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace _11c_dev_collections {
+
+/**
+ * Fork / join thread pool with work stealing, for divide and conquer over
+ * trees.
+ *
+ * Invoke(a, b) offers b to the pool and runs a on the calling thread.  Each
+ * worker keeps its own deque: it pushes and pops its own work at the back,
+ * so nested Invokes run depth first and stay in cache, while idle workers
+ * steal from the front of other deques, taking the oldest and so largest
+ * pieces of work.  A thread waiting for a stolen task runs other tasks in
+ * the meantime rather than blocking, so nested Invokes can never starve the
+ * pool.
+ *
+ * Threads that are not workers of the pool may call Invoke too; their
+ * tasks are handed to a worker's deque.
+ */
+class ThreadPool {
+ private:
+    /**
+     * A task offered by Invoke.  Lives on the stack of the Invoke that
+     * created it, which does not return until done is set.
+     */
+    struct Task {
+        std::function<void()> func;
+        std::exception_ptr error;
+        std::atomic<bool> done{false};
+
+        void Run() {
+            try {
+                func();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            done.store(true, std::memory_order_release);
+        }
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task*> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<bool> stop_;
+    std::atomic<int> queued_;
+    std::atomic<std::size_t> next_external_;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+
+    /**
+     * Index of the calling thread among this pool's workers, or -1.
+     */
+    int LocalIndex() const { return local_pool_ == this ? local_index_ : -1; }
+
+    static inline thread_local const ThreadPool *local_pool_ = nullptr;
+    static inline thread_local int local_index_ = -1;
+
+ public:
+    /**
+     * Starts a pool.
+     *
+     * @param thread_count Number of worker threads, defaults to one per
+     *          hardware thread.
+     */
+    explicit ThreadPool(int thread_count =
+            static_cast<int>(std::thread::hardware_concurrency())) {
+        thread_count = std::max(thread_count, 1);
+        stop_ = false;
+        queued_ = 0;
+        next_external_ = 0;
+        for (int i = 0; i < thread_count; i++)
+            workers_.push_back(std::make_unique<Worker>());
+        for (int i = 0; i < thread_count; i++)
+            threads_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /**
+     * Stops and joins every worker.  No Invoke may be in progress.
+     */
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread &thread : threads_) thread.join();
+    }
+
+    /**
+     * Returns the number of worker threads.
+     */
+    int GetThreadCount() const { return static_cast<int>(workers_.size()); }
+
+    /**
+     * Runs a and b, possibly in parallel, and returns once both are done.
+     * If either throws, the exception is rethrown here after both are done;
+     * if both throw, a's exception wins.
+     *
+     * @param a Callable run on the calling thread.
+     * @param b Callable offered to the pool.
+     */
+    template <typename FuncA, typename FuncB>
+    void Invoke(FuncA a, FuncB b) {
+        Task task;
+        task.func = std::move(b);
+
+        int index = LocalIndex();
+        Worker &worker = *workers_[index >= 0 ? index
+            : next_external_.fetch_add(1, std::memory_order_relaxed)
+                % workers_.size()];
+        Push(&worker, &task);
+
+        std::exception_ptr error;
+        try {
+            a();
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        // Run b here if nobody has stolen it, else help until it is done.
+        if (TakeBack(&worker, &task)) task.Run();
+        while (!task.done.load(std::memory_order_acquire)) {
+            if (!RunOne(index)) std::this_thread::yield();
+        }
+
+        if (error) std::rethrow_exception(error);
+        if (task.error) std::rethrow_exception(task.error);
+    }
+
+ private:
+    void Push(Worker *worker, Task *task) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->tasks.push_back(task);
+        }
+        queued_.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+        }
+        wake_.notify_one();
+    }
+
+    /**
+     * Removes task from the back of worker's deque, if it is still there.
+     */
+    bool TakeBack(Worker *worker, Task *task) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        if (worker->tasks.empty() || worker->tasks.back() != task) return false;
+        worker->tasks.pop_back();
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * Runs one queued task, the newest of the caller's own deque if it has
+     * one, else the oldest stolen from another worker.
+     *
+     * @param index Caller's worker index, or -1.
+     *
+     * @return false if no task was found.
+     */
+    bool RunOne(int index) {
+        Task *task = nullptr;
+        if (index >= 0) {
+            Worker &own = *workers_[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+            }
+        }
+
+        std::size_t count = workers_.size();
+        std::size_t start = index >= 0 ? static_cast<std::size_t>(index) : 0;
+        for (std::size_t i = 1; task == nullptr && i <= count; i++) {
+            Worker &victim = *workers_[(start + i) % count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+            }
+        }
+
+        if (task == nullptr) return false;
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        task->Run();
+        return true;
+    }
+
+    void WorkerLoop(int index) {
+        local_pool_ = this;
+        local_index_ = index;
+        while (true) {
+            if (RunOne(index)) continue;
+
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            wake_.wait(lock, [this] {
+                return stop_ || queued_.load(std::memory_order_acquire) > 0;
+            });
+            if (stop_) return;
+        }
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_THREADPOOL_H_
@@ -0,0 +1,235 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_THREADREGISTRY_H_
+#define SRC_THREADREGISTRY_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace _11c_dev_collections {
+
+/**
+ * Hands out one TRecord per thread, per registry, and lets any thread walk
+ * every record.
+ *
+ * Records are created on a thread's first call to Local and are kept on a
+ * push only, lock free list, so walking the records never blocks a thread
+ * that is registering.  Records live as long as the registry.  When a
+ * thread exits, the registry's exit hook, if any, is called on each of its
+ * records, which are then marked free and handed to the next thread that
+ * registers, so the list only grows with the number of threads alive at
+ * once.  A record keeps its contents across owners; the hook is where an
+ * owner of the registry hands off whatever must not wait for a new thread.
+ * The owner must not be destroyed while threads that used it are exiting.
+ *
+ * Each live registry holds a small slot number, reused once it is
+ * destroyed, that indexes a per thread array of record pointers, so Local
+ * is an array index and a compare rather than a hash lookup, and the array
+ * only grows with the number of registries alive at once.
+ *
+ * @param <TRecord> Per thread state.  Must be default constructible.
+ */
+template <class TRecord>
+class ThreadRegistry {
+ public:
+    /**
+     * Function called on the exiting thread for each of its records,
+     * before the record is marked free.
+     *
+     * @param context Context pointer given to the constructor.
+     * @param record Record of the exiting thread.
+     */
+    using ExitHook = void (*)(void *context, TRecord *record);
+
+ private:
+    struct Entry {
+        TRecord record;
+        Entry *next;
+        std::atomic<bool> free{false};
+    };
+
+    /**
+     * A thread's record for the registry holding slot, tagged with that
+     * registry's id so that an entry left by an earlier holder of the slot
+     * is never returned.
+     */
+    struct Cached {
+        std::uint64_t id;
+        Entry *entry;
+    };
+
+    /**
+     * Ids, free slot numbers and the live registry in each slot, shared by
+     * every registry of this type.
+     */
+    struct Slots {
+        std::mutex lock;
+        std::uint64_t next_id = 1;
+        std::size_t next_slot = 0;
+        std::vector<std::size_t> free;
+        std::vector<ThreadRegistry*> live;
+    };
+
+    /**
+     * The calling thread's records, by slot.  Releases them when the thread
+     * exits.
+     */
+    struct ThreadCache {
+        std::vector<Cached> entries;
+
+        ~ThreadCache() {
+            Slots &slots = GetSlots();
+            std::lock_guard<std::mutex> lock(slots.lock);
+            for (std::size_t slot = 0; slot < entries.size(); slot++) {
+                // A registry destroyed since, or one now holding its slot,
+                // has nothing of this thread's.
+                if (entries[slot].entry == nullptr || slot >= slots.live.size()
+                        || slots.live[slot] == nullptr
+                        || slots.live[slot]->id_ != entries[slot].id)
+                    continue;
+                slots.live[slot]->Release(entries[slot].entry);
+            }
+        }
+    };
+
+    std::atomic<Entry*> head_;
+    std::uint64_t id_;
+    std::size_t slot_;
+    ExitHook exit_hook_;
+    void *exit_context_;
+
+    static Slots& GetSlots() {
+        static Slots slots;
+        return slots;
+    }
+
+ public:
+    /**
+     * Creates a registry whose records are released at thread exit with
+     * no hook.
+     */
+    ThreadRegistry() : ThreadRegistry(nullptr, nullptr) {}
+
+    /**
+     * Creates a registry that calls exit_hook(context, record) on each
+     * record of an exiting thread.
+     */
+    ThreadRegistry(ExitHook exit_hook, void *context) : head_(nullptr),
+            exit_hook_(exit_hook), exit_context_(context) {
+        Slots &slots = GetSlots();
+        std::lock_guard<std::mutex> lock(slots.lock);
+        id_ = slots.next_id++;
+        if (slots.free.empty()) {
+            slot_ = slots.next_slot++;
+        } else {
+            slot_ = slots.free.back();
+            slots.free.pop_back();
+        }
+        if (slots.live.size() <= slot_) slots.live.resize(slot_ + 1, nullptr);
+        slots.live[slot_] = this;
+    }
+
+    ThreadRegistry(const ThreadRegistry&) = delete;
+    ThreadRegistry& operator=(const ThreadRegistry&) = delete;
+
+    ~ThreadRegistry() {
+        {
+            // Taken first, so no exiting thread is releasing a record.
+            Slots &slots = GetSlots();
+            std::lock_guard<std::mutex> lock(slots.lock);
+            slots.live[slot_] = nullptr;
+            slots.free.push_back(slot_);
+        }
+        Entry *entry = head_.load();
+        while (entry != nullptr) {
+            Entry *next = entry->next;
+            delete entry;
+            entry = next;
+        }
+    }
+
+    /**
+     * Returns the calling thread's record, taking a free one or creating
+     * one on first use.
+     */
+    TRecord* Local() {
+        thread_local ThreadCache cache;
+        if (slot_ < cache.entries.size() && cache.entries[slot_].id == id_)
+            return &cache.entries[slot_].entry->record;
+
+        Entry *entry = Claim();
+        if (entry == nullptr) {
+            entry = new Entry();
+            entry->next = head_.load(std::memory_order_relaxed);
+            while (!head_.compare_exchange_weak(entry->next, entry,
+                    std::memory_order_release, std::memory_order_relaxed)) {}
+        }
+
+        if (cache.entries.size() <= slot_)
+            cache.entries.resize(slot_ + 1, Cached{0, nullptr});
+        cache.entries[slot_] = Cached{id_, entry};
+        return &entry->record;
+    }
+
+    /**
+     * Calls func for every record registered so far, newest first.  Records
+     * registered during the walk may or may not be visited.
+     *
+     * @param func Callable taking a TRecord&.
+     */
+    template <typename Func>
+    void ForEach(Func func) {
+        for (Entry *entry = head_.load(std::memory_order_acquire);
+                entry != nullptr; entry = entry->next) {
+            func(entry->record);
+        }
+    }
+
+ private:
+    /**
+     * Takes a record freed by an exited thread, or returns nullptr if there
+     * is none.
+     */
+    Entry* Claim() {
+        for (Entry *entry = head_.load(std::memory_order_acquire);
+                entry != nullptr; entry = entry->next) {
+            bool free = true;
+            if (entry->free.load(std::memory_order_relaxed)
+                    && entry->free.compare_exchange_strong(free, false,
+                        std::memory_order_acquire))
+                return entry;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Runs the exit hook on entry and marks it free.  Called with the slots
+     * lock held.
+     */
+    void Release(Entry *entry) {
+        if (exit_hook_ != nullptr) exit_hook_(exit_context_, &entry->record);
+        entry->free.store(true, std::memory_order_release);
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_THREADREGISTRY_H_
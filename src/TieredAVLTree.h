@@ -0,0 +1,503 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_TIEREDAVLTREE_H_
+#define SRC_TIEREDAVLTREE_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <fstream>
+#include <list>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "AVLTree.h"
+#include "AVLTreeCodec.h"
+#include "AVLTreeOperation.h"
+#include "MapEntry.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Counters kept by a TieredAVLTree.  A hit is a lookup served from the
+ * value cache, a miss one that read the value log.
+ */
+struct TieredAVLTreeStats {
+    std::uint64_t hits;
+    std::uint64_t misses;
+};
+
+/**
+ * AVL tree whose keys stay in memory but whose values live in an append
+ * only value log file, with the recently used ones cached in memory under
+ * a byte budget.  For large values that do not all fit in memory.
+ *
+ * The tree maps each key to a locator, the offset and size of the key's
+ * latest record in the log.  A lookup finds the locator in the tree and
+ * then the value in an LRU cache keyed by log offset; on a miss it reads
+ * the record with one pread and caches it, evicting the least recently
+ * used values until the cache is back under budget.
+ *
+ * Every Add and InsertOrAssign appends a record of the key and value, and
+ * every Remove a tombstone, so the log alone describes the tree: opening
+ * an existing log replays it to rebuild the keys, stopping at a torn
+ * record left by a crash.  Replaced and removed records become garbage
+ * that Compact drops by copying the live records to a new log.  Records
+ * are written but not synced; call Flush for durability.
+ *
+ * Records are a 4 byte length, the 8 byte FNV-1a hash of the rest, a one
+ * byte type, and the key and, for puts, the value as encoded by their
+ * AVLTreeCodec.  Reads check the hash.  Not thread safe.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting. Must
+ *            implement <, =, and >, and have an AVLTreeCodec.
+ * @param <TValue>
+ *            Generic type representing the data being stored.  Must have an
+ *            AVLTreeCodec.
+ */
+template <class TKey, class TValue>
+class TieredAVLTree {
+ private:
+    static constexpr unsigned char kPut = 0;
+    static constexpr unsigned char kRemove = 1;
+    static constexpr std::uint64_t kRecordHeader = 12;
+
+    /**
+     * Where a key's value record is in the log.
+     */
+    struct Locator {
+        std::uint64_t offset = 0;
+        std::uint64_t size = 0;
+    };
+
+    struct CacheEntry {
+        std::uint64_t offset;
+        TValue value;
+        std::size_t bytes;
+    };
+
+    std::string path_;
+    int fd_;
+    std::uint64_t log_size_;
+    std::uint64_t garbage_;
+
+    AVLTree<TKey, Locator> tree_;
+
+    // Most recently used first.
+    std::list<CacheEntry> lru_;
+    std::unordered_map<std::uint64_t,
+        typename std::list<CacheEntry>::iterator> cache_;
+    std::size_t cache_bytes_;
+    std::size_t cache_budget_;
+    TieredAVLTreeStats stats_;
+
+ public:
+    /**
+     * Opens the value log at path, creating it if it does not exist, and
+     * rebuilds the keys from it.
+     *
+     * @param cache_budget Bytes of encoded values to keep in memory.
+     *
+     * @throws system_error if the log can not be opened or read
+     */
+    TieredAVLTree(std::string path, std::size_t cache_budget)
+        : path_(std::move(path)), fd_(-1), log_size_(0), garbage_(0),
+          cache_bytes_(0), cache_budget_(cache_budget), stats_{} {
+        Replay();
+        fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+        if (ftruncate(fd_, static_cast<off_t>(log_size_)) != 0) {
+            int error = errno;
+            close(fd_);
+            throw std::system_error(error, std::generic_category(), path_);
+        }
+    }
+
+    TieredAVLTree(const TieredAVLTree&) = delete;
+    TieredAVLTree& operator=(const TieredAVLTree&) = delete;
+
+    ~TieredAVLTree() { close(fd_); }
+
+    /**
+     * Returns the number of elements in the tree.
+     */
+    int GetCount() const { return tree_.GetCount(); }
+
+    /**
+     * Returns the size of the value log in bytes.
+     */
+    std::uint64_t GetLogSize() const { return log_size_; }
+
+    /**
+     * Returns the bytes of the value log taken by replaced and removed
+     * records, which Compact would free.
+     */
+    std::uint64_t GetGarbageSize() const { return garbage_; }
+
+    /**
+     * Returns the bytes of encoded values held in the cache.
+     */
+    std::size_t GetCacheSize() const { return cache_bytes_; }
+
+    TieredAVLTreeStats GetStats() const { return stats_; }
+
+    /**
+     * Sets every counter back to zero.
+     */
+    void ResetStats() { stats_ = TieredAVLTreeStats{}; }
+
+    /**
+     * Returns true if key is present in the tree.  Never reads the log.
+     */
+    bool Contains(TKey key) const { return tree_.Contains(key); }
+
+    /**
+     * Looks up the value stored at key, reading it from the log if it is
+     * not cached.
+     *
+     * @return Value at key, or std::nullopt if key is not in the tree.
+     *
+     * @throws system_error if the value can not be read
+     * @throws runtime_error if its record is corrupt
+     */
+    std::optional<TValue> Find(TKey key) {
+        std::optional<Locator> locator = tree_.Find(key);
+        if (!locator.has_value()) return std::nullopt;
+        return Fetch(*locator);
+    }
+
+    /**
+     * Add a key/value pair to the tree.
+     *
+     * @throws std::range_error if key is already present.
+     * @throws system_error if the log can not be written
+     */
+    void Add(TKey key, TValue value) {
+        if (tree_.Contains(key))
+            throw std::range_error("! Key already exists in Tree !");
+        Put(key, value);
+    }
+
+    /**
+     * Add a key/value pair to the tree, or replace the value if key is
+     * already present.
+     *
+     * @throws system_error if the log can not be written
+     */
+    void InsertOrAssign(TKey key, TValue value) { Put(key, value); }
+
+    /**
+     * Remove an entry from the tree.
+     *
+     * @return MapEntry representing the key/value pair that was removed.
+     *
+     * @throws std::range_error if key is not present.
+     * @throws system_error if the log can not be read or written
+     */
+    MapEntry<TKey, TValue> Remove(TKey key) {
+        std::optional<Locator> locator = tree_.Find(key);
+        if (!locator.has_value()) {
+            throw std::range_error
+                (std::format("! Key {} not present in Tree !", key));
+        }
+        TValue value = Fetch(*locator);
+
+        std::string record = Encode(kRemove, key, nullptr);
+        Append(record);
+        garbage_ += locator->size + record.size();
+        Forget(*locator);
+        tree_.Remove(key);
+        return MapEntry<TKey, TValue>(key, value);
+    }
+
+    /**
+     * Syncs the value log to disk.
+     *
+     * @throws system_error if the sync fails
+     */
+    void Flush() {
+        if (fdatasync(fd_) != 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+    }
+
+    /**
+     * Copies the live records to a new log, in key order, and renames it
+     * over the old one.  Cached values stay cached.
+     *
+     * @throws system_error if the new log can not be written
+     */
+    void Compact() {
+        std::string temp_path = path_ + ".tmp";
+        int temp_fd = open(temp_path.c_str(),
+            O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (temp_fd < 0)
+            throw std::system_error(errno, std::generic_category(), temp_path);
+
+        std::vector<AVLTreeOperation<TKey, Locator>> moves;
+        std::vector<std::uint64_t> from_offsets;
+        moves.reserve(static_cast<std::size_t>(tree_.GetCount()));
+        from_offsets.reserve(moves.capacity());
+        std::uint64_t size = 0;
+        try {
+            std::string buffer;
+            tree_.ForEach([&](const AVLTreeNode<TKey, Locator> &node) {
+                Locator from = node.GetValue();
+                buffer += ReadRecord(from);
+                moves.emplace_back(AVLTreeOperationType::InsertOrAssign,
+                    node.GetKey(), Locator{size, from.size});
+                from_offsets.push_back(from.offset);
+                size += from.size;
+                if (buffer.size() >= (1 << 20)) {
+                    WriteAll(temp_fd, buffer, size - buffer.size());
+                    buffer.clear();
+                }
+            });
+            WriteAll(temp_fd, buffer, size - buffer.size());
+            if (fdatasync(temp_fd) != 0
+                    || std::rename(temp_path.c_str(), path_.c_str()) != 0)
+                throw std::system_error(errno, std::generic_category(),
+                    temp_path);
+        } catch (...) {
+            close(temp_fd);
+            std::remove(temp_path.c_str());
+            throw;
+        }
+
+        close(fd_);
+        fd_ = temp_fd;
+        log_size_ = size;
+        garbage_ = 0;
+
+        // Re-key the cache by the new offsets.
+        std::unordered_map<std::uint64_t,
+            typename std::list<CacheEntry>::iterator> moved;
+        moved.reserve(cache_.size());
+        for (std::size_t i = 0; i < moves.size(); i++) {
+            auto cached = cache_.find(from_offsets[i]);
+            if (cached == cache_.end()) continue;
+            cached->second->offset = moves[i].value.offset;
+            moved.emplace(moves[i].value.offset, cached->second);
+        }
+        cache_.swap(moved);
+        tree_.ApplyBatch(moves);
+    }
+
+ private:
+    /**
+     * Appends a record of key and value and points key at it.
+     */
+    void Put(const TKey &key, const TValue &value) {
+        std::string record = Encode(kPut, key, &value);
+        std::uint64_t offset = Append(record);
+
+        std::optional<Locator> previous = tree_.Find(key);
+        if (previous.has_value()) {
+            garbage_ += previous->size;
+            Forget(*previous);
+        }
+        tree_.InsertOrAssign(key, Locator{offset, record.size()});
+        Remember(offset, value, record.size());
+    }
+
+    /**
+     * Returns the value of the record at locator, from the cache if it is
+     * there.
+     */
+    TValue Fetch(const Locator &locator) {
+        auto cached = cache_.find(locator.offset);
+        if (cached != cache_.end()) {
+            stats_.hits++;
+            lru_.splice(lru_.begin(), lru_, cached->second);
+            return cached->second->value;
+        }
+
+        stats_.misses++;
+        std::string record = ReadRecord(locator);
+        unsigned char type;
+        TKey key;
+        TValue value;
+        if (!Decode(record, &type, &key, &value) || type != kPut)
+            throw std::runtime_error("! Corrupt value log record !");
+        Remember(locator.offset, value, record.size());
+        return value;
+    }
+
+    /**
+     * Caches value, from the record at offset, evicting the least recently
+     * used values to stay within budget.
+     */
+    void Remember(std::uint64_t offset, const TValue &value,
+            std::size_t bytes) {
+        if (bytes > cache_budget_) return;
+        while (cache_bytes_ + bytes > cache_budget_) {
+            cache_bytes_ -= lru_.back().bytes;
+            cache_.erase(lru_.back().offset);
+            lru_.pop_back();
+        }
+        lru_.push_front(CacheEntry{offset, value, bytes});
+        cache_.emplace(offset, lru_.begin());
+        cache_bytes_ += bytes;
+    }
+
+    /**
+     * Drops the cached value of the record at locator, if any.
+     */
+    void Forget(const Locator &locator) {
+        auto cached = cache_.find(locator.offset);
+        if (cached == cache_.end()) return;
+        cache_bytes_ -= cached->second->bytes;
+        lru_.erase(cached->second);
+        cache_.erase(cached);
+    }
+
+    static std::string Encode(unsigned char type, const TKey &key,
+            const TValue *value) {
+        std::ostringstream payload_out;
+        SnapshotWriter payload(&payload_out);
+        payload.Write(&type, 1);
+        AVLTreeCodec<TKey>::Write(&payload, key);
+        if (value != nullptr) AVLTreeCodec<TValue>::Write(&payload, *value);
+        std::string bytes = payload_out.str();
+
+        std::ostringstream record_out;
+        SnapshotWriter record(&record_out);
+        record.WriteU32(static_cast<std::uint32_t>(bytes.size()));
+        record.WriteU64(payload.GetChecksum());
+        record.Write(bytes.data(), bytes.size());
+        return record_out.str();
+    }
+
+    /**
+     * Decodes a whole record, checking its length and hash.  value may be
+     * nullptr to skip decoding it.
+     */
+    static bool Decode(const std::string &record, unsigned char *type,
+            TKey *key, TValue *value) {
+        std::istringstream header_in(record.substr(0, kRecordHeader));
+        SnapshotReader header(&header_in);
+        std::uint32_t length;
+        std::uint64_t hash;
+        if (!header.ReadU32(&length) || !header.ReadU64(&hash)
+                || record.size() != kRecordHeader + length)
+            return false;
+
+        std::istringstream payload_in(record.substr(kRecordHeader));
+        SnapshotReader payload(&payload_in);
+        if (!payload.Read(type, 1) || !AVLTreeCodec<TKey>::Read(&payload, key))
+            return false;
+        if (*type == kPut) {
+            TValue ignored;
+            if (!AVLTreeCodec<TValue>::Read(&payload,
+                    value != nullptr ? value : &ignored))
+                return false;
+        } else if (*type != kRemove) {
+            return false;
+        }
+        return payload_in.peek() == std::char_traits<char>::eof()
+            && payload.GetChecksum() == hash;
+    }
+
+    /**
+     * Rebuilds the tree from the log, stopping at the first bad record.
+     */
+    void Replay() {
+        std::ifstream in(path_, std::ios::binary | std::ios::ate);
+        if (!in) return;
+        std::uint64_t file_size = static_cast<std::uint64_t>(in.tellg());
+        in.seekg(0);
+        while (in) {
+            char header[kRecordHeader];
+            if (!in.read(header, kRecordHeader)) break;
+            std::uint32_t length = 0;
+            for (int i = 0; i < 4; i++) {
+                length |= static_cast<std::uint32_t>(
+                    static_cast<unsigned char>(header[i])) << (8 * i);
+            }
+            // A corrupt length must not size the buffer past the file.
+            if (length > file_size - log_size_ - kRecordHeader) break;
+            std::string record(header, kRecordHeader);
+            record.resize(kRecordHeader + length);
+            if (!in.read(record.data() + kRecordHeader, length)) break;
+
+            unsigned char type;
+            TKey key;
+            if (!Decode(record, &type, &key, nullptr)) break;
+            std::optional<Locator> previous = tree_.Find(key);
+            if (previous.has_value()) garbage_ += previous->size;
+            if (type == kPut) {
+                tree_.InsertOrAssign(key, Locator{log_size_, record.size()});
+            } else {
+                garbage_ += record.size();
+                if (previous.has_value()) tree_.Remove(key);
+            }
+            log_size_ += record.size();
+        }
+    }
+
+    std::uint64_t Append(const std::string &record) {
+        std::uint64_t offset = log_size_;
+        WriteAll(fd_, record, offset);
+        log_size_ += record.size();
+        return offset;
+    }
+
+    void WriteAll(int fd, const std::string &bytes, std::uint64_t offset) {
+        std::size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t result = pwrite(fd, bytes.data() + done,
+                bytes.size() - done, static_cast<off_t>(offset + done));
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                throw std::system_error(errno, std::generic_category(), path_);
+            }
+            done += static_cast<std::size_t>(result);
+        }
+    }
+
+    std::string ReadRecord(const Locator &locator) const {
+        std::string record(locator.size, '\0');
+        std::size_t done = 0;
+        while (done < record.size()) {
+            ssize_t result = pread(fd_, record.data() + done,
+                record.size() - done,
+                static_cast<off_t>(locator.offset + done));
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0)
+                throw std::system_error(result < 0 ? errno : EIO,
+                    std::generic_category(), path_);
+            done += static_cast<std::size_t>(result);
+        }
+        return record;
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_TIEREDAVLTREE_H_
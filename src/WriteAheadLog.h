@@ -0,0 +1,281 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_WRITEAHEADLOG_H_
+#define SRC_WRITEAHEADLOG_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <utility>
+#include "AVLTreeCodec.h"
+#include "AVLTreeOperation.h"
+
+namespace _11c_dev_collections {
+
+/**
+ * Append only log of AVLTreeOperations, made durable with group commit.
+ *
+ * Each record is a 4 byte payload length, the 8 byte FNV-1a hash of the
+ * payload, and the payload: a one byte operation type, the key, and for
+ * Add and InsertOrAssign the value, encoded with AVLTreeCodec.  Header
+ * integers are little endian.
+ *
+ * Append only encodes a record into an in memory buffer and hands back its
+ * log sequence number.  Sync(lsn) returns once that record is on disk.
+ * The first thread to call Sync while no flush is running becomes the
+ * leader: it takes everything buffered so far, writes it with one write and
+ * one fdatasync, and wakes every thread whose record went out with it.
+ * Threads that arrive while a flush is running wait and, if their record
+ * missed it, one of them leads the next.  Under load, one fdatasync covers
+ * as many records as arrived during the previous one.
+ *
+ * A crash can leave a torn record at the end of the file.  Replay stops at
+ * the first record that is short or fails its hash, and the constructor
+ * truncates the file there before appending.
+ *
+ * @param <TKey>
+ *            Generic type representing the key used for sorting.  Must have
+ *            an AVLTreeCodec.
+ * @param <TValue>
+ *            Generic type representing the data being stored.  Must have an
+ *            AVLTreeCodec.
+ */
+template <class TKey, class TValue>
+class WriteAheadLog {
+ private:
+    int fd_;
+    std::string path_;
+
+    std::mutex mutex_;
+    std::condition_variable flushed_;
+    std::string buffer_;            // records appended, not yet written
+    std::uint64_t appended_lsn_;    // lsn of the last appended record
+    std::uint64_t durable_lsn_;     // lsn of the last record on disk
+    bool flushing_;
+    int error_;                     // errno of a failed flush, 0 if none
+
+ public:
+    /**
+     * Opens or creates the log at path, dropping any torn record at its
+     * end.
+     *
+     * @throws system_error if the file can not be opened or truncated
+     */
+    explicit WriteAheadLog(std::string path) : path_(std::move(path)),
+        appended_lsn_(0), durable_lsn_(0), flushing_(false), error_(0) {
+        std::uint64_t valid_size = Replay(path_,
+            [](const AVLTreeOperation<TKey, TValue>&) {});
+
+        fd_ = open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+            0644);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+        if (ftruncate(fd_, static_cast<off_t>(valid_size)) != 0) {
+            int error = errno;
+            close(fd_);
+            throw std::system_error(error, std::generic_category(), path_);
+        }
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    /**
+     * Closes the log.  Records appended but never synced are lost.
+     */
+    ~WriteAheadLog() { close(fd_); }
+
+    /**
+     * Calls func for every intact record of the log at path, in order.
+     * A missing file holds no records.
+     *
+     * @param func Callable taking a const AVLTreeOperation<TKey, TValue>&.
+     *
+     * @return Size in bytes of the intact prefix of the file.
+     */
+    template <typename Func>
+    static std::uint64_t Replay(const std::string &path, Func func) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) return 0;
+        // A torn or corrupt length can claim more than the file holds;
+        // checking it first keeps it from sizing the payload buffer.
+        std::uint64_t file_size = static_cast<std::uint64_t>(in.tellg());
+        in.seekg(0);
+        std::uint64_t valid_size = 0;
+        while (in) {
+            SnapshotReader header(&in);
+            std::uint32_t length;
+            std::uint64_t hash;
+            if (!header.ReadU32(&length) || !header.ReadU64(&hash)) break;
+            if (length > file_size - valid_size - 12) break;
+
+            std::string payload(length, '\0');
+            if (!in.read(payload.data(), length)) break;
+            std::istringstream payload_in(payload);
+            SnapshotReader reader(&payload_in);
+            AVLTreeOperation<TKey, TValue> op;
+            if (!Decode(&reader, &op) || reader.GetChecksum() != hash
+                    || payload_in.peek() != std::char_traits<char>::eof())
+                break;
+
+            func(op);
+            valid_size += 12 + length;
+        }
+        return valid_size;
+    }
+
+    /**
+     * Buffers a record of op.  Not durable until Sync returns.
+     *
+     * @return Log sequence number of the record.
+     *
+     * @throws system_error if an earlier flush failed and no Truncate has
+     *          happened since
+     */
+    std::uint64_t Append(const AVLTreeOperation<TKey, TValue> &op) {
+        std::ostringstream payload_out;
+        SnapshotWriter payload(&payload_out);
+        Encode(&payload, op);
+        std::string bytes = payload_out.str();
+
+        std::ostringstream record_out;
+        SnapshotWriter record(&record_out);
+        record.WriteU32(static_cast<std::uint32_t>(bytes.size()));
+        record.WriteU64(payload.GetChecksum());
+        record.Write(bytes.data(), bytes.size());
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_ != 0)
+            throw std::system_error(error_, std::generic_category(), path_);
+        buffer_ += record_out.str();
+        return ++appended_lsn_;
+    }
+
+    /**
+     * Returns once the record with log sequence number lsn, and every one
+     * before it, is on disk.
+     *
+     * @throws system_error if writing or syncing the log failed
+     */
+    void Sync(std::uint64_t lsn) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (durable_lsn_ < lsn) {
+            if (error_ != 0)
+                throw std::system_error(error_, std::generic_category(), path_);
+            if (flushing_) {
+                flushed_.wait(lock);
+                continue;
+            }
+
+            // Lead a flush of everything buffered so far.
+            flushing_ = true;
+            std::string batch;
+            batch.swap(buffer_);
+            std::uint64_t batch_lsn = appended_lsn_;
+            lock.unlock();
+            int error = WriteAll(batch);
+            lock.lock();
+
+            flushing_ = false;
+            if (error != 0)
+                error_ = error;
+            else
+                durable_lsn_ = batch_lsn;
+            flushed_.notify_all();
+        }
+    }
+
+    /**
+     * Appends op and waits until it is on disk.
+     *
+     * @throws system_error if writing or syncing the log failed
+     */
+    void Log(const AVLTreeOperation<TKey, TValue> &op) { Sync(Append(op)); }
+
+    /**
+     * Empties the log once everything in it is covered by a durable
+     * snapshot.  Records buffered but not yet written count as durable, and
+     * so do the records of a failed flush, so the log accepts appends again.
+     *
+     * @throws system_error if the file can not be truncated
+     */
+    void Truncate() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        flushed_.wait(lock, [this] { return !flushing_; });
+        if (ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0)
+            throw std::system_error(errno, std::generic_category(), path_);
+        buffer_.clear();
+        durable_lsn_ = appended_lsn_;
+        error_ = 0;
+        flushed_.notify_all();
+    }
+
+ private:
+    /**
+     * Writes and fdatasyncs bytes.
+     *
+     * @return 0, or the errno of the failure.
+     */
+    int WriteAll(const std::string &bytes) {
+        std::size_t written = 0;
+        while (written < bytes.size()) {
+            ssize_t result = write(fd_, bytes.data() + written,
+                bytes.size() - written);
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                return errno;
+            }
+            written += static_cast<std::size_t>(result);
+        }
+        return fdatasync(fd_) == 0 ? 0 : errno;
+    }
+
+    static void Encode(SnapshotWriter *writer,
+            const AVLTreeOperation<TKey, TValue> &op) {
+        unsigned char type = static_cast<unsigned char>(op.type);
+        writer->Write(&type, 1);
+        AVLTreeCodec<TKey>::Write(writer, op.key);
+        if (op.type != AVLTreeOperationType::Remove)
+            AVLTreeCodec<TValue>::Write(writer, op.value);
+    }
+
+    static bool Decode(SnapshotReader *reader,
+            AVLTreeOperation<TKey, TValue> *op) {
+        unsigned char type;
+        if (!reader->Read(&type, 1)) return false;
+        if (type > static_cast<unsigned char>(AVLTreeOperationType::Remove))
+            return false;
+        op->type = static_cast<AVLTreeOperationType>(type);
+        if (!AVLTreeCodec<TKey>::Read(reader, &op->key)) return false;
+        if (op->type != AVLTreeOperationType::Remove)
+            return AVLTreeCodec<TValue>::Read(reader, &op->value);
+        return true;
+    }
+};
+
+}  // namespace _11c_dev_collections
+
+#endif  // SRC_WRITEAHEADLOG_H_
@@ -0,0 +1,482 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Benchmarks AVLTree against std::map and a sorted std::vector.
+ *
+ * For every combination of size, key type and distribution it times, on
+ * each structure: building it, lookups, in order, reverse and top down
+ * iteration, range scans of kRangeWidth keys, and removing every key.
+ * Results go to stdout, one line per measurement, as CSV or JSON lines.
+ *
+ * Keys are the odd numbers below 2n, so lookups of even numbers miss.  The
+ * distribution sets the order keys are added and removed in, and the keys
+ * looked up and scanned from:
+ *   sequential  ascending order
+ *   random      shuffled order, lookups uniform over the keys
+ *   zipf        shuffled order, lookups Zipfian (s = 0.99) over the keys
+ *
+ * The sorted vector is built with one sort and looked up with binary
+ * search; removing from it is O(n) per key, so it is skipped above
+ * kVectorRemoveLimit keys.  Top down iteration is AVLTree only.
+ *
+ * Usage: bench [--sizes 1000,100000] [--keys int,uint64,string]
+ *              [--dists sequential,random,zipf] [--structures avl,map,vector]
+ *              [--lookups N] [--seed N] [--json]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "AVLTree.h"
+
+namespace {
+
+using _11c_dev_collections::AVLTree;
+using _11c_dev_collections::AVLTreeNode;
+using _11c_dev_collections::AVLTreeTraversalMethod;
+
+constexpr int kRangeWidth = 100;
+constexpr std::size_t kRangeScans = 10000;
+constexpr std::size_t kVectorRemoveLimit = 100000;
+
+struct Options {
+    std::vector<std::size_t> sizes = {1000, 10000, 100000, 1000000};
+    std::vector<std::string> keys = {"int", "uint64", "string"};
+    std::vector<std::string> dists = {"sequential", "random", "zipf"};
+    std::vector<std::string> structures = {"avl", "map", "vector"};
+    std::size_t lookups = 1000000;
+    std::uint64_t seed = 1;
+    bool json = false;
+};
+
+// Results are added here so the compiler can not drop the work.
+volatile std::uint64_t sink;
+
+template <typename T>
+T MakeKey(std::uint64_t n);
+
+template <>
+int MakeKey<int>(std::uint64_t n) { return static_cast<int>(n); }
+
+template <>
+std::uint64_t MakeKey<std::uint64_t>(std::uint64_t n) {
+    // Spread over the whole range, keeping the order.
+    return n << 20;
+}
+
+template <>
+std::string MakeKey<std::string>(std::uint64_t n) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "key:%016llx",
+        static_cast<unsigned long long>(n));  // NOLINT(runtime/int)
+    return buffer;
+}
+
+/**
+ * Keys and access order for one run.
+ */
+template <typename TKey>
+struct Workload {
+    std::vector<TKey> sorted;   // every key, ascending
+    std::vector<TKey> order;    // every key, in add and remove order
+    std::vector<TKey> lookups;  // hits and misses, in lookup order
+    std::vector<std::size_t> range_starts;  // indexes into sorted
+};
+
+/**
+ * Draws ranks in [0, n) with P(rank k) proportional to 1 / (k + 1)^s, by
+ * binary search of the cumulative distribution.
+ */
+class Zipf {
+ public:
+    Zipf(std::size_t n, double s) : cumulative_(n) {
+        double total = 0;
+        for (std::size_t k = 0; k < n; k++) {
+            total += 1.0 / std::pow(static_cast<double>(k + 1), s);
+            cumulative_[k] = total;
+        }
+        for (double &c : cumulative_) c /= total;
+    }
+
+    std::size_t operator()(std::mt19937_64 &rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return static_cast<std::size_t>(std::lower_bound(cumulative_.begin(),
+            cumulative_.end(), u) - cumulative_.begin());
+    }
+
+ private:
+    std::vector<double> cumulative_;
+};
+
+template <typename TKey>
+Workload<TKey> MakeWorkload(std::size_t n, const std::string &dist,
+        const Options &options) {
+    std::mt19937_64 rng(options.seed);
+    Workload<TKey> work;
+    work.sorted.reserve(n);
+    for (std::size_t i = 0; i < n; i++)
+        work.sorted.push_back(MakeKey<TKey>(2 * i + 1));
+
+    work.order = work.sorted;
+    if (dist != "sequential")
+        std::shuffle(work.order.begin(), work.order.end(), rng);
+
+    // Every fourth lookup misses.
+    std::size_t count = options.lookups;
+    work.lookups.reserve(count);
+    std::uniform_int_distribution<std::size_t> uniform(0, n - 1);
+    if (dist == "zipf") {
+        // Popular ranks are scattered over the key space.
+        std::vector<std::size_t> rank_to_index(n);
+        for (std::size_t i = 0; i < n; i++) rank_to_index[i] = i;
+        std::shuffle(rank_to_index.begin(), rank_to_index.end(), rng);
+        Zipf zipf(n, 0.99);
+        for (std::size_t i = 0; i < count; i++) {
+            std::size_t index = rank_to_index[zipf(rng)];
+            work.lookups.push_back(i % 4 == 3 ? MakeKey<TKey>(2 * index)
+                : work.sorted[index]);
+        }
+    } else {
+        for (std::size_t i = 0; i < count; i++) {
+            std::size_t index = dist == "sequential" ? i % n : uniform(rng);
+            work.lookups.push_back(i % 4 == 3 ? MakeKey<TKey>(2 * index)
+                : work.sorted[index]);
+        }
+    }
+
+    std::size_t last_start = n > kRangeWidth ? n - kRangeWidth : 0;
+    std::uniform_int_distribution<std::size_t> start(0, last_start);
+    for (std::size_t i = 0; i < kRangeScans; i++) {
+        work.range_starts.push_back(dist == "sequential"
+            ? (i * kRangeWidth) % (last_start + 1) : start(rng));
+    }
+    return work;
+}
+
+/**
+ * Writes one measurement.
+ */
+class Reporter {
+ public:
+    explicit Reporter(bool json) : json_(json) {
+        if (!json_) {
+            std::cout << "structure,key_type,distribution,size,operation,"
+                "ops,seconds,ns_per_op\n";
+        }
+    }
+
+    void SetRun(const std::string &key_type, const std::string &dist,
+            std::size_t size) {
+        key_type_ = key_type;
+        dist_ = dist;
+        size_ = size;
+    }
+
+    void Report(const std::string &structure, const std::string &operation,
+            std::size_t ops, double seconds) {
+        double ns_per_op = ops == 0 ? 0 : seconds * 1e9 / ops;
+        if (json_) {
+            std::cout << "{\"structure\":\"" << structure
+                << "\",\"key_type\":\"" << key_type_
+                << "\",\"distribution\":\"" << dist_
+                << "\",\"size\":" << size_
+                << ",\"operation\":\"" << operation
+                << "\",\"ops\":" << ops
+                << ",\"seconds\":" << seconds
+                << ",\"ns_per_op\":" << ns_per_op << "}\n";
+        } else {
+            std::cout << structure << ',' << key_type_ << ',' << dist_ << ','
+                << size_ << ',' << operation << ',' << ops << ',' << seconds
+                << ',' << ns_per_op << '\n';
+        }
+        std::cout.flush();
+    }
+
+ private:
+    bool json_;
+    std::string key_type_;
+    std::string dist_;
+    std::size_t size_ = 0;
+};
+
+/**
+ * Runs func once and returns how long it took, in seconds.
+ */
+template <typename Func>
+double Time(Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+template <typename TKey>
+void BenchAVLTree(const Workload<TKey> &work, Reporter *reporter) {
+    const std::size_t n = work.sorted.size();
+    AVLTree<TKey, std::uint64_t> tree;
+
+    reporter->Report("avl", "add", n, Time([&] {
+        std::uint64_t value = 0;
+        for (const TKey &key : work.order) tree.Add(key, value++);
+    }));
+
+    reporter->Report("avl", "find", work.lookups.size(), Time([&] {
+        std::uint64_t found = 0;
+        for (const TKey &key : work.lookups) {
+            std::optional<std::uint64_t> value = tree.Find(key);
+            if (value.has_value()) found += *value;
+        }
+        sink = sink + found;
+    }));
+
+    const std::pair<AVLTreeTraversalMethod, const char*> traversals[] = {
+        {AVLTreeTraversalMethod::InOrder, "iterate_in_order"},
+        {AVLTreeTraversalMethod::ReverseOrder, "iterate_reverse"},
+        {AVLTreeTraversalMethod::TopDown, "iterate_top_down"},
+    };
+    for (const auto &[method, name] : traversals) {
+        tree.SetTraversalMethod(method);
+        reporter->Report("avl", name, n, Time([&] {
+            std::uint64_t total = 0;
+            for (const AVLTreeNode<TKey, std::uint64_t> &node : tree)
+                total += node.GetValue();
+            sink = sink + total;
+        }));
+    }
+
+    reporter->Report("avl", "range_scan", work.range_starts.size(), Time([&] {
+        std::uint64_t total = 0;
+        for (std::size_t start : work.range_starts) {
+            std::size_t end = std::min(start + kRangeWidth, n) - 1;
+            tree.Range(work.sorted[start], work.sorted[end],
+                [&total](const AVLTreeNode<TKey, std::uint64_t> &node) {
+                    total += node.GetValue();
+                });
+        }
+        sink = sink + total;
+    }));
+
+    reporter->Report("avl", "remove", n, Time([&] {
+        for (const TKey &key : work.order) tree.Remove(key);
+    }));
+}
+
+template <typename TKey>
+void BenchMap(const Workload<TKey> &work, Reporter *reporter) {
+    const std::size_t n = work.sorted.size();
+    std::map<TKey, std::uint64_t> map;
+
+    reporter->Report("map", "add", n, Time([&] {
+        std::uint64_t value = 0;
+        for (const TKey &key : work.order) map.emplace(key, value++);
+    }));
+
+    reporter->Report("map", "find", work.lookups.size(), Time([&] {
+        std::uint64_t found = 0;
+        for (const TKey &key : work.lookups) {
+            auto it = map.find(key);
+            if (it != map.end()) found += it->second;
+        }
+        sink = sink + found;
+    }));
+
+    reporter->Report("map", "iterate_in_order", n, Time([&] {
+        std::uint64_t total = 0;
+        for (const auto &entry : map) total += entry.second;
+        sink = sink + total;
+    }));
+
+    reporter->Report("map", "iterate_reverse", n, Time([&] {
+        std::uint64_t total = 0;
+        for (auto it = map.rbegin(); it != map.rend(); ++it)
+            total += it->second;
+        sink = sink + total;
+    }));
+
+    reporter->Report("map", "range_scan", work.range_starts.size(), Time([&] {
+        std::uint64_t total = 0;
+        for (std::size_t start : work.range_starts) {
+            std::size_t end = std::min(start + kRangeWidth, n) - 1;
+            auto last = map.upper_bound(work.sorted[end]);
+            for (auto it = map.lower_bound(work.sorted[start]); it != last;
+                    ++it)
+                total += it->second;
+        }
+        sink = sink + total;
+    }));
+
+    reporter->Report("map", "remove", n, Time([&] {
+        for (const TKey &key : work.order) map.erase(key);
+    }));
+}
+
+template <typename TKey>
+void BenchVector(const Workload<TKey> &work, Reporter *reporter) {
+    const std::size_t n = work.sorted.size();
+    using Entry = std::pair<TKey, std::uint64_t>;
+    std::vector<Entry> vector;
+    auto less = [](const Entry &entry, const TKey &key) {
+        return entry.first < key;
+    };
+
+    reporter->Report("vector", "add", n, Time([&] {
+        vector.reserve(n);
+        std::uint64_t value = 0;
+        for (const TKey &key : work.order) vector.emplace_back(key, value++);
+        std::sort(vector.begin(), vector.end(),
+            [](const Entry &a, const Entry &b) { return a.first < b.first; });
+    }));
+
+    reporter->Report("vector", "find", work.lookups.size(), Time([&] {
+        std::uint64_t found = 0;
+        for (const TKey &key : work.lookups) {
+            auto it = std::lower_bound(vector.begin(), vector.end(), key,
+                less);
+            if (it != vector.end() && it->first == key) found += it->second;
+        }
+        sink = sink + found;
+    }));
+
+    reporter->Report("vector", "iterate_in_order", n, Time([&] {
+        std::uint64_t total = 0;
+        for (const Entry &entry : vector) total += entry.second;
+        sink = sink + total;
+    }));
+
+    reporter->Report("vector", "iterate_reverse", n, Time([&] {
+        std::uint64_t total = 0;
+        for (auto it = vector.rbegin(); it != vector.rend(); ++it)
+            total += it->second;
+        sink = sink + total;
+    }));
+
+    reporter->Report("vector", "range_scan", work.range_starts.size(),
+        Time([&] {
+            std::uint64_t total = 0;
+            for (std::size_t start : work.range_starts) {
+                std::size_t end = std::min(start + kRangeWidth, n) - 1;
+                auto it = std::lower_bound(vector.begin(), vector.end(),
+                    work.sorted[start], less);
+                for (; it != vector.end() && !(work.sorted[end] < it->first);
+                        ++it)
+                    total += it->second;
+            }
+            sink = sink + total;
+        }));
+
+    if (n > kVectorRemoveLimit) return;
+    reporter->Report("vector", "remove", n, Time([&] {
+        for (const TKey &key : work.order) {
+            vector.erase(std::lower_bound(vector.begin(), vector.end(), key,
+                less));
+        }
+    }));
+}
+
+template <typename TKey>
+void Bench(const std::string &key_type, const Options &options,
+        Reporter *reporter) {
+    for (std::size_t size : options.sizes) {
+        for (const std::string &dist : options.dists) {
+            Workload<TKey> work = MakeWorkload<TKey>(size, dist, options);
+            reporter->SetRun(key_type, dist, size);
+            for (const std::string &structure : options.structures) {
+                if (structure == "avl") BenchAVLTree(work, reporter);
+                if (structure == "map") BenchMap(work, reporter);
+                if (structure == "vector") BenchVector(work, reporter);
+            }
+        }
+    }
+}
+
+std::vector<std::string> SplitList(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+bool Contains(const std::vector<std::string> &list, const std::string &item) {
+    return std::find(list.begin(), list.end(), item) != list.end();
+}
+
+int Usage() {
+    std::cerr << "usage: bench [--sizes N,...] [--keys int,uint64,string]\n"
+        "             [--dists sequential,random,zipf]\n"
+        "             [--structures avl,map,vector] [--lookups N]\n"
+        "             [--seed N] [--json]\n";
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json") {
+            options.json = true;
+            continue;
+        }
+        if (i + 1 >= argc) return Usage();
+        std::string value = argv[++i];
+        if (arg == "--sizes") {
+            options.sizes.clear();
+            for (const std::string &size : SplitList(value))
+                options.sizes.push_back(std::strtoull(size.c_str(), nullptr,
+                    10));
+        } else if (arg == "--keys") {
+            options.keys = SplitList(value);
+        } else if (arg == "--dists") {
+            options.dists = SplitList(value);
+        } else if (arg == "--structures") {
+            options.structures = SplitList(value);
+        } else if (arg == "--lookups") {
+            options.lookups = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (arg == "--seed") {
+            options.seed = std::strtoull(value.c_str(), nullptr, 10);
+        } else {
+            return Usage();
+        }
+    }
+    for (std::size_t size : options.sizes) {
+        if (size == 0) return Usage();
+    }
+
+    Reporter reporter(options.json);
+    if (Contains(options.keys, "int"))
+        Bench<int>("int", options, &reporter);
+    if (Contains(options.keys, "uint64"))
+        Bench<std::uint64_t>("uint64", options, &reporter);
+    if (Contains(options.keys, "string"))
+        Bench<std::string>("string", options, &reporter);
+    return 0;
+}
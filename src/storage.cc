@@ -0,0 +1,776 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Functional test for the storage code: snapshots, MappedAVLTree,
+ * WriteAheadLog, DurableAVLTree, AVLTreeCheckpoint, PagedAVLTree,
+ * TieredAVLTree, PersistentAVLTree, SharedAVLTree, and the Merkle Diff and
+ * Equals of AVLTree.
+ *
+ * Every test drives a store with random puts and erases and checks it,
+ * and each store reopened from its files, against a std::map.  The log
+ * and block formats are also cut short part way through their last
+ * record, as a crash would leave them, and must reopen as of the record
+ * before.  Files go to a fresh directory under /tmp, removed at the end.
+ *
+ * Usage: storage [--seed N]
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "AVLTree.h"
+#include "AVLTreeCheckpoint.h"
+#include "DurableAVLTree.h"
+#include "MappedAVLTree.h"
+#include "PagedAVLTree.h"
+#include "PersistentAVLTree.h"
+#include "SharedAVLTree.h"
+#include "TieredAVLTree.h"
+#include "WriteAheadLog.h"
+
+namespace _11c_dev_collections {
+
+// Trees keyed by int32_t cache their subtree hashes, so Diff and Equals
+// are tested both ways.
+template <>
+struct AVLTreeHashPolicy<std::int32_t, std::int64_t> {
+    static constexpr bool kCache = true;
+};
+
+// Trees keyed by int64_t record their checkpoint offsets for
+// TestCheckpoint.
+template <>
+struct AVLTreeCheckpointPolicy<std::int64_t, std::int64_t> {
+    static constexpr bool kTrack = true;
+};
+
+}  // namespace _11c_dev_collections
+
+namespace {
+
+using _11c_dev_collections::AVLTree;
+using _11c_dev_collections::AVLTreeCheckpoint;
+using _11c_dev_collections::AVLTreeNode;
+using _11c_dev_collections::AVLTreeOperation;
+using _11c_dev_collections::AVLTreeOperationType;
+using _11c_dev_collections::DurableAVLTree;
+using _11c_dev_collections::MapEntry;
+using _11c_dev_collections::MappedAVLTree;
+using _11c_dev_collections::PagedAVLTree;
+using _11c_dev_collections::PersistentAVLTree;
+using _11c_dev_collections::SharedAVLTree;
+using _11c_dev_collections::SharedAVLTreeReader;
+using _11c_dev_collections::TieredAVLTree;
+using _11c_dev_collections::WriteAheadLog;
+
+using Model = std::map<std::int64_t, std::int64_t>;
+
+constexpr int kKeys = 4096;
+
+int failures = 0;
+std::string directory;
+std::uint64_t seed = 1;
+
+void Fail(const std::string &test, const std::string &what) {
+    std::cerr << test << ": " << what << "\n";
+    failures++;
+}
+
+std::string PathOf(const std::string &name) { return directory + "/" + name; }
+
+std::uint64_t FileSize(const std::string &path) {
+    return std::filesystem::file_size(path);
+}
+
+void CutFile(const std::string &path, std::uint64_t size) {
+    std::filesystem::resize_file(path, size);
+}
+
+void AppendGarbage(const std::string &path) {
+    std::ofstream out(path, std::ios::binary | std::ios::app);
+    out << "torn record";
+}
+
+/**
+ * Change made by RandomOps: a put of value at key, or, without a value,
+ * an erase of key.
+ */
+struct Change {
+    std::int64_t key;
+    std::optional<std::int64_t> value;
+};
+
+/**
+ * Makes count random changes to model and returns them.  A quarter are
+ * erases of keys the model holds.
+ */
+std::vector<Change> RandomOps(Model *model, std::mt19937_64 *random,
+        int count) {
+    std::vector<Change> changes;
+    for (int i = 0; i < count; i++) {
+        std::int64_t key = static_cast<std::int64_t>((*random)() % kKeys);
+        if ((*random)() % 4 == 0) {
+            if (model->erase(key) > 0) changes.push_back({key, std::nullopt});
+        } else {
+            std::int64_t value = static_cast<std::int64_t>((*random)()
+                % 1000000);
+            (*model)[key] = value;
+            changes.push_back({key, value});
+        }
+    }
+    return changes;
+}
+
+/**
+ * Checks find against model for every key that RandomOps can produce,
+ * and count against the model's size.
+ */
+void CheckFind(const std::string &test, const Model &model, int count,
+        const std::function<std::optional<std::int64_t>(std::int64_t)>
+            &find) {
+    if (count != static_cast<int>(model.size())) {
+        Fail(test, "count is " + std::to_string(count) + ", expected "
+            + std::to_string(model.size()));
+    }
+    for (std::int64_t key = 0; key < kKeys; key++) {
+        std::optional<std::int64_t> got = find(key);
+        auto expected = model.find(key);
+        if (got.has_value() != (expected != model.end())
+                || (got.has_value() && *got != expected->second)) {
+            Fail(test, "Find(" + std::to_string(key) + ") disagrees");
+            return;
+        }
+    }
+}
+
+/**
+ * Checks that entries, in the order a store listed them, are model.
+ */
+void CheckEntries(const std::string &test, const Model &model,
+        const std::vector<std::pair<std::int64_t, std::int64_t>> &entries) {
+    if (!std::equal(entries.begin(), entries.end(), model.begin(),
+            model.end(), [](const auto &a, const auto &b) {
+                return a.first == b.first && a.second == b.second;
+            })) {
+        Fail(test, "entries differ from the model");
+    }
+}
+
+template <typename TKey>
+std::vector<std::pair<std::int64_t, std::int64_t>> EntriesOf(
+        const AVLTree<TKey, std::int64_t> &tree) {
+    std::vector<std::pair<std::int64_t, std::int64_t>> entries;
+    tree.ForEach([&entries](const AVLTreeNode<TKey, std::int64_t> &node) {
+        entries.emplace_back(node.GetKey(), node.GetValue());
+    });
+    return entries;
+}
+
+template <typename TKey>
+void Apply(AVLTree<TKey, std::int64_t> *tree,
+        const std::vector<Change> &changes) {
+    for (const Change &change : changes) {
+        if (change.value.has_value()) {
+            tree->InsertOrAssign(static_cast<TKey>(change.key), *change.value);
+        } else {
+            tree->Remove(static_cast<TKey>(change.key));
+        }
+    }
+}
+
+void TestSnapshot() {
+    std::mt19937_64 random(seed);
+    Model model;
+    AVLTree<std::int64_t, std::int64_t> tree;
+    Apply(&tree, RandomOps(&model, &random, 8000));
+
+    std::string path = PathOf("snapshot");
+    {
+        std::ofstream out(path, std::ios::binary);
+        tree.Save(out);
+    }
+    {
+        std::ifstream in(path, std::ios::binary);
+        auto loaded = AVLTree<std::int64_t, std::int64_t>::Load(in);
+        CheckEntries("snapshot", model, EntriesOf(loaded));
+        CheckFind("snapshot", model, loaded.GetCount(),
+            [&loaded](std::int64_t key) { return loaded.Find(key); });
+    }
+
+    // A snapshot cut short, or read as other types, is rejected.
+    CutFile(path, FileSize(path) - 3);
+    try {
+        std::ifstream in(path, std::ios::binary);
+        AVLTree<std::int64_t, std::int64_t>::Load(in);
+        Fail("snapshot", "loaded a truncated snapshot");
+    } catch (const std::runtime_error&) {}
+    {
+        std::stringstream buffer;
+        tree.Save(buffer);
+        try {
+            AVLTree<std::int64_t, double>::Load(buffer);
+            Fail("snapshot", "loaded a snapshot as other value types");
+        } catch (const std::runtime_error&) {}
+    }
+
+    // Strings go through their own codec.
+    AVLTree<std::string, std::string> strings;
+    for (int i = 0; i < 500; i++)
+        strings.Add(std::to_string(i), std::string(i * 37 % 300, 'a' + i % 26));
+    std::stringstream buffer;
+    strings.Save(buffer);
+    auto loaded = AVLTree<std::string, std::string>::Load(buffer);
+    bool same = loaded.GetCount() == strings.GetCount();
+    strings.ForEach([&](const AVLTreeNode<std::string, std::string> &node) {
+        same = same && loaded.Find(node.GetKey()) == node.GetValue();
+    });
+    if (!same) Fail("snapshot", "string tree differs after a round trip");
+}
+
+void TestMapped() {
+    std::mt19937_64 random(seed + 1);
+    Model model;
+    AVLTree<std::int64_t, std::int64_t> tree;
+    Apply(&tree, RandomOps(&model, &random, 8000));
+
+    std::string path = PathOf("mapped");
+    MappedAVLTree<std::int64_t, std::int64_t>::Write(path, tree);
+    auto mapped = MappedAVLTree<std::int64_t, std::int64_t>::Open(path);
+    CheckFind("mapped", model, mapped.GetCount(),
+        [&mapped](std::int64_t key) { return mapped.Find(key); });
+
+    // Changes go to the overlay, and Save over the open file must leave
+    // this mapping readable.
+    for (const Change &change : RandomOps(&model, &random, 2000)) {
+        if (change.value.has_value()) {
+            mapped.InsertOrAssign(change.key, *change.value);
+        } else {
+            mapped.Remove(change.key);
+        }
+    }
+    std::vector<std::pair<std::int64_t, std::int64_t>> entries;
+    mapped.ForEach([&entries](const MapEntry<std::int64_t, std::int64_t> &e) {
+        entries.emplace_back(e.key, e.value);
+    });
+    CheckEntries("mapped", model, entries);
+    mapped.Save(path);
+    CheckFind("mapped", model, mapped.GetCount(),
+        [&mapped](std::int64_t key) { return mapped.Find(key); });
+
+    auto reopened = MappedAVLTree<std::int64_t, std::int64_t>::Open(path);
+    CheckFind("mapped reopened", model, reopened.GetCount(),
+        [&reopened](std::int64_t key) { return reopened.Find(key); });
+    std::size_t in_range = 0;
+    for (const auto &entry : reopened.Range(100, 1000)) {
+        if (entry.key < 100 || entry.key > 1000
+                || model.at(entry.key) != entry.value)
+            Fail("mapped reopened", "Range returned a wrong entry");
+        in_range++;
+    }
+    if (in_range != static_cast<std::size_t>(std::distance(
+            model.lower_bound(100), model.upper_bound(1000))))
+        Fail("mapped reopened", "Range missed entries");
+}
+
+AVLTreeOperation<std::int64_t, std::int64_t> OperationOf(
+        const Change &change) {
+    if (change.value.has_value()) {
+        return AVLTreeOperation<std::int64_t, std::int64_t>(
+            AVLTreeOperationType::InsertOrAssign, change.key, *change.value);
+    }
+    return AVLTreeOperation<std::int64_t, std::int64_t>(
+        AVLTreeOperationType::Remove, change.key);
+}
+
+/**
+ * Returns the model rebuilt by replaying the log at path.
+ */
+Model ReplayLog(const std::string &path) {
+    Model model;
+    WriteAheadLog<std::int64_t, std::int64_t>::Replay(path,
+        [&model](const AVLTreeOperation<std::int64_t, std::int64_t> &op) {
+            if (op.type == AVLTreeOperationType::Remove) {
+                model.erase(op.key);
+            } else {
+                model[op.key] = op.value;
+            }
+        });
+    return model;
+}
+
+void TestWriteAheadLog() {
+    std::mt19937_64 random(seed + 2);
+    std::string path = PathOf("wal");
+    Model model;
+    Model before_last;
+    {
+        WriteAheadLog<std::int64_t, std::int64_t> log(path);
+        std::vector<Change> changes = RandomOps(&model, &random, 3000);
+        Model replayed;
+        for (const Change &change : changes) {
+            before_last = replayed;
+            if (change.value.has_value()) {
+                replayed[change.key] = *change.value;
+            } else {
+                replayed.erase(change.key);
+            }
+            log.Sync(log.Append(OperationOf(change)));
+        }
+    }
+    if (ReplayLog(path) != model) Fail("wal", "replay differs from model");
+
+    AppendGarbage(path);
+    if (ReplayLog(path) != model)
+        Fail("wal", "garbage after the last record changed the replay");
+    std::uint64_t size = FileSize(path);
+    CutFile(path, size - std::string("torn record").size() - 3);
+    if (ReplayLog(path) != before_last)
+        Fail("wal", "a torn last record was not dropped");
+
+    // Truncate empties the log, torn tail and all.
+    {
+        WriteAheadLog<std::int64_t, std::int64_t> log(path);
+        log.Truncate();
+        log.Log(OperationOf({7, 70}));
+    }
+    if (ReplayLog(path) != Model{{7, 70}})
+        Fail("wal", "log does not hold just the record after Truncate");
+}
+
+void TestDurable() {
+    std::mt19937_64 random(seed + 3);
+    std::string snapshot = PathOf("durable.snapshot");
+    std::string log = PathOf("durable.log");
+    Model model;
+    Model before_last;
+    auto apply = [](DurableAVLTree<std::int64_t, std::int64_t> *tree,
+            const Change &change) {
+        if (change.value.has_value()) {
+            tree->InsertOrAssign(change.key, *change.value);
+        } else {
+            tree->Remove(change.key);
+        }
+    };
+    {
+        DurableAVLTree<std::int64_t, std::int64_t> tree(snapshot, log);
+        for (const Change &change : RandomOps(&model, &random, 2000))
+            apply(&tree, change);
+        tree.Checkpoint();
+        Model replayed = model;
+        for (const Change &change : RandomOps(&model, &random, 500)) {
+            before_last = replayed;
+            apply(&tree, change);
+            if (change.value.has_value()) {
+                replayed[change.key] = *change.value;
+            } else {
+                replayed.erase(change.key);
+            }
+        }
+        try {
+            tree.Add(model.begin()->first, 1);
+            Fail("durable", "Add of a present key succeeded");
+        } catch (const std::range_error&) {}
+    }
+    {
+        DurableAVLTree<std::int64_t, std::int64_t> tree(snapshot, log);
+        CheckFind("durable reopened", model, tree.GetCount(),
+            [&tree](std::int64_t key) { return tree.Find(key); });
+    }
+    CutFile(log, FileSize(log) - 3);
+    {
+        DurableAVLTree<std::int64_t, std::int64_t> tree(snapshot, log);
+        CheckFind("durable torn log", before_last, tree.GetCount(),
+            [&tree](std::int64_t key) { return tree.Find(key); });
+    }
+}
+
+void TestCheckpoint() {
+    std::mt19937_64 random(seed + 4);
+    std::string path = PathOf("checkpoint");
+    Model model;
+    Model previous;
+    std::uint64_t previous_size = 0;
+    {
+        AVLTreeCheckpoint<std::int64_t, std::int64_t> file(path);
+        AVLTree<std::int64_t, std::int64_t> tree;
+        for (int round = 0; round < 20; round++) {
+            previous = model;
+            previous_size = file.GetFileSize();
+            Apply(&tree, RandomOps(&model, &random, 300));
+            Checkpoint(&tree, &file);
+        }
+    }
+    {
+        AVLTreeCheckpoint<std::int64_t, std::int64_t> file(path);
+        auto tree = RestoreCheckpoint(file);
+        CheckEntries("checkpoint reopened", model, EntriesOf(tree));
+
+        // An incremental checkpoint on top of a restored tree.
+        Apply(&tree, RandomOps(&model, &random, 300));
+        Checkpoint(&tree, &file);
+        std::uint64_t grown = file.GetFileSize();
+        CompactCheckpoint(&tree, &file);
+        if (file.GetFileSize() >= grown)
+            Fail("checkpoint", "CompactCheckpoint did not shrink the file");
+    }
+    {
+        AVLTreeCheckpoint<std::int64_t, std::int64_t> file(path);
+        CheckEntries("checkpoint compacted", model,
+            EntriesOf(RestoreCheckpoint(file)));
+    }
+
+    // A torn last block restores the checkpoint before it.
+    std::string torn = PathOf("checkpoint.torn");
+    {
+        std::mt19937_64 again(seed + 4);
+        Model replay;
+        AVLTreeCheckpoint<std::int64_t, std::int64_t> file(torn);
+        AVLTree<std::int64_t, std::int64_t> tree;
+        for (int round = 0; round < 20; round++) {
+            Apply(&tree, RandomOps(&replay, &again, 300));
+            Checkpoint(&tree, &file);
+        }
+    }
+    CutFile(torn, (previous_size + FileSize(torn)) / 2);
+    AppendGarbage(torn);
+    {
+        AVLTreeCheckpoint<std::int64_t, std::int64_t> file(torn);
+        if (file.GetFileSize() != previous_size)
+            Fail("checkpoint torn", "torn block was not dropped");
+        CheckEntries("checkpoint torn", previous,
+            EntriesOf(RestoreCheckpoint(file)));
+    }
+}
+
+void TestPaged() {
+    std::mt19937_64 random(seed + 5);
+    std::string path = PathOf("paged");
+    Model model;
+    {
+        PagedAVLTree<std::int64_t, std::int64_t> tree(path,
+            PagedAVLTree<std::int64_t, std::int64_t>::kMinFrames);
+        for (const Change &change : RandomOps(&model, &random, 20000)) {
+            if (change.value.has_value()) {
+                tree.InsertOrAssign(change.key, *change.value);
+            } else {
+                tree.Remove(change.key);
+            }
+        }
+        CheckFind("paged", model, tree.GetCount(),
+            [&tree](std::int64_t key) { return tree.Find(key); });
+    }
+    for (bool async : {false, true}) {
+        // A fresh pool per pass, so lookups start cold.
+        PagedAVLTree<std::int64_t, std::int64_t> tree(path,
+            PagedAVLTree<std::int64_t, std::int64_t>::kMinFrames);
+        std::string test = async ? "paged FindAsync, io_uring"
+            : "paged FindAsync";
+        if (async && !tree.EnableAsyncReads(32)) continue;
+
+        std::vector<std::optional<std::int64_t>> found(kKeys);
+        std::vector<bool> called(kKeys, false);
+        for (std::int64_t key = 0; key < kKeys; key++) {
+            tree.FindAsync(key, [&found, &called, key](
+                    std::optional<std::int64_t> value) {
+                found[key] = value;
+                called[key] = true;
+            });
+        }
+        tree.Wait();
+        if (tree.GetPendingCount() != 0)
+            Fail(test, "lookups still pending after Wait");
+        for (std::int64_t key = 0; key < kKeys; key++) {
+            if (!called[key] || found[key] != tree.Find(key)) {
+                Fail(test, "FindAsync(" + std::to_string(key)
+                    + ") disagrees with Find");
+                break;
+            }
+        }
+        CheckFind(test, model, tree.GetCount(),
+            [&found](std::int64_t key) { return found[key]; });
+    }
+}
+
+void TestTiered() {
+    std::mt19937_64 random(seed + 6);
+    std::string path = PathOf("tiered");
+    Model model;
+    Model before_last;
+    auto apply = [](TieredAVLTree<std::int64_t, std::string> *tree,
+            const Change &change) {
+        if (change.value.has_value()) {
+            tree->InsertOrAssign(change.key, std::to_string(*change.value));
+        } else {
+            tree->Remove(change.key);
+        }
+    };
+    auto find = [](TieredAVLTree<std::int64_t, std::string> *tree) {
+        return [tree](std::int64_t key) -> std::optional<std::int64_t> {
+            std::optional<std::string> value = tree->Find(key);
+            if (!value.has_value()) return std::nullopt;
+            return std::stoll(*value);
+        };
+    };
+    {
+        // A budget far below the live values, so most lookups miss.
+        TieredAVLTree<std::int64_t, std::string> tree(path, 4096);
+        for (const Change &change : RandomOps(&model, &random, 8000))
+            apply(&tree, change);
+        CheckFind("tiered", model, tree.GetCount(), find(&tree));
+
+        std::uint64_t size = tree.GetLogSize();
+        tree.Compact();
+        if (tree.GetLogSize() >= size || tree.GetGarbageSize() != 0)
+            Fail("tiered", "Compact left garbage in the log");
+        CheckFind("tiered compacted", model, tree.GetCount(), find(&tree));
+
+        Model replayed = model;
+        for (const Change &change : RandomOps(&model, &random, 500)) {
+            before_last = replayed;
+            apply(&tree, change);
+            if (change.value.has_value()) {
+                replayed[change.key] = *change.value;
+            } else {
+                replayed.erase(change.key);
+            }
+        }
+        tree.Flush();
+    }
+    {
+        TieredAVLTree<std::int64_t, std::string> tree(path, 4096);
+        CheckFind("tiered reopened", model, tree.GetCount(), find(&tree));
+    }
+    CutFile(path, FileSize(path) - 3);
+    {
+        TieredAVLTree<std::int64_t, std::string> tree(path, 4096);
+        CheckFind("tiered torn log", before_last, tree.GetCount(),
+            find(&tree));
+        // The torn record is cut off, so new records are readable.
+        tree.InsertOrAssign(kKeys, "1");
+    }
+    {
+        TieredAVLTree<std::int64_t, std::string> tree(path, 4096);
+        if (tree.Find(kKeys) != std::optional<std::string>("1"))
+            Fail("tiered torn log", "record after a torn tail was lost");
+    }
+}
+
+void TestPersistent() {
+    std::string path = PathOf("persistent");
+    auto apply = [](PersistentAVLTree<std::int64_t, std::int64_t> *tree,
+            const Change &change) {
+        if (change.value.has_value()) {
+            tree->InsertOrAssign(change.key, *change.value);
+        } else {
+            tree->Remove(change.key);
+        }
+    };
+    Model model;
+    {
+        std::mt19937_64 random(seed + 7);
+        PersistentAVLTree<std::int64_t, std::int64_t> tree(path, false);
+        for (const Change &change : RandomOps(&model, &random, 5000))
+            apply(&tree, change);
+        CheckFind("persistent", model, tree.GetCount(),
+            [&tree](std::int64_t key) { return tree.Find(key); });
+    }
+    {
+        PersistentAVLTree<std::int64_t, std::int64_t> tree(path, false);
+        CheckFind("persistent reopened", model, tree.GetCount(),
+            [&tree](std::int64_t key) { return tree.Find(key); });
+    }
+
+    // A process that dies without closing the file leaves every change
+    // that returned; reopening finds the free nodes by walking the tree.
+    std::mt19937_64 random(seed + 8);
+    Model crashed = model;
+    std::vector<Change> changes = RandomOps(&crashed, &random, 2000);
+    pid_t child = fork();
+    if (child == 0) {
+        PersistentAVLTree<std::int64_t, std::int64_t> tree(path, false);
+        for (const Change &change : changes) apply(&tree, change);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        Fail("persistent crashed", "child failed");
+        return;
+    }
+    PersistentAVLTree<std::int64_t, std::int64_t> tree(path, false);
+    CheckFind("persistent crashed", crashed, tree.GetCount(),
+        [&tree](std::int64_t key) { return tree.Find(key); });
+    std::vector<std::pair<std::int64_t, std::int64_t>> entries;
+    tree.ForEach([&entries](const MapEntry<std::int64_t, std::int64_t> &e) {
+        entries.emplace_back(e.key, e.value);
+    });
+    CheckEntries("persistent crashed", crashed, entries);
+}
+
+void TestShared() {
+    std::mt19937_64 random(seed + 9);
+    std::string name = "/11c-avl-storage-" + std::to_string(getpid());
+    SharedAVLTree<std::int64_t, std::int64_t> tree(name, 4 * kKeys);
+    SharedAVLTreeReader<std::int64_t, std::int64_t> reader(name);
+    Model model;
+    for (int round = 0; round < 10; round++) {
+        std::vector<Change> changes = RandomOps(&model, &random, 500);
+        tree.Update([&changes](auto &writer) {
+            for (const Change &change : changes) {
+                if (change.value.has_value()) {
+                    writer.InsertOrAssign(change.key, *change.value);
+                } else {
+                    writer.Remove(change.key);
+                }
+            }
+        });
+        CheckFind("shared reader", model, reader.GetCount(),
+            [&reader](std::int64_t key) { return reader.Find(key); });
+    }
+    CheckFind("shared", model, tree.GetCount(),
+        [&tree](std::int64_t key) { return tree.Find(key); });
+    std::vector<std::pair<std::int64_t, std::int64_t>> entries;
+    reader.ForEach([&entries](const MapEntry<std::int64_t, std::int64_t> &e) {
+        entries.emplace_back(e.key, e.value);
+    });
+    CheckEntries("shared reader", model, entries);
+}
+
+/**
+ * Checks Diff and Equals of two trees built by random changes from a
+ * common base against their models, with TKey deciding whether hashes
+ * are cached.
+ */
+template <typename TKey>
+void TestDiff(const std::string &test) {
+    std::mt19937_64 random(seed + 10);
+    Model left_model;
+    AVLTree<TKey, std::int64_t> left;
+    AVLTree<TKey, std::int64_t> right;
+    std::vector<Change> base = RandomOps(&left_model, &random, 6000);
+    Apply(&left, base);
+    Apply(&right, base);
+    Model right_model = left_model;
+    if (!left.Equals(right) || left.GetHash() != right.GetHash())
+        Fail(test, "equal trees compare unequal");
+
+    for (int round = 0; round < 5; round++) {
+        Apply(&left, RandomOps(&left_model, &random, 20));
+        Apply(&right, RandomOps(&right_model, &random, 20));
+        if (round == 2) {
+            left.Compact();
+            CheckEntries(test + " Compact", left_model, EntriesOf(left));
+        }
+
+        std::vector<std::int64_t> expected;
+        auto l = left_model.begin();
+        auto r = right_model.begin();
+        while (l != left_model.end() || r != right_model.end()) {
+            if (r == right_model.end()
+                    || (l != left_model.end() && l->first < r->first)) {
+                expected.push_back((l++)->first);
+            } else if (l == left_model.end() || r->first < l->first) {
+                expected.push_back((r++)->first);
+            } else {
+                if (l->second != r->second) expected.push_back(l->first);
+                l++;
+                r++;
+            }
+        }
+        std::vector<std::int64_t> got;
+        left.Diff(right, [&got](const TKey &key) { got.push_back(key); });
+        if (got != expected)
+            Fail(test, "Diff disagrees with the models");
+        if (left.Equals(right) != expected.empty())
+            Fail(test, "Equals disagrees with the models");
+    }
+
+    // Same entries in different shapes still compare equal.
+    AVLTree<TKey, std::int64_t> rebuilt;
+    for (auto it = left_model.rbegin(); it != left_model.rend(); ++it)
+        rebuilt.Add(static_cast<TKey>(it->first), it->second);
+    if (!left.Equals(rebuilt) || left.GetHash() != rebuilt.GetHash())
+        Fail(test, "trees of the same entries compare unequal");
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--seed" && i + 1 < argc) {
+            seed = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            std::cerr << "usage: storage [--seed N]\n";
+            return 2;
+        }
+    }
+    char scratch[] = "/tmp/11c-avl-storage-XXXXXX";
+    if (mkdtemp(scratch) == nullptr) {
+        std::cerr << "storage: can not create a scratch directory\n";
+        return 2;
+    }
+    directory = scratch;
+
+    std::vector<std::pair<std::string, std::function<void()>>> tests = {
+        {"snapshot", TestSnapshot},
+        {"mapped", TestMapped},
+        {"wal", TestWriteAheadLog},
+        {"durable", TestDurable},
+        {"checkpoint", TestCheckpoint},
+        {"paged", TestPaged},
+        {"tiered", TestTiered},
+        {"persistent", TestPersistent},
+        {"shared", TestShared},
+        {"diff", []() { TestDiff<std::int64_t>("diff"); }},
+        {"diff cached", []() { TestDiff<std::int32_t>("diff cached"); }},
+    };
+    for (const auto &[name, test] : tests) {
+        try {
+            test();
+        } catch (const std::exception &e) {
+            Fail(name, std::string("threw ") + e.what());
+        }
+    }
+    std::filesystem::remove_all(directory);
+
+    if (failures > 0) {
+        std::cerr << failures << " failures\n";
+        return 1;
+    }
+    std::cout << "storage: ok\n";
+    return 0;
+}
@@ -0,0 +1,441 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 11c.dev AVL Balanced Binary Search Tree implementation.
+ *
+ * AVL Balanced Binary Search Tree is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * AVL Balanced Binary Search Tree is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the AVL Balanced Binary Search Tree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Stress test for epoch reclamation and the concurrent trees.
+ *
+ * Epoch reclamation is checked by readers that follow a pointer writers
+ * keep replacing and retiring; a reader that sees a freed object fails the
+ * run, and building with -fsanitize=address turns the read itself into a
+ * report.  Threads also exit with objects still in limbo, to exercise the
+ * orphan list, and registries are created and destroyed from many threads
+ * at once, to exercise slot reuse.
+ *
+ * Each concurrent tree is driven by writer threads that each own every
+ * kThreads'th key, so a writer can check every Find of its own keys
+ * against a std::map, while scanner threads check that ForEach and Range
+ * always see keys in ascending order.  When the writers finish, the tree
+ * must hold exactly the union of their maps.  BufferedAVLTree is also
+ * written by threads taking turns on shared keys, to check that writes
+ * in different buffers are ordered.
+ *
+ * Usage: stress [--rounds N] [--seed N]
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BufferedAVLTree.h"
+#include "ConcurrentAVLTree.h"
+#include "EpochReclamation.h"
+#include "FlatCombiningAVLTree.h"
+#include "OptimisticAVLTree.h"
+#include "RcuAVLTree.h"
+#include "ShardedAVLTree.h"
+
+namespace {
+
+using _11c_dev_collections::AVLTreeNode;
+using _11c_dev_collections::BufferedAVLTree;
+using _11c_dev_collections::ConcurrentAVLTree;
+using _11c_dev_collections::EpochManager;
+using _11c_dev_collections::FlatCombiningAVLTree;
+using _11c_dev_collections::MapEntry;
+using _11c_dev_collections::OptimisticAVLTree;
+using _11c_dev_collections::RcuAVLTree;
+using _11c_dev_collections::ShardedAVLTree;
+
+constexpr int kThreads = 4;
+constexpr int kKeys = 2048;
+constexpr std::uint64_t kAlive = 0x600dcafe600dcafe;
+constexpr std::uint64_t kDead = 0xdeaddeaddeaddead;
+
+std::atomic<int> failures(0);
+
+void Fail(const std::string &test, const std::string &what) {
+    std::cerr << test << ": " << what << "\n";
+    failures.fetch_add(1);
+}
+
+/**
+ * Object that marks itself dead when freed, so a read after free that the
+ * allocator leaves in place is still caught.
+ */
+struct Canary {
+    std::atomic<std::uint64_t> mark{kAlive};
+    ~Canary() { mark.store(kDead, std::memory_order_relaxed); }
+};
+
+void StressEpochs(int rounds) {
+    EpochManager epochs;
+    std::atomic<Canary*> current(new Canary());
+    std::atomic<bool> done(false);
+
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kThreads; t++) {
+        readers.emplace_back([&epochs, &current, &done]() {
+            while (!done.load(std::memory_order_relaxed)) {
+                auto guard = epochs.Pin();
+                Canary *canary = current.load(std::memory_order_acquire);
+                for (int i = 0; i < 16; i++) {
+                    if (canary->mark.load(std::memory_order_relaxed)
+                            != kAlive) {
+                        Fail("epochs", "reader saw a freed object");
+                        return;
+                    }
+                }
+            }
+        });
+    }
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 2; t++) {
+        writers.emplace_back([&epochs, &current, rounds]() {
+            for (int i = 0; i < rounds * 64; i++) {
+                Canary *old = current.exchange(new Canary(),
+                    std::memory_order_acq_rel);
+                epochs.Retire(old);
+            }
+        });
+    }
+    for (std::thread &writer : writers) writer.join();
+    done.store(true);
+    for (std::thread &reader : readers) reader.join();
+    delete current.load();
+}
+
+/**
+ * Short lived threads retire objects and exit with them still in limbo,
+ * while readers check them, so their limbo goes to the orphan list and
+ * their records to later threads.  Every orphan must be freed once the
+ * epoch has moved on.
+ */
+void StressThreadExit(int rounds) {
+    EpochManager epochs;
+    std::atomic<Canary*> current(new Canary());
+    std::atomic<bool> done(false);
+
+    std::thread reader([&epochs, &current, &done]() {
+        while (!done.load(std::memory_order_relaxed)) {
+            auto guard = epochs.Pin();
+            if (current.load(std::memory_order_acquire)->mark.load(
+                    std::memory_order_relaxed) != kAlive) {
+                Fail("thread exit", "reader saw a freed object");
+                return;
+            }
+        }
+    });
+    for (int i = 0; i < rounds * 16; i++) {
+        std::vector<std::thread> writers;
+        for (int t = 0; t < kThreads; t++) {
+            writers.emplace_back([&epochs, &current]() {
+                for (int j = 0; j < 8; j++) {
+                    Canary *old = current.exchange(new Canary(),
+                        std::memory_order_acq_rel);
+                    epochs.Retire(old);
+                }
+            });
+        }
+        for (std::thread &writer : writers) writer.join();
+    }
+    done.store(true);
+    reader.join();
+
+    for (int i = 0; i < 4 && epochs.GetOrphanCount() > 0; i++)
+        epochs.Collect();
+    if (epochs.GetOrphanCount() != 0)
+        Fail("thread exit", "orphaned objects were never freed");
+    delete current.load();
+}
+
+void StressRegistries(int rounds) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([rounds]() {
+            for (int i = 0; i < rounds; i++) {
+                auto epochs = std::make_unique<EpochManager>();
+                for (int j = 0; j < 8; j++) {
+                    auto guard = epochs->Pin();
+                    epochs->Retire(new Canary());
+                }
+                if (epochs->GetPendingCount() != 8)
+                    Fail("registries", "record shared with another manager");
+            }
+        });
+    }
+    for (std::thread &thread : threads) thread.join();
+}
+
+/**
+ * The operations StressTree needs from a tree, as callables, since the
+ * trees do not share one interface.
+ */
+struct TreeOps {
+    std::function<void(int, int)> put;
+    std::function<void(int)> erase;
+    std::function<std::optional<int>(int)> find;
+    // Calls its argument for every key in [low, high], or is empty if the
+    // tree cannot scan.
+    std::function<void(int, int, std::function<void(int)>)> scan;
+    std::function<void()> background;
+};
+
+void StressTree(const std::string &name, const TreeOps &ops, int rounds,
+        std::uint64_t seed) {
+    std::vector<std::map<int, int>> models(kThreads);
+    std::atomic<int> writers_left(kThreads);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() {
+            std::mt19937_64 random(seed + t);
+            std::map<int, int> &model = models[t];
+            for (int i = 0; i < rounds * 256; i++) {
+                int key = static_cast<int>(random() % (kKeys / kThreads))
+                    * kThreads + t;
+                int value = static_cast<int>(random() % 1000000);
+                auto found = model.find(key);
+                switch (random() % 4) {
+                  case 0:
+                  case 1:
+                    ops.put(key, value);
+                    model[key] = value;
+                    break;
+                  case 2:
+                    if (found != model.end()) {
+                        ops.erase(key);
+                        model.erase(found);
+                    }
+                    break;
+                  default: {
+                    std::optional<int> got = ops.find(key);
+                    bool expected = found != model.end();
+                    if (got.has_value() != expected
+                            || (expected && *got != found->second))
+                        Fail(name, "Find(" + std::to_string(key)
+                            + ") disagrees with the writer's own writes");
+                  }
+                }
+            }
+            writers_left.fetch_sub(1);
+        });
+    }
+    if (ops.scan) {
+        for (int t = 0; t < 2; t++) {
+            threads.emplace_back([&, t]() {
+                std::mt19937_64 random(seed + kThreads + t);
+                while (writers_left.load() > 0) {
+                    int low = static_cast<int>(random() % kKeys);
+                    int high = t == 0 ? kKeys
+                        : low + static_cast<int>(random() % 256);
+                    int last = -1;
+                    ops.scan(low, high, [&](int key) {
+                        if (key <= last || key < low || key > high)
+                            Fail(name, "scan out of order or out of range");
+                        last = key;
+                    });
+                }
+            });
+        }
+    }
+    if (ops.background) {
+        threads.emplace_back([&]() {
+            while (writers_left.load() > 0) ops.background();
+        });
+    }
+    for (std::thread &thread : threads) thread.join();
+
+    for (int t = 0; t < kThreads; t++) {
+        for (int i = 0; i < kKeys / kThreads; i++) {
+            int key = i * kThreads + t;
+            auto expected = models[t].find(key);
+            std::optional<int> got = ops.find(key);
+            if (got.has_value() != (expected != models[t].end())
+                    || (got.has_value() && *got != expected->second)) {
+                Fail(name, "final contents differ at key "
+                    + std::to_string(key));
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Threads take turns writing the same few keys of a BufferedAVLTree, each
+ * into its own buffer, while another thread flushes.  Each turn starts
+ * after the last one's write returned, so every lookup must see the write
+ * of the latest turn whichever buffer holds it.
+ */
+void StressHandoff(int rounds, std::uint64_t seed) {
+    BufferedAVLTree<int, int> tree(64);
+    std::atomic<int> turn(0);
+    std::atomic<bool> done(false);
+    // Turns go to threads at random, so their buffers see different
+    // numbers of writes.
+    std::mt19937_64 random(seed);
+    std::vector<int> owners(rounds * 1024);
+    for (int &owner : owners) owner = static_cast<int>(random() % kThreads);
+    int turns = static_cast<int>(owners.size());
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() {
+            for (;;) {
+                int current = turn.load();
+                if (current >= turns) return;
+                if (owners[current] != t) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                int key = current % 7;
+                if (current % 5 == 4) {
+                    tree.Erase(key);
+                } else {
+                    tree.InsertOrAssign(key, current);
+                }
+                std::optional<int> got = tree.Find(key);
+                if (got != (current % 5 == 4 ? std::nullopt
+                        : std::optional<int>(current)))
+                    Fail("BufferedAVLTree handoff",
+                        "lookup missed the latest write");
+                turn.store(current + 1);
+            }
+        });
+    }
+    std::thread flusher([&]() {
+        while (!done.load()) {
+            tree.Flush();
+            std::this_thread::yield();
+        }
+    });
+    for (std::thread &thread : threads) thread.join();
+    done.store(true);
+    flusher.join();
+}
+
+void StressTrees(int rounds, std::uint64_t seed) {
+    using Node = AVLTreeNode<int, int>;
+    {
+        ConcurrentAVLTree<int, int> tree;
+        StressTree("ConcurrentAVLTree", TreeOps{
+            [&](int k, int v) { tree.InsertOrAssign(k, v); },
+            [&](int k) { tree.Remove(k); },
+            [&](int k) { return tree.Find(k); },
+            [&](int low, int high, std::function<void(int)> f) {
+                for (const MapEntry<int, int> &e : tree.Range(low, high))
+                    f(e.key);
+            },
+            nullptr}, rounds, seed);
+    }
+    {
+        OptimisticAVLTree<int, int> tree;
+        StressTree("OptimisticAVLTree", TreeOps{
+            [&](int k, int v) { tree.InsertOrAssign(k, v); },
+            [&](int k) { tree.Remove(k); },
+            [&](int k) { return tree.Find(k); },
+            nullptr, nullptr}, rounds, seed);
+    }
+    {
+        RcuAVLTree<int, int> tree;
+        StressTree("RcuAVLTree", TreeOps{
+            [&](int k, int v) { tree.InsertOrAssign(k, v); },
+            [&](int k) { tree.Remove(k); },
+            [&](int k) { return tree.Find(k); },
+            [&](int low, int high, std::function<void(int)> f) {
+                tree.Range(low, high,
+                    [&f](const Node &node) { f(node.GetKey()); });
+            },
+            nullptr}, rounds, seed);
+    }
+    {
+        ShardedAVLTree<int, int> tree({8, 16, kKeys - 8});
+        StressTree("ShardedAVLTree", TreeOps{
+            [&](int k, int v) { tree.InsertOrAssign(k, v); },
+            [&](int k) { tree.Remove(k); },
+            [&](int k) { return tree.Find(k); },
+            [&](int low, int high, std::function<void(int)> f) {
+                tree.Range(low, high,
+                    [&f](const Node &node) { f(node.GetKey()); });
+            },
+            [&]() { tree.Rebalance(); }}, rounds, seed);
+    }
+    {
+        FlatCombiningAVLTree<int, int> tree;
+        StressTree("FlatCombiningAVLTree", TreeOps{
+            [&](int k, int v) { tree.InsertOrAssign(k, v); },
+            [&](int k) { tree.Remove(k); },
+            [&](int k) { return tree.Find(k); },
+            [&](int low, int high, std::function<void(int)> f) {
+                tree.ForEach([&](const Node &node) {
+                    if (node.GetKey() >= low && node.GetKey() <= high)
+                        f(node.GetKey());
+                });
+            },
+            nullptr}, rounds, seed);
+    }
+    {
+        BufferedAVLTree<int, int> tree(64);
+        StressTree("BufferedAVLTree", TreeOps{
+            [&](int k, int v) { tree.InsertOrAssign(k, v); },
+            [&](int k) { tree.Erase(k); },
+            [&](int k) { return tree.Find(k); },
+            [&](int low, int high, std::function<void(int)> f) {
+                for (const MapEntry<int, int> &e : tree.Range(low, high))
+                    f(e.key);
+            },
+            [&]() { tree.Flush(); }}, rounds, seed);
+    }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    int rounds = 10;
+    std::uint64_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--rounds" && i + 1 < argc) {
+            rounds = std::atoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            std::cerr << "usage: stress [--rounds N] [--seed N]\n";
+            return 2;
+        }
+    }
+
+    StressEpochs(rounds);
+    StressThreadExit(rounds);
+    StressRegistries(rounds);
+    StressTrees(rounds, seed);
+    StressHandoff(rounds, seed);
+
+    if (failures.load() > 0) {
+        std::cerr << failures.load() << " failures\n";
+        return 1;
+    }
+    std::cout << "stress: ok\n";
+    return 0;
+}